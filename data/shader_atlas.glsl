@@ -7,6 +7,7 @@ multi basic.vs multi.fs
 compute test.cs
 
 shadows_plain basic.vs shadows_plain.fs
+shadows_plain_skinned basic.vs shadows_plain.fs SKINNING
 
 // forward shaders
 singlepass_phong_forward basic.vs singlepass_phong_forward.fs
@@ -14,8 +15,25 @@ multipass_phong_forward basic.vs multipass_phong_forward.fs
 
 singlepass_pbr_forward basic.vs singlepass_pbr_forward.fs
 
+// reflection probes: the scene in linear space (no gamma) and the GGX prefilter of the capture
+reflection_probe_capture basic.vs singlepass_pbr_forward.fs CAPTURE
+reflection_probe_prefilter quad.vs reflection_probe_prefilter.fs
+
+// skinned versions (bones in a UBO)
+singlepass_phong_forward_skinned basic.vs singlepass_phong_forward.fs SKINNING
+multipass_phong_forward_skinned basic.vs multipass_phong_forward.fs SKINNING
+singlepass_pbr_forward_skinned basic.vs singlepass_pbr_forward.fs SKINNING
+
+// instanced crowds with the vertex animation baked in textures
+shadows_plain_vat basic.vs shadows_plain.fs VAT
+singlepass_phong_forward_vat basic.vs singlepass_phong_forward.fs VAT
+multipass_phong_forward_vat basic.vs multipass_phong_forward.fs VAT
+singlepass_pbr_forward_vat basic.vs singlepass_pbr_forward.fs VAT
+fill_gbuffer_vat basic.vs fill_gbuffer.fs VAT
+
 // deferred shaders
 fill_gbuffer basic.vs fill_gbuffer.fs
+fill_gbuffer_skinned basic.vs fill_gbuffer.fs SKINNING
 ssao_compute quad.vs ssao_compute.fs
 volumetric_rendering_compute quad.vs volumetric_rendering_compute.fs
 upsample_half_to_full_rgb quad.vs upsample_half_to_full_rgb.fs
@@ -47,29 +65,78 @@ void main()
 in vec3 a_vertex;
 in vec3 a_normal;
 in vec2 a_coord;
+in vec2 a_coord1;
 in vec4 a_color;
 
 uniform vec3 u_camera_position;
 
+#ifdef VAT
+//instanced crowds, the vertices of every frame are baked in the textures (see VertexAnimation)
+in mat4 u_model;
+in vec4 a_instance; //x: first frame of the clip, y: frames of the clip, z: time offset, w: speed
+uniform sampler2D u_vat_positions;
+uniform sampler2D u_vat_normals;
+uniform ivec2 u_vat_size; //x: width of the textures, y: rows of one frame
+uniform float u_vat_fps;
+uniform float u_vat_time; //seconds
+#else
 uniform mat4 u_model;
+#endif
 uniform mat4 u_viewprojection;
+uniform vec4 u_lightmap_rect; //from the uvs1 to the page of the lightmap
+
+#ifdef SKINNING
+in vec4 a_bones;
+in vec4 a_weights;
+layout(std140) uniform u_bones_block {
+	mat4 u_bones[128];
+};
+uniform int u_num_bones; //of the mesh, the ids outside do not move the vertex (like the CPU skinning)
+#endif
 
 //this will store the color for the pixel shader
 out vec3 v_position;
 out vec3 v_world_position;
 out vec3 v_normal;
 out vec2 v_uv;
+out vec2 v_uv1;
 out vec4 v_color;
 
 uniform float u_time;
 
 void main()
 {	
+	vec3 vertex = a_vertex;
+	vec3 normal = a_normal;
+
+	#ifdef SKINNING
+		ivec4 ids = ivec4(a_bones);
+		vec4 weights = a_weights * vec4(lessThan(ids, ivec4(u_num_bones)));
+		ids = clamp(ids, ivec4(0), ivec4(max(u_num_bones - 1, 0)));
+		mat4 skin = u_bones[ids.x] * weights.x +
+			u_bones[ids.y] * weights.y +
+			u_bones[ids.z] * weights.z +
+			u_bones[ids.w] * weights.w;
+		vertex = (skin * vec4(vertex, 1.0)).xyz;
+		normal = (skin * vec4(normal, 0.0)).xyz;
+	#endif
+
+	#ifdef VAT
+		float frame = mod((u_vat_time * a_instance.w + a_instance.z) * u_vat_fps, a_instance.y);
+		float frame0 = floor(frame);
+		float frame1 = mod(frame0 + 1.0, a_instance.y);
+		ivec2 texel = ivec2(gl_VertexID % u_vat_size.x, gl_VertexID / u_vat_size.x);
+		ivec2 texel0 = texel + ivec2(0, int(a_instance.x + frame0) * u_vat_size.y);
+		ivec2 texel1 = texel + ivec2(0, int(a_instance.x + frame1) * u_vat_size.y);
+		vertex = mix(texelFetch(u_vat_positions, texel0, 0).xyz, texelFetch(u_vat_positions, texel1, 0).xyz, frame - frame0);
+		normal = mix(texelFetch(u_vat_normals, texel0, 0).xyz, texelFetch(u_vat_normals, texel1, 0).xyz, frame - frame0);
+	#endif
+
 	//calcule the normal in camera space (the NormalMatrix is like ViewMatrix but without traslation)
-	v_normal = (u_model * vec4( a_normal, 0.0) ).xyz;
+	v_normal = (u_model * vec4( normal, 0.0) ).xyz;
 	
 	//calcule the vertex in object space
-	v_position = a_vertex;
+	v_position = vertex;
 	v_world_position = (u_model * vec4( v_position, 1.0) ).xyz;
 	
 	//store the color in the varying var to use it from the pixel shader
@@ -77,6 +144,7 @@ void main()
 
 	//store the texture coordinates
 	v_uv = a_coord;
+	v_uv1 = a_coord1 * u_lightmap_rect.xy + u_lightmap_rect.zw;
 
 	//calcule the position of the vertex using the matrices
 	gl_Position = u_viewprojection * vec4( v_world_position, 1.0 );
@@ -280,6 +348,13 @@ vec3 perturbNormal(vec3 N, vec3 WP, vec2 uv, vec3 normal_pixel)
 	return normalize(TBN * normal_pixel);
 }
 
+//from the texel of a normal map, Z is rebuilt because BC5 normal maps only store XY
+vec3 unpackNormal(vec3 texel)
+{
+	vec2 xy = texel.xy * 2.0 - 1.0;
+	return vec3(xy, sqrt(max(0.0, 1.0 - dot(xy, xy))));
+}
+
 \constants
 
 // light types
@@ -310,6 +385,7 @@ uniform vec3 u_light_positions[MAX_LIGHTS];
 uniform vec3 u_light_colors[MAX_LIGHTS];
 uniform vec3 u_light_directions[MAX_LIGHTS];
 uniform vec2 u_light_cones[MAX_LIGHTS]; // alpha_min and alpha_max in radians
+uniform int u_lights_baked[MAX_LIGHTS]; // already in the lightmaps
 
 // for multipass
 uniform float u_light_intensity;
@@ -318,6 +394,8 @@ uniform vec3 u_light_position;
 uniform vec3 u_light_color;
 uniform vec3 u_light_direction;
 uniform vec2 u_light_cone; // alpha_min and alpha_max in radians
+uniform int u_light_baked;
+uniform int u_light_pass; // only the first one adds the ambient
 
 \shadows
 
@@ -445,6 +523,152 @@ vec3 cook_torrance_reflectance_with_ssr(vec3 V, vec3 L, vec3 N, vec3 albedo, flo
 	return (kd / PI) + (F * D * G) / (4.0 * clamp(dot(N, L), 0.0001, 1.0) * clamp(dot(N, V), 0.0001, 1.0)); // small delta to avoid division by 0
 }
 
+\spherical_harmonics
+
+//the 9 coefficients of computeSH (irradiance / PI) evaluated in the direction N
+vec3 eval_sh(vec3 sh[9], vec3 N)
+{
+	vec3 result = sh[0]
+		+ sh[1] * N.y + sh[2] * N.z + sh[3] * N.x
+		+ sh[4] * N.x * N.y + sh[5] * N.y * N.z + sh[6] * (3.0 * N.z * N.z - 1.0)
+		+ sh[7] * N.x * N.z + sh[8] * (N.x * N.x - N.y * N.y);
+	return max(result, vec3(0.0));
+}
+
+\ibl
+
+//image based lighting baked by GFX::IBL from the skybox (split sum approximation)
+uniform int u_ibl_active;
+uniform vec3 u_ibl_sh[9];
+uniform samplerCube u_ibl_specular; //one roughness per mip
+uniform sampler2D u_ibl_brdf_lut;
+uniform float u_ibl_max_lod;
+
+//irradiance / PI in the direction N, it is multiplied by the albedo like the ambient light
+vec3 ibl_diffuse(vec3 N)
+{
+	return eval_sh(u_ibl_sh, N);
+}
+
+//the environment seen in the direction R, blurred by the roughness
+vec3 ibl_prefiltered(vec3 R, float roughness)
+{
+	return textureLod(u_ibl_specular, R, roughness * u_ibl_max_lod).rgb;
+}
+
+//the second half of the split sum, the LUT does not depend on the environment
+vec3 ibl_brdf(vec3 N, vec3 V, vec3 F0, float roughness)
+{
+	vec2 brdf = texture(u_ibl_brdf_lut, vec2(clamp(dot(N, V), 0.0, 1.0), roughness)).rg;
+	return F0 * brdf.x + brdf.y;
+}
+
+vec3 ibl_specular(vec3 N, vec3 V, vec3 F0, float roughness)
+{
+	return ibl_prefiltered(reflect(-V, N), roughness) * ibl_brdf(N, V, F0, roughness);
+}
+
+\irradiance
+
+//probes of the IrradianceVolumeEntity, the coefficient k of every probe is in the slices [k * dims.z, (k + 1) * dims.z) of the 3D texture
+uniform int u_irr_active;
+uniform sampler3D u_irr_texture;
+uniform vec3 u_irr_start; //position of the first probe
+uniform vec3 u_irr_scale; //from world units to probes
+uniform vec3 u_irr_dims;
+uniform float u_irr_normal_distance;
+
+//irradiance / PI interpolated between the 8 closest probes, like ibl_diffuse
+vec3 irradiance_diffuse(vec3 P, vec3 N)
+{
+	vec3 coords = clamp((P + N * u_irr_normal_distance - u_irr_start) * u_irr_scale, vec3(0.0), u_irr_dims - 1.0);
+	//the center of the texels so the interpolation never mixes two coefficients
+	vec3 uvw = (coords + 0.5) / vec3(u_irr_dims.xy, u_irr_dims.z * 9.0);
+	float slice = 1.0 / 9.0;
+	vec3 sh[9];
+	for (int i = 0; i < 9; ++i)
+		sh[i] = texture(u_irr_texture, uvw + vec3(0.0, 0.0, slice * float(i))).rgb;
+	return eval_sh(sh, N);
+}
+
+\reflection_probes
+
+//the prefiltered cubemaps of the ReflectionProbeEntity closest to the camera, one layer of the array per probe
+const int MAX_BLENDED_PROBES = 4;
+uniform int u_probes_count;
+uniform samplerCubeArray u_probes_texture; //one roughness per mip
+uniform vec4 u_probes_spheres[MAX_BLENDED_PROBES]; //where they were captured and radius
+uniform vec2 u_probes_info[MAX_BLENDED_PROBES]; //layer and falloff
+uniform float u_probes_max_lod;
+
+//the radiance reflected in P towards R from the probes around it, premultiplied by their weight
+//a is how much of it has to come from the environment: where no probe reaches and where the probes see the sky
+vec4 probes_radiance(vec3 P, vec3 R, float roughness)
+{
+	vec3 radiance = vec3(0.0);
+	float sky = 0.0;
+	float total_weight = 0.0;
+	for (int i = 0; i < u_probes_count; ++i)
+	{
+		vec3 center = u_probes_spheres[i].xyz;
+		float radius = u_probes_spheres[i].w;
+		vec3 D = P - center;
+		float weight = clamp((radius - length(D)) / (radius * u_probes_info[i].y), 0.0, 1.0);
+		if (weight <= 0.0)
+			continue;
+
+		//parallax: where R leaves the sphere, seen from the center of the probe
+		float b = dot(D, R);
+		float t = -b + sqrt(max(b * b - dot(D, D) + radius * radius, 0.0));
+		vec3 dir = D + R * t;
+
+		vec4 probe = textureLod(u_probes_texture, vec4(dir, u_probes_info[i].x), roughness * u_probes_max_lod);
+		radiance += probe.rgb * weight;
+		sky += (1.0 - probe.a) * weight;
+		total_weight += weight;
+	}
+
+	if (total_weight > 1.0)
+		return vec4(radiance / total_weight, sky / total_weight);
+	return vec4(radiance, sky + 1.0 - total_weight);
+}
+
+//replaces ibl_specular, the environment is only what the probes do not see
+vec3 probes_specular(vec3 P, vec3 N, vec3 V, vec3 F0, float roughness)
+{
+	vec3 R = reflect(-V, N);
+	vec4 probes = probes_radiance(P, R, roughness);
+	vec3 environment = u_ibl_active != 0 ? ibl_prefiltered(R, roughness) : vec3(0.0);
+	return (probes.rgb + environment * probes.a) * ibl_brdf(N, V, F0, roughness);
+}
+
+\lightmap
+
+//baked by the LightmapEntity: irradiance / PI (linear) of the baked lights, their bounces and the ambient, like ibl_diffuse
+//it replaces the diffuse ambient and the baked lights (the phong lights are not divided by PI, they look brighter than it)
+uniform int u_lightmap_active;
+uniform sampler2D u_lightmap_texture;
+
+vec3 lightmap_diffuse(vec2 uv)
+{
+	return texture(u_lightmap_texture, uv).rgb;
+}
+
+//the gbuffer has 8 bits per channel, the lightmap goes as RGBM and a = 0 marks the pixels without lightmap
+const float LIGHTMAP_RGBM_RANGE = 8.0;
+
+vec4 encode_lightmap(vec3 color)
+{
+	float m = clamp(max(max(color.r, color.g), color.b) / LIGHTMAP_RGBM_RANGE, 1.0 / 255.0, 1.0);
+	m = ceil(m * 255.0) / 255.0;
+	return vec4(clamp(color / (m * LIGHTMAP_RGBM_RANGE), 0.0, 1.0), m);
+}
+
+vec3 decode_lightmap(vec4 rgbm)
+{
+	return rgbm.rgb * rgbm.a * LIGHTMAP_RGBM_RANGE;
+}
+
 \hdr_tonemapping
 
 uniform int u_lgc_active;
@@ -496,12 +720,14 @@ void main ()
 #include constants
 #include lights
 #include shadows
+#include lightmap
 #include hdr_tonemapping
 
 in vec3 v_position;
 in vec3 v_world_position;
 in vec3 v_normal;
 in vec2 v_uv;
+in vec2 v_uv1;
 in vec4 v_color;
 
 uniform float u_time;
@@ -549,6 +775,11 @@ void main()
 		}
 	}
 
+	// the lightmap replaces the ambient term (it is already linear)
+	if (u_lightmap_active != 0) {
+		final_light = lightmap_diffuse(v_uv1);
+	}
+
 	vec3 diffuse_term, specular_term, light_intensity, L, R;
 	float N_dot_L, R_dot_V, dist, numerator;
 	
@@ -556,14 +787,16 @@ void main()
 	vec3 V = normalize(u_camera_position - v_world_position);
 
 	if (u_maps[NORMALMAP] != 0) {
-		vec3 texture_normal = texture(u_normal_map, uv).xyz;
-		texture_normal = (texture_normal * 2.0) - 1.0;
-		texture_normal = normalize(texture_normal);
+		vec3 texture_normal = unpackNormal(texture(u_normal_map, uv).xyz);
 		N = perturbNormal(N, v_world_position, uv, texture_normal);
 	}
 
 	for (int i=0; i<u_light_count; i++)
 	{
+		// already in the lightmap
+		if (u_lightmap_active != 0 && u_lights_baked[i] != 0)
+			continue;
+
 		// diffuse
 		if (u_light_types[i] == LT_DIRECTIONAL) {
 			L = u_light_directions[i];
@@ -632,12 +865,14 @@ void main()
 #include constants
 #include lights
 #include shadows
+#include lightmap
 #include hdr_tonemapping
 
 in vec3 v_position;
 in vec3 v_world_position;
 in vec3 v_normal;
 in vec2 v_uv;
+in vec2 v_uv1;
 in vec4 v_color;
 
 uniform float u_time;
@@ -683,6 +918,11 @@ void main()
 		light_color = degamma(light_color);
 	}
 
+	// the lightmap replaces the ambient term of the first pass (it is already linear)
+	if (u_lightmap_active != 0) {
+		final_light = u_light_pass == 0 ? lightmap_diffuse(v_uv1) : vec3(0.0);
+	}
+
 	vec3 diffuse_term, specular_term, light_intensity, L, R;
 	float N_dot_L, R_dot_V, dist, numerator;
 	
@@ -690,9 +930,7 @@ void main()
 	vec3 V = normalize(u_camera_position - v_world_position);
 
 	if (u_maps[NORMALMAP] != 0) {
-		vec3 texture_normal = texture(u_normal_map, uv).xyz;
-		texture_normal = (texture_normal * 2.0) - 1.0;
-		texture_normal = normalize(texture_normal);
+		vec3 texture_normal = unpackNormal(texture(u_normal_map, uv).xyz);
 		N = perturbNormal(N, v_world_position, uv, texture_normal);
 	}
 
@@ -738,6 +976,10 @@ void main()
 		discard;
 	}
 
+	// already in the lightmap, this pass only adds the ambient
+	if (u_lightmap_active != 0 && u_light_baked != 0)
+		light_intensity = vec3(0.0);
+
 	N_dot_L = clamp(dot(N, L), 0.0, 1.0);
 	diffuse_term = N_dot_L * light_intensity;
 
@@ -768,11 +1010,13 @@ void main()
 #include utils
 #include constants
 #include hdr_tonemapping
+#include lightmap
 
 in vec3 v_position;
 in vec3 v_world_position;
 in vec3 v_normal;
 in vec2 v_uv;
+in vec2 v_uv1;
 in vec4 v_color;
 
 uniform float u_time;
@@ -793,6 +1037,7 @@ uniform sampler2D u_texture_metallic_roughness;
 
 layout(location = 0) out vec4 gbuffer_albedo;
 layout(location = 1) out vec4 gbuffer_normal_mat;
+layout(location = 2) out vec4 gbuffer_lightmap; //RGBM, alpha 0 when the node has no lightmap
 
 void main()
 {
@@ -815,9 +1060,7 @@ void main()
 	vec3 V = normalize(u_camera_position - v_world_position);
 
 	if (u_maps[NORMALMAP] != 0) {
-		vec3 texture_normal = texture(u_normal_map, uv).xyz;
-		texture_normal = (texture_normal * 2.0) - 1.0;
-		texture_normal = normalize(texture_normal);
+		vec3 texture_normal = unpackNormal(texture(u_normal_map, uv).xyz);
 		//N = perturbNormal(N, v_world_position, uv, texture_normal);
 	}
 
@@ -828,6 +1071,7 @@ void main()
 
 	gbuffer_albedo = vec4(color.xyz, bao_rou_met.g);
 	gbuffer_normal_mat = vec4(N*0.5+0.5, bao_rou_met.b);
+	gbuffer_lightmap = u_lightmap_active != 0 ? encode_lightmap(lightmap_diffuse(v_uv1)) : vec4(0.0);
 }
 
 \singlepass_phong_deferred.fs
@@ -837,6 +1081,7 @@ void main()
 #include constants
 #include lights
 #include shadows
+#include lightmap
 #include hdr_tonemapping
 
 in vec2 v_uv;
@@ -844,6 +1089,7 @@ in vec2 v_uv;
 uniform sampler2D u_gbuffer_color;
 uniform sampler2D u_gbuffer_normal;
 uniform sampler2D u_gbuffer_depth;
+uniform sampler2D u_gbuffer_lightmap;
 uniform sampler2D u_ssao_texture;
 
 uniform vec2 u_res_inv;
@@ -884,6 +1130,13 @@ void main()
 		final_light *= texture(u_ssao_texture, uv).rgb;
 	}
 
+	// the lightmap replaces the ambient term, it already has the occlusion of the static scene
+	vec4 lightmap_texel = texture(u_gbuffer_lightmap, uv);
+	bool lightmapped = lightmap_texel.a > 0.0;
+	if (lightmapped) {
+		final_light = decode_lightmap(lightmap_texel);
+	}
+
 	vec3 diffuse_term, specular_term, light_intensity, L, R;
 	float N_dot_L, R_dot_V, dist, numerator;
 	
@@ -901,6 +1154,10 @@ void main()
 
 	for (int i=0; i<u_light_count; i++)
 	{
+		// already in the lightmap
+		if (lightmapped && u_lights_baked[i] != 0)
+			continue;
+
 		// diffuse
 		if (u_light_types[i] == LT_DIRECTIONAL) {
 			L = u_light_directions[i];
@@ -961,6 +1218,7 @@ void main()
 #include constants
 #include lights
 #include shadows
+#include lightmap
 #include hdr_tonemapping
 
 in vec2 v_uv;
@@ -968,6 +1226,7 @@ in vec2 v_uv;
 uniform sampler2D u_gbuffer_color;
 uniform sampler2D u_gbuffer_normal;
 uniform sampler2D u_gbuffer_depth;
+uniform sampler2D u_gbuffer_lightmap;
 uniform sampler2D u_ssao_texture;
 
 uniform vec2 u_res_inv;
@@ -1008,6 +1267,13 @@ void main()
 		final_light *= texture(u_ssao_texture, uv).rgb;
 	}
 
+	// the lightmap replaces the ambient term, it already has the occlusion of the static scene
+	vec4 lightmap_texel = texture(u_gbuffer_lightmap, uv);
+	bool lightmapped = lightmap_texel.a > 0.0;
+	if (lightmapped) {
+		final_light = decode_lightmap(lightmap_texel);
+	}
+
 	vec3 diffuse_term, specular_term, light_intensity, L, R;
 	float N_dot_L, R_dot_V, dist, numerator;
 	
@@ -1025,6 +1291,10 @@ void main()
 
 	for (int i=0; i<u_light_count; i++)
 	{
+		// already in the lightmap
+		if (lightmapped && u_lights_baked[i] != 0)
+			continue;
+
 		// diffuse
 		if (u_light_types[i] == LT_DIRECTIONAL) {
 			L = u_light_directions[i];
@@ -1063,6 +1333,7 @@ void main()
 #include constants
 #include lights
 #include shadows
+#include lightmap
 #include hdr_tonemapping
 
 in vec2 v_uv;
@@ -1070,6 +1341,7 @@ in vec2 v_uv;
 uniform sampler2D u_gbuffer_color;
 uniform sampler2D u_gbuffer_normal;
 uniform sampler2D u_gbuffer_depth;
+uniform sampler2D u_gbuffer_lightmap;
 
 uniform vec2 u_res_inv;
 uniform mat4 u_inv_vp_mat;
@@ -1124,6 +1396,11 @@ void main()
 	// first pass, we do ambient and directional lights
 	int i = u_light_id;
 
+	// already in the lightmap
+	if (texture(u_gbuffer_lightmap, uv).a > 0.0 && u_lights_baked[i] != 0) {
+		discard;
+	}
+
 	if (u_light_types[i] == LT_POINT) {
 		L = u_light_positions[i] - world_pos;
 		dist = length(L); // used in light intensity
@@ -1214,19 +1491,25 @@ void main()
 
 \singlepass_pbr_forward.fs
 
-#version 330 core
+#version 400 core
 
 #include utils
 #include constants
 #include lights
 #include shadows
 #include pbr_functions
+#include spherical_harmonics
+#include ibl
+#include irradiance
+#include reflection_probes
+#include lightmap
 #include hdr_tonemapping
 
 in vec3 v_position;
 in vec3 v_world_position;
 in vec3 v_normal;
 in vec2 v_uv;
+in vec2 v_uv1;
 in vec4 v_color;
 
 uniform float u_time;
@@ -1279,9 +1562,7 @@ void main()
 	vec3 V = normalize(u_camera_position - v_world_position);
 
 	if (u_maps[NORMALMAP] != 0) {
-		vec3 texture_normal = texture(u_normal_map, uv).xyz;
-		texture_normal = (texture_normal * 2.0) - 1.0;
-		texture_normal = normalize(texture_normal);
+		vec3 texture_normal = unpackNormal(texture(u_normal_map, uv).xyz);
 		N = perturbNormal(N, v_world_position, uv, texture_normal);
 	}
 
@@ -1290,8 +1571,36 @@ void main()
 		bao_rou_met *= texture( u_texture_metallic_roughness, v_uv ).rgb;
 	}
 
+	// the environment replaces the ambient term, the specular part is not multiplied by the albedo
+	vec3 ibl_color = vec3(0.0);
+	if (u_ibl_active != 0) {
+		vec3 F0 = mix(vec3(0.04), color.rgb, bao_rou_met.b);
+		final_light = ibl_diffuse(N) * (1.0 - bao_rou_met.b) * bao_rou_met.r;
+		ibl_color = ibl_specular(N, V, F0, bao_rou_met.g) * bao_rou_met.r;
+	}
+
+	// the irradiance volume replaces the diffuse part of the ambient (and of the environment)
+	if (u_irr_active != 0) {
+		final_light = irradiance_diffuse(v_world_position, N) * (1.0 - bao_rou_met.b) * bao_rou_met.r;
+	}
+
+	// the lightmap replaces the diffuse part of everything above, it has the bounces of the static scene
+	if (u_lightmap_active != 0) {
+		final_light = lightmap_diffuse(v_uv1) * (1.0 - bao_rou_met.b) * bao_rou_met.r;
+	}
+
+	// the reflection probes replace the specular part of the environment around them
+	if (u_probes_count > 0) {
+		vec3 F0 = mix(vec3(0.04), color.rgb, bao_rou_met.b);
+		ibl_color = probes_specular(v_world_position, N, V, F0, bao_rou_met.g) * bao_rou_met.r;
+	}
+
 	for (int i=0; i<u_light_count; i++)
 	{
+		// already in the lightmap
+		if (u_lightmap_active != 0 && u_lights_baked[i] != 0)
+			continue;
+
 		// diffuse
 		if (u_light_types[i] == LT_DIRECTIONAL) {
 			L = u_light_directions[i];
@@ -1331,21 +1640,28 @@ void main()
 		final_light += light_intensity * cook_torrance_reflectance(V, L, N, color.rgb, bao_rou_met.g, bao_rou_met.b);
 	}
 
-	vec3 final_color = final_light * color.xyz;
+	vec3 final_color = final_light * color.xyz + ibl_color;
+#ifndef CAPTURE
 	if (u_lgc_active != 0) {
 		final_color = gamma(final_color);
 	}
+#endif
 	FragColor = vec4(final_color, color.a);
 }
 
 \singlepass_pbr_deferred.fs
 
-#version 330 core
+#version 400 core
 
 #include constants
 #include lights
 #include shadows
 #include pbr_functions
+#include spherical_harmonics
+#include ibl
+#include irradiance
+#include reflection_probes
+#include lightmap
 #include hdr_tonemapping
 
 in vec2 v_uv;
@@ -1353,6 +1669,7 @@ in vec2 v_uv;
 uniform sampler2D u_gbuffer_color;
 uniform sampler2D u_gbuffer_normal;
 uniform sampler2D u_gbuffer_depth;
+uniform sampler2D u_gbuffer_lightmap;
 uniform sampler2D u_ssao_texture;
 
 uniform vec2 u_res_inv;
@@ -1424,11 +1741,53 @@ void main()
 		discard;
 	}
 
+	// the environment replaces the ambient term, the specular part is not multiplied by the albedo
+	vec3 ibl_color = vec3(0.0);
+	if (u_ibl_active != 0) {
+		float occlusion = u_ssao_active != 0 ? texture(u_ssao_texture, uv).r : 1.0;
+		vec3 F0 = mix(vec3(0.04), color, metalness);
+		final_light = ibl_diffuse(N) * (1.0 - metalness) * occlusion;
+		ibl_color = ibl_specular(N, V, F0, roughness) * occlusion;
+	}
+
+	// the irradiance volume replaces the diffuse part of the ambient (and of the environment)
+	if (u_irr_active != 0) {
+		float occlusion = u_ssao_active != 0 ? texture(u_ssao_texture, uv).r : 1.0;
+		final_light = irradiance_diffuse(world_pos, N) * (1.0 - metalness) * occlusion;
+	}
+
+	// the lightmap replaces the diffuse part of everything above, it already has the occlusion of the static scene
+	vec4 lightmap_texel = texture(u_gbuffer_lightmap, uv);
+	bool lightmapped = lightmap_texel.a > 0.0;
+	if (lightmapped) {
+		final_light = decode_lightmap(lightmap_texel) * (1.0 - metalness);
+	}
+
+	// the reflection probes replace the specular part of the environment around them
+	if (u_probes_count > 0) {
+		float occlusion = u_ssao_active != 0 ? texture(u_ssao_texture, uv).r : 1.0;
+		vec3 F0 = mix(vec3(0.04), color, metalness);
+		ibl_color = probes_specular(world_pos, N, V, F0, roughness) * occlusion;
+	}
+
 	// FOR SSR
-	vec3 ssr_color = texture(u_ssr_texture, uv).rgb;
+	vec4 ssr_sample = texture(u_ssr_texture, uv);
+	vec3 ssr_color = ssr_sample.rgb;
+	float ssr_confidence = u_ssr_active != 0 ? ssr_sample.a : 0.0;
+
+	// where the environment gives the specular part, the SSR replaces it as far as it can be trusted
+	bool ssr_over_environment = ssr_confidence > 0.0 && (u_ibl_active != 0 || u_probes_count > 0);
+	if (ssr_over_environment) {
+		vec3 F0 = mix(vec3(0.04), color, metalness);
+		ibl_color = mix(ibl_color, ssr_color * ibl_brdf(N, V, F0, roughness), ssr_confidence);
+	}
 
 	for (int i=0; i<u_light_count; i++)
 	{
+		// already in the lightmap
+		if (lightmapped && u_lights_baked[i] != 0)
+			continue;
+
 		// diffuse
 		if (u_light_types[i] == LT_DIRECTIONAL) {
 			L = u_light_directions[i];
@@ -1465,7 +1824,7 @@ void main()
 			continue;
 		}
 
-		if (u_ssr_active != 0 && u_ssr_method == SSR_METHOD_FRESNEL_TWEAK) {
+		if (u_ssr_active != 0 && !ssr_over_environment && u_ssr_method == SSR_METHOD_FRESNEL_TWEAK) {
 			final_light += light_intensity * cook_torrance_reflectance_with_ssr(V, L, N, color, roughness, metalness, ssr_color);
 		} else {
 			final_light += light_intensity * cook_torrance_reflectance(V, L, N, color, roughness, metalness);
@@ -1473,17 +1832,99 @@ void main()
 
 	}
 
-	if (u_ssr_active != 0 && u_ssr_method == SSR_METHOD_BALANCE_SLIDER) {
-		final_light = (1.0 - u_ssr_weight) * final_light + u_ssr_weight * ssr_color;
-	} else if (u_ssr_active != 0 && u_ssr_method == SSR_METHOD_BALANCE_METALNESS) {
-		final_light = (1.0 - metalness) * final_light + metalness * ssr_color;
-	} else if (u_ssr_active != 0 && u_ssr_method == SSR_METHOD_BALANCE_ROUGHNESS) {
-		final_light = roughness * final_light + (1.0 - roughness) * ssr_color;
-	} else if (u_ssr_active != 0 && u_ssr_method == SSR_METHOD_TREAT_AS_LIGHT) {
-		final_light += ssr_color * cook_torrance_reflectance(V, reflect(-V, N), N, color, roughness, metalness);
+	// without environment the compose methods mix the SSR with the lights, also weighted by its confidence
+	if (!ssr_over_environment && ssr_confidence > 0.0) {
+		if (u_ssr_method == SSR_METHOD_BALANCE_SLIDER) {
+			final_light = mix(final_light, ssr_color, u_ssr_weight * ssr_confidence);
+		} else if (u_ssr_method == SSR_METHOD_BALANCE_METALNESS) {
+			final_light = mix(final_light, ssr_color, metalness * ssr_confidence);
+		} else if (u_ssr_method == SSR_METHOD_BALANCE_ROUGHNESS) {
+			final_light = mix(final_light, ssr_color, (1.0 - roughness) * ssr_confidence);
+		} else if (u_ssr_method == SSR_METHOD_TREAT_AS_LIGHT) {
+			final_light += ssr_color * ssr_confidence * cook_torrance_reflectance(V, reflect(-V, N), N, color, roughness, metalness);
+		}
 	}
 
-	illumination = vec4(final_light * color, 1.0);
+	illumination = vec4(final_light * color + ibl_color, 1.0);
+}
+
+\reflection_probe_prefilter.fs
+
+#version 330 core
+
+#include pbr_functions
+
+in vec2 v_uv;
+
+uniform samplerCube u_texture; //the capture with its mips
+uniform int u_face;
+uniform float u_roughness;
+uniform float u_size; //of the first level of the capture
+uniform int u_samples;
+
+out vec4 FragColor;
+
+//direction of a texel of the face, same orientation as GL (and as the cameras of the capture)
+vec3 face_direction(int face, vec2 uv)
+{
+	vec2 st = uv * 2.0 - 1.0;
+	if (face == 0) return vec3(1.0, -st.y, -st.x);
+	if (face == 1) return vec3(-1.0, -st.y, st.x);
+	if (face == 2) return vec3(st.x, 1.0, st.y);
+	if (face == 3) return vec3(st.x, -1.0, -st.y);
+	if (face == 4) return vec3(st.x, -st.y, 1.0);
+	return vec3(-st.x, -st.y, -1.0);
+}
+
+float radical_inverse(uint bits)
+{
+	bits = (bits << 16u) | (bits >> 16u);
+	bits = ((bits & 0x55555555u) << 1u) | ((bits & 0xAAAAAAAAu) >> 1u);
+	bits = ((bits & 0x33333333u) << 2u) | ((bits & 0xCCCCCCCCu) >> 2u);
+	bits = ((bits & 0x0F0F0F0Fu) << 4u) | ((bits & 0xF0F0F0F0u) >> 4u);
+	bits = ((bits & 0x00FF00FFu) << 8u) | ((bits & 0xFF00FF00u) >> 8u);
+	return float(bits) * 2.3283064365386963e-10;
+}
+
+//filtered importance sampling like GFX::IBL, every sample reads the mip that covers its solid angle
+void main()
+{
+	vec3 N = normalize(face_direction(u_face, v_uv));
+	if (u_roughness == 0.0) {
+		FragColor = textureLod(u_texture, N, 0.0);
+		return;
+	}
+
+	vec3 up = abs(N.z) < 0.999 ? vec3(0.0, 0.0, 1.0) : vec3(1.0, 0.0, 0.0);
+	vec3 T = normalize(cross(up, N));
+	vec3 B = cross(N, T);
+
+	float alpha = u_roughness * u_roughness;
+	float texel_solid_angle = 4.0 * PI / (6.0 * u_size * u_size);
+	vec4 color = vec4(0.0);
+	float total_weight = 0.0;
+	for (int i = 0; i < u_samples; ++i)
+	{
+		float u = float(i) / float(u_samples);
+		float v = radical_inverse(uint(i));
+		float phi = 2.0 * PI * u;
+		float cos_theta = sqrt((1.0 - v) / (1.0 + (alpha * alpha - 1.0) * v));
+		float sin_theta = sqrt(1.0 - cos_theta * cos_theta);
+		vec3 H = vec3(sin_theta * cos(phi), sin_theta * sin(phi), cos_theta);
+		//N = V
+		vec3 L = vec3(2.0 * H.z * H.x, 2.0 * H.z * H.y, 2.0 * H.z * H.z - 1.0);
+		if (L.z <= 0.0)
+			continue;
+
+		float d = H.z * H.z * (alpha * alpha - 1.0) + 1.0;
+		float pdf = alpha * alpha / (PI * d * d) * 0.25;
+		float sample_solid_angle = 1.0 / (float(u_samples) * pdf + 0.0001);
+		float lod = max(0.0, 0.5 * log2(sample_solid_angle / texel_solid_angle) + 1.0);
+
+		color += textureLod(u_texture, T * L.x + B * L.y + N * L.z, lod) * L.z;
+		total_weight += L.z;
+	}
+	FragColor = color / max(total_weight, 0.0001);
 }
 
 \ssao_compute.fs
@@ -1881,7 +2322,8 @@ uniform float u_step_size;
 
 uniform sampler2D u_prev_frame;
 
-layout(location = 0) out vec3 ssr_fbo;
+//rgb is the reflected color, a how much it can be trusted (0 where the ray found nothing)
+layout(location = 0) out vec4 ssr_fbo;
 
 void main() {
 	// Typical deferred preamble to get the world position of a fragment
@@ -1941,7 +2383,11 @@ void main() {
 		if (difference < u_hidden_offset) discard;
 
 		if (difference < 0.0) {
-			ssr_fbo = reflection_color;
+			// the hits close to the borders of the screen and at the end of the ray fade out, there the environment takes over
+			vec2 edge = min(sample_uv, 1.0 - sample_uv);
+			float confidence = clamp(min(edge.x, edge.y) * 10.0, 0.0, 1.0);
+			confidence *= 1.0 - float(i) / float(u_raymarching_steps);
+			ssr_fbo = vec4(reflection_color, confidence);
 			return;
 		}
 	}
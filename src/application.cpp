@@ -5,7 +5,12 @@
 #include <cstdio>
 
 #include "editor.h"
+#include "benchmark.h"
 #include "pipeline/light.h"
+#include "pipeline/irradiance.h"
+#include "pipeline/reflections.h"
+#include "pipeline/animator.h"
+#include "utils/pak.h"
 
 std::vector<vec3> debug_points; //useful
 
@@ -13,7 +18,7 @@ float cam_speed = 1.5;
 
 SceneEditor* editor = nullptr;
 
-Application::Application()
+Application::Application(const char* scene_filename)
 {
 	instance = this;
 	mouse_locked = false;
@@ -22,6 +27,11 @@ Application::Application()
 	REGISTER_ENTITY_TYPE(SCN::PrefabEntity);
 	//add here your own entities
 	REGISTER_ENTITY_TYPE(SCN::LightEntity);
+	REGISTER_ENTITY_TYPE(SCN::IrradianceVolumeEntity);
+	REGISTER_ENTITY_TYPE(SCN::ReflectionProbeEntity);
+	REGISTER_ENTITY_TYPE(SCN::LightmapEntity);
+	REGISTER_ENTITY_TYPE(SCN::CharacterEntity);
+	REGISTER_ENTITY_TYPE(SCN::CrowdEntity);
 	//...
 
 	// Create camera
@@ -29,9 +39,12 @@ Application::Application()
 	camera->lookAt(vec3(-150.f, 150.0f, 250.f), vec3(0.f, 0.0f, 0.f), vec3(0.f, 1.f, 0.f));
 	camera->setPerspective( 45.f, window_width/(float)window_height, 0.01f, 1000.f);
 
+	//packed assets (see GTR_Cooker -p), files not found inside are read from disk
+	Pak::mount("data/assets.pak");
+
 	//load scene
 	scene = new SCN::Scene();
-	if (!scene->load("data/scene.json"))
+	if (!scene->load(scene_filename))
 		exit(1);
 
 	camera->lookAt(scene->main_camera.eye, scene->main_camera.center, vec3(0, 1, 0));
@@ -82,6 +95,9 @@ void Application::render(void)
 
 void Application::update(double seconds_elapsed)
 {
+	//the clocks of the scene, the poses are sampled when rendering
+	SCN::Animator::advance(scene, (float)seconds_elapsed);
+
 	float speed = seconds_elapsed * cam_speed; //the speed is defined by the seconds_elapsed so it goes constant
 	float orbit_speed = seconds_elapsed * 0.5f;
 	
@@ -151,6 +167,7 @@ void Application::onKeyDown( SDL_KeyboardEvent event )
 			camera->lookAt(scene->main_camera.eye, scene->main_camera.center, Vector3f(0, 1, 0));
 			camera->fov = scene->main_camera.fov;
 			break;
+		case SDLK_F8: Benchmark::recordKey(camera, BENCHMARK_PATH_FILENAME); break; //adds the camera to the path of the benchmark
 	}
 }
 
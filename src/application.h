@@ -18,7 +18,7 @@ public:
 	SCN::Renderer* renderer = nullptr;
 	bool render_debug = true;
 
-	Application();
+	Application(const char* scene_filename = "data/scene.json");
 
 	//main functions
 	void render( void );
@@ -0,0 +1,398 @@
+#include "benchmark.h"
+
+#include <iostream>
+#include <cstring>
+#include <cstdlib>
+#include <cmath>
+#include <chrono>
+#include <algorithm>
+
+#include "application.h"
+#include "core/task.h"
+#include "gfx/profiler.h"
+#include "gfx/uploader.h"
+#include "gfx/streamer.h"
+#include "pipeline/animator.h"
+
+#define BENCHMARK_TASKS_MS 4 //like the main loop
+#define BENCHMARK_ORBIT_KEYS 8 //of the default path
+
+bool Benchmark::parseArgs(int argc, char** argv, sBenchmarkSettings& settings)
+{
+	bool benchmark = false;
+	for (int i = 1; i < argc; ++i)
+	{
+		const char* arg = argv[i];
+		if (strcmp(arg, "--benchmark") == 0)
+		{
+			benchmark = true;
+			if (i + 1 < argc && argv[i + 1][0] != '-') //the scene is optional
+				settings.scene_filename = argv[++i];
+			continue;
+		}
+		if (i + 1 >= argc)
+		{
+			std::cerr << "Missing value of " << arg << std::endl;
+			break;
+		}
+
+		const char* value = argv[++i];
+		if (strcmp(arg, "--frames") == 0)
+			settings.frames = (std::max)(1, atoi(value));
+		else if (strcmp(arg, "--warmup") == 0)
+			settings.warmup = (std::max)(0, atoi(value));
+		else if (strcmp(arg, "--width") == 0)
+			settings.width = (std::max)(16, atoi(value));
+		else if (strcmp(arg, "--height") == 0)
+			settings.height = (std::max)(16, atoi(value));
+		else if (strcmp(arg, "--fps") == 0)
+			settings.fps = (std::max)(1.0f, (float)atof(value));
+		else if (strcmp(arg, "--timeout") == 0)
+			settings.load_timeout = (float)atof(value);
+		else if (strcmp(arg, "--path") == 0)
+			settings.path_filename = value;
+		else if (strcmp(arg, "--output") == 0)
+			settings.output_filename = value;
+		else
+			std::cerr << "Unknown argument: " << arg << std::endl;
+	}
+	return benchmark;
+}
+
+//one frame like the main loop, with a fixed step of the clock, false if the app must exit
+static bool renderFrame(CORE::Window* window, Application* app, float elapsed_time)
+{
+	app->elapsed_time = elapsed_time;
+	app->time += elapsed_time;
+	app->frame++;
+	SCN::Animator::advance(app->scene, elapsed_time); //Application::update is not called, it only moves the camera with the input
+
+	GFX::Profiler::beginFrame(app->frame);
+	app->render();
+	GFX::Profiler::endFrame();
+
+	SDL_GL_SwapWindow(window);
+
+	SDL_Event event;
+	while (SDL_PollEvent(&event))
+		if (event.type == SDL_EVENT_QUIT)
+			return false;
+
+	TaskManager::foreground.fetchTasks(BENCHMARK_TASKS_MS);
+	GFX::Uploader::update();
+	GFX::TextureStreamer::update();
+	return !app->must_exit;
+}
+
+static void setCamera(Camera* camera, const Benchmark::sKey& key)
+{
+	camera->lookAt(key.eye, key.center, Vector3f(0, 1, 0));
+	camera->fov = key.fov;
+}
+
+static void writeStats(cJSON* json, const char* name, const Benchmark::sStats& stats)
+{
+	cJSON* stats_json = cJSON_CreateObject();
+	cJSON_AddNumberToObject(stats_json, "mean", stats.mean);
+	cJSON_AddNumberToObject(stats_json, "p50", stats.p50);
+	cJSON_AddNumberToObject(stats_json, "p95", stats.p95);
+	cJSON_AddNumberToObject(stats_json, "p99", stats.p99);
+	cJSON_AddNumberToObject(stats_json, "max", stats.max);
+	cJSON_AddItemToObject(json, name, stats_json);
+}
+
+int Benchmark::run(const sBenchmarkSettings& settings)
+{
+	std::cout << "Benchmark: " << settings.scene_filename << " at " << settings.width << " x " << settings.height << ", " << settings.frames << " frames" << std::endl;
+
+	CORE::init(true);
+	CORE::Window* window = CORE::createWindow("GTR Benchmark", settings.width, settings.height);
+	if (!window)
+		return 1;
+
+	Application* app = new Application(settings.scene_filename.c_str());
+	app->render_ui = false;
+	app->render_debug = false;
+	Camera* camera = app->camera;
+	camera->aspect = settings.width / (float)settings.height;
+
+	//the path, by default an orbit around the center of the main camera at its distance and height
+	std::vector<sKey> keys;
+	bool loop = true;
+	if (settings.path_filename.size())
+	{
+		if (!loadPath(settings.path_filename.c_str(), keys, loop) || keys.empty())
+		{
+			std::cerr << "Benchmark: camera path not found or empty: " << settings.path_filename << std::endl;
+			CORE::destroy();
+			return 1;
+		}
+	}
+	else
+	{
+		const Camera& main_camera = app->scene->main_camera;
+		Vector3f offset = main_camera.eye - main_camera.center;
+		float radius = (std::max)(sqrtf(offset.x * offset.x + offset.z * offset.z), 0.01f);
+		float start = atan2f(offset.z, offset.x);
+		for (int i = 0; i < BENCHMARK_ORBIT_KEYS; ++i)
+		{
+			float angle = start + i * 2.0f * (float)PI / BENCHMARK_ORBIT_KEYS;
+			Vector3f eye = main_camera.center + Vector3f(cosf(angle) * radius, offset.y, sinf(angle) * radius);
+			keys.push_back({ eye, main_camera.center, main_camera.fov });
+		}
+	}
+	setCamera(camera, keys[0]);
+
+	GFX::Profiler& profiler = GFX::Profiler::instance();
+	profiler.is_active = true;
+	profiler.keep_history = false;
+
+	//the clock is stopped until everything is loaded, the baked data (probes, lightmaps) is done in the first frames
+	auto load_start = std::chrono::steady_clock::now();
+	double load_time = 0;
+	bool running = true;
+	int loading_frames = 0;
+	while (running && (!loading_frames || app->renderer->prefabs_pending || GFX::Uploader::getPendingBytes()))
+	{
+		running = renderFrame(window, app, 0.0f);
+		loading_frames++;
+		load_time = std::chrono::duration<double>(std::chrono::steady_clock::now() - load_start).count();
+		if (load_time > settings.load_timeout)
+		{
+			std::cerr << "Benchmark: the scene is still loading after " << (int)load_time << "s, measuring anyway" << std::endl;
+			break;
+		}
+	}
+	std::cout << " + Loaded in " << load_time << "s (" << loading_frames << " frames)" << std::endl;
+
+	float step = 1.0f / settings.fps;
+	for (int i = 0; running && i < settings.warmup; ++i)
+		running = renderFrame(window, app, step);
+
+	//measured frames
+	GFX::Profiler::clear();
+	profiler.keep_history = true;
+	std::vector<double> frame_times;
+	int segments = loop ? settings.frames : settings.frames - 1;
+	for (int i = 0; running && i < settings.frames; ++i)
+	{
+		setCamera(camera, samplePath(keys, loop, segments > 0 ? i / (float)segments : 0.0f));
+		auto start = std::chrono::steady_clock::now();
+		running = renderFrame(window, app, step);
+		frame_times.push_back(std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count());
+	}
+	GFX::Profiler::flush();
+	profiler.keep_history = false;
+
+	//the samples of every pass, in the order they appear, the passes repeated in a frame are added
+	struct sPassSamples {
+		std::string name;
+		int depth = 0;
+		std::vector<double> cpu;
+		std::vector<double> gpu;
+	};
+	std::vector<sPassSamples> passes;
+	for (const GFX::Profiler::sFrame& frame : profiler.history)
+	{
+		std::vector<int> used; //in this frame
+		for (const GFX::Profiler::sPass& pass : frame.passes)
+		{
+			int index = -1;
+			for (size_t j = 0; j < passes.size() && index == -1; ++j)
+				if (passes[j].name == pass.name)
+					index = (int)j;
+			if (index == -1)
+			{
+				index = (int)passes.size();
+				passes.push_back(sPassSamples());
+				passes.back().name = pass.name;
+				passes.back().depth = pass.depth;
+			}
+			sPassSamples& samples = passes[index];
+			if (std::find(used.begin(), used.end(), index) != used.end())
+			{
+				samples.cpu.back() += pass.cpu_time;
+				samples.gpu.back() += pass.gpu_time;
+				continue;
+			}
+			used.push_back(index);
+			samples.cpu.push_back(pass.cpu_time);
+			samples.gpu.push_back(pass.gpu_time);
+		}
+	}
+
+	//results
+	const char* pipeline_names[] = { "forward", "deferred", "forward_plus" };
+	cJSON* json = cJSON_CreateObject();
+	writeJSONString(json, "scene", settings.scene_filename.c_str());
+	writeJSONString(json, "path", settings.path_filename.size() ? settings.path_filename.c_str() : "orbit");
+	writeJSONString(json, "renderer", (const char*)glGetString(GL_RENDERER));
+	writeJSONString(json, "version", (const char*)glGetString(GL_VERSION));
+	writeJSONString(json, "pipeline", pipeline_names[app->renderer->pipeline_mode]);
+	writeJSONNumber(json, "width", (float)settings.width);
+	writeJSONNumber(json, "height", (float)settings.height);
+	writeJSONNumber(json, "frames", (float)frame_times.size());
+	writeJSONNumber(json, "warmup", (float)settings.warmup);
+	writeJSONNumber(json, "fps", settings.fps);
+	writeJSONNumber(json, "load_time", (float)load_time);
+	writeStats(json, "frame_time", computeStats(frame_times)); //wall clock of the whole frame, with the swap and the tasks
+
+	std::cout << " + " << frame_times.size() << " frames (ms)" << std::endl;
+	cJSON* passes_json = cJSON_CreateArray();
+	cJSON_AddItemToObject(json, "passes", passes_json);
+	for (sPassSamples& samples : passes)
+	{
+		sStats cpu = computeStats(samples.cpu);
+		sStats gpu = computeStats(samples.gpu);
+		cJSON* pass_json = cJSON_CreateObject();
+		cJSON_AddItemToArray(passes_json, pass_json);
+		writeJSONString(pass_json, "name", samples.name.c_str());
+		writeJSONNumber(pass_json, "depth", (float)samples.depth);
+		writeJSONNumber(pass_json, "samples", (float)samples.cpu.size());
+		writeStats(pass_json, "cpu", cpu);
+		writeStats(pass_json, "gpu", gpu);
+
+		printf("   %*s%-*s CPU %7.3f p95 %7.3f | GPU %7.3f p95 %7.3f\n", samples.depth * 2, "", 16 - samples.depth * 2, samples.name.c_str(), cpu.mean, cpu.p95, gpu.mean, gpu.p95);
+	}
+
+	char* str = cJSON_Print(json);
+	std::string data = str;
+	cJSON_free(str);
+	cJSON_Delete(json);
+
+	bool saved = writeFile(settings.output_filename, data);
+	if (saved)
+		std::cout << " + Results saved to " << settings.output_filename << std::endl;
+	else
+		std::cerr << "Benchmark: cannot write " << settings.output_filename << std::endl;
+
+	profiler.history.clear();
+	CORE::destroy();
+	return saved && running ? 0 : 1;
+}
+
+bool Benchmark::loadPath(const char* filename, std::vector<sKey>& keys, bool& loop)
+{
+	std::string content;
+	if (!readFile(filename, content))
+		return false;
+	cJSON* json = cJSON_Parse(content.c_str());
+	if (!json)
+	{
+		std::cerr << "JSON has errors: " << filename << std::endl;
+		return false;
+	}
+
+	keys.clear();
+	loop = readJSONBool(json, "loop", false);
+	cJSON* keys_json = cJSON_GetObjectItemCaseSensitive(json, "keys");
+	cJSON* key_json;
+	cJSON_ArrayForEach(key_json, keys_json)
+	{
+		sKey key;
+		key.eye = readJSONVector3(key_json, "eye", Vector3f());
+		key.center = readJSONVector3(key_json, "center", Vector3f(0, 0, -1));
+		key.fov = readJSONNumber(key_json, "fov", 45.0f);
+		keys.push_back(key);
+	}
+	cJSON_Delete(json);
+	return true;
+}
+
+bool Benchmark::savePath(const char* filename, const std::vector<sKey>& keys, bool loop)
+{
+	cJSON* json = cJSON_CreateObject();
+	writeJSONBool(json, "loop", loop);
+	cJSON* keys_json = cJSON_CreateArray();
+	cJSON_AddItemToObject(json, "keys", keys_json);
+	for (const sKey& key : keys)
+	{
+		cJSON* key_json = cJSON_CreateObject();
+		cJSON_AddItemToArray(keys_json, key_json);
+		writeJSONVector3(key_json, "eye", key.eye);
+		writeJSONVector3(key_json, "center", key.center);
+		writeJSONNumber(key_json, "fov", key.fov);
+	}
+
+	char* str = cJSON_Print(json);
+	std::string data = str;
+	cJSON_free(str);
+	cJSON_Delete(json);
+	return writeFile(filename, data);
+}
+
+void Benchmark::recordKey(Camera* camera, const char* filename)
+{
+	std::vector<sKey> keys;
+	bool loop = false;
+	loadPath(filename, keys, loop); //a new path if it does not exist
+	keys.push_back({ camera->eye, camera->center, camera->fov });
+	if (!savePath(filename, keys, loop))
+	{
+		std::cerr << "Cannot save the camera path: " << filename << std::endl;
+		return;
+	}
+	std::cout << " + Camera key " << keys.size() << " saved to " << filename << std::endl;
+	UI::addNotification("Camera key " + std::to_string(keys.size()) + " saved to " + filename);
+}
+
+template<typename T> static T catmullRom(const T& p0, const T& p1, const T& p2, const T& p3, float t)
+{
+	float t2 = t * t;
+	float t3 = t2 * t;
+	return (p1 * 2.0f + (p2 - p0) * t + (p0 * 2.0f - p1 * 5.0f + p2 * 4.0f - p3) * t2 + (p1 * 3.0f - p0 - p2 * 3.0f + p3) * t3) * 0.5f;
+}
+
+Benchmark::sKey Benchmark::samplePath(const std::vector<sKey>& keys, bool loop, float t)
+{
+	assert(keys.size() && "empty camera path");
+	int num = (int)keys.size();
+	if (num == 1)
+		return keys[0];
+
+	int segments = loop ? num : num - 1;
+	float f = clamp(t, 0.0f, 1.0f) * segments;
+	int segment = (std::min)((int)f, segments - 1);
+	float u = f - segment;
+
+	//the keys around the segment, the ends are repeated when it does not loop
+	auto getKey = [&](int i) -> const sKey& {
+		if (loop)
+			return keys[((i % num) + num) % num];
+		return keys[(std::max)(0, (std::min)(i, num - 1))];
+	};
+	const sKey& k0 = getKey(segment - 1);
+	const sKey& k1 = getKey(segment);
+	const sKey& k2 = getKey(segment + 1);
+	const sKey& k3 = getKey(segment + 2);
+
+	sKey result;
+	result.eye = catmullRom(k0.eye, k1.eye, k2.eye, k3.eye, u);
+	result.center = catmullRom(k0.center, k1.center, k2.center, k3.center, u);
+	result.fov = catmullRom(k0.fov, k1.fov, k2.fov, k3.fov, u);
+	return result;
+}
+
+Benchmark::sStats Benchmark::computeStats(std::vector<double> samples)
+{
+	sStats stats = { 0, 0, 0, 0, 0 };
+	if (samples.empty())
+		return stats;
+	std::sort(samples.begin(), samples.end());
+
+	double total = 0;
+	for (double sample : samples)
+		total += sample;
+	stats.mean = total / samples.size();
+
+	//nearest rank
+	auto percentile = [&](double p) {
+		size_t rank = (size_t)ceil(p * samples.size());
+		return samples[(std::min)(samples.size() - 1, rank ? rank - 1 : 0)];
+	};
+	stats.p50 = percentile(0.50);
+	stats.p95 = percentile(0.95);
+	stats.p99 = percentile(0.99);
+	stats.max = samples.back();
+	return stats;
+}
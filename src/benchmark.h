@@ -0,0 +1,60 @@
+/*  Benchmark: renders a scene without a user and measures every pass (GTR --benchmark scene.json)
+	+ the window is created offscreen (SDL offscreen video driver, EGL), it works in machines without display like the CI with Mesa llvmpipe
+	+ the scene is loaded, the textures and prefabs are waited for and some warmup frames are rendered before measuring
+	+ the camera flies along a recorded path (F8 in the app adds the current camera as a key), Catmull-Rom between the keys,
+	  without path it orbits around the main camera of the scene
+	+ the clock of the scene advances a fixed step per frame so every run renders the same frames
+	+ the Profiler measures the CPU and GPU time of every pass, the mean, p50, p95 and p99 are saved as JSON
+*/
+#pragma once
+
+#include <string>
+#include <vector>
+
+#include "core/math.h"
+
+class Camera;
+
+#define BENCHMARK_PATH_FILENAME "data/camera_path.json"
+
+struct sBenchmarkSettings {
+	std::string scene_filename = "data/scene.json";
+	std::string path_filename; //empty orbits around the main camera of the scene
+	std::string output_filename = "benchmark.json";
+	int width = 1280;
+	int height = 720;
+	int frames = 600; //measured
+	int warmup = 60; //rendered but not measured, once the scene is loaded
+	float fps = 60.0f; //of the clock of the scene
+	float load_timeout = 120.0f; //seconds waiting for the assets
+};
+
+class Benchmark {
+public:
+	struct sKey {
+		Vector3f eye;
+		Vector3f center;
+		float fov;
+	};
+
+	struct sStats {
+		double mean;
+		double p50;
+		double p95;
+		double p99;
+		double max;
+	};
+
+	//false if the arguments do not ask for a benchmark
+	static bool parseArgs(int argc, char** argv, sBenchmarkSettings& settings);
+	//creates the offscreen window and the app, renders and saves the results, returns the exit code
+	static int run(const sBenchmarkSettings& settings);
+
+	//camera paths
+	static bool loadPath(const char* filename, std::vector<sKey>& keys, bool& loop);
+	static bool savePath(const char* filename, const std::vector<sKey>& keys, bool loop);
+	static void recordKey(Camera* camera, const char* filename); //appends the camera to the path in the file
+	static sKey samplePath(const std::vector<sKey>& keys, bool loop, float t); //t from 0 to 1
+
+	static sStats computeStats(std::vector<double> samples);
+};
@@ -0,0 +1,680 @@
+/*  GTR COOKER
+	Headless tool that preprocesses the assets so the application only has to read binary data at startup:
+	 + meshes (OBJ, ASE, MESH and the named primitives of glTFs) are parsed and stored as .mbin
+	 + images (PNG, JPG, TGA) are decoded, their mips built (see gfx/mipmaps.h) and block compressed (see gfx/compression.h)
+	   into a .ktx. How they are used comes from the materials of the glTFs (or the name), normal maps go to BC5
+	 + HDRE environments get their image based lighting baked (see gfx/ibl.h) into the ibl folder
+	The results go to the cooked folder (see getCookedFilename), the loaders check it before parsing the source files.
+	It only links the assets library (the loaders and the encoders built with SKIP_GL, see core/includes.h), there is no GL,
+	SDL or ImGui in it, so it builds and runs in a build machine.
+
+	usage: GTR_Cooker <scene.json | folder | file> [-o cooked_folder] [-j num_threads] [-f] [-p pak_filename] [-u] [-q fast|normal|high] [-r] [-b] [-bm [triangles]]
+	 + run it from the same folder as the application so the paths match
+	 + files are only cooked again if the source is newer than the cooked version, unless -f is used
+	 + -q is the compression quality preset (normal by default), -r stores the images raw (.ibin) instead
+	 + -b only measures how long it takes to decode the PNG and JPG images (nothing is cooked)
+	 + -bm only measures the OBJ parser against the previous one (loadOBJLegacy) with a generated grid (10M triangles by default),
+	   both results are written as .mbin and compared byte by byte, no input needed
+	 + -p packs the sources and the cooked files in a pak (see utils/pak.h), -u stores them uncompressed
+*/
+
+#include <iostream>
+#include <filesystem>
+#include <thread>
+#include <set>
+#include <map>
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cctype>
+
+#include "../gfx/mesh.h"
+#include "../gfx/texture.h"
+#include "../gfx/mipmaps.h"
+#include "../gfx/compression.h"
+#include "../gfx/ibl.h"
+#include "../pipeline/prefab.h"
+#include "../utils/utils.h"
+#include "../utils/gltf_loader.h"
+#include "../utils/pak.h"
+#include "../core/task.h"
+
+namespace fs = std::filesystem;
+
+enum eCookType {
+	COOK_NONE,
+	COOK_MESH,
+	COOK_IMAGE,
+	COOK_GLTF,
+	COOK_HDRE
+};
+
+struct sCookJob {
+	std::string filename;
+	eCookType type;
+	bool done;
+};
+
+bool force_cook = false;
+bool compress_images = true;
+GFX::BlockCompressor::eQuality compress_quality = GFX::BlockCompressor::NORMAL;
+std::map<std::string, GFX::MipGenerator::sOptions> image_options; //by canonical path, filled before cooking
+
+eCookType getCookType(const std::string& filename)
+{
+	std::string ext = toLowerCase(getExtension(filename));
+	if (ext == "obj" || ext == "ase" || ext == "mesh")
+		return COOK_MESH;
+	if (ext == "png" || ext == "jpg" || ext == "jpeg" || ext == "tga")
+		return COOK_IMAGE;
+	if (ext == "gltf" || ext == "glb")
+		return COOK_GLTF;
+	if (ext == "hdre")
+		return COOK_HDRE;
+	return COOK_NONE;
+}
+
+//the cooked file of every type, glTFs leave a stamp because they generate several files
+std::string getCookTarget(const sCookJob& job)
+{
+	if (job.type == COOK_MESH)
+		return getCookedFilename(job.filename, ".mbin");
+	if (job.type == COOK_IMAGE)
+		return getCookedFilename(job.filename, compress_images ? ".ktx" : ".ibin");
+	return getCookedFilename(job.filename, ".stamp");
+}
+
+bool isUpToDate(const sCookJob& job)
+{
+	std::error_code err;
+	fs::path target = getCookTarget(job);
+	if (force_cook || !fs::exists(target, err))
+		return false;
+	return fs::last_write_time(target, err) >= fs::last_write_time(job.filename, err);
+}
+
+void createFolderFor(const std::string& filename)
+{
+	std::error_code err;
+	fs::path folder = fs::path(filename).parent_path();
+	if (!folder.empty())
+		fs::create_directories(folder, err);
+}
+
+bool cookMesh(const std::string& filename)
+{
+	GFX::Mesh mesh;
+	if (!mesh.load(filename.c_str()))
+		return false;
+
+	if (GFX::Mesh::interleave_meshes)
+		mesh.interleaveBuffers();
+
+	//writeBin adds the .mbin extension
+	std::string cooked = getCookedFilename(filename);
+	createFolderFor(cooked);
+	return mesh.writeBin(cooked.c_str());
+}
+
+GFX::MipGenerator::sOptions getImageOptions(const std::string& filename)
+{
+	std::error_code err;
+	auto it = image_options.find(fs::weakly_canonical(filename, err).generic_string());
+	if (it != image_options.end())
+		return it->second;
+	return GFX::MipGenerator::guessOptions(filename);
+}
+
+bool cookImage(const std::string& filename)
+{
+	Image* image = new Image();
+	if (!image->load(filename.c_str()))
+	{
+		delete image;
+		return false;
+	}
+
+	bool result;
+	if (compress_images)
+	{
+		GFX::MipGenerator::sOptions options = getImageOptions(filename);
+		std::vector<Image*> levels;
+		GFX::MipGenerator::build(image, levels, options);
+		GFX::BlockCompressor::eFormat format = GFX::BlockCompressor::chooseFormat(image, options.normal_map, compress_quality);
+		std::string cooked = getCookedFilename(filename, ".ktx");
+		createFolderFor(cooked);
+		result = GFX::BlockCompressor::saveKTX(cooked.c_str(), levels, format, compress_quality);
+		for (Image* level : levels) //levels[0] is the image
+			delete level;
+	}
+	else
+	{
+		std::string cooked = getCookedFilename(filename, ".ibin");
+		createFolderFor(cooked);
+		result = image->saveIBIN(cooked.c_str());
+		delete image;
+	}
+	return result;
+}
+
+//how the materials of a glTF use its images
+void addImageOptions(const std::string& filename)
+{
+	std::error_code err;
+	for (auto& it : getGLTFImageOptions(filename.c_str()))
+		image_options[fs::weakly_canonical(it.first, err).generic_string()] = it.second;
+}
+
+//not thread safe, the glTF importer uses globals and registers the meshes
+bool cookGLTF(const std::string& filename)
+{
+	SCN::Prefab* prefab = loadGLTF(filename.c_str());
+	if (!prefab)
+		return false;
+
+	//the importer registers the named primitives as "filename::mesh::index"
+	std::string prefix = filename + "::";
+	std::vector<std::string> names;
+	for (auto& it : GFX::Mesh::sMeshesLoaded)
+		if (it.first.compare(0, prefix.size(), prefix) == 0)
+			names.push_back(it.first);
+
+	bool result = true;
+	for (std::string& name : names)
+	{
+		std::string cooked = getCookedFilename(name);
+		createFolderFor(cooked);
+		result = GFX::Mesh::sMeshesLoaded[name]->writeBin(cooked.c_str()) && result;
+	}
+
+	delete prefab;
+	for (std::string& name : names)
+	{
+		delete GFX::Mesh::sMeshesLoaded[name];
+		GFX::Mesh::sMeshesLoaded.erase(name);
+	}
+
+	std::cout << " * " << names.size() << " meshes cooked from " << filename << std::endl;
+	if (result)
+	{
+		std::string stamp = getCookedFilename(filename, ".stamp");
+		std::string content = std::to_string(names.size());
+		createFolderFor(stamp);
+		writeFile(stamp, content);
+	}
+	return result;
+}
+
+//the IBL cache is named by the contents, the stamp only tells that the file was visited
+bool cookHDRE(const std::string& filename)
+{
+	GFX::IBL* ibl = GFX::IBL::Get(filename.c_str(), false);
+	if (!ibl)
+		return false;
+
+	std::string stamp = getCookedFilename(filename, ".stamp");
+	std::string content = GFX::IBL::getCacheFilename(ibl->hash);
+	createFolderFor(stamp);
+	writeFile(stamp, content);
+
+	std::vector<float> lut;
+	GFX::IBL::loadBRDFLUT(lut);
+	return true;
+}
+
+//decodes every image a few times from memory, to compare the PNG and JPG decoders
+void benchmarkImages(const std::vector<sCookJob>& jobs)
+{
+	const int num_iterations = 3;
+	struct sStats { int files = 0; size_t pixels = 0; double time = 0; };
+	sStats png, jpg;
+
+	for (const sCookJob& job : jobs)
+	{
+		std::string ext = toLowerCase(getExtension(job.filename));
+		bool is_png = ext == "png";
+		if (job.type != COOK_IMAGE || (!is_png && ext != "jpg" && ext != "jpeg"))
+			continue;
+		std::vector<unsigned char> buffer;
+		if (!readFileBin(job.filename, buffer))
+			continue;
+
+		double best = 0;
+		size_t pixels = 0;
+		for (int i = 0; i < num_iterations; ++i)
+		{
+			Image image;
+			long start = getTime();
+			bool result = is_png ? image.loadPNG(buffer) : image.loadJPG(buffer);
+			double time = (double)(getTime() - start);
+			if (!result)
+				break;
+			pixels = (size_t)image.width * image.height;
+			best = i == 0 ? time : (std::min)(best, time);
+		}
+		if (!pixels)
+			continue;
+		std::cout << " * " << job.filename << ": " << best << "ms" << std::endl;
+		sStats& stats = is_png ? png : jpg;
+		stats.files++;
+		stats.pixels += pixels;
+		stats.time += best;
+	}
+
+	for (int i = 0; i < 2; ++i)
+	{
+		sStats& stats = i == 0 ? png : jpg;
+		std::cout << (i == 0 ? " * PNG: " : " * JPG: ") << stats.files << " files, " << stats.time << "ms, "
+			<< (stats.time > 0 ? stats.pixels / (stats.time * 1000.0) : 0) << " Mpixels/s" << std::endl;
+	}
+}
+
+#define OBJ_BENCHMARK_TRIANGLES 10000000
+
+//the OBJ loader before the chunked parser (a line at a time, tokenize and atof), only kept as the reference of the benchmark
+bool loadOBJLegacy(GFX::Mesh& mesh, const char* filename)
+{
+	std::string data;
+	if (!readFile(filename, data))
+		return false;
+	char* pos = &data[0];
+	char line[255];
+	int i = 0;
+
+	std::vector<Vector3f> indexed_positions;
+	std::vector<Vector3f> indexed_normals;
+	std::vector<Vector2f> indexed_uvs;
+
+	const float max_float = 10000000;
+	const float min_float = -10000000;
+	mesh.aabb_min.set(max_float, max_float, max_float);
+	mesh.aabb_max.set(min_float, min_float, min_float);
+
+	GFX::sSubmeshInfo submesh_info;
+	unsigned int last_submesh_vertex = 0;
+	memset(&submesh_info, 0, sizeof(submesh_info));
+
+	while (*pos != 0)
+	{
+		if (*pos == '\n') pos++;
+		if (*pos == '\r') pos++;
+
+		//read one line
+		i = 0;
+		while (i < 255 && pos[i] != '\n' && pos[i] != '\r' && pos[i] != 0) i++;
+		memcpy(line, pos, i);
+		line[i] = 0;
+		pos = pos + i;
+
+		if (*line == '#' || *line == 0) continue; //comment
+
+		std::vector<std::string> tokens = tokenize(line, " ");
+		if (tokens.empty()) continue;
+
+		if (tokens[0] == "v" && tokens.size() == 4)
+		{
+			Vector3f v((float)atof(tokens[1].c_str()), (float)atof(tokens[2].c_str()), (float)atof(tokens[3].c_str()));
+			indexed_positions.push_back(v);
+			mesh.aabb_min.setMin(v);
+			mesh.aabb_max.setMax(v);
+		}
+		else if (tokens[0] == "vt" && tokens.size() >= 3)
+			indexed_uvs.push_back(Vector2f((float)atof(tokens[1].c_str()), 1.0f - (float)atof(tokens[2].c_str())));
+		else if (tokens[0] == "vn" && tokens.size() == 4)
+			indexed_normals.push_back(Vector3f((float)atof(tokens[1].c_str()), (float)atof(tokens[2].c_str()), (float)atof(tokens[3].c_str())));
+		else if ((tokens[0] == "usemtl" || tokens[0] == "g") && tokens.size() >= 2)
+		{
+			if (last_submesh_vertex != mesh.vertices.size())
+			{
+				submesh_info.length = (unsigned int)mesh.vertices.size() - submesh_info.start;
+				last_submesh_vertex = (unsigned int)mesh.vertices.size();
+				mesh.submeshes.push_back(submesh_info);
+				memset(&submesh_info, 0, sizeof(submesh_info));
+				strcpy(submesh_info.name, tokens[1].c_str());
+				submesh_info.start = last_submesh_vertex;
+			}
+			else if (tokens[0] == "usemtl")
+				strcpy(submesh_info.material, tokens[1].c_str());
+		}
+		else if (tokens[0] == "f" && tokens.size() >= 4)
+		{
+			Vector3f v1, v2, v3;
+			v1.parseFromText(tokens[1].c_str(), '/');
+			for (unsigned int iPoly = 2; iPoly < tokens.size() - 1; iPoly++)
+			{
+				v2.parseFromText(tokens[iPoly].c_str(), '/');
+				v3.parseFromText(tokens[iPoly + 1].c_str(), '/');
+				mesh.vertices.push_back(indexed_positions[(unsigned int)(v1.x) - 1]);
+				mesh.vertices.push_back(indexed_positions[(unsigned int)(v2.x) - 1]);
+				mesh.vertices.push_back(indexed_positions[(unsigned int)(v3.x) - 1]);
+				if (indexed_uvs.size() > 0)
+				{
+					mesh.uvs.push_back(indexed_uvs[(unsigned int)(v1.y) - 1]);
+					mesh.uvs.push_back(indexed_uvs[(unsigned int)(v2.y) - 1]);
+					mesh.uvs.push_back(indexed_uvs[(unsigned int)(v3.y) - 1]);
+				}
+				if (indexed_normals.size() > 0)
+				{
+					mesh.normals.push_back(indexed_normals[(unsigned int)(v1.z) - 1]);
+					mesh.normals.push_back(indexed_normals[(unsigned int)(v2.z) - 1]);
+					mesh.normals.push_back(indexed_normals[(unsigned int)(v3.z) - 1]);
+				}
+			}
+		}
+	}
+
+	mesh.box.center = (mesh.aabb_max + mesh.aabb_min) * 0.5f;
+	mesh.box.halfsize = (mesh.aabb_max - mesh.box.center);
+	mesh.radius = (float)fmax(mesh.aabb_max.length(), mesh.aabb_min.length());
+
+	submesh_info.length = (unsigned int)mesh.vertices.size() - last_submesh_vertex;
+	mesh.submeshes.push_back(submesh_info);
+	return true;
+}
+
+//writes a grid with positions, uvs and normals to a temporary OBJ and parses it a few times with both loaders
+void benchmarkOBJ(int num_triangles)
+{
+	const int num_iterations = 3;
+	int side = (std::max)(1, (int)ceil(sqrt(num_triangles * 0.5)));
+	std::string filename = (fs::temp_directory_path() / "gtr_benchmark.obj").string();
+
+	std::cout << " * Writing " << (size_t)side * side * 2 << " triangles to " << filename << std::endl;
+	FILE* f = fopen(filename.c_str(), "wb");
+	if (!f)
+	{
+		std::cerr << "Cannot write " << filename << std::endl;
+		return;
+	}
+	std::vector<char> buffer(1 << 20);
+	size_t used = 0;
+	auto flush = [&](bool force) {
+		if (used && (force || used > buffer.size() - 256))
+		{
+			fwrite(&buffer[0], 1, used, f);
+			used = 0;
+		}
+	};
+	for (int y = 0; y <= side; ++y)
+		for (int x = 0; x <= side; ++x)
+		{
+			float u = x / (float)side;
+			float v = y / (float)side;
+			used += snprintf(&buffer[used], 256, "v %f %f %f\nvt %f %f\nvn 0 1 0\n", u * 100.0f, sinf(u * 20.0f) * cosf(v * 20.0f), v * 100.0f, u, v);
+			flush(false);
+		}
+	for (int y = 0; y < side; ++y)
+		for (int x = 0; x < side; ++x)
+		{
+			int a = y * (side + 1) + x + 1; //1-based
+			int b = a + 1;
+			int c = a + side + 1;
+			int d = c + 1;
+			used += snprintf(&buffer[used], 256, "f %d/%d/%d %d/%d/%d %d/%d/%d\nf %d/%d/%d %d/%d/%d %d/%d/%d\n", a, a, a, c, c, c, b, b, b, b, b, b, c, c, c, d, d, d);
+			flush(false);
+		}
+	flush(true);
+	fclose(f);
+
+	std::error_code err;
+	double size_mb = fs::file_size(filename, err) / (1024.0 * 1024.0);
+	double best[2] = { 0, 0 };
+	size_t triangles = 0;
+	std::string mbin_filenames[2];
+	for (int loader = 0; loader < 2; ++loader)
+	{
+		const char* loader_name = loader == 0 ? "legacy" : "chunked";
+		for (int i = 0; i < num_iterations; ++i)
+		{
+			GFX::Mesh mesh;
+			long start = getTime();
+			bool result = loader == 0 ? loadOBJLegacy(mesh, filename.c_str()) : mesh.load(filename.c_str());
+			double time = (double)(getTime() - start);
+			if (!result)
+			{
+				std::cerr << "Cannot parse " << filename << " with the " << loader_name << " loader" << std::endl;
+				fs::remove(filename, err);
+				return;
+			}
+			triangles = mesh.vertices.size() / 3;
+			best[loader] = i == 0 ? time : (std::min)(best[loader], time);
+			std::cout << " * " << loader_name << " iteration " << i << ": " << time << "ms" << std::endl;
+
+			//the result of the last one is kept to compare both loaders (the extension is added by writeBin)
+			if (i == num_iterations - 1)
+			{
+				mbin_filenames[loader] = (fs::temp_directory_path() / (std::string("gtr_benchmark_") + loader_name + ".obj")).string();
+				mesh.writeBin(mbin_filenames[loader].c_str());
+			}
+		}
+	}
+	fs::remove(filename, err);
+
+	std::vector<unsigned char> mbins[2];
+	for (int loader = 0; loader < 2; ++loader)
+	{
+		std::string mbin_filename = mbin_filenames[loader] + ".mbin";
+		readFileBin(mbin_filename.c_str(), mbins[loader]);
+		fs::remove(mbin_filename, err);
+	}
+	bool identical = mbins[0].size() && mbins[0] == mbins[1];
+
+	for (int loader = 0; loader < 2; ++loader)
+		std::cout << " * OBJ " << (loader == 0 ? "legacy:  " : "chunked: ") << triangles << " triangles, " << size_mb << "MB in " << best[loader] << "ms, "
+			<< (best[loader] > 0 ? size_mb / (best[loader] * 0.001) : 0) << " MB/s, " << (best[loader] > 0 ? triangles / (best[loader] * 1000.0) : 0) << " Mtriangles/s" << std::endl;
+	std::cout << " * Speedup " << (best[1] > 0 ? best[0] / best[1] : 0) << "x using " << TaskManager::background.getNumThreads() + 1 << " threads, .mbin "
+		<< (identical ? TermColor::GREEN : TermColor::RED) << (identical ? "identical" : "DIFFERENT") << TermColor::DEFAULT << std::endl;
+}
+
+//every file is remembered for the pak, but only some of them need to be cooked
+void addFile(std::vector<sCookJob>& jobs, std::set<std::string>& added, const std::string& filename)
+{
+	if (added.count(filename))
+		return;
+	added.insert(filename);
+	eCookType type = getCookType(filename);
+	if (type != COOK_NONE)
+		jobs.push_back({ filename, type, false });
+}
+
+void addFolder(std::vector<sCookJob>& jobs, std::set<std::string>& added, const std::string& folder)
+{
+	std::error_code err;
+	fs::path cooked = fs::weakly_canonical(cooked_folder, err);
+	for (fs::recursive_directory_iterator it(folder, err), end; it != end; it.increment(err))
+	{
+		if (it->is_directory() && fs::weakly_canonical(it->path(), err) == cooked)
+		{
+			it.disable_recursion_pending(); //never cook the cooked files
+			continue;
+		}
+		if (it->is_regular_file())
+			addFile(jobs, added, it->path().generic_string());
+	}
+}
+
+//the prefabs of the scene and the images in their folders
+bool addScene(std::vector<sCookJob>& jobs, std::set<std::string>& added, const std::string& filename)
+{
+	std::string content;
+	if (!readFile(filename, content))
+	{
+		std::cout << "- ERROR: Scene file not found: " << TermColor::RED << filename << TermColor::DEFAULT << std::endl;
+		return false;
+	}
+
+	cJSON* json = cJSON_Parse(content.c_str());
+	if (!json)
+	{
+		std::cout << "ERROR: Scene JSON has errors: " << TermColor::RED << filename << TermColor::DEFAULT << std::endl;
+		return false;
+	}
+
+	added.insert(filename);
+
+	//same paths the scene builds when loading
+	std::string base_folder = getFolderName(filename);
+	std::string skybox = readJSONString(json, "skybox", "");
+	if (skybox.size())
+		addFile(jobs, added, base_folder + "/" + skybox);
+
+	cJSON* entity_json;
+	cJSON* entities_json = cJSON_GetObjectItemCaseSensitive(json, "entities");
+	cJSON_ArrayForEach(entity_json, entities_json)
+	{
+		std::string prefab = readJSONString(entity_json, "filename", "");
+		if (prefab.empty())
+			continue;
+		std::string fullpath = base_folder + "/" + prefab;
+		addFile(jobs, added, fullpath);
+		if (getCookType(fullpath) == COOK_GLTF)
+			addFolder(jobs, added, getFolderName(fullpath));
+	}
+
+	cJSON_Delete(json);
+	return true;
+}
+
+int main(int argc, char **argv)
+{
+	std::string input;
+	std::string pak_filename;
+	bool pak_compress = true;
+	bool benchmark = false;
+	int benchmark_triangles = 0;
+	int num_threads = (std::max)(1, (int)std::thread::hardware_concurrency());
+
+	for (int i = 1; i < argc; ++i)
+	{
+		std::string arg = argv[i];
+		if (arg == "-o" && i + 1 < argc)
+			cooked_folder = cleanPath(argv[++i]);
+		else if (arg == "-j" && i + 1 < argc)
+			num_threads = (std::max)(1, atoi(argv[++i]));
+		else if (arg == "-f")
+			force_cook = true;
+		else if (arg == "-p" && i + 1 < argc)
+			pak_filename = cleanPath(argv[++i]);
+		else if (arg == "-u")
+			pak_compress = false;
+		else if (arg == "-q" && i + 1 < argc)
+		{
+			std::string preset = toLowerCase(argv[++i]);
+			compress_quality = preset == "fast" ? GFX::BlockCompressor::FAST : (preset == "high" ? GFX::BlockCompressor::HIGH : GFX::BlockCompressor::NORMAL);
+		}
+		else if (arg == "-r")
+			compress_images = false;
+		else if (arg == "-b")
+			benchmark = true;
+		else if (arg == "-bm")
+			benchmark_triangles = i + 1 < argc && isdigit(argv[i + 1][0]) ? (std::max)(2, atoi(argv[++i])) : OBJ_BENCHMARK_TRIANGLES;
+		else
+			input = cleanPath(arg);
+	}
+
+	if (benchmark_triangles)
+	{
+		GFX::Mesh::use_binary = false;
+		GFX::Mesh::auto_upload_to_vram = false;
+		TaskManager::background.startThread(num_threads - 1);
+		benchmarkOBJ(benchmark_triangles);
+		return 0;
+	}
+
+	if (input.empty())
+	{
+		std::cout << "usage: GTR_Cooker <scene.json | folder | file> [-o cooked_folder] [-j num_threads] [-f] [-p pak_filename] [-u] [-q fast|normal|high] [-r] [-b] [-bm [triangles]]" << std::endl;
+		return 1;
+	}
+
+	//the cooker reads the sources and only keeps the data in RAM
+	use_cooked_assets = false;
+	load_textures = false;
+	GFX::Mesh::use_binary = false;
+	GFX::Mesh::auto_upload_to_vram = false;
+
+	long time = getTime();
+
+	std::vector<sCookJob> jobs;
+	std::set<std::string> added;
+	std::error_code err;
+	if (fs::is_directory(input, err))
+		addFolder(jobs, added, input);
+	else if (toLowerCase(getExtension(input)) == "json")
+	{
+		if (!addScene(jobs, added, input))
+			return 1;
+	}
+	else
+		addFile(jobs, added, input);
+
+	if (benchmark)
+	{
+		TaskManager::background.startThread(num_threads - 1); //the JPGs with restart markers use it
+		benchmarkImages(jobs);
+		return 0;
+	}
+
+	//the mips and the compressor need to know how the images are used
+	if (compress_images)
+		for (sCookJob& job : jobs)
+			if (job.type == COOK_GLTF)
+				addImageOptions(job.filename);
+
+	//skip what is already cooked
+	std::vector<sCookJob*> pending;
+	for (sCookJob& job : jobs)
+		if (!isUpToDate(job))
+			pending.push_back(&job);
+		else
+			job.done = true;
+
+	std::cout << " * Cooking " << pending.size() << " of " << jobs.size() << " files into " << TermColor::YELLOW << cooked_folder << TermColor::DEFAULT << " using " << num_threads << " threads" << std::endl;
+
+	//meshes and images in the pool, glTFs share the importer state so they go one by one in the main thread
+	TaskManager::background.startThread(num_threads - 1);
+	TaskGroup group;
+	for (sCookJob* job : pending)
+	{
+		if (job->type == COOK_MESH)
+			TaskManager::background.addTask(new Task([job]() { job->done = cookMesh(job->filename); }), &group);
+		else if (job->type == COOK_IMAGE)
+			TaskManager::background.addTask(new Task([job]() { job->done = cookImage(job->filename); }), &group);
+	}
+
+	for (sCookJob* job : pending)
+		if (job->type == COOK_GLTF)
+			job->done = cookGLTF(job->filename);
+
+	//the bakes already use all the threads
+	for (sCookJob* job : pending)
+		if (job->type == COOK_HDRE)
+			job->done = cookHDRE(job->filename);
+
+	group.wait();
+
+	int num_errors = 0;
+	for (sCookJob* job : pending)
+		if (!job->done)
+		{
+			std::cout << TermColor::RED << "[ERROR] cannot cook: " << job->filename << TermColor::DEFAULT << std::endl;
+			num_errors++;
+		}
+
+	//the sources and everything in the cooked folder
+	if (pak_filename.size())
+	{
+		std::vector<std::string> files(added.begin(), added.end());
+		for (fs::recursive_directory_iterator it(cooked_folder, err), end; it != end; it.increment(err))
+			if (it->is_regular_file() && it->path().extension() != ".stamp")
+				files.push_back(it->path().generic_string());
+		files.erase(std::remove(files.begin(), files.end(), pak_filename), files.end());
+
+		std::cout << " * Packing " << files.size() << " files into " << TermColor::YELLOW << pak_filename << TermColor::DEFAULT << std::endl;
+		if (!Pak::build(pak_filename.c_str(), files, pak_compress))
+			num_errors++;
+	}
+
+	std::cout << " * Done in " << (getTime() - time) * 0.001 << "sec, " << num_errors << " errors" << std::endl;
+	return num_errors ? 1 : 0;
+}
@@ -6,6 +6,9 @@
 
 #include "../gfx/gfx.h" //check errors
 #include "../gfx/texture.h" //??
+#include "../gfx/uploader.h"
+#include "../gfx/streamer.h"
+#include "../gfx/profiler.h"
 #include "../utils/utils.h" //cleanPath
 
 #ifdef WIN32
@@ -16,9 +19,12 @@
 	#include <sys/time.h>
 #endif
 
+#define FOREGROUND_TASKS_MS 4 //time of every frame used by the tasks that must run in the main thread
+
 SDL_GLContext glcontext;
 SDL_Window* current_window = nullptr;
 long last_time = 0; //this is used to calcule the elapsed time between frames
+bool headless = false; //the window is never shown
 std::string CORE::base_path;
 
 CORE::BaseApplication* CORE::BaseApplication::instance = nullptr;
@@ -42,19 +48,25 @@ CORE::BaseApplication::BaseApplication()
 	this->window_height = (int)window_size.y;
 }
 
-void CORE::init()
+void CORE::init(bool headless_mode)
 {
+	//SDL renders to an EGL pbuffer, works without a display (Mesa llvmpipe in the CI machines)
+	headless = headless_mode;
+	if (headless)
+		SDL_SetHint(SDL_HINT_VIDEO_DRIVER, "offscreen");
+
 	//prepare SDL
 	// TODO(Juan): SDL_init_everything?
 	SDL_Init(SDL_INIT_JOYSTICK | SDL_INIT_GAMEPAD | SDL_INIT_TIMER  | SDL_INIT_EVENTS | SDL_INIT_VIDEO);
 	Input::init();
-	TaskManager::background.startThread();
+	//one thread per core (leaving one for the main thread) so images can be decoded in parallel
+	TaskManager::background.startThread((std::max)(1, (int)std::thread::hardware_concurrency() - 1));
 }
 
 //create a window using SDL
 CORE::Window* CORE::createWindow(const char* caption, int width, int height, bool fullscreen)
 {
-	int multisample = 8;
+	int multisample = headless ? 0 : 8; //software rasterizers are too slow with it
 	bool retina = false; //change this to use a retina display
 
 	//set attributes
@@ -72,7 +84,7 @@ CORE::Window* CORE::createWindow(const char* caption, int width, int height, boo
 #endif
 
 	//antialiasing (disable this lines if it goes too slow)
-	SDL_GL_SetAttribute(SDL_GL_MULTISAMPLEBUFFERS, 1);
+	SDL_GL_SetAttribute(SDL_GL_MULTISAMPLEBUFFERS, multisample ? 1 : 0);
 	SDL_GL_SetAttribute(SDL_GL_MULTISAMPLESAMPLES, multisample); //increase to have smoother polygons
 
 	// Initialize the joystick subsystem
@@ -80,9 +92,10 @@ CORE::Window* CORE::createWindow(const char* caption, int width, int height, boo
 
 	//create the window
 	// TODO(Juan): SDL_WINDOWPOS_CENTERED in SDL3?
-	SDL_Window* sdl_window = SDL_CreateWindow(caption, width, height, SDL_WINDOW_OPENGL | SDL_WINDOW_RESIZABLE |
+	SDL_Window* sdl_window = SDL_CreateWindow(caption, width, height, SDL_WINDOW_OPENGL |
+		(headless ? SDL_WINDOW_HIDDEN : SDL_WINDOW_RESIZABLE) |
 		(retina ? SDL_WINDOW_HIGH_PIXEL_DENSITY : 0) |
-		(fullscreen ? SDL_WINDOW_FULLSCREEN : 0));
+		(fullscreen && !headless ? SDL_WINDOW_FULLSCREEN : 0));
 	if (!sdl_window)
 	{
 		fprintf(stderr, "Window creation error: %s\n", SDL_GetError());
@@ -91,6 +104,11 @@ CORE::Window* CORE::createWindow(const char* caption, int width, int height, boo
 
 	// Create an OpenGL context associated with the window.
 	glcontext = SDL_GL_CreateContext(sdl_window);
+	if (!glcontext)
+	{
+		fprintf(stderr, "OpenGL context creation error: %s\n", SDL_GetError());
+		exit(-1);
+	}
 	SDL_GL_MakeCurrent(sdl_window, glcontext);
 
 	//in case of exit, call SDL_Quit()
@@ -111,6 +129,7 @@ CORE::Window* CORE::createWindow(const char* caption, int width, int height, boo
 	base_path = cleanPath( getPath() );
 	std::cout << " * Window size: " << window_width << " x " << window_height << std::endl;
 	std::cout << " * OpenGL Version: " << glGetString(GL_VERSION) << std::endl;
+	std::cout << " * OpenGL Renderer: " << glGetString(GL_RENDERER) << (headless ? " (headless)" : "") << std::endl;
 	std::cout << " * Path: " << base_path  << std::endl;
 	std::cout << std::endl;
 
@@ -175,16 +194,20 @@ void CORE::mainLoop(CORE::Window* window, BaseApplication* app)
 		}
 		gputime.start();
 
-		//render frame
-		GFX::startGPULabel("Frame");
+		//render frame (the profiler opens the Frame label)
+		GFX::Profiler::beginFrame(app->frame);
 			GFX::checkGLErrors();
 			app->render();
 			GFX::checkGLErrors();
-		GFX::endGPULabel();
 
 		//render graphical user interface
 		if (app->render_ui)
+		{
+			GFX::Profiler::begin("UI");
 			renderUI(window, app);
+			GFX::Profiler::end();
+		}
+		GFX::Profiler::endFrame();
 
 		GFX::checkGLErrors();
 		gputime.finish();
@@ -273,8 +296,12 @@ void CORE::mainLoop(CORE::Window* window, BaseApplication* app)
 		//update app logic
 		app->update(elapsed_time);
 
-		//execute a task in the main task manager (blocking)
-		TaskManager::foreground.fetchTask();
+		//execute the tasks of the main task manager (blocking) for a few ms (uploads, prefabs being loaded...)
+		TaskManager::foreground.fetchTasks(FOREGROUND_TASKS_MS);
+
+		//stream the textures decoded in the background, limited by its own budget
+		GFX::Uploader::update();
+		GFX::TextureStreamer::update();
 
 		//check errors in opengl only when working in debug
 #ifdef _DEBUG
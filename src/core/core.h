@@ -5,10 +5,11 @@
 
 namespace CORE {
 
-	typedef SDL_Window Window;
-
 	extern std::string base_path;
 
+#ifndef SKIP_GL //the assets library only uses the paths
+	typedef SDL_Window Window;
+
 	class BaseApplication
 	{
 	public:
@@ -45,7 +46,7 @@ namespace CORE {
 		virtual void onFileDrop(std::string filename, std::string relative, SDL_Event event) {};
 	};
 
-	void init();
+	void init(bool headless = false); //headless uses the offscreen video driver (EGL), no display is needed
 	void initUI();
 	Window* createWindow(const char* caption, int width, int height, bool fullscreen = false);
 	void mainLoop(CORE::Window* window, BaseApplication* app);
@@ -62,6 +63,7 @@ namespace CORE {
 	inline long getTime();
 	std::string getPath(); //get root path where the app is running
 	std::string openFileDialog(const char* default_path = nullptr);
+#endif
 };
 
 	
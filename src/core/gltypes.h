@@ -0,0 +1,41 @@
+/*  GL types without GL
+	The assets library (SKIP_GL, see includes.h) describes the images and the meshes with the same enums as the engine,
+	but it never calls GL, so it is built and linked without GL, SDL or ImGui.
+	The values are the ones of the GL headers.
+*/
+
+#ifndef GLTYPES_H
+#define GLTYPES_H
+
+#include <cstdint>
+#include <cstring> //SDL brings the C headers in the engine
+
+typedef unsigned int GLenum;
+typedef unsigned int GLuint;
+typedef int GLint;
+typedef int GLsizei;
+typedef float GLfloat;
+typedef unsigned char GLboolean;
+typedef unsigned char GLubyte;
+typedef uint64_t GLuint64;
+typedef uint8_t Uint8;
+
+//formats
+#define GL_RED 0x1903
+#define GL_RGB 0x1907
+#define GL_RGBA 0x1908
+#define GL_RG 0x8227
+#define GL_DEPTH_COMPONENT 0x1902
+
+//types
+#define GL_UNSIGNED_BYTE 0x1401
+#define GL_UNSIGNED_SHORT 0x1403
+#define GL_UNSIGNED_INT 0x1405
+#define GL_FLOAT 0x1406
+
+//primitives
+#define GL_POINTS 0x0000
+#define GL_LINES 0x0001
+#define GL_TRIANGLES 0x0004
+
+#endif
@@ -6,6 +6,16 @@
 #ifndef INCLUDES_H
 #define INCLUDES_H
 
+//SKIP_GL builds the loaders and the encoders without GL, SDL or ImGui (the assets library of the cooker),
+//only the types and the enums that describe the data are defined
+#ifdef SKIP_GL
+	#ifndef SKIP_IMGUI
+		#define SKIP_IMGUI
+	#endif
+	#include "gltypes.h"
+	#include <iostream>
+#else
+
 //under windows we need this file to make opengl work
 #ifdef WIN32 
 	#include <windows.h>
@@ -54,6 +64,8 @@
 #define REGISTER_GLEXT(RET, FUNCNAME, ...) typedef RET ( * FUNCNAME ## _func)(__VA_ARGS__); FUNCNAME ## _func FUNCNAME = NULL; 
 #define IMPORT_GLEXT(FUNCNAME) FUNCNAME = (FUNCNAME ## _func) SDL_GL_GetProcAddress(#FUNCNAME); if (FUNCNAME == NULL) { std::cout << "ERROR: This Graphics card doesnt support " << #FUNCNAME << std::endl; }
 
+#endif //SKIP_GL
+
 
 //OPENGL EXTENSIONS
 
@@ -9,6 +9,20 @@
 #include <cstring>
 #include <algorithm>
 #include <iostream>
+#include <chrono>
+#include <cfloat>
+
+#include "task.h"
+
+//SIMD kernels of Matrix44 and Quaternion, chosen at compile time: AVX, SSE or the scalar code (other CPUs, like NEON ones)
+#if defined(__SSE__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 1)
+	#define MATH_USE_SSE
+	#include <xmmintrin.h>
+	#if defined(__AVX__)
+		#define MATH_USE_AVX
+		#include <immintrin.h>
+	#endif
+#endif
 
 #define M_PI_2 1.57079632679489661923
 
@@ -246,7 +260,7 @@ void Matrix44::setTranslation(float x, float y, float z)
 	m[14] = z;
 }
 
-Vector3f Matrix44::getTranslation()
+Vector3f Matrix44::getTranslation() const
 {
 	return Vector3f(m[12],m[13],m[14]);
 }
@@ -289,7 +303,7 @@ Matrix44 Matrix44::getRotationOnly()
 }
 
 //not tested
-Vector3f Matrix44::getScale()
+Vector3f Matrix44::getScale() const
 {
 	return Vector3f((float)Vector3f(m[0], m[1], m[2]).length(),
 		(float)Vector3f(m[4], m[5], m[6]).length(),
@@ -402,42 +416,123 @@ Vector3f Matrix44::project(const Vector3f& v)
 }
 
 
-//Multiply a matrix by another and returns the result
-Matrix44 Matrix44::operator*(const Matrix44& matrix) const
+//scalar kernels, used when there is no SIMD and as reference by benchmarkMath
+static void multiplyMatrixScalar(const float* a, const float* b, float* result)
 {
-	Matrix44 ret;
-
-	unsigned int i,j,k;
-	for (i=0;i<4;i++) 	
+	for (int i = 0; i < 4; i++)
 	{
-		for (j=0;j<4;j++) 
+		for (int j = 0; j < 4; j++)
 		{
-			ret.M[i][j]=0.0;
-			for (k=0;k<4;k++) 
-				ret.M[i][j] += M[i][k] * matrix.M[k][j];
+			float v = 0.0f;
+			for (int k = 0; k < 4; k++)
+				v += a[i * 4 + k] * b[k * 4 + j];
+			result[i * 4 + j] = v;
 		}
 	}
+}
+
+static Vector3f transformVectorScalar(const float* m, const Vector3f& v)
+{
+	float x = m[0] * v.x + m[4] * v.y + m[8] * v.z + m[12];
+	float y = m[1] * v.x + m[5] * v.y + m[9] * v.z + m[13];
+	float z = m[2] * v.x + m[6] * v.y + m[10] * v.z + m[14];
+	return Vector3f(x, y, z);
+}
+
+#ifdef MATH_USE_SSE
+//a row of the left matrix times the rows of the right one, in the same order as the scalar code so the results match
+static inline __m128 combineRowsSSE(__m128 a, const __m128* b)
+{
+	__m128 r = _mm_mul_ps(_mm_shuffle_ps(a, a, 0x00), b[0]);
+	r = _mm_add_ps(r, _mm_mul_ps(_mm_shuffle_ps(a, a, 0x55), b[1]));
+	r = _mm_add_ps(r, _mm_mul_ps(_mm_shuffle_ps(a, a, 0xAA), b[2]));
+	r = _mm_add_ps(r, _mm_mul_ps(_mm_shuffle_ps(a, a, 0xFF), b[3]));
+	return r;
+}
+
+static inline __m128 transformSSE(const float* m, __m128 x, __m128 y, __m128 z)
+{
+	__m128 r = _mm_mul_ps(_mm_load_ps(m), x);
+	r = _mm_add_ps(r, _mm_mul_ps(_mm_load_ps(m + 4), y));
+	r = _mm_add_ps(r, _mm_mul_ps(_mm_load_ps(m + 8), z));
+	return r;
+}
 
+//a.yzx * b.zxy - a.zxy * b.yzx
+static inline __m128 crossSSE(__m128 a, __m128 b)
+{
+	__m128 a_yzx = _mm_shuffle_ps(a, a, _MM_SHUFFLE(3, 0, 2, 1));
+	__m128 b_yzx = _mm_shuffle_ps(b, b, _MM_SHUFFLE(3, 0, 2, 1));
+	__m128 c = _mm_sub_ps(_mm_mul_ps(a, b_yzx), _mm_mul_ps(a_yzx, b));
+	return _mm_shuffle_ps(c, c, _MM_SHUFFLE(3, 0, 2, 1));
+}
+#endif
+
+#ifdef MATH_USE_AVX
+//two rows of the left matrix at once, the rows of the right one are in both halves
+static inline __m256 combineRowsAVX(__m256 a, const __m256* b)
+{
+	__m256 r = _mm256_mul_ps(_mm256_shuffle_ps(a, a, 0x00), b[0]);
+	r = _mm256_add_ps(r, _mm256_mul_ps(_mm256_shuffle_ps(a, a, 0x55), b[1]));
+	r = _mm256_add_ps(r, _mm256_mul_ps(_mm256_shuffle_ps(a, a, 0xAA), b[2]));
+	r = _mm256_add_ps(r, _mm256_mul_ps(_mm256_shuffle_ps(a, a, 0xFF), b[3]));
+	return r;
+}
+#endif
+
+//Multiply a matrix by another and returns the result
+Matrix44 Matrix44::operator*(const Matrix44& matrix) const
+{
+	Matrix44 ret;
+#if defined(MATH_USE_AVX)
+	__m256 b[4] = {
+		_mm256_broadcast_ps((const __m128*)(matrix.m)),
+		_mm256_broadcast_ps((const __m128*)(matrix.m + 4)),
+		_mm256_broadcast_ps((const __m128*)(matrix.m + 8)),
+		_mm256_broadcast_ps((const __m128*)(matrix.m + 12)) };
+	_mm256_storeu_ps(ret.m, combineRowsAVX(_mm256_loadu_ps(m), b)); //only 16 bytes aligned
+	_mm256_storeu_ps(ret.m + 8, combineRowsAVX(_mm256_loadu_ps(m + 8), b));
+#elif defined(MATH_USE_SSE)
+	__m128 b[4] = { _mm_load_ps(matrix.m), _mm_load_ps(matrix.m + 4), _mm_load_ps(matrix.m + 8), _mm_load_ps(matrix.m + 12) };
+	_mm_store_ps(ret.m, combineRowsSSE(_mm_load_ps(m), b));
+	_mm_store_ps(ret.m + 4, combineRowsSSE(_mm_load_ps(m + 4), b));
+	_mm_store_ps(ret.m + 8, combineRowsSSE(_mm_load_ps(m + 8), b));
+	_mm_store_ps(ret.m + 12, combineRowsSSE(_mm_load_ps(m + 12), b));
+#else
+	multiplyMatrixScalar(m, matrix.m, ret.m);
+#endif
 	return ret;
 }
 
 //Multiplies a vector by a matrix and returns the new vector
 Vector3f operator * (const Matrix44& matrix, const Vector3f& v) 
-{   
-   float x = matrix.m[0] * v.x + matrix.m[4] * v.y + matrix.m[8] * v.z + matrix.m[12]; 
-   float y = matrix.m[1] * v.x + matrix.m[5] * v.y + matrix.m[9] * v.z + matrix.m[13]; 
-   float z = matrix.m[2] * v.x + matrix.m[6] * v.y + matrix.m[10] * v.z + matrix.m[14];
-   return Vector3f(x,y,z);
+{
+#ifdef MATH_USE_SSE
+	__m128 r = _mm_add_ps(transformSSE(matrix.m, _mm_set1_ps(v.x), _mm_set1_ps(v.y), _mm_set1_ps(v.z)), _mm_load_ps(matrix.m + 12));
+	alignas(16) float result[4];
+	_mm_store_ps(result, r);
+	return Vector3f(result[0], result[1], result[2]);
+#else
+	return transformVectorScalar(matrix.m, v);
+#endif
 }
 
 //Multiplies a vector by a matrix and returns the new vector
 Vector4f operator * (const Matrix44& matrix, const Vector4f& v)
 {
+#ifdef MATH_USE_SSE
+	__m128 r = transformSSE(matrix.m, _mm_set1_ps(v.x), _mm_set1_ps(v.y), _mm_set1_ps(v.z));
+	r = _mm_add_ps(r, _mm_mul_ps(_mm_set1_ps(v.w), _mm_load_ps(matrix.m + 12)));
+	Vector4f result;
+	_mm_storeu_ps(result.v, r);
+	return result;
+#else
 	float x = matrix.m[0] * v.x + matrix.m[4] * v.y + matrix.m[8] * v.z + v.w * matrix.m[12];
 	float y = matrix.m[1] * v.x + matrix.m[5] * v.y + matrix.m[9] * v.z + v.w * matrix.m[13];
 	float z = matrix.m[2] * v.x + matrix.m[6] * v.y + matrix.m[10] * v.z + v.w * matrix.m[14];
 	float w = matrix.m[3] * v.x + matrix.m[7] * v.y + matrix.m[11] * v.z + v.w * matrix.m[15];
 	return Vector4f(x, y, z, w);
+#endif
 }
 
 void Matrix44::setUpAndOrthonormalize(Vector3f up)
@@ -513,8 +608,72 @@ void Matrix44::setFrontAndOrthonormalize(Vector3f front)
 	
 }
 
-bool Matrix44::inverse()
+//the rows of the 3x3 inverse are the cross products of its rows over the determinant, then the translation is moved back
+bool Matrix44::inverseAffine()
+{
+#ifdef MATH_USE_SSE
+	__m128 r0 = _mm_load_ps(m);
+	__m128 r1 = _mm_load_ps(m + 4);
+	__m128 r2 = _mm_load_ps(m + 8);
+	__m128 c0 = crossSSE(r1, r2);
+	__m128 c1 = crossSSE(r2, r0);
+	__m128 c2 = crossSSE(r0, r1);
+	alignas(16) float dots[4];
+	_mm_store_ps(dots, _mm_mul_ps(r0, c0));
+	float det = dots[0] + dots[1] + dots[2];
+	if (std::abs(det) <= 1e-11f)
+	{
+		setIdentity();
+		return false;
+	}
+	__m128 rdet = _mm_set1_ps(1.0f / det);
+	__m128 c3 = _mm_setzero_ps();
+	_MM_TRANSPOSE4_PS(c0, c1, c2, c3);
+	c0 = _mm_mul_ps(c0, rdet);
+	c1 = _mm_mul_ps(c1, rdet);
+	c2 = _mm_mul_ps(c2, rdet);
+	__m128 t = _mm_mul_ps(c0, _mm_set1_ps(-m[12]));
+	t = _mm_add_ps(t, _mm_mul_ps(c1, _mm_set1_ps(-m[13])));
+	t = _mm_add_ps(t, _mm_mul_ps(c2, _mm_set1_ps(-m[14])));
+	_mm_store_ps(m, c0);
+	_mm_store_ps(m + 4, c1);
+	_mm_store_ps(m + 8, c2);
+	_mm_store_ps(m + 12, t);
+	m[15] = 1.0f;
+	return true;
+#else
+	Vector3f r0(m[0], m[1], m[2]);
+	Vector3f r1(m[4], m[5], m[6]);
+	Vector3f r2(m[8], m[9], m[10]);
+	Vector3f c0 = r1.cross(r2);
+	Vector3f c1 = r2.cross(r0);
+	Vector3f c2 = r0.cross(r1);
+	float det = r0.dot(c0);
+	if (std::abs(det) <= 1e-11f)
+	{
+		setIdentity();
+		return false;
+	}
+	float rdet = 1.0f / det;
+	Vector3f t(-m[12], -m[13], -m[14]);
+	Matrix44 inv;
+	inv.m[0] = c0.x * rdet; inv.m[1] = c1.x * rdet; inv.m[2] = c2.x * rdet;
+	inv.m[4] = c0.y * rdet; inv.m[5] = c1.y * rdet; inv.m[6] = c2.y * rdet;
+	inv.m[8] = c0.z * rdet; inv.m[9] = c1.z * rdet; inv.m[10] = c2.z * rdet;
+	Vector3f translation = inv.rotateVector(t);
+	inv.m[12] = translation.x;
+	inv.m[13] = translation.y;
+	inv.m[14] = translation.z;
+	*this = inv;
+	return true;
+#endif
+}
+
+//any matrix, in double precision (projections need it)
+static bool inverseGeneral(Matrix44& matrix)
 {
+	float* m = matrix.m;
+
 	// http://www.geometrictools.com/LibFoundation/Mathematics/Wm4Matrix4.inl
 	double A0 = m[0] * m[5] - m[1] * m[4];
 	double A1 = m[0] * m[6] - m[2] * m[4];
@@ -535,7 +694,7 @@ bool Matrix44::inverse()
 	auto threshold = (double)1e-11;
 	if (std::abs(det) <= threshold)
 	{
-		setIdentity();
+		matrix.setIdentity();
 		return false;
 	}
 
@@ -577,6 +736,14 @@ bool Matrix44::inverse()
 	return true;
 }
 
+bool Matrix44::inverse()
+{
+	//most are transforms of nodes, bones and cameras
+	if (isAffine())
+		return inverseAffine();
+	return inverseGeneral(*this);
+}
+
 Quaternion::Quaternion()
 {
 	x = y = z = 0.0f; w = 1.0f;
@@ -674,7 +841,7 @@ void Quaternion::operator += (const Quaternion &q)
 	w += q.w;
 }
 
-Quaternion operator * (const Quaternion& q1, const Quaternion& q2)
+static Quaternion multiplyQuaternionScalar(const Quaternion& q1, const Quaternion& q2)
 {
 	Quaternion q;
 
@@ -685,6 +852,32 @@ Quaternion operator * (const Quaternion& q1, const Quaternion& q2)
 	return q;
 }
 
+#ifdef MATH_USE_SSE
+//w1*q2 + (x1w2, y1w2, z1w2, -x1x2) + (y1z2, z1x2, x1y2, -y1y2) - (z1y2, x1z2, y1x2, z1z2)
+static inline __m128 multiplyQuaternionSSE(__m128 a, __m128 b)
+{
+	const __m128 flip_w = _mm_set_ps(-0.0f, 0.0f, 0.0f, 0.0f);
+	__m128 r = _mm_mul_ps(_mm_shuffle_ps(a, a, _MM_SHUFFLE(3, 3, 3, 3)), b);
+	__m128 t1 = _mm_mul_ps(_mm_shuffle_ps(a, a, _MM_SHUFFLE(0, 2, 1, 0)), _mm_shuffle_ps(b, b, _MM_SHUFFLE(0, 3, 3, 3)));
+	__m128 t2 = _mm_mul_ps(_mm_shuffle_ps(a, a, _MM_SHUFFLE(1, 0, 2, 1)), _mm_shuffle_ps(b, b, _MM_SHUFFLE(1, 1, 0, 2)));
+	__m128 t3 = _mm_mul_ps(_mm_shuffle_ps(a, a, _MM_SHUFFLE(2, 1, 0, 2)), _mm_shuffle_ps(b, b, _MM_SHUFFLE(2, 0, 2, 1)));
+	r = _mm_add_ps(r, _mm_xor_ps(t1, flip_w));
+	r = _mm_add_ps(r, _mm_xor_ps(t2, flip_w));
+	return _mm_sub_ps(r, t3);
+}
+#endif
+
+Quaternion operator * (const Quaternion& q1, const Quaternion& q2)
+{
+#ifdef MATH_USE_SSE
+	Quaternion q;
+	_mm_store_ps(q.q, multiplyQuaternionSSE(_mm_load_ps(q1.q), _mm_load_ps(q2.q)));
+	return q;
+#else
+	return multiplyQuaternionScalar(q1, q2);
+#endif
+}
+
 /*
 //http://www.cs.yorku.ca/~arlene/aquasim/mymath.c
 quaternion operator * (const quaternion& p, const quaternion& q)
@@ -699,6 +892,12 @@ p.w*q.w - p.x*q.x - p.y*q.y - p.z*q.z);
 
 Quaternion operator * (const Quaternion &q, const Vector3f& v)
 {
+#ifdef MATH_USE_SSE
+	//the vector is a quaternion with w = 0
+	Quaternion result;
+	_mm_store_ps(result.q, multiplyQuaternionSSE(_mm_load_ps(q.q), _mm_set_ps(0.0f, v.z, v.y, v.x)));
+	return result;
+#else
 	return Quaternion
 	(
 		q.w*v.x + q.y*v.z - q.z*v.y,
@@ -706,6 +905,7 @@ Quaternion operator * (const Quaternion &q, const Vector3f& v)
 		q.w*v.z + q.x*v.y - q.y*v.x,
 		-(q.x*v.x + q.y*v.y + q.z*v.z)
 	);
+#endif
 }
 
 void Quaternion::operator *= (float f)
@@ -1459,23 +1659,48 @@ float signedDistanceToPlane( const Vector4f& plane, const Vector3f& point )
 
 const Vector3f corners[] = { {1,1,1},  {1,1,-1},  {1,-1,1},  {1,-1,-1},  {-1,1,1},  {-1,1,-1},  {-1,-1,1},  {-1,-1,-1} };
 
-BoundingBox transformBoundingBox(const Matrix44 m, const BoundingBox& box)
-{
-	Vector3f box_min(10000000.0f,1000000.0f, 1000000.0f);
-	Vector3f box_max(-10000000.0f, -1000000.0f, -1000000.0f);
+//the same box as the one around the 8 transformed corners: the center is transformed and the halfsize
+//is projected on the absolute axes of the matrix (Arvo, Graphics Gems 1990)
+BoundingBox transformBoundingBox(const Matrix44& m, const BoundingBox& box)
+{
+#ifdef MATH_USE_SSE
+	const __m128 sign_mask = _mm_set1_ps(-0.0f);
+	__m128 center = _mm_add_ps(transformSSE(m.m, _mm_set1_ps(box.center.x), _mm_set1_ps(box.center.y), _mm_set1_ps(box.center.z)), _mm_load_ps(m.m + 12));
+	__m128 halfsize = _mm_mul_ps(_mm_andnot_ps(sign_mask, _mm_load_ps(m.m)), _mm_set1_ps(fabs(box.halfsize.x)));
+	halfsize = _mm_add_ps(halfsize, _mm_mul_ps(_mm_andnot_ps(sign_mask, _mm_load_ps(m.m + 4)), _mm_set1_ps(fabs(box.halfsize.y))));
+	halfsize = _mm_add_ps(halfsize, _mm_mul_ps(_mm_andnot_ps(sign_mask, _mm_load_ps(m.m + 8)), _mm_set1_ps(fabs(box.halfsize.z))));
+	alignas(16) float result[8];
+	_mm_store_ps(result, center);
+	_mm_store_ps(result + 4, halfsize);
+	return BoundingBox(Vector3f(result[0], result[1], result[2]), Vector3f(result[4], result[5], result[6]));
+#else
+	Vector3f h(fabs(box.halfsize.x), fabs(box.halfsize.y), fabs(box.halfsize.z));
+	Vector3f halfsize(
+		fabs(m.m[0]) * h.x + fabs(m.m[4]) * h.y + fabs(m.m[8]) * h.z,
+		fabs(m.m[1]) * h.x + fabs(m.m[5]) * h.y + fabs(m.m[9]) * h.z,
+		fabs(m.m[2]) * h.x + fabs(m.m[6]) * h.y + fabs(m.m[10]) * h.z);
+	return BoundingBox(m * box.center, halfsize);
+#endif
+}
+
+//the 8 corners, used by benchmarkMath as reference
+static BoundingBox transformBoundingBoxCorners(const Matrix44& m, const BoundingBox& box)
+{
+	Vector3f box_min(FLT_MAX, FLT_MAX, FLT_MAX);
+	Vector3f box_max(-FLT_MAX, -FLT_MAX, -FLT_MAX);
 
 	for (int i = 0; i < 8; ++i)
 	{
 		Vector3f corner = corners[i];
 		corner = box.halfsize * corner;
 		corner = corner + box.center;
-		corner = m * corner;
+		corner = transformVectorScalar(m.m, corner);
 		box_min.setMin(corner);
 		box_max.setMax(corner);
 	}
 
 	Vector3f halfsize = (box_max - box_min) * 0.5f;
-	return BoundingBox(box_max - halfsize, halfsize );
+	return BoundingBox(box_max - halfsize, halfsize);
 }
 
 BoundingBox mergeBoundingBoxes(const BoundingBox& a, const BoundingBox& b)
@@ -1613,3 +1838,310 @@ std::ostream& operator<<(std::ostream& os, const Vector4f& v)
 	os << v.x << ',' << v.y << ',' << v.z << ',' << v.w;
 	return os;
 }
+
+//** Batched transforms ********************************************************
+
+#define MATH_BATCH_CHUNK 4096 //elements per task
+
+//calls kernel(start, end) over [0, count), in parallel when it is worth it
+template<typename F> static void runBatch(size_t count, const F& kernel)
+{
+	if (count < MATH_BATCH_PARALLEL || !TaskManager::background.getNumThreads())
+	{
+		kernel((size_t)0, count);
+		return;
+	}
+	size_t num_chunks = (count + MATH_BATCH_CHUNK - 1) / MATH_BATCH_CHUNK;
+	TaskManager::background.parallelFor(num_chunks, [&](size_t i) {
+		size_t start = i * MATH_BATCH_CHUNK;
+		kernel(start, (std::min)(start + MATH_BATCH_CHUNK, count));
+	});
+}
+
+#ifdef MATH_USE_SSE
+//4 packed Vector3f (12 floats) to xxxx, yyyy, zzzz and back
+static inline void loadPointsSSE(const float* p, __m128& x, __m128& y, __m128& z)
+{
+	__m128 a = _mm_loadu_ps(p); //x0 y0 z0 x1
+	__m128 b = _mm_loadu_ps(p + 4); //y1 z1 x2 y2
+	__m128 c = _mm_loadu_ps(p + 8); //z2 x3 y3 z3
+	x = _mm_shuffle_ps(a, _mm_shuffle_ps(b, c, _MM_SHUFFLE(1, 1, 2, 2)), _MM_SHUFFLE(2, 0, 3, 0));
+	y = _mm_shuffle_ps(_mm_shuffle_ps(a, b, _MM_SHUFFLE(0, 0, 1, 1)), _mm_shuffle_ps(b, c, _MM_SHUFFLE(2, 2, 3, 3)), _MM_SHUFFLE(2, 0, 2, 0));
+	z = _mm_shuffle_ps(_mm_shuffle_ps(a, b, _MM_SHUFFLE(1, 1, 2, 2)), _mm_shuffle_ps(c, c, _MM_SHUFFLE(3, 3, 0, 0)), _MM_SHUFFLE(2, 0, 2, 0));
+}
+
+static inline void storePointsSSE(float* p, __m128 x, __m128 y, __m128 z)
+{
+	__m128 a = _mm_shuffle_ps(_mm_shuffle_ps(x, y, _MM_SHUFFLE(0, 0, 0, 0)), _mm_shuffle_ps(z, x, _MM_SHUFFLE(1, 1, 0, 0)), _MM_SHUFFLE(2, 0, 2, 0));
+	__m128 b = _mm_shuffle_ps(_mm_shuffle_ps(y, z, _MM_SHUFFLE(1, 1, 1, 1)), _mm_shuffle_ps(x, y, _MM_SHUFFLE(2, 2, 2, 2)), _MM_SHUFFLE(2, 0, 2, 0));
+	__m128 c = _mm_shuffle_ps(_mm_shuffle_ps(z, x, _MM_SHUFFLE(3, 3, 2, 2)), _mm_shuffle_ps(y, z, _MM_SHUFFLE(3, 3, 3, 3)), _MM_SHUFFLE(2, 0, 2, 0));
+	_mm_storeu_ps(p, a);
+	_mm_storeu_ps(p + 4, b);
+	_mm_storeu_ps(p + 8, c);
+}
+
+//one matrix for 4 points, with the splatted elements of the matrix
+static inline void transformSoASSE(const __m128* m, __m128& x, __m128& y, __m128& z, bool translate)
+{
+	__m128 rx = _mm_add_ps(_mm_add_ps(_mm_mul_ps(m[0], x), _mm_mul_ps(m[4], y)), _mm_mul_ps(m[8], z));
+	__m128 ry = _mm_add_ps(_mm_add_ps(_mm_mul_ps(m[1], x), _mm_mul_ps(m[5], y)), _mm_mul_ps(m[9], z));
+	__m128 rz = _mm_add_ps(_mm_add_ps(_mm_mul_ps(m[2], x), _mm_mul_ps(m[6], y)), _mm_mul_ps(m[10], z));
+	if (translate)
+	{
+		rx = _mm_add_ps(rx, m[12]);
+		ry = _mm_add_ps(ry, m[13]);
+		rz = _mm_add_ps(rz, m[14]);
+	}
+	x = rx;
+	y = ry;
+	z = rz;
+}
+
+//the zero vectors stay zero
+static inline void normalizeSoASSE(__m128& x, __m128& y, __m128& z)
+{
+	__m128 length2 = _mm_add_ps(_mm_add_ps(_mm_mul_ps(x, x), _mm_mul_ps(y, y)), _mm_mul_ps(z, z));
+	__m128 inv = _mm_and_ps(_mm_cmpgt_ps(length2, _mm_setzero_ps()), _mm_div_ps(_mm_set1_ps(1.0f), _mm_sqrt_ps(length2)));
+	x = _mm_mul_ps(x, inv);
+	y = _mm_mul_ps(y, inv);
+	z = _mm_mul_ps(z, inv);
+}
+#endif
+
+static inline Vector3f normalizeOrZero(const Vector3f& v)
+{
+	float length = v.length();
+	return length > 0.0f ? v * (1.0f / length) : v;
+}
+
+static void transformVectorsRange(const Matrix44& m, const Vector3f* vectors, Vector3f* result, size_t start, size_t end, bool translate, bool normalize)
+{
+	size_t i = start;
+#ifdef MATH_USE_SSE
+	__m128 splat[16];
+	for (int j = 0; j < 16; ++j)
+		splat[j] = _mm_set1_ps(m.m[j]);
+	for (; i + 4 <= end; i += 4)
+	{
+		__m128 x, y, z;
+		loadPointsSSE(vectors[i].v, x, y, z);
+		transformSoASSE(splat, x, y, z, translate);
+		if (normalize)
+			normalizeSoASSE(x, y, z);
+		storePointsSSE(result[i].v, x, y, z);
+	}
+#endif
+	for (; i < end; ++i)
+	{
+		Vector3f v = translate ? m * vectors[i] : m.rotateVector(vectors[i]);
+		result[i] = normalize ? normalizeOrZero(v) : v;
+	}
+}
+
+void transformPoints(const Matrix44& m, const Vector3f* points, Vector3f* result, size_t count)
+{
+	runBatch(count, [&](size_t start, size_t end) { transformVectorsRange(m, points, result, start, end, true, false); });
+}
+
+void transformPoints(const Matrix44* matrices, const Vector3f* points, Vector3f* result, size_t count)
+{
+	runBatch(count, [&](size_t start, size_t end) {
+		for (size_t i = start; i < end; ++i)
+			result[i] = matrices[i] * points[i];
+	});
+}
+
+void transformNormals(const Matrix44& m, const Vector3f* normals, Vector3f* result, size_t count, bool normalize)
+{
+	runBatch(count, [&](size_t start, size_t end) { transformVectorsRange(m, normals, result, start, end, false, normalize); });
+}
+
+void transformNormals(const Matrix44* matrices, const Vector3f* normals, Vector3f* result, size_t count, bool normalize)
+{
+	runBatch(count, [&](size_t start, size_t end) {
+		for (size_t i = start; i < end; ++i)
+		{
+			Vector3f n = matrices[i].rotateVector(normals[i]);
+			result[i] = normalize ? normalizeOrZero(n) : n;
+		}
+	});
+}
+
+void transformBoundingBoxes(const Matrix44& m, const BoundingBox* boxes, BoundingBox* result, size_t count)
+{
+	runBatch(count, [&](size_t start, size_t end) {
+		for (size_t i = start; i < end; ++i)
+			result[i] = transformBoundingBox(m, boxes[i]);
+	});
+}
+
+void transformBoundingBoxes(const Matrix44* matrices, const BoundingBox* boxes, BoundingBox* result, size_t count)
+{
+	runBatch(count, [&](size_t start, size_t end) {
+		for (size_t i = start; i < end; ++i)
+			result[i] = transformBoundingBox(matrices[i], boxes[i]);
+	});
+}
+
+void multiplyMatrices(const Matrix44* matrices, const Matrix44& m, Matrix44* result, size_t count)
+{
+	runBatch(count, [&](size_t start, size_t end) {
+		for (size_t i = start; i < end; ++i)
+			result[i] = matrices[i] * m;
+	});
+}
+
+static void computeBoundsRange(const Vector3f* points, size_t stride, size_t start, size_t end, Vector3f& box_min, Vector3f& box_max)
+{
+	size_t i = start;
+#ifdef MATH_USE_SSE
+	if (stride == sizeof(Vector3f) && end - start >= 4)
+	{
+		__m128 min_x = _mm_set1_ps(FLT_MAX), min_y = min_x, min_z = min_x;
+		__m128 max_x = _mm_set1_ps(-FLT_MAX), max_y = max_x, max_z = max_x;
+		for (; i + 4 <= end; i += 4)
+		{
+			__m128 x, y, z;
+			loadPointsSSE(points[i].v, x, y, z);
+			min_x = _mm_min_ps(min_x, x); min_y = _mm_min_ps(min_y, y); min_z = _mm_min_ps(min_z, z);
+			max_x = _mm_max_ps(max_x, x); max_y = _mm_max_ps(max_y, y); max_z = _mm_max_ps(max_z, z);
+		}
+		alignas(16) float v[6][4];
+		_mm_store_ps(v[0], min_x); _mm_store_ps(v[1], min_y); _mm_store_ps(v[2], min_z);
+		_mm_store_ps(v[3], max_x); _mm_store_ps(v[4], max_y); _mm_store_ps(v[5], max_z);
+		for (int j = 0; j < 4; ++j)
+		{
+			box_min.setMin(Vector3f(v[0][j], v[1][j], v[2][j]));
+			box_max.setMax(Vector3f(v[3][j], v[4][j], v[5][j]));
+		}
+	}
+#endif
+	for (; i < end; ++i)
+	{
+		const Vector3f& p = *(const Vector3f*)((const uint8*)points + i * stride);
+		box_min.setMin(p);
+		box_max.setMax(p);
+	}
+}
+
+BoundingBox computeBoundingBox(const Vector3f* points, size_t count, size_t stride)
+{
+	if (!count)
+		return BoundingBox(Vector3f(), Vector3f());
+
+	Vector3f box_min(FLT_MAX, FLT_MAX, FLT_MAX);
+	Vector3f box_max(-FLT_MAX, -FLT_MAX, -FLT_MAX);
+	if (count < MATH_BATCH_PARALLEL || !TaskManager::background.getNumThreads())
+		computeBoundsRange(points, stride, 0, count, box_min, box_max);
+	else
+	{
+		size_t num_chunks = (count + MATH_BATCH_CHUNK - 1) / MATH_BATCH_CHUNK;
+		std::vector<Vector3f> mins(num_chunks, box_min), maxs(num_chunks, box_max);
+		TaskManager::background.parallelFor(num_chunks, [&](size_t i) {
+			size_t start = i * MATH_BATCH_CHUNK;
+			computeBoundsRange(points, stride, start, (std::min)(start + MATH_BATCH_CHUNK, count), mins[i], maxs[i]);
+		});
+		for (size_t i = 0; i < num_chunks; ++i)
+		{
+			box_min.setMin(mins[i]);
+			box_max.setMax(maxs[i]);
+		}
+	}
+	Vector3f center = (box_max + box_min) * 0.5f;
+	return BoundingBox(center, box_max - center);
+}
+
+//the kernels run over arrays of random transforms so the loops are not removed
+void benchmarkMath(int iterations)
+{
+	const int N = 256;
+	std::vector<Matrix44> matrices(N);
+	std::vector<Matrix44> results(N);
+	std::vector<Quaternion> quats(N);
+	std::vector<Vector3f> points(N);
+	std::vector<BoundingBox> boxes(N);
+	for (int i = 0; i < N; ++i)
+	{
+		Matrix44& m = matrices[i];
+		m.setRotation(random(6.28f), normalize(Vector3f(random(2.0f, -1) + 0.01f, random(2.0f, -1), random(2.0f, -1))));
+		m.scale(random(2.0f) + 0.1f, random(2.0f) + 0.1f, random(2.0f) + 0.1f);
+		m.translateGlobal(random(200.0f, -100), random(200.0f, -100), random(200.0f, -100));
+		quats[i].setAxisAngle(Vector3f(0.0f, 1.0f, 0.0f), random(6.28f));
+		points[i].set(random(20.0f, -10), random(20.0f, -10), random(20.0f, -10));
+		boxes[i] = BoundingBox(points[i], Vector3f(random(5.0f), random(5.0f), random(5.0f)));
+	}
+	int rounds = (std::max)(1, iterations / N);
+	float sink = 0.0f;
+
+	auto run = [&](const char* name, auto kernel) {
+		auto start = std::chrono::steady_clock::now();
+		for (int r = 0; r < rounds; ++r)
+			for (int i = 0; i < N; ++i)
+				sink += kernel(i);
+		double ns = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count() / (double(rounds) * N);
+		std::cout << "  " << name << ": " << ns << " ns" << std::endl;
+	};
+
+#if defined(MATH_USE_AVX)
+	std::cout << " + Math benchmark (AVX), " << rounds * N << " iterations" << std::endl;
+#elif defined(MATH_USE_SSE)
+	std::cout << " + Math benchmark (SSE), " << rounds * N << " iterations" << std::endl;
+#else
+	std::cout << " + Math benchmark (scalar), " << rounds * N << " iterations" << std::endl;
+#endif
+
+	run("multiply scalar", [&](int i) { multiplyMatrixScalar(matrices[i].m, matrices[(i + 1) % N].m, results[i].m); return results[i].m[12]; });
+	run("multiply", [&](int i) { results[i] = matrices[i] * matrices[(i + 1) % N]; return results[i].m[12]; });
+	run("inverse general", [&](int i) { results[i] = matrices[i]; inverseGeneral(results[i]); return results[i].m[12]; });
+	run("inverse affine", [&](int i) { results[i] = matrices[i]; results[i].inverseAffine(); return results[i].m[12]; });
+	run("transform point scalar", [&](int i) { return transformVectorScalar(matrices[i].m, points[i]).x; });
+	run("transform point", [&](int i) { return (matrices[i] * points[i]).x; });
+	run("transform box corners", [&](int i) { return transformBoundingBoxCorners(matrices[i], boxes[i]).halfsize.x; });
+	run("transform box", [&](int i) { return transformBoundingBox(matrices[i], boxes[i]).halfsize.x; });
+	run("quaternion multiply scalar", [&](int i) { return multiplyQuaternionScalar(quats[i], quats[(i + 1) % N]).w; });
+	run("quaternion multiply", [&](int i) { return (quats[i] * quats[(i + 1) % N]).w; });
+
+	//the batched versions, per element
+	std::vector<Vector3f> transformed(N);
+	auto runBatched = [&](const char* name, auto kernel) {
+		auto start = std::chrono::steady_clock::now();
+		for (int r = 0; r < rounds; ++r)
+		{
+			kernel();
+			sink += transformed[r % N].x;
+		}
+		double ns = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count() / (double(rounds) * N);
+		std::cout << "  " << name << ": " << ns << " ns" << std::endl;
+	};
+	runBatched("transform points batched", [&]() { transformPoints(matrices[0], &points[0], &transformed[0], N); });
+	runBatched("transform normals batched", [&]() { transformNormals(matrices[0], &points[0], &transformed[0], N, true); });
+	runBatched("bounding of points batched", [&]() { transformed[0] = computeBoundingBox(&points[0], N).halfsize; });
+
+	//how far the kernels are from the scalar code
+	float max_error[4] = { 0, 0, 0, 0 };
+	for (int i = 0; i < N; ++i)
+	{
+		Matrix44 a, b = matrices[i], c = matrices[i];
+		multiplyMatrixScalar(matrices[i].m, matrices[(i + 1) % N].m, a.m);
+		Matrix44 d = matrices[i] * matrices[(i + 1) % N];
+		inverseGeneral(b);
+		c.inverseAffine();
+		BoundingBox e = transformBoundingBoxCorners(matrices[i], boxes[i]);
+		BoundingBox f = transformBoundingBox(matrices[i], boxes[i]);
+		Quaternion g = multiplyQuaternionScalar(quats[i], quats[(i + 1) % N]);
+		Quaternion h = quats[i] * quats[(i + 1) % N];
+		for (int j = 0; j < 16; ++j)
+		{
+			max_error[0] = (std::max)(max_error[0], std::abs(a.m[j] - d.m[j]));
+			max_error[1] = (std::max)(max_error[1], std::abs(b.m[j] - c.m[j]));
+		}
+		max_error[2] = (std::max)({ max_error[2], e.center.distance(f.center), e.halfsize.distance(f.halfsize) });
+		for (int j = 0; j < 4; ++j)
+			max_error[3] = (std::max)(max_error[3], std::abs(g.q[j] - h.q[j]));
+	}
+	transformPoints(matrices[0], &points[0], &transformed[0], N);
+	for (int i = 0; i < N; ++i)
+		max_error[0] = (std::max)(max_error[0], transformed[i].distance(transformVectorScalar(matrices[0].m, points[i])));
+	std::cout << "  max error: multiply " << max_error[0] << ", inverse " << max_error[1] << ", box " << max_error[2] << ", quaternion " << max_error[3] << std::endl;
+	std::cout << "  (" << sink << ")" << std::endl;
+}
@@ -226,7 +226,9 @@ typedef Vector4ub Color;
 
 //****************************
 //Matrix44 class
-class Matrix44
+//aligned to 16 bytes so every row can be loaded at once by the SIMD kernels (SSE/AVX, see math.cpp)
+//pass it by reference, some compilers cannot pass aligned types by value
+class alignas(16) Matrix44
 {
 	public:
 		static const Matrix44 IDENTITY;
@@ -259,7 +261,9 @@ class Matrix44
 		Vector3f topVector() { return Vector3f(m[4],m[5],m[6]); }
 		Vector3f frontVector() { return Vector3f(m[8],m[9],m[10]); }
 
-		bool inverse();
+		bool inverse(); //uses inverseAffine when there is no projection
+		bool inverseAffine(); //only valid when the last column is (0,0,0,1)
+		bool isAffine() const { return m[3] == 0.0f && m[7] == 0.0f && m[11] == 0.0f && m[15] == 1.0f; }
 		void setUpAndOrthonormalize(Vector3f up);
 		void setFrontAndOrthonormalize(Vector3f front);
 
@@ -282,8 +286,8 @@ class Matrix44
 		void setRotation( float angle_in_rad, const Vector3f& axis );
 		void setScale(float x, float y, float z);
 
-		Vector3f getTranslation();
-		Vector3f getScale();
+		Vector3f getTranslation() const;
+		Vector3f getScale() const;
 
 		bool getXYZ(float* euler) const; //not sure which axis...
 
@@ -303,7 +307,7 @@ Vector4f operator * (const Matrix44& matrix, const Vector4f& v);
 
 //** QUAT ********************************************************
 
-class Quaternion
+class alignas(16) Quaternion
 {
 public:
 
@@ -398,8 +402,25 @@ public:
 
 //applies a transform to a AABB from object to world
 BoundingBox mergeBoundingBoxes(const BoundingBox& a, const BoundingBox& b);
-BoundingBox transformBoundingBox(const Matrix44 m, const BoundingBox& box);
-
+BoundingBox transformBoundingBox(const Matrix44& m, const BoundingBox& box);
+
+
+//** Batched transforms ********************************************************
+//many elements at once: the ones with one matrix are SoA SIMD loops, the ones with a matrix per element are plain loops
+//all of them are split between the threads of TaskManager::background from MATH_BATCH_PARALLEL elements
+//the results can be written over the inputs
+#define MATH_BATCH_PARALLEL 16384
+
+void transformPoints(const Matrix44& m, const Vector3f* points, Vector3f* result, size_t count);
+void transformPoints(const Matrix44* matrices, const Vector3f* points, Vector3f* result, size_t count); //one matrix per point
+//without translation, use the inverse transpose when the matrix has non uniform scale
+void transformNormals(const Matrix44& m, const Vector3f* normals, Vector3f* result, size_t count, bool normalize = false);
+void transformNormals(const Matrix44* matrices, const Vector3f* normals, Vector3f* result, size_t count, bool normalize = false);
+void transformBoundingBoxes(const Matrix44& m, const BoundingBox* boxes, BoundingBox* result, size_t count);
+void transformBoundingBoxes(const Matrix44* matrices, const BoundingBox* boxes, BoundingBox* result, size_t count);
+void multiplyMatrices(const Matrix44* matrices, const Matrix44& m, Matrix44* result, size_t count); //matrices[i] * m
+//of the points, stride in bytes for the vertices of interleaved buffers
+BoundingBox computeBoundingBox(const Vector3f* points, size_t count, size_t stride = sizeof(Vector3f));
 
 //** RAY ********************************************************
 class Ray
@@ -424,6 +445,9 @@ inline Vector3f reflect(const Vector3f& I, const Vector3f& N) { return I - N * 2
 //value between 0 and 1
 inline float random(float range = 1.0f, int offset = 0) { return ((rand() % 1000) / (1000.0f)) * range + offset; }
 
+//times the SIMD kernels of Matrix44 and Quaternion against the scalar ones and prints the results
+void benchmarkMath(int iterations = 1000000);
+
 std::ostream& operator << (std::ostream& os, const Vector3f& v);
 std::ostream& operator << (std::ostream& os, const Vector4f& v);
 
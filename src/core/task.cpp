@@ -4,76 +4,211 @@
 #include <chrono>		  //ms
 #include <cassert>
 
+#define TASK_CHUNKS_PER_THREAD 4 //parallelFor splits the work in more chunks than threads so stealing can balance it
+
 TaskManager TaskManager::foreground;
 TaskManager TaskManager::background;
 
-TaskManager::TaskManager()
+//which queue belongs to the current thread (-1 if it is not a thread of a pool)
+thread_local TaskManager* t_manager = NULL;
+thread_local int t_worker = -1;
+
+//only the tasks of the group, an unrelated long task would delay the caller (the main thread in a frame)
+void TaskGroup::wait()
+{
+	while (pending.load() > 0)
+		if (!manager || !manager->fetchTask(this))
+			std::this_thread::yield();
+}
+
+TaskManager::TaskManager() : num_pending(0)
 {
 	must_loop = false;
-	_thread = NULL;
+	queues.push_back(new sQueue());
+}
+
+TaskManager::~TaskManager()
+{
+	stop();
+	for (sQueue* queue : queues)
+		delete queue;
 }
 
-void TaskManager::loop()
+void TaskManager::loop(int worker)
 {
-	using namespace std::chrono_literals;
-	std::cout << "Starting Task Manager ..." << std::endl;
+	std::cout << "Starting Task Manager thread " << worker << " ..." << std::endl;
+	t_manager = this;
+	t_worker = worker;
 
 	while (must_loop)
 	{
-		if (pending_tasks.empty())
+		Task* task = popTask(worker);
+		if (task)
 		{
-			std::this_thread::sleep_for(10ms);
+			execute(task);
 			continue;
 		}
 
-		fetchTask();
+		//sleep until there is work
+		std::unique_lock<std::mutex> lock(sleep_mutex);
+		wake_up.wait(lock, [this]() { return num_pending.load() > 0 || !must_loop; });
 	}
 
-	std::cout << "Ending Task Manager" << std::endl;
+	std::cout << "Ending Task Manager thread " << worker << std::endl;
 }
 
-void TaskManager::fetchTask()
+//own queue from the back (hot in cache), then the external queue and the other threads from the front (oldest first)
+//with a group only its tasks are taken, wherever they are in the queues
+Task* TaskManager::popTask(int worker, TaskGroup* group)
 {
 	Task* task = NULL;
-	try
+	if (worker >= 0)
 	{
-		//lock
-		const std::lock_guard<std::mutex> lock(tasks_mutex);
-		if (pending_tasks.empty())
-			return;
-		task = pending_tasks.front();
-		pending_tasks.pop_front();
-		//unlock after finishing scope
+		sQueue* queue = queues[worker];
+		const std::lock_guard<std::mutex> lock(queue->mutex);
+		for (auto it = queue->tasks.rbegin(); it != queue->tasks.rend(); ++it)
+			if (!group || (*it)->group == group)
+			{
+				task = *it;
+				queue->tasks.erase(std::next(it).base());
+				break;
+			}
 	}
-	catch (std::logic_error&) {
-		std::cout << "[exception caught]\n";
+
+	for (size_t i = 0; !task && i < queues.size(); ++i)
+	{
+		size_t index = worker >= 0 ? (worker + i) % queues.size() : i;
+		if ((int)index == worker)
+			continue;
+		sQueue* queue = queues[index];
+		const std::lock_guard<std::mutex> lock(queue->mutex);
+		for (auto it = queue->tasks.begin(); it != queue->tasks.end(); ++it)
+			if (!group || (*it)->group == group)
+			{
+				task = *it;
+				queue->tasks.erase(it);
+				break;
+			}
 	}
 
 	if (task)
-	{
-		task->onExecute();
+		num_pending--;
+	return task;
+}
+
+void TaskManager::execute(Task* task)
+{
+	task->onExecute();
+
+	//the task may not exist after notifying the group
+	TaskGroup* group = task->group;
+	if (task->auto_delete)
 		delete task;
-		task = NULL;
-	}
+	if (group)
+		group->pending--;
 }
 
-void thread_loop_func(TaskManager* manager)
+bool TaskManager::fetchTask(TaskGroup* group)
 {
-	manager->loop();
-	//join?
+	Task* task = popTask(t_manager == this ? t_worker : -1, group);
+	if (!task)
+		return false;
+	execute(task);
+	return true;
 }
 
-void TaskManager::startThread()
+void TaskManager::fetchTasks(float max_ms)
 {
-	assert(!_thread && "TaskManager already in a thread");
+	auto start = std::chrono::steady_clock::now();
+	do {
+		if (!fetchTask())
+			return;
+	} while (std::chrono::duration<float, std::milli>(std::chrono::steady_clock::now() - start).count() < max_ms);
+}
+
+void TaskManager::startThread(int num_threads)
+{
+	assert(threads.empty() && "TaskManager already in a thread");
 	must_loop = true;
-	_thread = new std::thread(thread_loop_func, this);
+	for (int i = 0; i < num_threads; ++i)
+		queues.push_back(new sQueue());
+	for (int i = 0; i < num_threads; ++i)
+		threads.push_back(new std::thread(&TaskManager::loop, this, i + 1));
+}
+
+void TaskManager::stop()
+{
+	if (threads.empty())
+		return;
+	{
+		const std::lock_guard<std::mutex> lock(sleep_mutex);
+		must_loop = false;
+	}
+	wake_up.notify_all();
+	for (std::thread* thread : threads)
+	{
+		thread->join();
+		delete thread;
+	}
+	threads.clear();
+}
+
+void TaskManager::addTask(Task* task, TaskGroup* group)
+{
+	assert(task);
+	if (group)
+	{
+		task->group = group;
+		group->manager = this;
+		group->pending++;
+	}
+
+	//tasks created inside a task go to the queue of that thread
+	sQueue* queue = queues[t_manager == this && t_worker >= 0 ? t_worker : 0];
+	{
+		const std::lock_guard<std::mutex> lock(queue->mutex);
+		queue->tasks.push_back(task);
+	}
+
+	{
+		const std::lock_guard<std::mutex> lock(sleep_mutex);
+		num_pending++;
+	}
+	wake_up.notify_one();
 }
 
-void TaskManager::addTask(Task* task)
+void TaskManager::parallelFor(size_t count, const std::function<void(size_t)>& func, size_t grain)
 {
-	//block pending_tasks
-	const std::lock_guard<std::mutex> lock(tasks_mutex);
-	pending_tasks.push_back(task);
-	//release pending_tasks automatically
-}
\ No newline at end of file
+	if (grain < 1)
+		grain = 1;
+	size_t num_chunks = (count + grain - 1) / grain;
+	if (threads.empty() || num_chunks <= 1)
+	{
+		for (size_t i = 0; i < count; ++i)
+			func(i);
+		return;
+	}
+
+	num_chunks = std::min<size_t>(num_chunks, (threads.size() + 1) * TASK_CHUNKS_PER_THREAD);
+	size_t chunk_size = (count + num_chunks - 1) / num_chunks;
+	num_chunks = (count + chunk_size - 1) / chunk_size;
+
+	//the tasks live in this stack frame, no allocations per item
+	std::vector<Task> tasks(num_chunks);
+	TaskGroup group;
+	for (size_t i = 0; i < num_chunks; ++i)
+	{
+		size_t start = i * chunk_size;
+		size_t end = std::min<size_t>(start + chunk_size, count);
+		tasks[i].auto_delete = false;
+		tasks[i].callback = [&func, start, end]() {
+			for (size_t j = start; j < end; ++j)
+				func(j);
+		};
+		if (i > 0)
+			addTask(&tasks[i], &group);
+	}
+
+	tasks[0].onExecute();
+	group.wait();
+}
@@ -1,34 +1,73 @@
 #pragma once
 
 #include <vector>
-#include <list>
+#include <deque>
 #include <mutex>
+#include <condition_variable>
+#include <atomic>
 #include <thread>         // std::thread
 #include <functional>
 
+class TaskGroup;
+class TaskManager;
+
 //any task executed in BG should inherit from this one
 class Task {
 public:
 	std::function<void()> callback;
-	Task() { callback = NULL; };
-	Task(std::function<void()> func) { callback = func; };
+	TaskGroup* group; //notified when the task has been executed
+	bool auto_delete; //false if the task is owned by someone else (stack, vector...)
+	Task() { callback = NULL; group = NULL; auto_delete = true; };
+	Task(std::function<void()> func) { callback = func; group = NULL; auto_delete = true; };
 	virtual ~Task() {};
 	virtual void onExecute() { if (callback) callback(); }
 };
 
-class TaskManager {
+//counts the pending tasks of a fork-join
+class TaskGroup {
 public:
-	std::list<Task*> pending_tasks;
-	std::mutex tasks_mutex;  // protects pending_tasks
-	bool must_loop;
-	std::thread* _thread;
+	std::atomic<int> pending;
+	TaskManager* manager; //where its tasks were added
 
+	TaskGroup() : pending(0), manager(NULL) {}
+	bool isDone() { return pending.load() == 0; }
+	void wait(); //executes the queued tasks of this group while waiting, so it can be called from inside a task
+};
+
+//foreground: no threads, the main thread executes the tasks in order with fetchTask
+//background: a pool of threads, each one with its own queue. Idle threads steal tasks from the others and sleep when there is no work
+class TaskManager {
+public:
 	static TaskManager foreground;
 	static TaskManager background;
 
 	TaskManager();
-	void addTask(Task* task);
-	void fetchTask();
-	void loop();
-	void startThread();
-};
\ No newline at end of file
+	~TaskManager();
+
+	void addTask(Task* task, TaskGroup* group = NULL);
+	bool fetchTask(TaskGroup* group = NULL); //executes one task (of the group if any) in the calling thread, false if there was none
+	void fetchTasks(float max_ms); //executes tasks until the time budget is used (at least one)
+	void startThread(int num_threads = 1); //tasks are executed in parallel when using more than one thread
+	void stop();
+	int getNumThreads() { return (int)threads.size(); }
+
+	//calls func(i) for every i in [0,count) using all the threads, the calling thread also works. Returns when all have finished
+	void parallelFor(size_t count, const std::function<void(size_t)>& func, size_t grain = 1);
+
+private:
+	struct sQueue {
+		std::deque<Task*> tasks;
+		std::mutex mutex;
+	};
+
+	std::vector<sQueue*> queues; //[0] receives the tasks added from outside the pool, then one per thread
+	std::vector<std::thread*> threads;
+	std::atomic<int> num_pending;
+	std::mutex sleep_mutex;
+	std::condition_variable wake_up;
+	bool must_loop;
+
+	Task* popTask(int worker, TaskGroup* group = NULL);
+	void execute(Task* task);
+	void loop(int worker);
+};
@@ -177,6 +177,7 @@ void SceneEditor::render(Camera* camera)
 			switch (entity->getType())
 			{
 				case SCN::eEntityType::PREFAB: renderInList((SCN::PrefabEntity*)entity); break;
+				case SCN::eEntityType::CHARACTER: renderInList((SCN::PrefabEntity*)entity); break;
 				default: renderInList(entity); break;
 			}
 		}
@@ -228,6 +229,11 @@ void SceneEditor::render(Camera* camera)
 		{
 		case SCN::eEntityType::PREFAB: inspectEntity((SCN::PrefabEntity*)ent); break;
 		case SCN::eEntityType::LIGHT: inspectEntity((SCN::LightEntity*)ent); break;
+		case SCN::eEntityType::IRRADIANCE_VOLUME: inspectEntity((SCN::IrradianceVolumeEntity*)ent); break;
+		case SCN::eEntityType::REFLECTION_PROBE: inspectEntity((SCN::ReflectionProbeEntity*)ent); break;
+		case SCN::eEntityType::LIGHTMAP: inspectEntity((SCN::LightmapEntity*)ent); break;
+		case SCN::eEntityType::CHARACTER: inspectEntity((SCN::CharacterEntity*)ent); break;
+		case SCN::eEntityType::CROWD: inspectEntity((SCN::CrowdEntity*)ent); break;
 		case SCN::eEntityType::NONE: inspectEntity((SCN::UnknownEntity*)ent); break;
 		default: inspectEntity(ent); break;
 		}
@@ -336,6 +342,7 @@ void SceneEditor::inspectEntity(SCN::PrefabEntity* entity)
 	{
 		entity->loadPrefab(entity->filename.c_str());
 	}
+	ImGui::Checkbox("static", &entity->is_static);
 
 #endif
 }
@@ -367,9 +374,156 @@ void SceneEditor::inspectEntity(SCN::LightEntity* entity)
 	{
 		ImGui::DragFloat("shadow_bias", &entity->shadow_bias, 0.001, 0.0f, 0.1f);
 	}
+	ImGui::Checkbox("baked", &entity->baked);
 #endif
 }
 
+void SceneEditor::inspectEntity(SCN::IrradianceVolumeEntity* entity)
+{
+#ifndef SKIP_IMGUI
+	this->inspectEntity((SCN::BaseEntity*)entity);
+
+	int dims[3] = { (int)entity->dims.x, (int)entity->dims.y, (int)entity->dims.z };
+	if (ImGui::DragInt3("dims", dims, 0.1f, 1, 64))
+		entity->dims.set(dims[0], dims[1], dims[2]);
+	ImGui::DragFloat3("size", entity->size.v, 1.0f, 0.0f, 100000.0f);
+	ImGui::SliderInt("resolution", &entity->resolution, 2, 32);
+	ImGui::SliderInt("bounces", &entity->bounces, 1, 4);
+	ImGui::DragFloat("normal_distance", &entity->normal_distance, 0.1f, 0.0f, 100.0f);
+	ImGui::Checkbox("auto_update", &entity->auto_update);
+	UI::Filename("filename", entity->filename, scene->base_folder);
+
+	if (ImGui::Button("Bake"))
+		entity->bake();
+	ImGui::SameLine();
+	if (ImGui::Button("Check white box")) //the bounces must not add light, prints the result
+		SCN::IrradianceVolumeEntity::checkWhiteBox();
+	ImGui::Text("%d probes, last update: %d probes in %.0fms", (int)entity->probes.size(), entity->last_update_probes, entity->last_bake_time);
+#endif
+}
+
+void SceneEditor::inspectEntity(SCN::ReflectionProbeEntity* entity)
+{
+#ifndef SKIP_IMGUI
+	this->inspectEntity((SCN::BaseEntity*)entity);
+
+	ImGui::DragFloat("radius", &entity->radius, 0.1f, 0.001f, 100000.0f);
+	ImGui::SliderFloat("falloff", &entity->falloff, 0.001f, 1.0f);
+	ImGui::Checkbox("auto_update", &entity->auto_update);
+	UI::Filename("filename", entity->filename, scene->base_folder);
+
+	if (ImGui::Button("Capture"))
+		entity->capture();
+	if (entity->layer == -1)
+		ImGui::Text("No layer");
+	else if (entity->capture_requested)
+		ImGui::Text("Layer %d, capturing (step %d of %d)", entity->layer, entity->capture_step, REFLECTION_PROBE_STEPS);
+	else
+		ImGui::Text("Layer %d, last capture: %.1fms", entity->layer, entity->last_capture_time);
+#endif
+}
+
+void SceneEditor::inspectEntity(SCN::LightmapEntity* entity)
+{
+#ifndef SKIP_IMGUI
+	this->inspectEntity((SCN::BaseEntity*)entity);
+
+	ImGui::DragFloat("texels_per_unit", &entity->texels_per_unit, 0.1f, 0.01f, 1000.0f);
+	ImGui::DragIntRange2("size", &entity->min_size, &entity->max_size, 1.0f, 1, 4096);
+	ImGui::SliderInt("page_size", &entity->page_size, 256, 4096);
+	ImGui::SliderInt("samples", &entity->samples, 1, 1024);
+	ImGui::SliderInt("bounces", &entity->bounces, 0, 4);
+	ImGui::SliderInt("denoise_iterations", &entity->denoise_iterations, 0, 5);
+	UI::Filename("filename", entity->filename, scene->base_folder);
+
+	if (ImGui::Button("Bake"))
+		entity->bake();
+	ImGui::Text("%d nodes in %d pages, last bake: %d texels in %.0fms", (int)entity->nodes.size(), (int)entity->pages.size(), entity->last_bake_texels, entity->last_bake_time);
+#endif
+}
+
+void SceneEditor::inspectEntity(SCN::CharacterEntity* entity)
+{
+#ifndef SKIP_IMGUI
+	this->inspectEntity((SCN::BaseEntity*)entity);
+
+	ImGui::Separator();
+
+	if (UI::Filename("filename", entity->filename, scene->base_folder))
+	{
+		entity->loadPrefab(entity->filename.c_str());
+		SCN::Animator::release(entity);
+	}
+	if (UI::Filename("animation", entity->animation_filename, scene->base_folder))
+		entity->loadAnimation(entity->animation_filename.c_str());
+	if (UI::Filename("blend_animation", entity->blend_animation_filename, scene->base_folder))
+		entity->loadAnimation(entity->blend_animation_filename.c_str(), true);
+	if (entity->blend_animation)
+		ImGui::SliderFloat("blend", &entity->blend, 0.0f, 1.0f);
+	ImGui::DragFloat("speed", &entity->speed, 0.01f, -10.0f, 10.0f);
+	ImGui::Checkbox("loop", &entity->loop);
+
+	if (entity->animation)
+		ImGui::Text("%.2fs of %.2fs, updated every %d frames", entity->time, entity->animation->duration, entity->update_interval);
+	else
+		ImGui::Text("No animation");
+#endif
+}
+
+void SceneEditor::inspectEntity(SCN::CrowdEntity* entity)
+{
+#ifndef SKIP_IMGUI
+	this->inspectEntity((SCN::BaseEntity*)entity);
+
+	ImGui::Separator();
+
+	bool rebake = false;
+	if (UI::Filename("filename", entity->filename, scene->base_folder))
+	{
+		entity->loadPrefab(entity->filename.c_str());
+		rebake = true;
+	}
+	for (size_t i = 0; i < entity->animation_filenames.size(); ++i)
+	{
+		ImGui::PushID((int)i);
+		if (UI::Filename("animation", entity->animation_filenames[i], scene->base_folder))
+			rebake = true;
+		ImGui::SameLine();
+		if (ImGui::Button("X"))
+		{
+			entity->animation_filenames.erase(entity->animation_filenames.begin() + i);
+			rebake = true;
+		}
+		ImGui::PopID();
+	}
+	if (ImGui::Button("Add animation"))
+		entity->animation_filenames.push_back("");
+	UI::Filename("vat", entity->vat_filename, scene->base_folder);
+	rebake |= ImGui::DragFloat("fps", &entity->fps, 1.0f, 1.0f, 120.0f);
+
+	entity->instances_dirty |= ImGui::DragInt("count", &entity->count, 1.0f, 0, 100000);
+	entity->instances_dirty |= ImGui::DragFloat3("size", entity->size.v, 0.1f, 0.0f, 10000.0f);
+	entity->instances_dirty |= ImGui::SliderFloat("speed variation", &entity->speed_variation, 0.0f, 1.0f);
+	entity->instances_dirty |= ImGui::DragInt("seed", &entity->seed);
+
+	//the cache is ignored, it is written again with the new frames
+	if (ImGui::Button("Bake") || rebake)
+	{
+		entity->loadAnimations();
+		entity->bake(false);
+	}
+
+	SCN::VertexAnimation& vat = entity->vertex_animation;
+	if (vat.isEmpty())
+		ImGui::Text("Not baked");
+	else
+	{
+		ImGui::Text("%d clips, %d frames, %d vertices, %d KB", (int)vat.clips.size(), vat.num_frames, vat.num_vertices, (int)(vat.getMemorySize() / 1024));
+		ImGui::Text("Baked in %.2fms", vat.last_bake_time);
+		ImGui::Text("%d of %d instances visible", (int)entity->visible_models.size(), (int)entity->models.size());
+	}
+#endif
+}
 
 void SceneEditor::inspectEntity( SCN::UnknownEntity* entity )
 {
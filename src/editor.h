@@ -10,6 +10,11 @@ namespace SCN {
 
 	class PrefabEntity;
 	class LightEntity;
+	class IrradianceVolumeEntity;
+	class ReflectionProbeEntity;
+	class LightmapEntity;
+	class CharacterEntity;
+	class CrowdEntity;
 };
 
 class SceneEditor
@@ -32,6 +37,11 @@ public:
 	void inspectEntity(SCN::BaseEntity* entity);
 	void inspectEntity(SCN::PrefabEntity* entity);
 	void inspectEntity(SCN::LightEntity* entity);
+	void inspectEntity(SCN::IrradianceVolumeEntity* entity);
+	void inspectEntity(SCN::ReflectionProbeEntity* entity);
+	void inspectEntity(SCN::LightmapEntity* entity);
+	void inspectEntity(SCN::CharacterEntity* entity);
+	void inspectEntity(SCN::CrowdEntity* entity);
 	void inspectEntity(SCN::UnknownEntity* entity);
 
 	void renderInList(SCN::BaseEntity* entity);
@@ -657,6 +657,8 @@ static const ddsktx__block_info k__block_info[] =
 #define DDSKTX__KTX_COMPRESSED_SRGB_ALPHA_S3TC_DXT5_EXT       0x8C4F
 #define DDSKTX__KTX_COMPRESSED_LUMINANCE_LATC1_EXT            0x8C70
 #define DDSKTX__KTX_COMPRESSED_LUMINANCE_ALPHA_LATC2_EXT      0x8C72
+#define DDSKTX__KTX_COMPRESSED_RED_RGTC1                      0x8DBB
+#define DDSKTX__KTX_COMPRESSED_RG_RGTC2                       0x8DBD
 #define DDSKTX__KTX_COMPRESSED_RGBA_BPTC_UNORM_ARB            0x8E8C
 #define DDSKTX__KTX_COMPRESSED_SRGB_ALPHA_BPTC_UNORM_ARB      0x8E8D
 #define DDSKTX__KTX_COMPRESSED_RGB_BPTC_SIGNED_FLOAT_ARB      0x8E8E
@@ -833,6 +835,8 @@ static const ddsktx__ktx_format_info2 k__translate_ktx_fmt2[] =
     { DDSKTX__KTX_RGB,                          DDSKTX_FORMAT_RGB8  },
     { DDSKTX__KTX_RGBA,                         DDSKTX_FORMAT_RGBA8 },
     { DDSKTX__KTX_COMPRESSED_RGB_S3TC_DXT1_EXT, DDSKTX_FORMAT_BC1   },
+    { DDSKTX__KTX_COMPRESSED_RED_RGTC1,         DDSKTX_FORMAT_BC4   },
+    { DDSKTX__KTX_COMPRESSED_RG_RGTC2,          DDSKTX_FORMAT_BC5   },
 };
 
 typedef struct ddsktx__format_info
@@ -1,5 +1,110 @@
 #include "picopng.h"
 
+#include <cstring>
+
+//SIMD unfiltering of 8 bits RGB/RGBA scanlines (not part of the original picoPNG).
+//Up works on 16 bytes at a time, Sub on 4 RGBA pixels (prefix sum), Avg and Paeth depend on the
+//previous pixel so they go pixel by pixel but with the 3 or 4 channels at once
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+	#define PICOPNG_USE_SSE
+	#include <emmintrin.h>
+#endif
+
+#ifdef PICOPNG_USE_SSE
+namespace picopng_sse {
+
+	//the size is a template argument so the copies become a single move
+	template<size_t bytewidth> inline __m128i loadPixel(const unsigned char* p)
+	{
+		int v = 0;
+		memcpy(&v, p, bytewidth);
+		return _mm_cvtsi32_si128(v);
+	}
+
+	template<size_t bytewidth> inline void storePixel(unsigned char* p, __m128i v)
+	{
+		int t = _mm_cvtsi128_si32(v);
+		memcpy(p, &t, bytewidth);
+	}
+
+	inline void up(unsigned char* recon, const unsigned char* scanline, const unsigned char* precon, size_t length)
+	{
+		size_t i = 0;
+		for (; i + 16 <= length; i += 16)
+			_mm_storeu_si128((__m128i*)(recon + i), _mm_add_epi8(_mm_loadu_si128((const __m128i*)(scanline + i)), _mm_loadu_si128((const __m128i*)(precon + i))));
+		for (; i < length; i++)
+			recon[i] = scanline[i] + precon[i];
+	}
+
+	template<size_t bytewidth> inline void sub(unsigned char* recon, const unsigned char* scanline, size_t length)
+	{
+		__m128i a = _mm_setzero_si128();
+		size_t i = 0;
+		if (bytewidth == 4) //prefix sum of 4 pixels, then add the last pixel of the previous group
+			for (; i + 16 <= length; i += 16)
+			{
+				__m128i x = _mm_loadu_si128((const __m128i*)(scanline + i));
+				x = _mm_add_epi8(x, _mm_slli_si128(x, 4));
+				x = _mm_add_epi8(x, _mm_slli_si128(x, 8));
+				x = _mm_add_epi8(x, a);
+				_mm_storeu_si128((__m128i*)(recon + i), x);
+				a = _mm_shuffle_epi32(x, _MM_SHUFFLE(3, 3, 3, 3));
+			}
+		for (; i < length; i += bytewidth)
+		{
+			a = _mm_add_epi8(a, loadPixel<bytewidth>(scanline + i));
+			storePixel<bytewidth>(recon + i, a);
+		}
+	}
+
+	template<size_t bytewidth> inline void avg(unsigned char* recon, const unsigned char* scanline, const unsigned char* precon, size_t length)
+	{
+		__m128i a = _mm_setzero_si128();
+		const __m128i one = _mm_set1_epi8(1);
+		for (size_t i = 0; i < length; i += bytewidth)
+		{
+			__m128i b = loadPixel<bytewidth>(precon + i);
+			//_mm_avg_epu8 rounds up, PNG rounds down
+			__m128i average = _mm_sub_epi8(_mm_avg_epu8(a, b), _mm_and_si128(_mm_xor_si128(a, b), one));
+			a = _mm_add_epi8(average, loadPixel<bytewidth>(scanline + i));
+			storePixel<bytewidth>(recon + i, a);
+		}
+	}
+
+	inline __m128i abs16(__m128i x)
+	{
+		return _mm_max_epi16(x, _mm_sub_epi16(_mm_setzero_si128(), x));
+	}
+
+	inline __m128i select(__m128i mask, __m128i x, __m128i y)
+	{
+		return _mm_or_si128(_mm_and_si128(mask, x), _mm_andnot_si128(mask, y));
+	}
+
+	//same choice as paethPredictor, in 16 bits
+	template<size_t bytewidth> inline void paeth(unsigned char* recon, const unsigned char* scanline, const unsigned char* precon, size_t length)
+	{
+		const __m128i zero = _mm_setzero_si128();
+		__m128i a = zero, c = zero;
+		for (size_t i = 0; i < length; i += bytewidth)
+		{
+			__m128i b = _mm_unpacklo_epi8(loadPixel<bytewidth>(precon + i), zero);
+			__m128i pa = _mm_sub_epi16(b, c); //p - a
+			__m128i pb = _mm_sub_epi16(a, c); //p - b
+			__m128i pc = abs16(_mm_add_epi16(pa, pb)); //p - c
+			pa = abs16(pa);
+			pb = abs16(pb);
+			__m128i smallest = _mm_min_epi16(pc, _mm_min_epi16(pa, pb));
+			__m128i nearest = select(_mm_cmpeq_epi16(pa, smallest), a, select(_mm_cmpeq_epi16(pb, smallest), b, c));
+			__m128i x = _mm_add_epi8(_mm_packus_epi16(nearest, nearest), loadPixel<bytewidth>(scanline + i));
+			storePixel<bytewidth>(recon + i, x);
+			a = _mm_unpacklo_epi8(x, zero);
+			c = b;
+		}
+	}
+};
+#endif
+
 int decodePNG(std::vector<unsigned char>& out_image, unsigned int& image_width, unsigned int& image_height, const unsigned char* in_png, size_t in_size, bool convert_to_rgba32)
 {
 	// picoPNG version 20101224
@@ -38,6 +143,7 @@ int decodePNG(std::vector<unsigned char>& out_image, unsigned int& image_width,
 		static unsigned long readBitFromStream(size_t& bitp, const unsigned char* bits) { unsigned long result = (bits[bitp >> 3] >> (bitp & 0x7)) & 1; bitp++; return result; }
 		static unsigned long readBitsFromStream(size_t& bitp, const unsigned char* bits, size_t nbits)
 		{
+			if (nbits == 0) return 0;
 			unsigned long result = 0;
 			for (size_t i = 0; i < nbits; i++) result += (readBitFromStream(bitp, bits)) << i;
 			return result;
@@ -64,8 +170,19 @@ int decodePNG(std::vector<unsigned char>& out_image, unsigned int& image_width,
 						}
 						else treepos = tree2d[2 * treepos + bit] - numcodes; //subtract numcodes from address to get address value
 					}
+				//lookup table of the short codes indexed by the next bits of the stream (not part of the original picoPNG)
+				fast.assign(1 << FAST_BITS, 0);
+				for (unsigned long n = 0; n < numcodes; n++)
+				{
+					if (bitlen[n] == 0 || bitlen[n] > FAST_BITS) continue;
+					unsigned long reversed = 0; //the stream starts with the most significant bit of the code
+					for (unsigned long i = 0; i < bitlen[n]; i++) reversed |= ((tree1d[n] >> i) & 1) << (bitlen[n] - i - 1);
+					for (unsigned long k = reversed; k < (1UL << FAST_BITS); k += (1UL << bitlen[n])) fast[k] = (unsigned short)((n << 4) | bitlen[n]);
+				}
 				return 0;
 			}
+			enum { FAST_BITS = 9 };
+			std::vector<unsigned short> fast; //symbol << 4 | code length, 0 when the code is longer
 			int decode(bool& decoded, unsigned long& result, size_t& treepos, unsigned long bit) const
 			{ //Decodes a symbol from the tree
 				unsigned long numcodes = (unsigned long)tree2d.size() / 2;
@@ -108,6 +225,13 @@ int decodePNG(std::vector<unsigned char>& out_image, unsigned int& image_width,
 			unsigned long huffmanDecodeSymbol(const unsigned char* in, size_t& bp, const HuffmanTree& codetree, size_t inlength)
 			{ //decode a single symbol from given list of bits with given code tree. return value is the symbol
 				bool decoded; unsigned long ct;
+				if ((bp >> 3) + 2 < inlength)
+				{
+					size_t byte = bp >> 3;
+					unsigned long bits = (in[byte] | (in[byte + 1] << 8) | (in[byte + 2] << 16)) >> (bp & 7);
+					unsigned short entry = codetree.fast[bits & ((1 << HuffmanTree::FAST_BITS) - 1)];
+					if (entry) { bp += entry & 15; return entry >> 4; }
+				}
 				for (size_t treepos = 0;;)
 				{
 					if ((bp & 0x07) == 0 && (bp >> 3) > inlength) { error = 10; return 0; } //error: end reached without endcode
@@ -339,7 +463,8 @@ int decodePNG(std::vector<unsigned char>& out_image, unsigned int& image_width,
 			}
 			if (convert_to_rgba32 && (info.colorType != 6 || info.bitDepth != 8)) //conversion needed
 			{
-				std::vector<unsigned char> data = out;
+				std::vector<unsigned char> data;
+				data.swap(out);
 				error = convert(out, &data[0], info, info.width, info.height);
 			}
 		}
@@ -357,6 +482,16 @@ int decodePNG(std::vector<unsigned char>& out_image, unsigned int& image_width,
 		}
 		void unFilterScanline(unsigned char* recon, const unsigned char* scanline, const unsigned char* precon, size_t bytewidth, unsigned long filterType, size_t length)
 		{
+#ifdef PICOPNG_USE_SSE
+			if (filterType == 2 && precon) { picopng_sse::up(recon, scanline, precon, length); return; }
+			if ((bytewidth == 3 || bytewidth == 4) && length % bytewidth == 0)
+			{
+				bool rgba = bytewidth == 4;
+				if (filterType == 1) { rgba ? picopng_sse::sub<4>(recon, scanline, length) : picopng_sse::sub<3>(recon, scanline, length); return; }
+				if (filterType == 3 && precon) { rgba ? picopng_sse::avg<4>(recon, scanline, precon, length) : picopng_sse::avg<3>(recon, scanline, precon, length); return; }
+				if (filterType == 4 && precon) { rgba ? picopng_sse::paeth<4>(recon, scanline, precon, length) : picopng_sse::paeth<3>(recon, scanline, precon, length); return; }
+			}
+#endif
 			switch (filterType)
 			{
 			case 0: for (size_t i = 0; i < length; i++) recon[i] = scanline[i]; break;
@@ -446,6 +581,19 @@ int decodePNG(std::vector<unsigned char>& out_image, unsigned int& image_width,
 					out_[4 * i + 0] = out_[4 * i + 1] = out_[4 * i + 2] = in[i];
 					out_[4 * i + 3] = (infoIn.key_defined && in[i] == infoIn.key_r) ? 0 : 255;
 				}
+			else if (infoIn.bitDepth == 8 && infoIn.colorType == 2 && !infoIn.key_defined && numpixels) //RGB color, a 32 bits copy per pixel (reads one byte ahead except in the last one)
+			{
+				for (size_t i = 0; i < numpixels - 1; i++)
+				{
+					unsigned int v;
+					memcpy(&v, in + 3 * i, 4);
+					v |= 0xFF000000u;
+					memcpy(out_ + 4 * i, &v, 4);
+				}
+				size_t last = numpixels - 1;
+				for (size_t c = 0; c < 3; c++) out_[4 * last + c] = in[3 * last + c];
+				out_[4 * last + 3] = 255;
+			}
 			else if (infoIn.bitDepth == 8 && infoIn.colorType == 2) //RGB color
 				for (size_t i = 0; i < numpixels; i++)
 				{
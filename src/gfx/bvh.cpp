@@ -0,0 +1,705 @@
+#include "bvh.h"
+
+#include <algorithm>
+#include <cstring>
+#include <cassert>
+
+#include "mesh.h"
+
+#if defined(__SSE__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 1)
+	#define BVH_USE_SSE
+	#include <xmmintrin.h>
+#endif
+
+#define BVH_NUM_BINS 12
+#define BVH_EPSILON 1e-7f
+#define BVH_WIDE_STACK_SIZE (3 * BVH_MAX_DEPTH + 1) //every wide node visited pushes 3 more at most, one per level
+
+using namespace GFX;
+
+namespace {
+
+	//per component, not the ones of Vector3 so everything stays inline
+	inline Vector3f minVector(const Vector3f& a, const Vector3f& b) { return Vector3f((std::min)(a.x, b.x), (std::min)(a.y, b.y), (std::min)(a.z, b.z)); }
+	inline Vector3f maxVector(const Vector3f& a, const Vector3f& b) { return Vector3f((std::max)(a.x, b.x), (std::max)(a.y, b.y), (std::max)(a.z, b.z)); }
+
+	struct sBounds {
+		Vector3f min = Vector3f(FLT_MAX);
+		Vector3f max = Vector3f(-FLT_MAX);
+
+		void add(const Vector3f& p) { min = minVector(min, p); max = maxVector(max, p); }
+		void add(const sBounds& b) { min = minVector(min, b.min); max = maxVector(max, b.max); }
+		float area() const {
+			if (min.x > max.x)
+				return 0.0f;
+			Vector3f d = max - min;
+			return d.x * d.y + d.y * d.z + d.z * d.x;
+		}
+	};
+
+	struct sBuildRange {
+		int node;
+		int first;
+		int count;
+		int depth;
+	};
+
+	//levels of a tree of median splits of count primitives
+	inline int ceilLog2(int count)
+	{
+		int levels = 0;
+		while ((1 << levels) < count)
+			levels++;
+		return levels;
+	}
+
+	struct sWideEntry {
+		int child;
+		float t; //where the ray enters its box
+	};
+
+	inline float nodeArea(const BVH::sNode& node) {
+		Vector3f d = node.max - node.min;
+		return d.x * d.y + d.y * d.z + d.z * d.x;
+	}
+
+	//Ericson, Real-Time Collision Detection 5.1.5
+	Vector3f closestPointInTriangle(const Vector3f& p, const Vector3f& a, const Vector3f& b, const Vector3f& c)
+	{
+		Vector3f ab = b - a, ac = c - a, ap = p - a;
+		float d1 = dot(ab, ap), d2 = dot(ac, ap);
+		if (d1 <= 0.0f && d2 <= 0.0f)
+			return a;
+		Vector3f bp = p - b;
+		float d3 = dot(ab, bp), d4 = dot(ac, bp);
+		if (d3 >= 0.0f && d4 <= d3)
+			return b;
+		float vc = d1 * d4 - d3 * d2;
+		if (vc <= 0.0f && d1 >= 0.0f && d3 <= 0.0f)
+			return a + ab * (d1 / (d1 - d3));
+		Vector3f cp = p - c;
+		float d5 = dot(ab, cp), d6 = dot(ac, cp);
+		if (d6 >= 0.0f && d5 <= d6)
+			return c;
+		float vb = d5 * d2 - d1 * d6;
+		if (vb <= 0.0f && d2 >= 0.0f && d6 <= 0.0f)
+			return a + ac * (d2 / (d2 - d6));
+		float va = d3 * d6 - d5 * d4;
+		if (va <= 0.0f && (d4 - d3) >= 0.0f && (d5 - d6) >= 0.0f)
+			return b + (c - b) * ((d4 - d3) / ((d4 - d3) + (d5 - d6)));
+		float denom = 1.0f / (va + vb + vc);
+		return a + ab * (vb * denom) + ac * (vc * denom);
+	}
+};
+
+void BVH::clear()
+{
+	nodes.clear();
+	indices.clear();
+}
+
+void BVH::build(const std::vector<Vector3f>& mins, const std::vector<Vector3f>& maxs, int max_leaf_size)
+{
+	clear();
+	int num = (int)mins.size();
+	if (!num)
+		return;
+
+	std::vector<Vector3f> centers(num);
+	indices.resize(num);
+	for (int i = 0; i < num; ++i)
+	{
+		centers[i] = (mins[i] + maxs[i]) * 0.5f;
+		indices[i] = i;
+	}
+
+	nodes.reserve(num * 2);
+	nodes.push_back(sNode());
+
+	std::vector<sBuildRange> stack;
+	stack.push_back({ 0, 0, num, 0 });
+	while (stack.size())
+	{
+		sBuildRange range = stack.back();
+		stack.pop_back();
+
+		sBounds bounds, center_bounds;
+		for (int i = range.first; i < range.first + range.count; ++i)
+		{
+			int index = indices[i];
+			bounds.min = minVector(bounds.min, mins[index]);
+			bounds.max = maxVector(bounds.max, maxs[index]);
+			center_bounds.add(centers[index]);
+		}
+		sNode& node = nodes[range.node];
+		node.min = bounds.min;
+		node.max = bounds.max;
+		node.first = range.first;
+		node.count = range.count;
+
+		if (range.count <= max_leaf_size)
+			continue;
+
+		//binned SAH: the best plane of every axis between the bins of the centers
+		//it can go as deep as the primitives, so close to BVH_MAX_DEPTH only median splits (they halve the count every level)
+		int best_axis = -1;
+		int best_split = 0;
+		float best_cost = range.count * bounds.area(); //cost of leaving it as a leaf
+		bool use_sah = range.depth + ceilLog2(range.count) < BVH_MAX_DEPTH - 2;
+		for (int axis = 0; axis < 3 && use_sah; ++axis)
+		{
+			float axis_min = center_bounds.min.v[axis];
+			float extent = center_bounds.max.v[axis] - axis_min;
+			if (extent <= 0.0f)
+				continue;
+			float scale = BVH_NUM_BINS / extent;
+
+			sBounds bins[BVH_NUM_BINS];
+			int counts[BVH_NUM_BINS] = {};
+			for (int i = range.first; i < range.first + range.count; ++i)
+			{
+				int index = indices[i];
+				int bin = (std::min)(BVH_NUM_BINS - 1, (int)((centers[index].v[axis] - axis_min) * scale));
+				counts[bin]++;
+				bins[bin].min = minVector(bins[bin].min, mins[index]);
+				bins[bin].max = maxVector(bins[bin].max, maxs[index]);
+			}
+
+			float left_area[BVH_NUM_BINS - 1];
+			int left_count[BVH_NUM_BINS - 1];
+			sBounds accum;
+			int count = 0;
+			for (int i = 0; i < BVH_NUM_BINS - 1; ++i)
+			{
+				accum.add(bins[i]);
+				count += counts[i];
+				left_area[i] = accum.area();
+				left_count[i] = count;
+			}
+			accum = sBounds();
+			count = 0;
+			for (int i = BVH_NUM_BINS - 1; i > 0; --i)
+			{
+				accum.add(bins[i]);
+				count += counts[i];
+				if (!count || !left_count[i - 1])
+					continue;
+				float cost = left_count[i - 1] * left_area[i - 1] + count * accum.area();
+				if (cost < best_cost)
+				{
+					best_cost = cost;
+					best_axis = axis;
+					best_split = i;
+				}
+			}
+		}
+
+		int mid;
+		if (best_axis != -1)
+		{
+			float axis_min = center_bounds.min.v[best_axis];
+			float scale = BVH_NUM_BINS / (center_bounds.max.v[best_axis] - axis_min);
+			int* split = std::partition(&indices[range.first], &indices[range.first] + range.count, [&](int index) {
+				return (std::min)(BVH_NUM_BINS - 1, (int)((centers[index].v[best_axis] - axis_min) * scale)) < best_split;
+			});
+			mid = (int)(split - &indices[0]);
+		}
+		else
+		{
+			//all the centers together, SAH prefers a leaf bigger than max_leaf_size or too deep, split by the median
+			int axis = 0;
+			Vector3f extent = center_bounds.max - center_bounds.min;
+			if (extent.y > extent.x) axis = 1;
+			if (extent.z > extent.v[axis]) axis = 2;
+			mid = range.first + range.count / 2;
+			std::nth_element(&indices[range.first], &indices[mid], &indices[range.first] + range.count, [&](int a, int b) {
+				return centers[a].v[axis] < centers[b].v[axis];
+			});
+		}
+
+		int children = (int)nodes.size();
+		nodes.push_back(sNode());
+		nodes.push_back(sNode());
+		nodes[range.node].first = children;
+		nodes[range.node].count = 0;
+		stack.push_back({ children + 1, mid, range.first + range.count - mid, range.depth + 1 });
+		stack.push_back({ children, range.first, mid - range.first, range.depth + 1 });
+	}
+}
+
+bool BVH::intersectBox(const Vector3f& min, const Vector3f& max, const Vector3f& origin, const Vector3f& inv_direction, float max_t, float& t_enter)
+{
+#ifdef BVH_USE_SSE
+	__m128 o = _mm_set_ps(0, origin.z, origin.y, origin.x);
+	__m128 inv = _mm_set_ps(1, inv_direction.z, inv_direction.y, inv_direction.x);
+	__m128 t0 = _mm_mul_ps(_mm_sub_ps(_mm_set_ps(0, min.z, min.y, min.x), o), inv);
+	__m128 t1 = _mm_mul_ps(_mm_sub_ps(_mm_set_ps(0, max.z, max.y, max.x), o), inv);
+	__m128 t_near = _mm_min_ps(t0, t1);
+	__m128 t_far = _mm_max_ps(t0, t1);
+	float n[4], f[4];
+	_mm_storeu_ps(n, t_near);
+	_mm_storeu_ps(f, t_far);
+	float t_min = (std::max)((std::max)(n[0], n[1]), (std::max)(n[2], 0.0f));
+	float t_max = (std::min)((std::min)(f[0], f[1]), (std::min)(f[2], max_t));
+#else
+	float t_min = 0.0f;
+	float t_max = max_t;
+	for (int i = 0; i < 3; ++i)
+	{
+		float t0 = (min.v[i] - origin.v[i]) * inv_direction.v[i];
+		float t1 = (max.v[i] - origin.v[i]) * inv_direction.v[i];
+		t_min = (std::max)(t_min, (std::min)(t0, t1));
+		t_max = (std::min)(t_max, (std::max)(t0, t1));
+	}
+#endif
+	t_enter = t_min;
+	return t_min <= t_max;
+}
+
+void TriangleBVH::clear()
+{
+	nodes.clear();
+	packets.clear();
+	triangles.clear();
+	triangle_slots.clear();
+	min = max = Vector3f();
+}
+
+size_t TriangleBVH::getMemorySize() const
+{
+	return nodes.size() * sizeof(sWideNode) + packets.size() * sizeof(float) + (triangles.size() + triangle_slots.size()) * sizeof(int);
+}
+
+void TriangleBVH::build(const std::vector<Vector3f>& vertices)
+{
+	clear();
+	int num_triangles = (int)vertices.size() / 3;
+	if (!num_triangles)
+		return;
+
+	std::vector<Vector3f> mins(num_triangles);
+	std::vector<Vector3f> maxs(num_triangles);
+	for (int i = 0; i < num_triangles; ++i)
+	{
+		mins[i] = maxs[i] = vertices[i * 3];
+		for (int j = 1; j < 3; ++j)
+		{
+			mins[i] = minVector(mins[i], vertices[i * 3 + j]);
+			maxs[i] = maxVector(maxs[i], vertices[i * 3 + j]);
+		}
+	}
+	BVH bvh;
+	bvh.build(mins, maxs, BVH_MAX_LEAF_SIZE);
+	min = bvh.nodes[0].min;
+	max = bvh.nodes[0].max;
+
+	//every leaf becomes a packet of 4 triangles
+	std::vector<int> leaf_packets(bvh.nodes.size(), -1);
+	triangle_slots.assign(num_triangles, -1);
+	for (size_t n = 0; n < bvh.nodes.size(); ++n)
+	{
+		const BVH::sNode& node = bvh.nodes[n];
+		if (!node.count)
+			continue;
+		int packet = (int)triangles.size() / 4;
+		float data[9][4] = {};
+		for (int i = 0; i < 4; ++i)
+		{
+			int triangle = i < node.count ? bvh.indices[node.first + i] : -1;
+			triangles.push_back(triangle);
+			if (triangle == -1)
+				continue;
+			triangle_slots[triangle] = packet * 4 + i;
+			const Vector3f& v0 = vertices[triangle * 3];
+			Vector3f e1 = vertices[triangle * 3 + 1] - v0;
+			Vector3f e2 = vertices[triangle * 3 + 2] - v0;
+			for (int c = 0; c < 3; ++c)
+			{
+				data[c][i] = v0.v[c];
+				data[3 + c][i] = e1.v[c];
+				data[6 + c][i] = e2.v[c];
+			}
+		}
+		packets.insert(packets.end(), &data[0][0], &data[0][0] + 36);
+		leaf_packets[n] = packet;
+	}
+
+	//collapse the binary tree: every wide node takes the children of its biggest inner children until it has 4
+	nodes.reserve(bvh.nodes.size() / 2 + 1);
+	nodes.push_back(sWideNode());
+	std::vector<std::pair<int, int>> stack; //binary node, wide node
+	stack.push_back({ 0, 0 });
+	while (stack.size())
+	{
+		std::pair<int, int> entry = stack.back();
+		stack.pop_back();
+
+		int children[4];
+		int num_children = 0;
+		const BVH::sNode& parent = bvh.nodes[entry.first];
+		if (parent.count) //a root with a few triangles
+			children[num_children++] = entry.first;
+		else
+		{
+			children[num_children++] = parent.first;
+			children[num_children++] = parent.first + 1;
+			while (num_children < 4)
+			{
+				int best = -1;
+				float best_area = -1.0f;
+				for (int i = 0; i < num_children; ++i)
+				{
+					const BVH::sNode& child = bvh.nodes[children[i]];
+					if (!child.count && nodeArea(child) > best_area)
+					{
+						best = i;
+						best_area = nodeArea(child);
+					}
+				}
+				if (best == -1)
+					break;
+				int first = bvh.nodes[children[best]].first;
+				children[best] = first;
+				children[num_children++] = first + 1;
+			}
+		}
+
+		for (int i = 0; i < 4; ++i)
+		{
+			sWideNode& node = nodes[entry.second];
+			if (i >= num_children)
+			{
+				node.min_x[i] = node.min_y[i] = node.min_z[i] = 0.0f;
+				node.max_x[i] = node.max_y[i] = node.max_z[i] = 0.0f;
+				node.children[i] = BVH_WIDE_EMPTY;
+				continue;
+			}
+			const BVH::sNode& child = bvh.nodes[children[i]];
+			node.min_x[i] = child.min.x; node.min_y[i] = child.min.y; node.min_z[i] = child.min.z;
+			node.max_x[i] = child.max.x; node.max_y[i] = child.max.y; node.max_z[i] = child.max.z;
+			if (child.count)
+			{
+				node.children[i] = ~leaf_packets[children[i]];
+				continue;
+			}
+			node.children[i] = (int)nodes.size();
+			stack.push_back({ children[i], (int)nodes.size() });
+			nodes.push_back(sWideNode()); //node is not valid after this
+		}
+	}
+}
+
+void TriangleBVH::getTriangle(int triangle, Vector3f& v0, Vector3f& v1, Vector3f& v2) const
+{
+	int slot = triangle_slots[triangle];
+	const float* p = &packets[(slot / 4) * 36 + slot % 4];
+	v0.set(p[0], p[4], p[8]);
+	v1 = v0 + Vector3f(p[12], p[16], p[20]);
+	v2 = v0 + Vector3f(p[24], p[28], p[32]);
+}
+
+//front to back: the children hit are pushed sorted so the closest one is popped first, and the ones behind max_t are skipped when popped
+template<typename F> void TriangleBVH::traverse(const Vector3f& origin, const Vector3f& direction, float max_t, F visit) const
+{
+	if (nodes.empty())
+		return;
+
+	Vector3f inv_direction(1.0f / direction.x, 1.0f / direction.y, 1.0f / direction.z);
+#ifdef BVH_USE_SSE
+	__m128 ix = _mm_set1_ps(inv_direction.x), iy = _mm_set1_ps(inv_direction.y), iz = _mm_set1_ps(inv_direction.z);
+	__m128 oix = _mm_set1_ps(origin.x * inv_direction.x), oiy = _mm_set1_ps(origin.y * inv_direction.y), oiz = _mm_set1_ps(origin.z * inv_direction.z);
+	__m128 zero = _mm_setzero_ps();
+#endif
+
+	sWideEntry stack[BVH_WIDE_STACK_SIZE];
+	int stack_size = 0;
+	stack[stack_size++] = { 0, 0.0f };
+	while (stack_size)
+	{
+		sWideEntry entry = stack[--stack_size];
+		if (entry.t > max_t)
+			continue;
+		if (entry.child < 0)
+		{
+			if (visit(~entry.child, max_t))
+				return;
+			continue;
+		}
+
+		const sWideNode& node = nodes[entry.child];
+		float t_near[4];
+		int bits;
+#ifdef BVH_USE_SSE
+		//slab test of the 4 boxes: t = (bound - origin) / direction
+		__m128 tx0 = _mm_sub_ps(_mm_mul_ps(_mm_loadu_ps(node.min_x), ix), oix);
+		__m128 tx1 = _mm_sub_ps(_mm_mul_ps(_mm_loadu_ps(node.max_x), ix), oix);
+		__m128 ty0 = _mm_sub_ps(_mm_mul_ps(_mm_loadu_ps(node.min_y), iy), oiy);
+		__m128 ty1 = _mm_sub_ps(_mm_mul_ps(_mm_loadu_ps(node.max_y), iy), oiy);
+		__m128 tz0 = _mm_sub_ps(_mm_mul_ps(_mm_loadu_ps(node.min_z), iz), oiz);
+		__m128 tz1 = _mm_sub_ps(_mm_mul_ps(_mm_loadu_ps(node.max_z), iz), oiz);
+		__m128 t_min = _mm_max_ps(_mm_max_ps(_mm_min_ps(tx0, tx1), _mm_min_ps(ty0, ty1)), _mm_max_ps(_mm_min_ps(tz0, tz1), zero));
+		__m128 t_max = _mm_min_ps(_mm_min_ps(_mm_max_ps(tx0, tx1), _mm_max_ps(ty0, ty1)), _mm_min_ps(_mm_max_ps(tz0, tz1), _mm_set1_ps(max_t)));
+		bits = _mm_movemask_ps(_mm_cmple_ps(t_min, t_max));
+		_mm_storeu_ps(t_near, t_min);
+#else
+		bits = 0;
+		for (int i = 0; i < 4; ++i)
+		{
+			Vector3f box_min(node.min_x[i], node.min_y[i], node.min_z[i]);
+			Vector3f box_max(node.max_x[i], node.max_y[i], node.max_z[i]);
+			if (BVH::intersectBox(box_min, box_max, origin, inv_direction, max_t, t_near[i]))
+				bits |= 1 << i;
+		}
+#endif
+		//sorted by distance, closest first
+		int order[4];
+		int num_hits = 0;
+		for (int i = 0; i < 4; ++i)
+		{
+			if (!(bits & (1 << i)) || node.children[i] == BVH_WIDE_EMPTY)
+				continue;
+			int j = num_hits++;
+			while (j > 0 && t_near[order[j - 1]] > t_near[i])
+			{
+				order[j] = order[j - 1];
+				--j;
+			}
+			order[j] = i;
+		}
+		assert(stack_size + num_hits <= BVH_WIDE_STACK_SIZE);
+		for (int i = num_hits - 1; i >= 0; --i)
+			stack[stack_size++] = { node.children[order[i]], t_near[order[i]] };
+	}
+}
+
+void TriangleBVH::getTriangles(Mesh* mesh, std::vector<Vector3f>& vertices)
+{
+	vertices.clear();
+	if (mesh->m_indices.size())
+	{
+		vertices.resize(mesh->m_indices.size() - mesh->m_indices.size() % 3);
+		for (size_t i = 0; i < vertices.size(); ++i)
+			vertices[i] = mesh->interleaved.size() ? mesh->interleaved[mesh->m_indices[i]].vertex : mesh->vertices[mesh->m_indices[i]];
+	}
+	else if (mesh->interleaved.size())
+	{
+		vertices.resize(mesh->interleaved.size() - mesh->interleaved.size() % 3);
+		for (size_t i = 0; i < vertices.size(); ++i)
+			vertices[i] = mesh->interleaved[i].vertex;
+	}
+	else
+		vertices.assign(mesh->vertices.begin(), mesh->vertices.begin() + (mesh->vertices.size() - mesh->vertices.size() % 3));
+}
+
+void TriangleBVH::build(Mesh* mesh)
+{
+	std::vector<Vector3f> vertices;
+	getTriangles(mesh, vertices);
+	build(vertices);
+}
+
+//Moller-Trumbore against the 4 triangles of the packet, keeps the closest one below max_t
+bool TriangleBVH::intersectPacket(int packet, const Vector3f& origin, const Vector3f& direction, float max_t, sRayHit& hit) const
+{
+	const float* p = &packets[packet * 36];
+	const int* packet_triangles = &triangles[packet * 4];
+#ifdef BVH_USE_SSE
+	__m128 ox = _mm_set1_ps(origin.x), oy = _mm_set1_ps(origin.y), oz = _mm_set1_ps(origin.z);
+	__m128 dx = _mm_set1_ps(direction.x), dy = _mm_set1_ps(direction.y), dz = _mm_set1_ps(direction.z);
+	__m128 e1x = _mm_loadu_ps(p + 12), e1y = _mm_loadu_ps(p + 16), e1z = _mm_loadu_ps(p + 20);
+	__m128 e2x = _mm_loadu_ps(p + 24), e2y = _mm_loadu_ps(p + 28), e2z = _mm_loadu_ps(p + 32);
+
+	//pvec = dir x e2
+	__m128 px = _mm_sub_ps(_mm_mul_ps(dy, e2z), _mm_mul_ps(dz, e2y));
+	__m128 py = _mm_sub_ps(_mm_mul_ps(dz, e2x), _mm_mul_ps(dx, e2z));
+	__m128 pz = _mm_sub_ps(_mm_mul_ps(dx, e2y), _mm_mul_ps(dy, e2x));
+	__m128 det = _mm_add_ps(_mm_add_ps(_mm_mul_ps(e1x, px), _mm_mul_ps(e1y, py)), _mm_mul_ps(e1z, pz));
+	__m128 inv_det = _mm_div_ps(_mm_set1_ps(1.0f), det);
+
+	//tvec = origin - v0
+	__m128 tx = _mm_sub_ps(ox, _mm_loadu_ps(p));
+	__m128 ty = _mm_sub_ps(oy, _mm_loadu_ps(p + 4));
+	__m128 tz = _mm_sub_ps(oz, _mm_loadu_ps(p + 8));
+	__m128 u = _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(tx, px), _mm_mul_ps(ty, py)), _mm_mul_ps(tz, pz)), inv_det);
+
+	//qvec = tvec x e1
+	__m128 qx = _mm_sub_ps(_mm_mul_ps(ty, e1z), _mm_mul_ps(tz, e1y));
+	__m128 qy = _mm_sub_ps(_mm_mul_ps(tz, e1x), _mm_mul_ps(tx, e1z));
+	__m128 qz = _mm_sub_ps(_mm_mul_ps(tx, e1y), _mm_mul_ps(ty, e1x));
+	__m128 v = _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(dx, qx), _mm_mul_ps(dy, qy)), _mm_mul_ps(dz, qz)), inv_det);
+	__m128 t = _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(e2x, qx), _mm_mul_ps(e2y, qy)), _mm_mul_ps(e2z, qz)), inv_det);
+
+	__m128 zero = _mm_setzero_ps();
+	__m128 abs_det = _mm_max_ps(det, _mm_sub_ps(zero, det));
+	__m128 mask = _mm_cmpgt_ps(abs_det, _mm_set1_ps(BVH_EPSILON));
+	mask = _mm_and_ps(mask, _mm_cmpge_ps(u, zero));
+	mask = _mm_and_ps(mask, _mm_cmpge_ps(v, zero));
+	mask = _mm_and_ps(mask, _mm_cmple_ps(_mm_add_ps(u, v), _mm_set1_ps(1.0f)));
+	mask = _mm_and_ps(mask, _mm_cmpge_ps(t, zero));
+	mask = _mm_and_ps(mask, _mm_cmplt_ps(t, _mm_set1_ps(max_t)));
+	int bits = _mm_movemask_ps(mask);
+	if (!bits)
+		return false;
+
+	float ts[4], us[4], vs[4];
+	_mm_storeu_ps(ts, t);
+	_mm_storeu_ps(us, u);
+	_mm_storeu_ps(vs, v);
+	bool found = false;
+	for (int i = 0; i < 4; ++i)
+	{
+		if (!(bits & (1 << i)) || packet_triangles[i] == -1 || ts[i] >= max_t)
+			continue;
+		max_t = ts[i];
+		hit.t = ts[i];
+		hit.u = us[i];
+		hit.v = vs[i];
+		hit.primitive = packet_triangles[i];
+		found = true;
+	}
+	if (found)
+	{
+		int i = 0;
+		while (packet_triangles[i] != hit.primitive)
+			++i;
+		hit.normal = cross(Vector3f(p[12 + i], p[16 + i], p[20 + i]), Vector3f(p[24 + i], p[28 + i], p[32 + i]));
+	}
+	return found;
+#else
+	bool found = false;
+	for (int i = 0; i < 4; ++i)
+	{
+		if (packet_triangles[i] == -1)
+			continue;
+		Vector3f v0(p[i], p[4 + i], p[8 + i]);
+		Vector3f e1(p[12 + i], p[16 + i], p[20 + i]);
+		Vector3f e2(p[24 + i], p[28 + i], p[32 + i]);
+		Vector3f pvec = cross(direction, e2);
+		float det = dot(e1, pvec);
+		if (fabs(det) <= BVH_EPSILON)
+			continue;
+		float inv_det = 1.0f / det;
+		Vector3f tvec = origin - v0;
+		float u = dot(tvec, pvec) * inv_det;
+		if (u < 0.0f || u > 1.0f)
+			continue;
+		Vector3f qvec = cross(tvec, e1);
+		float v = dot(direction, qvec) * inv_det;
+		if (v < 0.0f || u + v > 1.0f)
+			continue;
+		float t = dot(e2, qvec) * inv_det;
+		if (t < 0.0f || t >= max_t)
+			continue;
+		max_t = t;
+		hit.t = t;
+		hit.u = u;
+		hit.v = v;
+		hit.primitive = packet_triangles[i];
+		hit.normal = cross(e1, e2);
+		found = true;
+	}
+	return found;
+#endif
+}
+
+bool TriangleBVH::testRay(const Vector3f& origin, const Vector3f& direction, float max_t, sRayHit& hit) const
+{
+	bool found = false;
+	traverse(origin, direction, max_t, [&](int packet, float& t) {
+		if (intersectPacket(packet, origin, direction, t, hit))
+		{
+			t = hit.t;
+			found = true;
+		}
+		return false;
+	});
+	return found;
+}
+
+bool TriangleBVH::testOcclusion(const Vector3f& origin, const Vector3f& direction, float max_t) const
+{
+	bool found = false;
+	traverse(origin, direction, max_t, [&](int packet, float& t) {
+		sRayHit hit;
+		found = intersectPacket(packet, origin, direction, t, hit);
+		return found;
+	});
+	return found;
+}
+
+int TriangleBVH::testRays(int count, const Vector3f* origins, const Vector3f* directions, float max_t, sRayHit* hits) const
+{
+	int num_hits = 0;
+	for (int i = 0; i < count; ++i)
+	{
+		hits[i] = sRayHit();
+		if (testRay(origins[i], directions[i], max_t, hits[i]))
+			num_hits++;
+	}
+	return num_hits;
+}
+
+bool TriangleBVH::testSphere(const Vector3f& center, float radius, Vector3f& point, int& triangle) const
+{
+	if (nodes.empty())
+		return false;
+
+	float radius2 = radius * radius;
+#ifdef BVH_USE_SSE
+	__m128 cx = _mm_set1_ps(center.x), cy = _mm_set1_ps(center.y), cz = _mm_set1_ps(center.z);
+	__m128 zero = _mm_setzero_ps();
+#endif
+
+	int stack[BVH_WIDE_STACK_SIZE];
+	int stack_size = 0;
+	stack[stack_size++] = 0;
+	while (stack_size)
+	{
+		int child = stack[--stack_size];
+		if (child < 0)
+		{
+			int packet = ~child;
+			for (int i = 0; i < 4; ++i)
+			{
+				if (triangles[packet * 4 + i] == -1)
+					continue;
+				Vector3f v0, v1, v2;
+				getTriangle(triangles[packet * 4 + i], v0, v1, v2);
+				Vector3f closest = closestPointInTriangle(center, v0, v1, v2);
+				Vector3f d = closest - center;
+				if (dot(d, d) > radius2)
+					continue;
+				point = closest;
+				triangle = triangles[packet * 4 + i];
+				return true;
+			}
+			continue;
+		}
+
+		//distance from the center to the 4 boxes
+		const sWideNode& node = nodes[child];
+		int bits;
+#ifdef BVH_USE_SSE
+		__m128 dx = _mm_add_ps(_mm_max_ps(_mm_sub_ps(_mm_loadu_ps(node.min_x), cx), zero), _mm_max_ps(_mm_sub_ps(cx, _mm_loadu_ps(node.max_x)), zero));
+		__m128 dy = _mm_add_ps(_mm_max_ps(_mm_sub_ps(_mm_loadu_ps(node.min_y), cy), zero), _mm_max_ps(_mm_sub_ps(cy, _mm_loadu_ps(node.max_y)), zero));
+		__m128 dz = _mm_add_ps(_mm_max_ps(_mm_sub_ps(_mm_loadu_ps(node.min_z), cz), zero), _mm_max_ps(_mm_sub_ps(cz, _mm_loadu_ps(node.max_z)), zero));
+		__m128 dist2 = _mm_add_ps(_mm_add_ps(_mm_mul_ps(dx, dx), _mm_mul_ps(dy, dy)), _mm_mul_ps(dz, dz));
+		bits = _mm_movemask_ps(_mm_cmple_ps(dist2, _mm_set1_ps(radius2)));
+#else
+		bits = 0;
+		for (int i = 0; i < 4; ++i)
+		{
+			float dx = (std::max)(0.0f, node.min_x[i] - center.x) + (std::max)(0.0f, center.x - node.max_x[i]);
+			float dy = (std::max)(0.0f, node.min_y[i] - center.y) + (std::max)(0.0f, center.y - node.max_y[i]);
+			float dz = (std::max)(0.0f, node.min_z[i] - center.z) + (std::max)(0.0f, center.z - node.max_z[i]);
+			if (dx * dx + dy * dy + dz * dz <= radius2)
+				bits |= 1 << i;
+		}
+#endif
+		assert(stack_size + 4 <= BVH_WIDE_STACK_SIZE);
+		for (int i = 0; i < 4; ++i)
+			if ((bits & (1 << i)) && node.children[i] != BVH_WIDE_EMPTY)
+				stack[stack_size++] = node.children[i];
+	}
+	return false;
+}
@@ -0,0 +1,142 @@
+/*  Bounding volume hierarchies for ray tracing on the CPU
+	+ BVH: the tree alone, built with the surface area heuristic (binned) from the boxes of any kind of primitives
+	+ TriangleBVH: the triangles of a mesh in object space. The binary tree is collapsed into a tree of 4 children per node
+	  with the 4 boxes stored together (SoA), and the leaves have up to 4 triangles stored as one packet (SoA),
+	  so a ray is tested against 4 boxes or 4 triangles at once with SSE
+	The tests do not modify anything, so many threads can trace rays against the same tree.
+*/
+#pragma once
+
+#include <vector>
+#include <cfloat>
+#include <cassert>
+
+#include "../core/math.h"
+
+#define BVH_MAX_LEAF_SIZE 4
+#define BVH_MAX_DEPTH 64 //the build switches to median splits to stay below it, the traversal stacks are sized with it
+#define BVH_WIDE_EMPTY 0x7FFFFFFF //unused child of a wide node
+
+namespace GFX {
+
+	class Mesh;
+
+	struct sRayHit {
+		float t = FLT_MAX;
+		int primitive = -1; //triangle index for TriangleBVH
+		float u = 0, v = 0; //barycentrics of the hit inside the triangle
+		Vector3f normal; //of the triangle, not normalized
+	};
+
+	class BVH {
+	public:
+		//leaves have count > 0 and their primitives are indices[first..first+count), inner nodes have the children in first and first+1
+		struct sNode {
+			Vector3f min;
+			int first;
+			Vector3f max;
+			int count;
+		};
+
+		std::vector<sNode> nodes; //nodes[0] is the root
+		std::vector<int> indices;
+
+		void build(const std::vector<Vector3f>& mins, const std::vector<Vector3f>& maxs, int max_leaf_size = BVH_MAX_LEAF_SIZE);
+		void clear();
+		bool isEmpty() const { return nodes.empty(); }
+
+		//calls visit(first, count, float& max_t) for every leaf the ray reaches, front to back. visit can reduce max_t and returns true to stop
+		template<typename F> void traverse(const Vector3f& origin, const Vector3f& direction, float max_t, F visit) const;
+
+		//slab test, inv_direction is 1 / direction
+		static bool intersectBox(const Vector3f& min, const Vector3f& max, const Vector3f& origin, const Vector3f& inv_direction, float max_t, float& t_enter);
+	};
+
+	class TriangleBVH {
+	public:
+		struct sWideNode {
+			float min_x[4], min_y[4], min_z[4];
+			float max_x[4], max_y[4], max_z[4];
+			int children[4]; //>= 0 another wide node, < 0 a leaf with the packet ~child, BVH_WIDE_EMPTY when unused
+		};
+
+		std::vector<sWideNode> nodes; //nodes[0] is the root
+		std::vector<float> packets; //9 * 4 floats per leaf: v0.xyz, edge1.xyz, edge2.xyz of 4 triangles
+		std::vector<int> triangles; //4 per leaf, the index of every triangle of the packets (-1 for the padding)
+		Vector3f min, max;
+
+		void build(const std::vector<Vector3f>& vertices); //three vertices per triangle
+		void build(Mesh* mesh);
+		void clear();
+		bool isEmpty() const { return nodes.empty(); }
+		size_t getMemorySize() const; //bytes
+
+		//closest hit in [0, max_t]
+		bool testRay(const Vector3f& origin, const Vector3f& direction, float max_t, sRayHit& hit) const;
+		//any hit in [0, max_t], for shadows
+		bool testOcclusion(const Vector3f& origin, const Vector3f& direction, float max_t) const;
+		//closest hit of many rays, hits[i].primitive is -1 when ray i hits nothing. Returns how many hit something
+		int testRays(int count, const Vector3f* origins, const Vector3f* directions, float max_t, sRayHit* hits) const;
+		//a triangle that touches the sphere (not the closest one), point is the closest point of that triangle to the center
+		bool testSphere(const Vector3f& center, float radius, Vector3f& point, int& triangle) const;
+
+		//the three vertices of a triangle of the tree
+		void getTriangle(int triangle, Vector3f& v0, Vector3f& v1, Vector3f& v2) const;
+
+		//the triangles of the mesh (indexed, interleaved or not) in a list of three vertices per triangle
+		static void getTriangles(Mesh* mesh, std::vector<Vector3f>& vertices);
+
+	private:
+		std::vector<int> triangle_slots; //where every triangle is in the packets
+
+		template<typename F> void traverse(const Vector3f& origin, const Vector3f& direction, float max_t, F visit) const;
+		bool intersectPacket(int packet, const Vector3f& origin, const Vector3f& direction, float max_t, sRayHit& hit) const;
+	};
+
+	template<typename F> void BVH::traverse(const Vector3f& origin, const Vector3f& direction, float max_t, F visit) const
+	{
+		if (nodes.empty())
+			return;
+
+		Vector3f inv_direction(1.0f / direction.x, 1.0f / direction.y, 1.0f / direction.z);
+		float t_enter;
+		if (!intersectBox(nodes[0].min, nodes[0].max, origin, inv_direction, max_t, t_enter))
+			return;
+
+		int stack[BVH_MAX_DEPTH];
+		int stack_size = 0;
+		int current = 0;
+		while (true)
+		{
+			const sNode& node = nodes[current];
+			if (node.count)
+			{
+				if (visit(node.first, node.count, max_t))
+					return;
+			}
+			else
+			{
+				//the closest child first, the other one waits in the stack
+				float t_first, t_second;
+				bool hit_first = intersectBox(nodes[node.first].min, nodes[node.first].max, origin, inv_direction, max_t, t_first);
+				bool hit_second = intersectBox(nodes[node.first + 1].min, nodes[node.first + 1].max, origin, inv_direction, max_t, t_second);
+				if (hit_first && hit_second)
+				{
+					bool swap = t_second < t_first;
+					assert(stack_size < BVH_MAX_DEPTH);
+					stack[stack_size++] = swap ? node.first : node.first + 1;
+					current = swap ? node.first + 1 : node.first;
+					continue;
+				}
+				if (hit_first || hit_second)
+				{
+					current = hit_first ? node.first : node.first + 1;
+					continue;
+				}
+			}
+			if (!stack_size)
+				return;
+			current = stack[--stack_size];
+		}
+	}
+};
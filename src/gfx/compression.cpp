@@ -0,0 +1,574 @@
+#include "compression.h"
+
+#include <cmath>
+#include <cstring>
+#include <cfloat>
+#include <cstdio>
+#include <algorithm>
+
+#include "texture.h"
+#include "../core/task.h"
+
+#if defined(__SSE__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 1)
+	#define BC_USE_SSE
+	#include <xmmintrin.h>
+#endif
+
+#define BC_PCA_ITERATIONS 8
+#define BC_REFINE_ITERATIONS 2 //least squares passes with the HIGH preset
+
+//the 16 pixels of a block by channel, so four pixels can be processed at once
+struct sBlock {
+	float c[4][16];
+};
+
+static const float bc7_weights[16] = { 0, 4, 9, 13, 17, 21, 26, 30, 34, 38, 43, 47, 51, 55, 60, 64 };
+
+static void loadBlock(const uint8_t* pixels, sBlock& block)
+{
+	for (int i = 0; i < 16; ++i)
+		for (int k = 0; k < 4; ++k)
+			block.c[k][i] = pixels[i * 4 + k];
+}
+
+//index of the closest palette entry of every pixel, returns the total squared error
+static float findClosest(const sBlock& block, int num_channels, const float (*palette)[4], int palette_size, uint8_t* indices)
+{
+	float total = 0;
+#ifdef BC_USE_SSE
+	for (int p = 0; p < 16; p += 4)
+	{
+		__m128 ch[4];
+		for (int k = 0; k < num_channels; ++k)
+			ch[k] = _mm_loadu_ps(&block.c[k][p]);
+
+		__m128 best = _mm_set1_ps(FLT_MAX);
+		__m128 best_index = _mm_setzero_ps();
+		for (int e = 0; e < palette_size; ++e)
+		{
+			__m128 err = _mm_setzero_ps();
+			for (int k = 0; k < num_channels; ++k)
+			{
+				__m128 d = _mm_sub_ps(ch[k], _mm_set1_ps(palette[e][k]));
+				err = _mm_add_ps(err, _mm_mul_ps(d, d));
+			}
+			__m128 mask = _mm_cmplt_ps(err, best);
+			best = _mm_min_ps(err, best);
+			best_index = _mm_or_ps(_mm_and_ps(mask, _mm_set1_ps((float)e)), _mm_andnot_ps(mask, best_index));
+		}
+
+		float index[4], error[4];
+		_mm_storeu_ps(index, best_index);
+		_mm_storeu_ps(error, best);
+		for (int j = 0; j < 4; ++j)
+		{
+			indices[p + j] = (uint8_t)index[j];
+			total += error[j];
+		}
+	}
+#else
+	for (int p = 0; p < 16; ++p)
+	{
+		float best = FLT_MAX;
+		for (int e = 0; e < palette_size; ++e)
+		{
+			float err = 0;
+			for (int k = 0; k < num_channels; ++k)
+			{
+				float d = block.c[k][p] - palette[e][k];
+				err += d * d;
+			}
+			if (err < best)
+			{
+				best = err;
+				indices[p] = (uint8_t)e;
+			}
+		}
+		total += best;
+	}
+#endif
+	return total;
+}
+
+//endpoints at both ends of the main direction of the colors (the diagonal of the bounding box when fast)
+static void computeEndpoints(const sBlock& block, int num_channels, bool fast, float* e0, float* e1)
+{
+	float mean[4] = { 0,0,0,0 };
+	float min[4], max[4];
+	for (int k = 0; k < num_channels; ++k)
+	{
+		min[k] = max[k] = block.c[k][0];
+		for (int i = 0; i < 16; ++i)
+		{
+			mean[k] += block.c[k][i];
+			min[k] = (std::min)(min[k], block.c[k][i]);
+			max[k] = (std::max)(max[k], block.c[k][i]);
+		}
+		mean[k] /= 16.0f;
+	}
+
+	float cov[4][4] = {};
+	for (int i = 0; i < 16; ++i)
+		for (int a = 0; a < num_channels; ++a)
+			for (int b = a; b < num_channels; ++b)
+				cov[a][b] += (block.c[a][i] - mean[a]) * (block.c[b][i] - mean[b]);
+	for (int a = 0; a < num_channels; ++a)
+		for (int b = 0; b < a; ++b)
+			cov[a][b] = cov[b][a];
+
+	float axis[4];
+	for (int k = 0; k < num_channels; ++k)
+		axis[k] = max[k] - min[k];
+
+	if (fast)
+	{
+		//the sign of the covariance with the first channel tells which diagonal
+		for (int k = 1; k < num_channels; ++k)
+			if (cov[0][k] < 0)
+				axis[k] = -axis[k];
+	}
+	else
+	{
+		for (int it = 0; it < BC_PCA_ITERATIONS; ++it)
+		{
+			float next[4];
+			float len = 0;
+			for (int a = 0; a < num_channels; ++a)
+			{
+				next[a] = 0;
+				for (int b = 0; b < num_channels; ++b)
+					next[a] += cov[a][b] * axis[b];
+				len = (std::max)(len, fabsf(next[a]));
+			}
+			if (len == 0)
+				break;
+			for (int a = 0; a < num_channels; ++a)
+				axis[a] = next[a] / len;
+		}
+	}
+
+	float len = 0;
+	for (int k = 0; k < num_channels; ++k)
+		len += axis[k] * axis[k];
+	if (len < 1e-6f)
+	{
+		for (int k = 0; k < num_channels; ++k)
+			e0[k] = e1[k] = mean[k];
+		return;
+	}
+	len = sqrtf(len);
+	for (int k = 0; k < num_channels; ++k)
+		axis[k] /= len;
+
+	float tmin = FLT_MAX, tmax = -FLT_MAX;
+	for (int i = 0; i < 16; ++i)
+	{
+		float t = 0;
+		for (int k = 0; k < num_channels; ++k)
+			t += (block.c[k][i] - mean[k]) * axis[k];
+		tmin = (std::min)(tmin, t);
+		tmax = (std::max)(tmax, t);
+	}
+
+	for (int k = 0; k < num_channels; ++k)
+	{
+		e0[k] = (std::min)(255.0f, (std::max)(0.0f, mean[k] + axis[k] * tmin));
+		e1[k] = (std::min)(255.0f, (std::max)(0.0f, mean[k] + axis[k] * tmax));
+	}
+}
+
+//least squares endpoints for the current indices, weights[i] is how much of e1 the index i takes
+static bool refineEndpoints(const sBlock& block, int num_channels, const uint8_t* indices, const float* weights, float* e0, float* e1)
+{
+	float A = 0, B = 0, C = 0;
+	float X0[4] = {}, X1[4] = {};
+	for (int i = 0; i < 16; ++i)
+	{
+		float w = weights[indices[i]];
+		float a = 1.0f - w;
+		A += a * a;
+		B += w * w;
+		C += a * w;
+		for (int k = 0; k < num_channels; ++k)
+		{
+			X0[k] += a * block.c[k][i];
+			X1[k] += w * block.c[k][i];
+		}
+	}
+
+	float det = A * B - C * C;
+	if (fabsf(det) < 1e-6f)
+		return false;
+
+	for (int k = 0; k < num_channels; ++k)
+	{
+		e0[k] = (std::min)(255.0f, (std::max)(0.0f, (B * X0[k] - C * X1[k]) / det));
+		e1[k] = (std::min)(255.0f, (std::max)(0.0f, (A * X1[k] - C * X0[k]) / det));
+	}
+	return true;
+}
+
+// BC1 ******************************************
+
+static uint16_t quantize565(const float* color)
+{
+	int r = (int)(color[0] * 31.0f / 255.0f + 0.5f);
+	int g = (int)(color[1] * 63.0f / 255.0f + 0.5f);
+	int b = (int)(color[2] * 31.0f / 255.0f + 0.5f);
+	return (uint16_t)((r << 11) | (g << 5) | b);
+}
+
+static void expand565(uint16_t c, float* color)
+{
+	int r = (c >> 11) & 31, g = (c >> 5) & 63, b = c & 31;
+	color[0] = (float)((r << 3) | (r >> 2));
+	color[1] = (float)((g << 2) | (g >> 4));
+	color[2] = (float)((b << 3) | (b >> 2));
+	color[3] = 255;
+}
+
+//always in 4 colors mode (c0 > c1), so the same block is valid inside BC3
+static float encodeBC1(const sBlock& block, const float* e0, const float* e1, uint16_t& c0, uint16_t& c1, uint8_t* indices)
+{
+	c0 = quantize565(e0);
+	c1 = quantize565(e1);
+	if (c0 < c1)
+		std::swap(c0, c1);
+
+	float palette[4][4];
+	expand565(c0, palette[0]);
+	expand565(c1, palette[1]);
+	for (int k = 0; k < 3; ++k)
+	{
+		palette[2][k] = (2 * palette[0][k] + palette[1][k]) / 3.0f;
+		palette[3][k] = (palette[0][k] + 2 * palette[1][k]) / 3.0f;
+	}
+
+	if (c0 == c1)
+	{
+		memset(indices, 0, 16);
+		return findClosest(block, 3, palette, 1, indices);
+	}
+	return findClosest(block, 3, palette, 4, indices);
+}
+
+void GFX::BlockCompressor::compressBlockBC1(const uint8_t* pixels, uint8_t* dst, eQuality quality)
+{
+	static const float weights[4] = { 0.0f, 1.0f, 1.0f / 3.0f, 2.0f / 3.0f };
+
+	sBlock block;
+	loadBlock(pixels, block);
+
+	float e0[4], e1[4];
+	computeEndpoints(block, 3, quality == FAST, e0, e1);
+
+	uint16_t c0, c1;
+	uint8_t indices[16];
+	float error = encodeBC1(block, e1, e0, c0, c1, indices);
+
+	for (int it = 0; quality == HIGH && it < BC_REFINE_ITERATIONS && c0 != c1; ++it)
+	{
+		float r0[4], r1[4];
+		if (!refineEndpoints(block, 3, indices, weights, r0, r1))
+			break;
+		uint16_t n0, n1;
+		uint8_t new_indices[16];
+		float new_error = encodeBC1(block, r0, r1, n0, n1, new_indices);
+		if (new_error >= error)
+			break;
+		error = new_error;
+		c0 = n0;
+		c1 = n1;
+		memcpy(indices, new_indices, 16);
+	}
+
+	uint32_t bits = 0;
+	for (int i = 0; i < 16; ++i)
+		bits |= (uint32_t)indices[i] << (i * 2);
+	dst[0] = c0 & 0xFF; dst[1] = c0 >> 8;
+	dst[2] = c1 & 0xFF; dst[3] = c1 >> 8;
+	for (int i = 0; i < 4; ++i)
+		dst[4 + i] = (bits >> (i * 8)) & 0xFF;
+}
+
+// BC4 ******************************************
+
+static float encodeBC4(const sBlock& block, int a0, int a1, uint8_t* indices)
+{
+	float palette[8][4];
+	palette[0][0] = (float)a0;
+	palette[1][0] = (float)a1;
+	for (int i = 2; i < 8; ++i)
+		palette[i][0] = ((8 - i) * a0 + (i - 1) * a1) / 7.0f;
+	if (a0 == a1)
+	{
+		memset(indices, 0, 16);
+		return findClosest(block, 1, palette, 1, indices);
+	}
+	return findClosest(block, 1, palette, 8, indices);
+}
+
+void GFX::BlockCompressor::compressBlockBC4(const uint8_t* pixels, int channel, uint8_t* dst, eQuality quality)
+{
+	sBlock block;
+	int min = 255, max = 0;
+	for (int i = 0; i < 16; ++i)
+	{
+		int v = pixels[i * 4 + channel];
+		block.c[0][i] = (float)v;
+		min = (std::min)(min, v);
+		max = (std::max)(max, v);
+	}
+
+	//a0 > a1 selects the 8 values mode
+	int a0 = max, a1 = min;
+	uint8_t indices[16];
+	float error = encodeBC4(block, a0, a1, indices);
+
+	//moving the endpoints inwards can reduce the error of the pixels in the middle
+	int inset = quality == HIGH ? 3 : (quality == NORMAL ? 1 : 0);
+	for (int d0 = 0; d0 <= inset; ++d0)
+		for (int d1 = 0; d1 <= inset; ++d1)
+		{
+			int n0 = max - d0, n1 = min + d1;
+			if ((d0 == 0 && d1 == 0) || n0 <= n1)
+				continue;
+			uint8_t new_indices[16];
+			float new_error = encodeBC4(block, n0, n1, new_indices);
+			if (new_error < error)
+			{
+				error = new_error;
+				a0 = n0;
+				a1 = n1;
+				memcpy(indices, new_indices, 16);
+			}
+		}
+
+	uint64_t bits = 0;
+	for (int i = 0; i < 16; ++i)
+		bits |= (uint64_t)indices[i] << (i * 3);
+	dst[0] = (uint8_t)a0;
+	dst[1] = (uint8_t)a1;
+	for (int i = 0; i < 6; ++i)
+		dst[2 + i] = (bits >> (i * 8)) & 0xFF;
+}
+
+// BC7 (mode 6) *********************************
+
+//7 bits per channel plus a shared bit, picks the bit with less error
+static void quantizeBC7(const float* color, int* q, int& pbit)
+{
+	float best = FLT_MAX;
+	for (int p = 0; p < 2; ++p)
+	{
+		int values[4];
+		float error = 0;
+		for (int k = 0; k < 4; ++k)
+		{
+			values[k] = (std::min)(127, (std::max)(0, (int)((color[k] - p) * 0.5f + 0.5f)));
+			float d = (values[k] * 2 + p) - color[k];
+			error += d * d;
+		}
+		if (error < best)
+		{
+			best = error;
+			pbit = p;
+			memcpy(q, values, sizeof(values));
+		}
+	}
+}
+
+static float encodeBC7(const sBlock& block, const float* e0, const float* e1, int* q0, int* q1, int& p0, int& p1, uint8_t* indices)
+{
+	quantizeBC7(e0, q0, p0);
+	quantizeBC7(e1, q1, p1);
+
+	float palette[16][4];
+	for (int i = 0; i < 16; ++i)
+		for (int k = 0; k < 4; ++k)
+		{
+			int a = q0[k] * 2 + p0;
+			int b = q1[k] * 2 + p1;
+			palette[i][k] = (float)(((64 - (int)bc7_weights[i]) * a + (int)bc7_weights[i] * b + 32) >> 6);
+		}
+	return findClosest(block, 4, palette, 16, indices);
+}
+
+struct sBitWriter {
+	uint8_t* data;
+	int pos;
+	void write(uint32_t value, int bits) {
+		for (int i = 0; i < bits; ++i, ++pos)
+			data[pos >> 3] |= ((value >> i) & 1) << (pos & 7);
+	}
+};
+
+void GFX::BlockCompressor::compressBlockBC7(const uint8_t* pixels, uint8_t* dst, eQuality quality)
+{
+	float weights[16];
+	for (int i = 0; i < 16; ++i)
+		weights[i] = bc7_weights[i] / 64.0f;
+
+	sBlock block;
+	loadBlock(pixels, block);
+
+	float e0[4], e1[4];
+	computeEndpoints(block, 4, quality == FAST, e0, e1);
+
+	int q0[4], q1[4], p0, p1;
+	uint8_t indices[16];
+	float error = encodeBC7(block, e0, e1, q0, q1, p0, p1, indices);
+
+	for (int it = 0; quality == HIGH && it < BC_REFINE_ITERATIONS; ++it)
+	{
+		float r0[4], r1[4];
+		if (!refineEndpoints(block, 4, indices, weights, r0, r1))
+			break;
+		int n0[4], n1[4], np0, np1;
+		uint8_t new_indices[16];
+		float new_error = encodeBC7(block, r0, r1, n0, n1, np0, np1, new_indices);
+		if (new_error >= error)
+			break;
+		error = new_error;
+		memcpy(q0, n0, sizeof(q0)); memcpy(q1, n1, sizeof(q1));
+		p0 = np0; p1 = np1;
+		memcpy(indices, new_indices, 16);
+	}
+
+	//the first index is stored with 3 bits, its top bit must be 0
+	if (indices[0] & 8)
+	{
+		for (int k = 0; k < 4; ++k)
+			std::swap(q0[k], q1[k]);
+		std::swap(p0, p1);
+		for (int i = 0; i < 16; ++i)
+			indices[i] = 15 - indices[i];
+	}
+
+	memset(dst, 0, 16);
+	sBitWriter writer = { dst, 0 };
+	writer.write(1 << 6, 7); //mode 6
+	for (int k = 0; k < 4; ++k)
+	{
+		writer.write(q0[k], 7);
+		writer.write(q1[k], 7);
+	}
+	writer.write(p0, 1);
+	writer.write(p1, 1);
+	writer.write(indices[0], 3);
+	for (int i = 1; i < 16; ++i)
+		writer.write(indices[i], 4);
+}
+
+// IMAGES ***************************************
+
+const char* GFX::BlockCompressor::getFormatName(eFormat format)
+{
+	static const char* names[] = { "BC1", "BC3", "BC4", "BC5", "BC7" };
+	return names[format];
+}
+
+int GFX::BlockCompressor::getBlockSize(eFormat format)
+{
+	return (format == BC1 || format == BC4) ? 8 : 16;
+}
+
+void GFX::BlockCompressor::compressImage(const Image* image, eFormat format, eQuality quality, std::vector<uint8_t>& output)
+{
+	int blocks_x = (image->width + 3) / 4;
+	int blocks_y = (image->height + 3) / 4;
+	int block_size = getBlockSize(format);
+	output.resize((size_t)blocks_x * blocks_y * block_size);
+
+	TaskManager::background.parallelFor(blocks_y, [&](size_t by) {
+		uint8_t pixels[64];
+		for (int bx = 0; bx < blocks_x; ++bx)
+		{
+			//RGBA, repeating the last row/column when the size is not multiple of 4
+			for (int i = 0; i < 16; ++i)
+			{
+				unsigned int x = (std::min)(bx * 4 + (i & 3), (int)image->width - 1);
+				unsigned int y = (std::min)((int)by * 4 + (i >> 2), (int)image->height - 1);
+				const uint8_t* src = image->data + (y * image->width + x) * image->num_channels;
+				for (int k = 0; k < 4; ++k)
+					pixels[i * 4 + k] = k < (int)image->num_channels ? src[k] : 255;
+			}
+
+			uint8_t* dst = &output[(by * blocks_x + bx) * block_size];
+			switch (format)
+			{
+			case BC1: compressBlockBC1(pixels, dst, quality); break;
+			case BC3: compressBlockBC4(pixels, 3, dst, quality); compressBlockBC1(pixels, dst + 8, quality); break;
+			case BC4: compressBlockBC4(pixels, 0, dst, quality); break;
+			case BC5: compressBlockBC4(pixels, 0, dst, quality); compressBlockBC4(pixels, 1, dst + 8, quality); break;
+			case BC7: compressBlockBC7(pixels, dst, quality); break;
+			}
+		}
+	});
+}
+
+GFX::BlockCompressor::eFormat GFX::BlockCompressor::chooseFormat(const Image* image, bool is_normal_map, eQuality quality)
+{
+	if (is_normal_map)
+		return BC5;
+	//the scan below needs RGB, one or two channels already fit the single and dual channel formats
+	if (image->num_channels == 1)
+		return BC4;
+	if (image->num_channels == 2)
+		return BC5;
+
+	bool grayscale = true;
+	bool alpha = false;
+	size_t num_pixels = (size_t)image->width * image->height;
+	for (size_t i = 0; i < num_pixels && (grayscale || !alpha); ++i)
+	{
+		const uint8_t* p = image->data + i * image->num_channels;
+		if (p[0] != p[1] || p[0] != p[2])
+			grayscale = false;
+		if (image->num_channels == 4 && p[3] != 255)
+			alpha = true;
+	}
+
+	if (grayscale && !alpha)
+		return BC4;
+	if (alpha)
+		return quality == FAST ? BC3 : BC7;
+	return quality == FAST ? BC1 : BC7;
+}
+
+bool GFX::BlockCompressor::saveKTX(const char* filename, const std::vector<Image*>& levels, eFormat format, eQuality quality)
+{
+	//the same enums Texture::loadKTX uploads, BC1 has no alpha
+	static const uint32_t internal_formats[] = { GL_COMPRESSED_RGB_S3TC_DXT1_EXT, GL_COMPRESSED_RGBA_S3TC_DXT5_EXT, GL_COMPRESSED_RED_RGTC1, GL_COMPRESSED_RG_RGTC2, GL_COMPRESSED_RGBA_BPTC_UNORM };
+	static const uint32_t base_formats[] = { GL_RGB, GL_RGBA, GL_RED, GL_RG, GL_RGBA };
+	static const uint8_t identifier[12] = { 0xAB, 'K', 'T', 'X', ' ', '1', '1', 0xBB, '\r', '\n', 0x1A, '\n' };
+
+	assert(levels.size() && "no image to save");
+
+	FILE* file = fopen(filename, "wb");
+	if (!file)
+		return false;
+
+	uint32_t header[13] = {
+		0x04030201, //endianness
+		0, 1, 0, //type, type size, format: compressed
+		internal_formats[format], base_formats[format],
+		levels[0]->width, levels[0]->height, 0,
+		0, 1, (uint32_t)levels.size(), //array elements, faces, mips
+		0 //key value data
+	};
+	fwrite(identifier, 1, sizeof(identifier), file);
+	fwrite(header, sizeof(uint32_t), 13, file);
+
+	std::vector<uint8_t> data;
+	for (Image* level : levels)
+	{
+		compressImage(level, format, quality, data);
+		uint32_t size = (uint32_t)data.size(); //blocks are 8 or 16 bytes, always 4 aligned
+		fwrite(&size, sizeof(size), 1, file);
+		fwrite(&data[0], 1, data.size(), file);
+	}
+
+	fclose(file);
+	return true;
+}
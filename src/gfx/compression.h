@@ -0,0 +1,54 @@
+/*  Block compression (BCn) encoder
+	Used by the GTR_Cooker to store the textures already compressed, so the GPU reads 4 to 8 times less memory:
+	 + BC1: RGB, 4bpp. Opaque albedo with the FAST preset
+	 + BC3: RGBA, 8bpp (BC4 alpha + BC1 color). Albedo with alpha with the FAST preset
+	 + BC4: one channel, 4bpp. Grayscale maps (roughness, occlusion), expanded to RRR1 when loading
+	 + BC5: two channels, 8bpp. Normal maps (XY), the shaders rebuild Z
+	 + BC7: RGBA, 8bpp. Only mode 6 (one subset, 7777+pbit endpoints, 4 bits indices), albedo by default
+	The closest palette entry of every pixel is searched with SSE (4 pixels at a time) and the blocks are
+	split between the threads of the TaskManager. The results are stored as KTX files that Texture::loadKTX uploads directly.
+*/
+#pragma once
+
+#include <vector>
+#include <string>
+#include <cstdint>
+
+class Image;
+
+namespace GFX {
+
+	class BlockCompressor {
+	public:
+		enum eFormat {
+			BC1,
+			BC3,
+			BC4,
+			BC5,
+			BC7
+		};
+
+		enum eQuality {
+			FAST,	//bounding box endpoints
+			NORMAL,	//principal axis endpoints
+			HIGH	//principal axis + least squares refinement
+		};
+
+		static const char* getFormatName(eFormat format);
+		static int getBlockSize(eFormat format); //bytes per 4x4 block
+
+		//compresses every 4x4 block of the image (sizes that are not multiple of 4 are padded repeating the border)
+		static void compressImage(const Image* image, eFormat format, eQuality quality, std::vector<uint8_t>& output);
+
+		//levels[0] is the full resolution, the rest are its mips
+		static bool saveKTX(const char* filename, const std::vector<Image*>& levels, eFormat format, eQuality quality);
+
+		//the format the cooker uses for an image
+		static eFormat chooseFormat(const Image* image, bool is_normal_map, eQuality quality);
+
+		//the blocks alone, pixels are RGBA (64 bytes)
+		static void compressBlockBC1(const uint8_t* pixels, uint8_t* dst, eQuality quality);
+		static void compressBlockBC4(const uint8_t* pixels, int channel, uint8_t* dst, eQuality quality);
+		static void compressBlockBC7(const uint8_t* pixels, uint8_t* dst, eQuality quality);
+	};
+};
@@ -0,0 +1,551 @@
+#include "ibl.h"
+
+#include <cmath>
+#include <cstring>
+#include <iostream>
+#include <filesystem>
+#include <algorithm>
+
+#include "texture.h"
+#ifndef SKIP_GL
+	#include "gfx.h"
+	#include "shader.h"
+#endif
+#include "../extra/hdre.h"
+#include "../core/task.h"
+#include "../utils/utils.h"
+
+#if defined(__SSE__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 1)
+	#define IBL_USE_SSE
+	#include <xmmintrin.h>
+#endif
+
+#ifndef GL_RG16F
+	#define GL_RG16F 0x822F
+#endif
+
+std::map<std::string, GFX::IBL*> GFX::IBL::s_loaded;
+GFX::Texture* GFX::IBL::brdf_lut = NULL;
+
+namespace {
+
+	struct sIBLHeader {
+		char signature[4];
+		int version;
+		uint64_t hash;
+		int size;
+		int num_levels; //0 for the BRDF LUT
+		float sh[27];
+	};
+
+#ifdef IBL_USE_SSE
+	typedef __m128 tTexel;
+	inline tTexel loadTexel(const float* p) { return _mm_loadu_ps(p); }
+	inline tTexel splat(float v) { return _mm_set1_ps(v); }
+	inline tTexel add(tTexel a, tTexel b) { return _mm_add_ps(a, b); }
+	inline tTexel mul(tTexel a, tTexel b) { return _mm_mul_ps(a, b); }
+	inline void storeTexel(float* p, tTexel a) { _mm_storeu_ps(p, a); }
+#else
+	struct tTexel { float v[4]; };
+	inline tTexel loadTexel(const float* p) { tTexel t; memcpy(t.v, p, sizeof(t.v)); return t; }
+	inline tTexel splat(float v) { return { { v, v, v, v } }; }
+	inline tTexel add(tTexel a, tTexel b) { for (int i = 0; i < 4; ++i) a.v[i] += b.v[i]; return a; }
+	inline tTexel mul(tTexel a, tTexel b) { for (int i = 0; i < 4; ++i) a.v[i] *= b.v[i]; return a; }
+	inline void storeTexel(float* p, tTexel a) { memcpy(p, a.v, sizeof(a.v)); }
+#endif
+
+	//one level of a cubemap, RGBA floats so a texel is one SSE register
+	struct sCubeLevel {
+		int size = 0;
+		std::vector<float> faces[6];
+	};
+
+	//a direction of the GGX lobe around (0,0,1), the mip of the source depends on its pdf
+	struct sSample {
+		float x, y, z;
+		float weight;
+		float lod;
+	};
+
+	//direction of the center of a texel, same convention as cubemapFaceNormals
+	inline Vector3f getTexelDirection(int face, int x, int y, int size)
+	{
+		float u = 2.0f * (x + 0.5f) / size - 1.0f;
+		float v = 2.0f * (y + 0.5f) / size - 1.0f;
+		return normalize(cubemapFaceNormals[face][0] * u + cubemapFaceNormals[face][1] * v + cubemapFaceNormals[face][2]);
+	}
+
+	//the inverse, s and t in [0..1]
+	inline int selectFace(const Vector3f& dir, float& s, float& t)
+	{
+		float ax = fabsf(dir.x), ay = fabsf(dir.y), az = fabsf(dir.z);
+		float ma, sc, tc;
+		int face;
+		if (ax >= ay && ax >= az) {
+			face = dir.x > 0 ? 0 : 1; ma = ax; sc = dir.x > 0 ? -dir.z : dir.z; tc = -dir.y;
+		}
+		else if (ay >= az) {
+			face = dir.y > 0 ? 2 : 3; ma = ay; sc = dir.x; tc = dir.y > 0 ? dir.z : -dir.z;
+		}
+		else {
+			face = dir.z > 0 ? 4 : 5; ma = az; sc = dir.z > 0 ? dir.x : -dir.x; tc = -dir.y;
+		}
+		s = (sc / ma + 1.0f) * 0.5f;
+		t = (tc / ma + 1.0f) * 0.5f;
+		return face;
+	}
+
+	//bilinear inside the face, the borders are clamped
+	inline tTexel sampleFace(const sCubeLevel& level, int face, float s, float t)
+	{
+		int size = level.size;
+		float x = s * size - 0.5f, y = t * size - 0.5f;
+		int x0 = (int)floorf(x), y0 = (int)floorf(y);
+		float fx = x - x0, fy = y - y0;
+		int x1 = (std::min)(x0 + 1, size - 1), y1 = (std::min)(y0 + 1, size - 1);
+		x0 = (std::max)(x0, 0); y0 = (std::max)(y0, 0);
+		x1 = (std::max)(x1, 0); y1 = (std::max)(y1, 0);
+		const float* pixels = &level.faces[face][0];
+		tTexel top = add(mul(loadTexel(pixels + (y0 * size + x0) * 4), splat(1.0f - fx)), mul(loadTexel(pixels + (y0 * size + x1) * 4), splat(fx)));
+		tTexel bottom = add(mul(loadTexel(pixels + (y1 * size + x0) * 4), splat(1.0f - fx)), mul(loadTexel(pixels + (y1 * size + x1) * 4), splat(fx)));
+		return add(mul(top, splat(1.0f - fy)), mul(bottom, splat(fy)));
+	}
+
+	//trilinear
+	inline tTexel sampleCube(const std::vector<sCubeLevel>& chain, const Vector3f& dir, float lod)
+	{
+		float s, t;
+		int face = selectFace(dir, s, t);
+		lod = clamp(lod, 0.0f, (float)(chain.size() - 1));
+		int level = (int)lod;
+		float f = lod - level;
+		tTexel result = sampleFace(chain[level], face, s, t);
+		if (f > 0.0f && level + 1 < (int)chain.size())
+			result = add(mul(result, splat(1.0f - f)), mul(sampleFace(chain[level + 1], face, s, t), splat(f)));
+		return result;
+	}
+
+	void downsampleCube(const sCubeLevel& src, sCubeLevel& dst)
+	{
+		dst.size = (std::max)(1, src.size / 2);
+		for (int face = 0; face < 6; ++face)
+		{
+			dst.faces[face].resize((size_t)dst.size * dst.size * 4);
+			const float* in = &src.faces[face][0];
+			float* out = &dst.faces[face][0];
+			for (int y = 0; y < dst.size; ++y)
+				for (int x = 0; x < dst.size; ++x)
+				{
+					int sx = (std::min)(x * 2, src.size - 1), sy = (std::min)(y * 2, src.size - 1);
+					int sx1 = (std::min)(sx + 1, src.size - 1), sy1 = (std::min)(sy + 1, src.size - 1);
+					tTexel sum = add(add(loadTexel(in + (sy * src.size + sx) * 4), loadTexel(in + (sy * src.size + sx1) * 4)),
+						add(loadTexel(in + (sy1 * src.size + sx) * 4), loadTexel(in + (sy1 * src.size + sx1) * 4)));
+					storeTexel(out + (y * dst.size + x) * 4, mul(sum, splat(0.25f)));
+				}
+		}
+	}
+
+	inline float radicalInverse(uint32_t bits)
+	{
+		bits = (bits << 16u) | (bits >> 16u);
+		bits = ((bits & 0x55555555u) << 1u) | ((bits & 0xAAAAAAAAu) >> 1u);
+		bits = ((bits & 0x33333333u) << 2u) | ((bits & 0xCCCCCCCCu) >> 2u);
+		bits = ((bits & 0x0F0F0F0Fu) << 4u) | ((bits & 0xF0F0F0F0u) >> 4u);
+		bits = ((bits & 0x00FF00FFu) << 8u) | ((bits & 0xFF00FF00u) >> 8u);
+		return bits * 2.3283064365386963e-10f;
+	}
+
+	//half vector around (0,0,1) for the sample i of a Hammersley sequence, alpha is roughness^2 like in the shaders
+	inline Vector3f importanceSampleGGX(int i, int num_samples, float alpha)
+	{
+		float u = (float)i / num_samples, v = radicalInverse(i);
+		float phi = 2.0f * (float)PI * u;
+		float cos_theta = sqrtf((1.0f - v) / (1.0f + (alpha * alpha - 1.0f) * v));
+		float sin_theta = sqrtf(1.0f - cos_theta * cos_theta);
+		return Vector3f(sin_theta * cosf(phi), sin_theta * sinf(phi), cos_theta);
+	}
+
+	//filtered importance sampling: every sample reads the mip whose texels cover its solid angle, so few samples are enough
+	std::vector<sSample> createSamples(float roughness, int source_size, int dest_size, int num_samples)
+	{
+		std::vector<sSample> samples;
+		if (roughness == 0.0f)
+		{
+			samples.push_back({ 0.0f, 0.0f, 1.0f, 1.0f, log2f((float)source_size / dest_size) });
+			return samples;
+		}
+
+		float alpha = roughness * roughness;
+		float texel_solid_angle = 4.0f * (float)PI / (6.0f * source_size * source_size);
+		for (int i = 0; i < num_samples; ++i)
+		{
+			Vector3f H = importanceSampleGGX(i, num_samples, alpha);
+			//N = V = (0,0,1)
+			Vector3f L(2.0f * H.z * H.x, 2.0f * H.z * H.y, 2.0f * H.z * H.z - 1.0f);
+			if (L.z <= 0.0f)
+				continue;
+			float d = H.z * H.z * (alpha * alpha - 1.0f) + 1.0f;
+			float D = alpha * alpha / ((float)PI * d * d);
+			float pdf = D * 0.25f; //D * NdotH / (4 * VdotH)
+			float sample_solid_angle = 1.0f / (num_samples * pdf + 0.0001f);
+			float lod = (std::max)(0.0f, 0.5f * log2f(sample_solid_angle / texel_solid_angle) + 1.0f);
+			samples.push_back({ L.x, L.y, L.z, L.z, lod });
+		}
+		return samples;
+	}
+
+	void prefilterLevel(const std::vector<sCubeLevel>& chain, const std::vector<sSample>& samples, int size, std::vector<float>* faces)
+	{
+		float total_weight = 0;
+		for (const sSample& sample : samples)
+			total_weight += sample.weight;
+		tTexel normalization = splat(1.0f / total_weight);
+
+		for (int face = 0; face < 6; ++face)
+			faces[face].resize((size_t)size * size * 3);
+
+		TaskManager::background.parallelFor((size_t)size * 6, [&](size_t row) {
+			int face = (int)(row / size), y = (int)(row % size);
+			float* out = &faces[face][(size_t)y * size * 3];
+			for (int x = 0; x < size; ++x)
+			{
+				Vector3f N = getTexelDirection(face, x, y, size);
+				Vector3f up = fabsf(N.z) < 0.999f ? Vector3f(0, 0, 1) : Vector3f(1, 0, 0);
+				Vector3f T = normalize(cross(up, N));
+				Vector3f B = cross(N, T);
+
+				tTexel acc = splat(0.0f);
+				for (const sSample& sample : samples)
+				{
+					Vector3f L = T * sample.x + B * sample.y + N * sample.z;
+					acc = add(acc, mul(sampleCube(chain, L, sample.lod), splat(sample.weight)));
+				}
+
+				float color[4];
+				storeTexel(color, mul(acc, normalization));
+				memcpy(out + x * 3, color, sizeof(float) * 3);
+			}
+		}, 4);
+	}
+
+	bool writeCache(const char* filename, const sIBLHeader& header, const std::vector<const std::vector<float>*>& blocks)
+	{
+		std::error_code err;
+		std::filesystem::create_directories(std::filesystem::path(filename).parent_path(), err);
+		FILE* file = fopen(filename, "wb");
+		if (file == NULL)
+			return false;
+		fwrite(&header, 1, sizeof(header), file);
+		for (const std::vector<float>* block : blocks)
+			fwrite(&(*block)[0], sizeof(float), block->size(), file);
+		fclose(file);
+		return true;
+	}
+
+	//checks the header, returns where the data starts
+	const float* readCache(const char* filename, std::vector<unsigned char>& buffer, sIBLHeader& header, size_t num_floats)
+	{
+		if (!readFileBin(filename, buffer) || buffer.size() < sizeof(sIBLHeader))
+			return NULL;
+		memcpy(&header, &buffer[0], sizeof(header));
+		if (memcmp(header.signature, "IBL", 3) != 0 || header.version != IBL_VERSION || buffer.size() < sizeof(header) + num_floats * sizeof(float))
+			return NULL;
+		return (const float*)&buffer[sizeof(header)];
+	}
+};
+
+GFX::IBL::IBL()
+{
+	hash = 0;
+	size = 0;
+	num_levels = 0;
+	specular_texture = NULL;
+}
+
+GFX::IBL::~IBL()
+{
+#ifndef SKIP_GL
+	if (specular_texture)
+		delete specular_texture;
+#endif
+}
+
+uint64_t GFX::IBL::computeHash(const void* data, size_t size, uint64_t hash)
+{
+	const uint8_t* bytes = (const uint8_t*)data;
+	for (size_t i = 0; i < size; ++i)
+	{
+		hash ^= bytes[i];
+		hash *= 1099511628211ULL;
+	}
+	return hash;
+}
+
+std::string GFX::IBL::getCacheFilename(uint64_t hash, const char* ext)
+{
+	char name[32];
+	snprintf(name, sizeof(name), "%016llx", (unsigned long long)hash);
+	return cooked_folder + "/ibl/" + name + ext;
+}
+
+GFX::IBL* GFX::IBL::Get(const char* hdre_filename, bool upload)
+{
+	auto it = s_loaded.find(hdre_filename);
+	if (it != s_loaded.end())
+		return it->second;
+
+	//the contents and the settings, so a new bake is done when any of them changes
+	std::vector<unsigned char> buffer;
+	if (!readFileBin(hdre_filename, buffer) || buffer.empty())
+	{
+		std::cout << " - ERROR: HDRE not found for the IBL: " << TermColor::RED << hdre_filename << TermColor::DEFAULT << std::endl;
+		return NULL;
+	}
+	const int settings[] = { IBL_VERSION, IBL_SPECULAR_SIZE, IBL_SPECULAR_LEVELS, IBL_SPECULAR_SAMPLES };
+	uint64_t hash = computeHash(&buffer[0], buffer.size());
+	hash = computeHash(settings, sizeof(settings), hash);
+
+	IBL* ibl = new IBL();
+	std::string cache = getCacheFilename(hash);
+	if (!ibl->load(cache.c_str()) || ibl->hash != hash)
+	{
+		HDRE* hdre = HDRE::Get(hdre_filename);
+		long time = getTime();
+		if (!hdre || !ibl->bake(hdre))
+		{
+			delete ibl;
+			return NULL;
+		}
+		ibl->hash = hash;
+		std::cout << " + IBL baked for " << hdre_filename << " in " << (getTime() - time) << "ms" << std::endl;
+		if (!ibl->save(cache.c_str()))
+			std::cout << " - WARNING: cannot write the IBL cache: " << TermColor::YELLOW << cache << TermColor::DEFAULT << std::endl;
+	}
+
+#ifndef SKIP_GL
+	if (upload)
+		ibl->upload();
+#else
+	(void)upload; //the cooker only bakes the cache
+#endif
+	s_loaded[hdre_filename] = ibl;
+	return ibl;
+}
+
+bool GFX::IBL::bake(HDRE* hdre)
+{
+	float** faces = hdre->getFacesf(0);
+	int num_channels = hdre->header.numChannels;
+	if (!faces || hdre->width <= 0 || hdre->width != hdre->height || num_channels < 3)
+		return false;
+
+	//the source with all its mips, the samples read the one that matches their footprint
+	std::vector<sCubeLevel> chain(1);
+	chain[0].size = hdre->width;
+	for (int face = 0; face < 6; ++face)
+	{
+		size_t num_pixels = (size_t)hdre->width * hdre->width;
+		chain[0].faces[face].resize(num_pixels * 4);
+		for (size_t i = 0; i < num_pixels; ++i)
+		{
+			float* dst = &chain[0].faces[face][i * 4];
+			memcpy(dst, faces[face] + i * num_channels, sizeof(float) * 3);
+			dst[3] = 1.0f;
+		}
+	}
+	while (chain.back().size > 1)
+	{
+		sCubeLevel level;
+		downsampleCube(chain.back(), level);
+		chain.push_back(std::move(level));
+	}
+
+	size = (std::min)(IBL_SPECULAR_SIZE, hdre->width);
+	num_levels = (std::min)(IBL_SPECULAR_LEVELS, (int)log2f((float)size) + 1);
+	for (int level = 0; level < num_levels; ++level)
+	{
+		float roughness = num_levels > 1 ? level / (float)(num_levels - 1) : 0.0f;
+		int level_size = (std::max)(1, size >> level);
+		std::vector<sSample> samples = createSamples(roughness, chain[0].size, level_size, IBL_SPECULAR_SAMPLES);
+		prefilterLevel(chain, samples, level_size, specular[level]);
+	}
+
+	//the irradiance is smooth, a small level is enough
+	const sCubeLevel* source = &chain[0];
+	for (const sCubeLevel& level : chain)
+		if (level.size <= 64 && level.size >= 8)
+		{
+			source = &level;
+			break;
+		}
+	sSHCubemap cubemap;
+	for (int face = 0; face < 6; ++face)
+		cubemap.faces[face] = &source->faces[face][0];
+	cubemap.size = source->size;
+	cubemap.num_channels = 4;
+	sh = computeSH(cubemap);
+	return true;
+}
+
+bool GFX::IBL::save(const char* filename)
+{
+	sIBLHeader header;
+	memset(&header, 0, sizeof(header));
+	memcpy(header.signature, "IBL", 4);
+	header.version = IBL_VERSION;
+	header.hash = hash;
+	header.size = size;
+	header.num_levels = num_levels;
+	memcpy(header.sh, sh.coeffs, sizeof(header.sh));
+
+	std::vector<const std::vector<float>*> blocks;
+	for (int level = 0; level < num_levels; ++level)
+		for (int face = 0; face < 6; ++face)
+			blocks.push_back(&specular[level][face]);
+	return writeCache(filename, header, blocks);
+}
+
+bool GFX::IBL::load(const char* filename)
+{
+	std::vector<unsigned char> buffer;
+	sIBLHeader header;
+	const float* data = readCache(filename, buffer, header, 0);
+	if (!data || header.num_levels <= 0 || header.num_levels > IBL_SPECULAR_LEVELS || header.size <= 0)
+		return false;
+
+	size_t num_floats = 0;
+	for (int level = 0; level < header.num_levels; ++level)
+		num_floats += (size_t)(std::max)(1, header.size >> level) * (std::max)(1, header.size >> level) * 3 * 6;
+	if (buffer.size() < sizeof(header) + num_floats * sizeof(float))
+		return false;
+
+	hash = header.hash;
+	size = header.size;
+	num_levels = header.num_levels;
+	memcpy(sh.coeffs, header.sh, sizeof(header.sh));
+	for (int level = 0; level < num_levels; ++level)
+	{
+		int level_size = (std::max)(1, size >> level);
+		for (int face = 0; face < 6; ++face)
+		{
+			specular[level][face].assign(data, data + (size_t)level_size * level_size * 3);
+			data += specular[level][face].size();
+		}
+	}
+	return true;
+}
+
+#ifndef SKIP_GL //the assets library only bakes
+void GFX::IBL::upload()
+{
+	if (!specular_texture)
+		specular_texture = new Texture();
+
+	Uint8* faces[6];
+	for (int level = 0; level < num_levels; ++level)
+	{
+		for (int face = 0; face < 6; ++face)
+			faces[face] = (Uint8*)&specular[level][face][0];
+		if (level == 0)
+			specular_texture->createCubemap(size, size, faces, GL_RGB, GL_FLOAT, true, GL_RGB16F);
+		else
+			specular_texture->uploadCubemap(GL_RGB, GL_FLOAT, false, faces, GL_RGB16F, level);
+	}
+
+	//the shaders pick the mip from the roughness
+	glBindTexture(GL_TEXTURE_CUBE_MAP, specular_texture->texture_id);
+	glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
+	glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_BASE_LEVEL, 0);
+	glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_MAX_LEVEL, num_levels - 1);
+	glBindTexture(GL_TEXTURE_CUBE_MAP, 0);
+}
+
+void GFX::IBL::bind(Shader* shader, IBL* ibl)
+{
+	shader->setUniform("u_ibl_active", ibl && ibl->specular_texture ? 1 : 0);
+	if (!ibl || !ibl->specular_texture)
+	{
+		//the samplers of different types cannot share the unit 0
+		shader->setUniform("u_ibl_specular", 6);
+		shader->setUniform("u_ibl_brdf_lut", 7);
+		return;
+	}
+	shader->setUniform3Array("u_ibl_sh", (float*)ibl->sh.coeffs, 9);
+	shader->setUniform("u_ibl_max_lod", (float)(ibl->num_levels - 1));
+	shader->setTexture("u_ibl_specular", ibl->specular_texture, 6);
+	shader->setTexture("u_ibl_brdf_lut", getBRDFLUT(), 7);
+}
+#endif
+
+//x is NdotV, y the roughness. The geometry term uses k = alpha / 2 like the shaders
+void GFX::IBL::bakeBRDFLUT(std::vector<float>& lut, int size)
+{
+	lut.resize((size_t)size * size * 2);
+	TaskManager::background.parallelFor(size, [&](size_t y) {
+		float roughness = (y + 0.5f) / size;
+		float alpha = roughness * roughness;
+		float k = alpha * 0.5f;
+		for (int x = 0; x < size; ++x)
+		{
+			float NdotV = (x + 0.5f) / size;
+			Vector3f V(sqrtf(1.0f - NdotV * NdotV), 0.0f, NdotV);
+			float g1_v = NdotV / (NdotV * (1.0f - k) + k);
+			float scale = 0, bias = 0;
+			for (int i = 0; i < IBL_BRDF_LUT_SAMPLES; ++i)
+			{
+				Vector3f H = importanceSampleGGX(i, IBL_BRDF_LUT_SAMPLES, alpha);
+				float VdotH = dot(V, H);
+				Vector3f L = H * (2.0f * VdotH) - V;
+				float NdotL = L.z;
+				if (NdotL <= 0.0f || VdotH <= 0.0f)
+					continue;
+				float G = g1_v * NdotL / (NdotL * (1.0f - k) + k);
+				float visibility = G * VdotH / (H.z * NdotV);
+				float fresnel = powf(1.0f - VdotH, 5.0f);
+				scale += (1.0f - fresnel) * visibility;
+				bias += fresnel * visibility;
+			}
+			lut[(y * size + x) * 2] = scale / IBL_BRDF_LUT_SAMPLES;
+			lut[(y * size + x) * 2 + 1] = bias / IBL_BRDF_LUT_SAMPLES;
+		}
+	});
+}
+
+void GFX::IBL::loadBRDFLUT(std::vector<float>& lut)
+{
+	const int settings[] = { IBL_VERSION, IBL_BRDF_LUT_SIZE, IBL_BRDF_LUT_SAMPLES };
+	uint64_t hash = computeHash(settings, sizeof(settings));
+	std::string cache = getCacheFilename(hash, ".lut");
+	size_t num_floats = (size_t)IBL_BRDF_LUT_SIZE * IBL_BRDF_LUT_SIZE * 2;
+
+	std::vector<unsigned char> buffer;
+	sIBLHeader header;
+	const float* data = readCache(cache.c_str(), buffer, header, num_floats);
+	if (data && header.hash == hash)
+	{
+		lut.assign(data, data + num_floats);
+		return;
+	}
+
+	bakeBRDFLUT(lut, IBL_BRDF_LUT_SIZE);
+	memset(&header, 0, sizeof(header));
+	memcpy(header.signature, "IBL", 4);
+	header.version = IBL_VERSION;
+	header.hash = hash;
+	header.size = IBL_BRDF_LUT_SIZE;
+	writeCache(cache.c_str(), header, { &lut });
+}
+
+#ifndef SKIP_GL
+GFX::Texture* GFX::IBL::getBRDFLUT()
+{
+	if (brdf_lut)
+		return brdf_lut;
+
+	std::vector<float> lut;
+	loadBRDFLUT(lut);
+	brdf_lut = new Texture();
+	brdf_lut->create(IBL_BRDF_LUT_SIZE, IBL_BRDF_LUT_SIZE, GL_RG, GL_FLOAT, false, (Uint8*)&lut[0], GL_RG16F);
+	return brdf_lut;
+}
+#endif
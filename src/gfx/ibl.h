@@ -0,0 +1,69 @@
+/*  Image based lighting
+	Bakes what the PBR shaders need to be lit by an HDRE environment (split sum approximation):
+	 + specular: the environment prefiltered with GGX, one roughness per mip (from 0 to 1)
+	 + diffuse: the irradiance as 9 spherical harmonics (see computeSH)
+	 + BRDF LUT: scale and bias of F0 for every (NdotV, roughness), shared by all the environments
+	Everything runs on the CPU (threads of the TaskManager + SSE) without GL, so the cooker can bake it headless.
+	The results are cached in cooked_folder/ibl by the hash of the HDRE contents, an environment is baked only once.
+*/
+#pragma once
+
+#include <map>
+#include <string>
+#include <vector>
+#include <cstdint>
+
+#include "sphericalharmonics.h"
+
+#define IBL_VERSION 1
+#define IBL_SPECULAR_SIZE 128
+#define IBL_SPECULAR_LEVELS 6
+#define IBL_SPECULAR_SAMPLES 128
+#define IBL_BRDF_LUT_SIZE 128
+#define IBL_BRDF_LUT_SAMPLES 256
+
+class HDRE;
+
+namespace GFX {
+
+	class Texture;
+	class Shader;
+
+	class IBL {
+	public:
+		static std::map<std::string, IBL*> s_loaded;
+		static Texture* brdf_lut;
+
+		uint64_t hash; //of the HDRE file and the bake settings
+		int size; //of the first specular level
+		int num_levels;
+		std::vector<float> specular[IBL_SPECULAR_LEVELS][6]; //RGB per face, GL order (+X,-X,+Y,-Y,+Z,-Z)
+		SphericalHarmonics sh;
+
+		Texture* specular_texture;
+
+		IBL();
+		~IBL();
+
+		//from the cache or baked (and cached), upload is false when there is no GL context
+		static IBL* Get(const char* hdre_filename, bool upload = true);
+
+		//the whole environment from the first level of the HDRE
+		bool bake(HDRE* hdre);
+		bool load(const char* filename);
+		bool save(const char* filename);
+
+		void upload();
+
+		//the IBL uniforms of the PBR shaders, ibl can be NULL to disable it
+		static void bind(Shader* shader, IBL* ibl);
+
+		//RG floats, size * size
+		static void bakeBRDFLUT(std::vector<float>& lut, int size);
+		static void loadBRDFLUT(std::vector<float>& lut); //from the cache, baked the first time
+		static Texture* getBRDFLUT();
+
+		static uint64_t computeHash(const void* data, size_t size, uint64_t hash = 14695981039346656037ULL); //FNV-1a
+		static std::string getCacheFilename(uint64_t hash, const char* ext = ".ibl");
+	};
+};
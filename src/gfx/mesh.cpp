@@ -11,11 +11,15 @@
 #include <iostream>
 #include <limits>
 #include <sys/stat.h>
+#include <mutex>
+#include <atomic>
+#include "../core/task.h"
+#include <algorithm>
 
 #include "../pipeline/camera.h" //??
 #include "texture.h"
+#include "bvh.h"
 //#include "animation.h"
-#include "../extra/coldet/coldet.h"
 
 //#include "engine/application.h"
 
@@ -36,12 +40,17 @@ uint32 Mesh::s_last_index = 0;
 #define FORMAT_MBIN 3
 #define FORMAT_MESH 4
 
+namespace {
+	std::mutex collision_bvh_mutex; //for collision_bvh and collision_bvh_pending of all the meshes
+};
+
 Mesh::Mesh()
 {
 	index = s_last_index++;
 	radius = 0;
 	vao_id = vertices_vbo_id = uvs_vbo_id = uvs1_vbo_id = normals_vbo_id = colors_vbo_id = interleaved_vbo_id = indices_vbo_id = bones_vbo_id = weights_vbo_id = 0;
-	collision_model = NULL;
+	collision_bvh = NULL;
+	collision_bvh_pending = false;
 
 	clear();
 }
@@ -54,8 +63,22 @@ Mesh::~Mesh()
 
 void Mesh::clear()
 {
+	//a background build still reads the vertices
+	while (true)
+	{
+		{
+			std::lock_guard<std::mutex> lock(collision_bvh_mutex);
+			if (!collision_bvh_pending)
+				break;
+		}
+		if (!TaskManager::background.fetchTask())
+			std::this_thread::yield();
+	}
+
 	//Free VBOs
-	#ifdef USE_OPENGL_EXT
+	#ifdef SKIP_GL
+		//the assets library never uploads them
+	#elif defined(USE_OPENGL_EXT)
 		if (vertices_vbo_id)
 			glDeleteBuffersARB(1,&vertices_vbo_id);
 		if (uvs_vbo_id)
@@ -100,6 +123,8 @@ void Mesh::clear()
 
 	//GPU Buffers ids set to 0
 	vao_id = vertices_vbo_id = uvs_vbo_id = normals_vbo_id = colors_vbo_id = interleaved_vbo_id = indices_vbo_id = weights_vbo_id = bones_vbo_id = uvs1_vbo_id = 0;
+	index_size = sizeof(unsigned int);
+	uv_density = -1;
 
 	//buffers
 	vertices.clear();
@@ -112,10 +137,16 @@ void Mesh::clear()
 	weights.clear();
 	m_uvs1.clear();
 
-	if (collision_model)
-		delete (CollisionModel3D*)collision_model;
+	if (collision_bvh)
+		delete collision_bvh;
+	collision_bvh = NULL;
 }
 
+#ifdef SKIP_GL
+//there is no VRAM in the assets library, the meshes stay in RAM
+void Mesh::uploadToVRAM() {}
+#else
+
 #define glGenBuffersARB glGenBuffers
 #define glBindBufferARB glBindBuffer
 #define glBufferDataARB glBufferData
@@ -217,7 +248,22 @@ void Mesh::uploadToVRAM()
 		if (indices_vbo_id == 0)
 			glGenBuffersARB(1, &indices_vbo_id);
 		glBindBufferARB(GL_ELEMENT_ARRAY_BUFFER, indices_vbo_id);
-		glBufferDataARB(GL_ELEMENT_ARRAY_BUFFER, m_indices.size() * sizeof(unsigned int), &m_indices[0], GL_STATIC_DRAW_ARB);
+
+		//use 16 bits indices when possible, halves the size of the buffer
+		unsigned int max_index = 0;
+		for (unsigned int i = 0; i < m_indices.size(); ++i)
+			max_index = (std::max)(max_index, m_indices[i]);
+		if (max_index <= 0xFFFF)
+		{
+			std::vector<uint16> indices16(m_indices.begin(), m_indices.end());
+			index_size = sizeof(uint16);
+			glBufferDataARB(GL_ELEMENT_ARRAY_BUFFER, indices16.size() * sizeof(uint16), &indices16[0], GL_STATIC_DRAW_ARB);
+		}
+		else
+		{
+			index_size = sizeof(unsigned int);
+			glBufferDataARB(GL_ELEMENT_ARRAY_BUFFER, m_indices.size() * sizeof(unsigned int), &m_indices[0], GL_STATIC_DRAW_ARB);
+		}
 	}
 	glBindBufferARB(GL_ELEMENT_ARRAY_BUFFER, 0);
 
@@ -233,6 +279,26 @@ void Mesh::uploadToVRAM()
 	//clear buffers to save memory
 }
 
+void Mesh::updateVerticesInVRAM()
+{
+	assert(vertices_vbo_id && !interleaved.size() && "mesh must be uploaded and not interleaved");
+
+	//orphan the previous buffer so the driver doesnt wait for the GPU to finish using it
+	glBindBufferARB(GL_ARRAY_BUFFER_ARB, vertices_vbo_id);
+	glBufferDataARB(GL_ARRAY_BUFFER_ARB, vertices.size() * sizeof(Vector3f), NULL, GL_STREAM_DRAW);
+	glBufferSubData(GL_ARRAY_BUFFER_ARB, 0, vertices.size() * sizeof(Vector3f), &vertices[0]);
+
+	if (normals.size() && normals_vbo_id)
+	{
+		glBindBufferARB(GL_ARRAY_BUFFER_ARB, normals_vbo_id);
+		glBufferDataARB(GL_ARRAY_BUFFER_ARB, normals.size() * sizeof(Vector3f), NULL, GL_STREAM_DRAW);
+		glBufferSubData(GL_ARRAY_BUFFER_ARB, 0, normals.size() * sizeof(Vector3f), &normals[0]);
+	}
+
+	glBindBufferARB(GL_ARRAY_BUFFER_ARB, 0);
+	checkGLErrors();
+}
+
 int vertex_location = -1;
 int normal_location = -1;
 int uv_location = -1;
@@ -405,6 +471,7 @@ void Mesh::render(unsigned int primitive, int submesh_id, int num_instances)
 	disableBuffers(shader);
 	checkGLErrors();
 }
+#endif //SKIP_GL
 
 void Mesh::getSubmeshStartAndSize(int submesh_id, unsigned int& start, unsigned int& size)
 {
@@ -424,6 +491,7 @@ void Mesh::getSubmeshStartAndSize(int submesh_id, unsigned int& start, unsigned
 	}
 }
 
+#ifndef SKIP_GL
 void Mesh::drawCall(unsigned int primitive, int submesh_id, int num_instances)
 {
 	unsigned int start;
@@ -437,11 +505,7 @@ void Mesh::drawCall(unsigned int primitive, int submesh_id, int num_instances)
 		{
 			assert(indices_vbo_id && "indices must be uploaded to the GPU");
 			glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, indices_vbo_id);
-			#ifdef OPENGL_ES3
-				glDrawElementsInstanced(primitive, size, GL_UNSIGNED_INT, (void*)(start * sizeof(Vector3u)), num_instances);
-            #else
-				assert(0 && "not supported in OpenGL ES2");
-            #endif
+			glDrawElementsInstanced(primitive, size, getIndexType(), (void*)(start * 3 * index_size), num_instances);
 			glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
 		}
 		else
@@ -450,7 +514,7 @@ void Mesh::drawCall(unsigned int primitive, int submesh_id, int num_instances)
 			{
 				/*if (size != 90)*/ {
 					glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, indices_vbo_id);
-					glDrawElements(primitive, size, GL_UNSIGNED_INT,(void *) (start * sizeof(Vector3u)));
+					glDrawElements(primitive, size, getIndexType(),(void *) (start * 3 * index_size));
 					glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
 				}
 				checkGLErrors();
@@ -462,13 +526,7 @@ void Mesh::drawCall(unsigned int primitive, int submesh_id, int num_instances)
 	else //not indexed
 	{
 		if (num_instances > 0)
-		{
-			#ifdef OPENGL_ES3
-				glDrawArraysInstanced(primitive, start, size, num_instances);
-            #else
-				assert(0 && "not supported in OpenGL ES2");
-            #endif
-		}
+			glDrawArraysInstanced(primitive, start, size, num_instances);
 		else
 			glDrawArrays(primitive, start, size);
 	}
@@ -477,6 +535,11 @@ void Mesh::drawCall(unsigned int primitive, int submesh_id, int num_instances)
 	num_meshes_rendered++;
 }
 
+unsigned int Mesh::getIndexType()
+{
+	return index_size == sizeof(uint16) ? GL_UNSIGNED_SHORT : GL_UNSIGNED_INT;
+}
+
 void Mesh::disableBuffers(Shader* shader)
 {
 	if (vertex_location != -1) glDisableVertexAttribArray(vertex_location);
@@ -502,19 +565,16 @@ void Mesh::drawUsingVAO(unsigned int primitive, int submesh_id)
 		glGenVertexArrays(1, &vao_id);
 		glBindVertexArray(vao_id);
 		enableBuffers(nullptr);
-		//enable also indices buffer
+		//enable also indices buffer (already uploaded by uploadToVRAM)
 		if (indices_vbo_id != 0)
-		{
 			glBindBufferARB(GL_ELEMENT_ARRAY_BUFFER, indices_vbo_id);
-			glBufferDataARB(GL_ELEMENT_ARRAY_BUFFER, m_indices.size() * sizeof(unsigned int), &m_indices[0], GL_STATIC_DRAW_ARB);
-		}
 		glBindVertexArray(0);
 	}
 
 	glBindVertexArray(vao_id);
 	if (indices_vbo_id)
 	{
-		glDrawElements(primitive, size, GL_UNSIGNED_INT, (void*)(start * sizeof(Vector3u)));
+		glDrawElements(primitive, size, getIndexType(), (void*)(start * 3 * index_size));
 		//glDrawElementsBaseVertex(primitive,size, GL_UNSIGNED_INT, (void*)(sizeof(unsigned int) * start), 0); //allows to specify offset for vertex buffers also, not only for indices
 	}
 	else
@@ -527,9 +587,30 @@ void Mesh::drawUsingVAO(unsigned int primitive, int submesh_id)
 
 GLuint instances_buffer_id = 0;
 unsigned int total_instances = 0;
+GLuint instances_data_buffer_id = 0;
+unsigned int total_instances_data = 0;
+
+//grows the buffer (never shrinks) and uploads the data of the instances
+static void uploadInstances(GLuint& buffer_id, unsigned int& capacity, const void* data, int num_instances, size_t stride)
+{
+	if (buffer_id == 0)
+	{
+		glGenBuffersARB(1, &buffer_id);
+		capacity = 0;
+	}
+	glBindBufferARB(GL_ARRAY_BUFFER_ARB, buffer_id);
+	if (capacity < (unsigned int)num_instances)
+	{
+		capacity = (std::max)(256u, capacity);
+		while (capacity < (unsigned int)num_instances)
+			capacity *= 2;
+		glBufferDataARB(GL_ARRAY_BUFFER_ARB, capacity * stride, nullptr, GL_STREAM_DRAW_ARB);
+	}
+	glBufferSubDataARB(GL_ARRAY_BUFFER_ARB, 0, num_instances * stride, data);
+}
 
 //should be faster but in some system it is slower
-void Mesh::renderInstanced(unsigned int primitive, const Matrix44* instanced_models, int num_instances)
+void Mesh::renderInstanced(unsigned int primitive, const Matrix44* instanced_models, int num_instances, const Vector4f* instanced_data)
 {
 	if (!num_instances)
 		return;
@@ -537,60 +618,55 @@ void Mesh::renderInstanced(unsigned int primitive, const Matrix44* instanced_mod
 	if (glVertexAttribDivisorARB == nullptr)
 		return;//not suported
 
-	#ifdef OPENGL_ES3
-		Shader* shader = Shader::current;
-		assert(shader && "shader must be enabled");
+	Shader* shader = Shader::current;
+	assert(shader && "shader must be enabled");
 
-		//initialize global buffer for models so we dont resize every time
-		if (instances_buffer_id == 0)
-		{
-			glGenBuffersARB(1, &instances_buffer_id);
-			glBindBufferARB(GL_ARRAY_BUFFER_ARB, instances_buffer_id);
-			total_instances = 256;
-			glBufferDataARB(GL_ARRAY_BUFFER_ARB, total_instances * sizeof(Matrix44), nullptr, GL_STREAM_DRAW_ARB);
-			//glBufferDataARB(GL_ARRAY_BUFFER_ARB, num_instances * sizeof(Matrix44), instanced_models, GL_STREAM_DRAW_ARB);
-		}
-		else if (total_instances < num_instances)
-		{
-			total_instances *= 2;
-			glBindBufferARB(GL_ARRAY_BUFFER_ARB, instances_buffer_id);
-			glBufferDataARB(GL_ARRAY_BUFFER_ARB, total_instances * sizeof(Matrix44), nullptr, GL_STREAM_DRAW_ARB);
-		}
+	int attribLocation = shader->getAttribLocation("u_model");
+	assert(attribLocation != -1 && "shader must have attribute mat4 u_model (not a uniform)");
+	if (attribLocation == -1)
+		return; //this shader doesnt support instanced model
 
-		//upload models
-		glBindBufferARB(GL_ARRAY_BUFFER_ARB, instances_buffer_id);
-		glBufferSubDataARB(GL_ARRAY_BUFFER_ARB, 0, total_instances * sizeof(Matrix44), instanced_models);
+	//upload models, the global buffer is reused so we dont resize every time
+	uploadInstances(instances_buffer_id, total_instances, instanced_models, num_instances, sizeof(Matrix44));
 
-		int attribLocation = shader->getAttribLocation("u_model");
-		assert(attribLocation != -1 && "shader must have attribute mat4 u_model (not a uniform)");
-		if (attribLocation == -1)
-			return; //this shader doesnt support instanced model
+	//mat4 count as 4 different attributes of vec4... (thanks opengl...)
+	for (int k = 0; k < 4; ++k)
+	{
+		glEnableVertexAttribArray(attribLocation + k );
+		int offset = sizeof(float) * 4 * k;
+		const Uint8* addr = (Uint8*) offset;
+		glVertexAttribPointer(attribLocation + k, 4, GL_FLOAT, false, sizeof(Matrix44), addr);
+		glVertexAttribDivisorARB(attribLocation + k, 1); // This makes it instanced!
+	}
 
-		//mat4 count as 4 different attributes of vec4... (thanks opengl...)
-		for (int k = 0; k < 4; ++k)
-		{
-			glEnableVertexAttribArray(attribLocation + k );
-			int offset = sizeof(float) * 4 * k;
-			const Uint8* addr = (Uint8*) offset;
-			glVertexAttribPointer(attribLocation + k, 4, GL_FLOAT, false, sizeof(Matrix44), addr);
-			glVertexAttribDivisorARB(attribLocation + k, 1); // This makes it instanced!
-		}
+	int dataLocation = instanced_data ? shader->getAttribLocation("a_instance") : -1;
+	if (dataLocation != -1)
+	{
+		uploadInstances(instances_data_buffer_id, total_instances_data, instanced_data, num_instances, sizeof(Vector4f));
+		glEnableVertexAttribArray(dataLocation);
+		glVertexAttribPointer(dataLocation, 4, GL_FLOAT, false, sizeof(Vector4f), 0);
+		glVertexAttribDivisorARB(dataLocation, 1);
+	}
+	glBindBufferARB(GL_ARRAY_BUFFER_ARB, 0);
 
-		//regular render
-		render(primitive, -1, num_instances);
+	//regular render
+	render(primitive, -1, num_instances);
 
-		//disable instanced attribs
-		for (int k = 0; k < 4; ++k)
-		{
-			glDisableVertexAttribArray(attribLocation + k);
-			glVertexAttribDivisorARB(attribLocation + k, 0);
-		}
-		
-    #else
-		assert(0 && "not supported");
-    #endif
+	//disable instanced attribs
+	for (int k = 0; k < 4; ++k)
+	{
+		glDisableVertexAttribArray(attribLocation + k);
+		glVertexAttribDivisorARB(attribLocation + k, 0);
+	}
+	if (dataLocation != -1)
+	{
+		glDisableVertexAttribArray(dataLocation);
+		glVertexAttribDivisorARB(dataLocation, 0);
+	}
 }
 
+#endif //SKIP_GL
+
 /*
 void Mesh::renderAnimated( unsigned int primitive, Skeleton* skeleton )
 {
@@ -608,135 +684,160 @@ void Mesh::renderAnimated( unsigned int primitive, Skeleton* skeleton )
 }
 */
 
-bool Mesh::createCollisionModel(bool is_static)
+void Mesh::buildCollisionBVH(bool in_background)
 {
-	if (collision_model)
-		return true;
+	{
+		std::lock_guard<std::mutex> lock(collision_bvh_mutex);
+		if (collision_bvh || collision_bvh_pending)
+			return;
+		collision_bvh_pending = true;
+	}
 
-	double time = getTime();
-	std::cout << "Creating collision model for: " << this->name << " (" << (interleaved.size() ? interleaved.size() : vertices.size()) / 3 << ") ...";
+	auto build = [this]() {
+		double time = getTime();
+		TriangleBVH* bvh = new TriangleBVH();
+		bvh->build(this);
+		std::lock_guard<std::mutex> lock(collision_bvh_mutex);
+		collision_bvh = bvh;
+		collision_bvh_pending = false;
+		std::cout << " + Collision BVH of " << name << ": " << bvh->getMemorySize() / 1024 << "KB in " << (getTime() - time) << "ms" << std::endl;
+	};
 
-	CollisionModel3D* collision_model = newCollisionModel3D(is_static);
+	if (in_background && TaskManager::background.getNumThreads())
+		TaskManager::background.addTask(new Task(build));
+	else
+		build();
+}
 
-	if (m_indices.size()) //indexed
-	{
-		collision_model->setTriangleNumber((int)m_indices.size() / 3);
+const TriangleBVH* Mesh::getCollisionBVH(bool wait)
+{
+	//nothing happens if it is built or being built (maybe by another thread)
+	buildCollisionBVH(!wait);
 
-		if (interleaved.size())
-			for (unsigned int i = 0; i < m_indices.size(); i+=3)
-			{
-				auto v1 = interleaved[m_indices[i+0]];
-				auto v2 = interleaved[m_indices[i+1]];
-				auto v3 = interleaved[m_indices[i+2]];
-				collision_model->addTriangle(v1.vertex.v, v2.vertex.v, v3.vertex.v);
-			}
-		else
-		for (unsigned int i = 0; i < m_indices.size(); i+=3)
-		{
-			auto v1 = vertices[m_indices[i+0]];
-			auto v2 = vertices[m_indices[i+1]];
-			auto v3 = vertices[m_indices[i+2]];
-			collision_model->addTriangle(v1.v, v2.v, v3.v);
-		}
-	}
-	else if (interleaved.size()) //is interleaved
-	{
-		collision_model->setTriangleNumber(interleaved.size() / 3);
-		for (unsigned int i = 0; i < interleaved.size(); i+=3)
-		{
-			auto v1 = interleaved[i];
-			auto v2 = interleaved[i+1];
-			auto v3 = interleaved[i+2];
-			collision_model->addTriangle(v1.vertex.v, v2.vertex.v, v3.vertex.v);
-		}
-	}
-	else if (vertices.size()) //non interleaved
+	while (true)
 	{
-		collision_model->setTriangleNumber((int)vertices.size() / 3);
-		for (unsigned int i = 0; i < (int)vertices.size(); i+=3)
 		{
-			auto v1 = vertices[i];
-			auto v2 = vertices[i + 1];
-			auto v3 = vertices[i + 2];
-			collision_model->addTriangle(v1.v, v2.v, v3.v);
+			std::lock_guard<std::mutex> lock(collision_bvh_mutex);
+			if (collision_bvh || !collision_bvh_pending)
+				return collision_bvh;
 		}
+		if (!wait)
+			return NULL;
+		if (!TaskManager::background.fetchTask())
+			std::this_thread::yield();
 	}
-	else
-	{
-		assert(0 && "mesh without vertices, cannot create collision model");
-		std::cout << "[ERROR]" << std::endl;
-		return false;
-	}
-	collision_model->finalize();
-	this->collision_model = collision_model;
-
-	std::cout << "[OK] Time: " << (getTime() - time) * 0.001 << "sec" << std::endl;
-
-	return true;
 }
 
 //help: model is the transform of the mesh, ray origin and direction, a Vector3 where to store the collision if found, a Vector3 where to store the normal if there was a collision, max ray distance in case the ray should go to infintiy, and in_object_space to get the collision point in object space or world space
-bool Mesh::testRayCollision(Matrix44 model, Vector3f start, Vector3f front, Vector3f& collision, Vector3f& normal, float max_ray_dist, bool in_object_space )
+bool Mesh::testRayCollision(const Matrix44& model, const Vector3f& start, const Vector3f& front, Vector3f& collision, Vector3f& normal, float max_ray_dist, bool in_object_space )
 {
-	if (!this->collision_model)
+	bool built;
 	{
-		//test first against bounding before creating collision model
+		std::lock_guard<std::mutex> lock(collision_bvh_mutex);
+		built = collision_bvh != NULL;
+	}
+	if (!built)
+	{
+		//test first against bounding before building the BVH
 		BoundingBox aabb = transformBoundingBox(model, box);
 		if (!RayBoundingBoxCollision(aabb, start, front, collision))
 			return false;
-
-		if (!createCollisionModel())
-			return false;
 	}
 
-	CollisionModel3D* collision_model = (CollisionModel3D*)this->collision_model;
-	assert(collision_model && "CollisionModel3D must be created before using it, call createCollisionModel");
-
-	collision_model->setTransform( model.m );
-	if (collision_model->rayCollision( start.v , front.v, true,0.0, max_ray_dist) == false)
+	const TriangleBVH* bvh = getCollisionBVH();
+	if (!bvh || bvh->isEmpty())
 		return false;
 
-	collision_model->getCollisionPoint( collision.v, in_object_space);
+	//traced in object space, t is the same in both spaces because the direction is not normalized
+	Matrix44 inverse_model = model;
+	inverse_model.inverse();
+	Vector3f local_start = inverse_model * start;
+	Vector3f local_front = inverse_model.rotateVector(front);
 
-	float t1[9],t2[9];
-	collision_model->getCollidingTriangles(t1,t2, in_object_space);
+	float front_length = front.length();
+	float max_t = front_length > 0.0f ? max_ray_dist / front_length : max_ray_dist;
+	sRayHit hit;
+	if (!bvh->testRay(local_start, local_front, max_t, hit))
+		return false;
 
-	Vector3f v1;
-	Vector3f v2;
-	v1=Vector3f(t1[3]-t1[0],t1[4]-t1[1],t1[5]-t1[2]);
-	v2=Vector3f(t1[6]-t1[0],t1[7]-t1[1],t1[8]-t1[2]);
-	v1.normalize();
-	v2.normalize();
-	normal = v1.cross(v2);
+	if (in_object_space)
+	{
+		collision = local_start + local_front * hit.t;
+		normal = hit.normal;
+	}
+	else
+	{
+		collision = start + front * hit.t;
+		Matrix44 normal_matrix = inverse_model;
+		normal_matrix.transpose();
+		normal = normal_matrix.rotateVector(hit.normal);
+	}
+	normal.normalize();
 
 	return true;
 }
 
-bool Mesh::testSphereCollision(Matrix44 model, Vector3f center, float radius, Vector3f& collision, Vector3f& normal)
+int Mesh::testRaysCollision(const Matrix44& model, int count, const Vector3f* origins, const Vector3f* directions, sRayHit* hits, float max_t)
 {
-	if (!this->collision_model)
-		if (!createCollisionModel())
-			return false;
-
-	CollisionModel3D* collision_model = (CollisionModel3D*)this->collision_model;
-	assert(collision_model && "CollisionModel3D must be created before using it, call createCollisionModel");
+	const TriangleBVH* bvh = getCollisionBVH();
+	if (!bvh || bvh->isEmpty())
+	{
+		for (int i = 0; i < count; ++i)
+			hits[i] = sRayHit();
+		return 0;
+	}
+
+	Matrix44 inverse_model = model;
+	inverse_model.inverse();
+	Matrix44 normal_matrix = inverse_model;
+	normal_matrix.transpose();
+
+	//in blocks, so every thread transforms its rays into object space
+	const int block_size = 256;
+	int num_blocks = (count + block_size - 1) / block_size;
+	std::atomic<int> num_hits(0);
+	TaskManager::background.parallelFor(num_blocks, [&](size_t block) {
+		int first = (int)block * block_size;
+		int block_count = (std::min)(block_size, count - first);
+		Vector3f local_origins[block_size];
+		Vector3f local_directions[block_size];
+		for (int i = 0; i < block_count; ++i)
+		{
+			local_origins[i] = inverse_model * origins[first + i];
+			local_directions[i] = inverse_model.rotateVector(directions[first + i]);
+		}
+		int block_hits = bvh->testRays(block_count, local_origins, local_directions, max_t, hits + first);
+		for (int i = 0; i < block_count; ++i)
+			if (hits[first + i].primitive != -1)
+				hits[first + i].normal = normal_matrix.rotateVector(hits[first + i].normal).normalize();
+		num_hits += block_hits;
+	});
+	return num_hits.load();
+}
 
-	collision_model->setTransform(model.m);
-	if (collision_model->sphereCollision(center.v, radius) == false)
+bool Mesh::testSphereCollision(const Matrix44& model, const Vector3f& center, float radius, Vector3f& collision, Vector3f& normal)
+{
+	const TriangleBVH* bvh = getCollisionBVH();
+	if (!bvh || bvh->isEmpty())
 		return false;
 
-	collision_model->getCollisionPoint(collision.v, false);
+	Matrix44 inverse_model = model;
+	inverse_model.inverse();
+	Vector3f inverse_scale = inverse_model.getScale();
+	float local_radius = radius * (std::max)({ fabs(inverse_scale.x), fabs(inverse_scale.y), fabs(inverse_scale.z) });
 
-	float t1[9], t2[9];
-	collision_model->getCollidingTriangles(t1, t2, false);
+	Vector3f point;
+	int triangle;
+	if (!bvh->testSphere(inverse_model * center, local_radius, point, triangle))
+		return false;
 
-	Vector3f v1;
-	Vector3f v2;
-	v1 = Vector3f(t1[3] - t1[0], t1[4] - t1[1], t1[5] - t1[2]);
-	v2 = Vector3f(t1[6] - t1[0], t1[7] - t1[1], t1[8] - t1[2]);
-	v1.normalize();
-	v2.normalize();
-	normal = v1.cross(v2);
+	Vector3f v0, v1, v2;
+	bvh->getTriangle(triangle, v0, v1, v2);
+	collision = model * point;
+	Matrix44 normal_matrix = inverse_model;
+	normal_matrix.transpose();
+	normal = normal_matrix.rotateVector(cross(v1 - v0, v2 - v0));
+	normal.normalize();
 
 	return true;
 }
@@ -784,23 +885,16 @@ typedef struct
 
 bool Mesh::readBin(const char* filename)
 {
-	FILE *f;
 	assert(filename);
 
-	struct stat stbuffer;
-
-	stat(filename,&stbuffer);
-	f = fopen(filename,"rb");
-	if (f == NULL)
+	//it can be inside a pak
+	std::vector<unsigned char> buffer;
+	if (!readFileBin(filename, buffer))
 		return false;
-
-	unsigned int size = (unsigned int)stbuffer.st_size;
-	char* data = new char[size];
-	fread(data,size,1,f);
-	fclose(f);
+	char* data = (char*)&buffer[0];
 
 	//watermark
-	if ( memcmp(data,"MBIN",4) != 0 )
+	if ( buffer.size() < 4 + sizeof(sMeshInfo) || memcmp(data,"MBIN",4) != 0 )
 	{
 		std::cout << "[ERROR] loading BIN: invalid content: " << filename << std::endl;
 		return false;
@@ -855,7 +949,7 @@ bool Mesh::readBin(const char* filename)
 	{
 		m_indices.resize(info.num_indices);
 		memcpy((void*)&m_indices[0], pos, sizeof(unsigned int) * info.num_indices);
-		pos += sizeof(Vector3u) * info.num_indices;
+		pos += sizeof(unsigned int) * info.num_indices;
 	}
 
 	if (info.streams[5] == 'B')
@@ -872,13 +966,6 @@ bool Mesh::readBin(const char* filename)
 		pos += sizeof(Vector4f) * info.size;
 	}
 
-	if (info.streams[7] == 'u')
-	{
-		m_uvs1.resize(info.size);
-		memcpy((void*)&m_uvs1[0], pos, sizeof(Vector2f) * info.size);
-		pos += sizeof(Vector2f) * info.size;
-	}
-
 	if (info.num_bones)
 	{
 		bones_info.resize(info.num_bones);
@@ -886,6 +973,13 @@ bool Mesh::readBin(const char* filename)
 		pos += sizeof(BoneInfo) * info.num_bones;
 	}
 
+	if (info.streams[7] == 'u')
+	{
+		m_uvs1.resize(info.size);
+		memcpy((void*)&m_uvs1[0], pos, sizeof(Vector2f) * info.size);
+		pos += sizeof(Vector2f) * info.size;
+	}
+
 	aabb_max = info.aabb_max;
 	aabb_min = info.aabb_min;
 	box.center = info.center;
@@ -894,10 +988,10 @@ bool Mesh::readBin(const char* filename)
 	bind_matrix = info.bind_matrix;
 
 	submeshes.resize(info.num_submeshes);
-	memcpy(&submeshes[0], pos, sizeof(sSubmeshInfo) * info.num_submeshes);
+	if (info.num_submeshes)
+		memcpy(&submeshes[0], pos, sizeof(sSubmeshInfo) * info.num_submeshes);
 	pos += sizeof(sSubmeshInfo) * info.num_submeshes;
 
-	createCollisionModel();
 	return true;
 }
 
@@ -971,7 +1065,8 @@ bool Mesh::writeBin(const char* filename)
 	if (m_uvs1.size())
 		fwrite((void*)&m_uvs1[0], m_uvs1.size() * sizeof(Vector2f), 1, f);
 
-	fwrite((void*)&submeshes[0], submeshes.size() * sizeof(sSubmeshInfo), 1, f);
+	if (submeshes.size())
+		fwrite((void*)&submeshes[0], submeshes.size() * sizeof(sSubmeshInfo), 1, f);
 
 	fclose(f);
 	return true;
@@ -1107,131 +1202,380 @@ bool Mesh::loadASE(const char* filename)
 	return true;
 }
 
-bool Mesh::loadOBJ(const char* filename)
-{
-	std::string data;
-	if(!readFile(filename,data))
-		return false;
-	char* pos = &data[0];
-	char line[255];
-	int i = 0;
+//OBJ PARSER *************************************************************
+//the file is split in chunks (at line boundaries) that are scanned in parallel without allocating per line,
+//afterwards the chunks are stitched in order so the result is the same as parsing the file serially
 
-	std::vector<Vector3f> indexed_positions;
-	std::vector<Vector3f> indexed_normals;
-	std::vector<Vector2f> indexed_uvs;
+#define OBJ_CHUNK_MIN_SIZE (1 << 20) //smaller files are parsed in a single chunk
 
-	const float max_float = 10000000;
-	const float min_float = -10000000;
-	aabb_min.set(max_float,max_float,max_float);
-	aabb_max.set(min_float,min_float,min_float);
+struct sOBJEvent {
+	char type; //'g' group, 'u' usemtl
+	unsigned int corner; //local corner when the event was found
+	char name[64];
+};
 
-	unsigned int vertex_i = 0;
+struct sOBJChunk {
+	const char* start;
+	const char* end;
 
-	sSubmeshInfo submesh_info;
-	int last_submesh_vertex = 0;
-	memset(&submesh_info, 0, sizeof(submesh_info));
+	std::vector<Vector3f> positions;
+	std::vector<Vector2f> uvs;
+	std::vector<Vector3f> normals;
+	std::vector<int> corners; //triplets of v/vt/vn indices (1-based, 0 if missing) already triangulated
+	std::vector<sOBJEvent> events;
 
-	//parse file
-	while(*pos != 0)
-	{
-		if (*pos == '\n') pos++;
-		if (*pos == '\r') pos++;
+	unsigned int first_uv_corner; //first corner that was read after a 'vt' was found in this chunk
+	unsigned int first_normal_corner;
+	Vector3f aabb_min;
+	Vector3f aabb_max;
+
+	//filled while stitching
+	unsigned int positions_offset, uvs_offset, normals_offset;
+	unsigned int corners_offset, out_uvs_offset, out_normals_offset;
+};
 
-		//read one line
-		i = 0;
-		while(i < 255 && pos[i] != '\n' && pos[i] != '\r' && pos[i] != 0) i++;
-		memcpy(line,pos,i);
-		line[i] = 0;
-		pos = pos + i;
+static inline bool isOBJSpace(char c) { return c == ' ' || c == '\t'; }
+static inline bool isOBJEndLine(char c) { return c == '\n' || c == '\r' || c == 0; }
+
+static inline const char* skipOBJToken(const char* pos, const char* end)
+{
+	while (pos < end && !isOBJSpace(*pos) && !isOBJEndLine(*pos)) pos++;
+	return pos;
+}
 
-		//std::cout << "Line: \"" << line << "\"" << std::endl;
-		if (*line == '#' || *line == 0) continue; //comment
+static inline const char* skipOBJSpaces(const char* pos, const char* end)
+{
+	while (pos < end && isOBJSpace(*pos)) pos++;
+	return pos;
+}
 
-		//tokenize line
-		std::vector<std::string> tokens = tokenize(line," ");
+//parses a number like atof but without copying the token, returns the position after the token.
+//uses the exact fast path when mantissa and exponent fit in a double, otherwise falls back to strtod
+static const char* parseOBJFloat(const char* pos, const char* end, double& result)
+{
+	static const double pow10[] = { 1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+		1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22 };
 
-		if (tokens.empty()) continue;
+	const char* start = pos;
+	bool negative = false;
+	if (pos < end && (*pos == '-' || *pos == '+'))
+		negative = *(pos++) == '-';
 
-		if (tokens[0] == "v" && tokens.size() == 4)
+	uint64_t mantissa = 0;
+	int digits = 0;
+	int exponent = 0;
+	bool valid = false;
+	while (pos < end && *pos >= '0' && *pos <= '9')
+	{
+		if (mantissa || *pos != '0') digits++;
+		mantissa = mantissa * 10 + (*(pos++) - '0');
+		valid = true;
+	}
+	if (pos < end && *pos == '.')
+	{
+		pos++;
+		while (pos < end && *pos >= '0' && *pos <= '9')
 		{
-			Vector3f v((float)atof(tokens[1].c_str()), (float)atof(tokens[2].c_str()), (float)atof(tokens[3].c_str()) );
-			indexed_positions.push_back(v);
+			if (mantissa || *pos != '0') digits++;
+			mantissa = mantissa * 10 + (*(pos++) - '0');
+			exponent--;
+			valid = true;
+		}
+	}
+	if (valid && pos < end && (*pos == 'e' || *pos == 'E'))
+	{
+		const char* exp_pos = pos + 1;
+		bool exp_negative = false;
+		if (exp_pos < end && (*exp_pos == '-' || *exp_pos == '+'))
+			exp_negative = *(exp_pos++) == '-';
+		if (exp_pos < end && *exp_pos >= '0' && *exp_pos <= '9')
+		{
+			int e = 0;
+			while (exp_pos < end && *exp_pos >= '0' && *exp_pos <= '9')
+			{
+				if (e < 10000) e = e * 10 + (*exp_pos - '0');
+				exp_pos++;
+			}
+			exponent += exp_negative ? -e : e;
+			pos = exp_pos;
+		}
+	}
 
-			aabb_min.setMin( v );
-			aabb_max.setMax( v );
+	const char* token_end = skipOBJToken(pos, end);
+	if (!valid && pos == token_end)
+		result = 0.0; //like atof
+	else if (pos != token_end)
+		result = strtod(start, NULL); //not a plain decimal (hex, nan, inf...)
+	else if (digits <= 15 && exponent >= -22 && exponent <= 22) //mantissa is exact in a double, one rounding only
+	{
+		double value = (double)mantissa;
+		value = exponent < 0 ? value / pow10[-exponent] : value * pow10[exponent];
+		result = negative ? -value : value;
+	}
+	else
+		result = strtod(start, NULL); //rare: long mantissas or huge exponents
+
+	return token_end;
+}
+
+//parses "v/vt/vn", "v//vn" or "v", missing fields are 0
+static const char* parseOBJCorner(const char* pos, const char* end, int* corner)
+{
+	corner[0] = corner[1] = corner[2] = 0;
+	int field = 0;
+	while (pos < end && !isOBJSpace(*pos) && !isOBJEndLine(*pos))
+	{
+		if (*pos == '/')
+		{
+			if (++field > 2)
+				return skipOBJToken(pos, end);
+			pos++;
+			continue;
 		}
-		else if (tokens[0] == "vt" && tokens.size() >= 3)
+		int value = 0;
+		while (pos < end && *pos >= '0' && *pos <= '9')
+			value = value * 10 + (*(pos++) - '0');
+		corner[field] = value;
+		if (pos < end && *pos != '/' && !isOBJSpace(*pos) && !isOBJEndLine(*pos))
+			pos++; //garbage, skip it
+	}
+	return pos;
+}
+
+static void readOBJName(const char* pos, const char* end, char* name)
+{
+	pos = skipOBJSpaces(pos, end);
+	const char* name_end = skipOBJToken(pos, end);
+	size_t len = std::min<size_t>(name_end - pos, 63);
+	memcpy(name, pos, len);
+	name[len] = 0;
+}
+
+static void parseOBJChunk(sOBJChunk* chunk)
+{
+	const float max_float = 10000000;
+	const float min_float = -10000000;
+	chunk->aabb_min.set(max_float, max_float, max_float);
+	chunk->aabb_max.set(min_float, min_float, min_float);
+	chunk->first_uv_corner = chunk->first_normal_corner = 0xFFFFFFFF;
+
+	const char* pos = chunk->start;
+	const char* end = chunk->end;
+	double values[3];
+	int face_corners[3][3];
+
+	while (pos < end)
+	{
+		//find line bounds
+		const char* line_end = pos;
+		while (line_end < end && !isOBJEndLine(*line_end)) line_end++;
+		const char* line = skipOBJSpaces(pos, line_end);
+		pos = line_end + 1;
+
+		if (line == line_end || *line == '#')
+			continue;
+
+		const char* keyword_end = skipOBJToken(line, line_end);
+		size_t keyword_len = keyword_end - line;
+		const char* current = skipOBJSpaces(keyword_end, line_end);
+
+		//count numeric fields to match the old tokenizer rules (v x y z, vn x y z, vt u v [w])
+		int num_tokens = 0;
+		if (keyword_len <= 2)
+			for (const char* it = current; it < line_end; it = skipOBJSpaces(skipOBJToken(it, line_end), line_end))
+				num_tokens++;
+
+		if (keyword_len == 1 && line[0] == 'v' && num_tokens == 3)
 		{
-			Vector2f v((float)atof(tokens[1].c_str()), 1.0 - (float)atof(tokens[2].c_str()) );
-			indexed_uvs.push_back(v);
+			for (int i = 0; i < 3; ++i)
+				current = skipOBJSpaces(parseOBJFloat(current, line_end, values[i]), line_end);
+			Vector3f v((float)values[0], (float)values[1], (float)values[2]);
+			chunk->positions.push_back(v);
+			chunk->aabb_min.setMin(v);
+			chunk->aabb_max.setMax(v);
 		}
-		else if (tokens[0] == "vn" && tokens.size() == 4)
+		else if (keyword_len == 2 && line[0] == 'v' && line[1] == 't' && num_tokens >= 2)
 		{
-			Vector3f v((float)atof(tokens[1].c_str()), (float)atof(tokens[2].c_str()), (float)atof(tokens[3].c_str()) );
-			indexed_normals.push_back(v);
+			for (int i = 0; i < 2; ++i)
+				current = skipOBJSpaces(parseOBJFloat(current, line_end, values[i]), line_end);
+			if (chunk->first_uv_corner == 0xFFFFFFFF)
+				chunk->first_uv_corner = (unsigned int)chunk->corners.size() / 3;
+			chunk->uvs.push_back(Vector2f((float)values[0], 1.0 - (float)values[1]));
 		}
-		else if (tokens[0] == "s") //surface? it appears one time before the faces
+		else if (keyword_len == 2 && line[0] == 'v' && line[1] == 'n' && num_tokens == 3)
 		{
-			//process mesh: ????
-			//if (uvs.size() == 0 && indexed_uvs.size() )
-			//	uvs.resize(1);
+			for (int i = 0; i < 3; ++i)
+				current = skipOBJSpaces(parseOBJFloat(current, line_end, values[i]), line_end);
+			if (chunk->first_normal_corner == 0xFFFFFFFF)
+				chunk->first_normal_corner = (unsigned int)chunk->corners.size() / 3;
+			chunk->normals.push_back(Vector3f((float)values[0], (float)values[1], (float)values[2]));
 		}
-		else if (tokens[0] == "usemtl") //surface? it appears one time before the faces
+		else if (keyword_len == 1 && line[0] == 'f' && num_tokens >= 3)
 		{
-			if (last_submesh_vertex != vertices.size())
+			//triangle fan
+			current = skipOBJSpaces(parseOBJCorner(current, line_end, face_corners[0]), line_end);
+			current = skipOBJSpaces(parseOBJCorner(current, line_end, face_corners[1]), line_end);
+			for (int i = 2; i < num_tokens; ++i)
 			{
-				submesh_info.length = vertices.size() - submesh_info.start;
-				last_submesh_vertex = vertices.size();
-				submeshes.push_back(submesh_info);
-				memset(&submesh_info, 0, sizeof(submesh_info));
-				strcpy(submesh_info.name, tokens[1].c_str());
-				submesh_info.start = last_submesh_vertex;
+				current = skipOBJSpaces(parseOBJCorner(current, line_end, face_corners[2]), line_end);
+				chunk->corners.insert(chunk->corners.end(), &face_corners[0][0], &face_corners[0][0] + 9);
+				memcpy(face_corners[1], face_corners[2], sizeof(face_corners[1]));
 			}
-			else
-				strcpy(submesh_info.material, tokens[1].c_str());
 		}
-		else if (tokens[0] == "g") //surface? it appears one time before the faces
+		else if ((keyword_len == 6 && strncmp(line, "usemtl", 6) == 0) || (keyword_len == 1 && line[0] == 'g'))
 		{
-			if (last_submesh_vertex != vertices.size())
-			{
-				submesh_info.length = vertices.size() - submesh_info.start;
-				last_submesh_vertex = vertices.size();
-				submeshes.push_back(submesh_info);
-				memset(&submesh_info, 0, sizeof(submesh_info));
-				strcpy( submesh_info.name, tokens[1].c_str());
-				submesh_info.start = last_submesh_vertex;
-			}
+			sOBJEvent event;
+			event.type = line[0] == 'g' ? 'g' : 'u';
+			event.corner = (unsigned int)chunk->corners.size() / 3;
+			readOBJName(current, line_end, event.name);
+			chunk->events.push_back(event);
+		}
+	}
+}
+
+//copies the attributes of every corner of a chunk into the final unindexed streams
+static void gatherOBJChunk(Mesh* mesh, sOBJChunk* chunk, const std::vector<Vector3f>& positions, const std::vector<Vector2f>& uvs, const std::vector<Vector3f>& normals)
+{
+	unsigned int num_corners = (unsigned int)chunk->corners.size() / 3;
+	const int* corner = chunk->corners.empty() ? NULL : &chunk->corners[0];
+	unsigned int out_uv = chunk->out_uvs_offset;
+	unsigned int out_normal = chunk->out_normals_offset;
+	bool has_uvs = chunk->uvs_offset > 0;
+	bool has_normals = chunk->normals_offset > 0;
+
+	for (unsigned int i = 0; i < num_corners; ++i, corner += 3)
+	{
+		unsigned int index = (unsigned int)corner[0] - 1;
+		mesh->vertices[chunk->corners_offset + i] = index < positions.size() ? positions[index] : Vector3f();
+
+		//the first corner of a face decides, as in a serial parse
+		if (!has_uvs && i >= chunk->first_uv_corner && (i % 3) == 0)
+			has_uvs = true;
+		if (!has_normals && i >= chunk->first_normal_corner && (i % 3) == 0)
+			has_normals = true;
+
+		if (has_uvs)
+		{
+			index = (unsigned int)corner[1] - 1;
+			mesh->uvs[out_uv++] = index < uvs.size() ? uvs[index] : Vector2f();
 		}
-		else if (tokens[0] == "f" && tokens.size() >= 4)
+		if (has_normals)
 		{
-			Vector3f v1,v2,v3;
-			v1.parseFromText( tokens[1].c_str(), '/' );
+			index = (unsigned int)corner[2] - 1;
+			mesh->normals[out_normal++] = index < normals.size() ? normals[index] : Vector3f();
+		}
+	}
+}
 
-			for (unsigned int iPoly = 2; iPoly < tokens.size() - 1; iPoly++)
-			{
-				v2.parseFromText( tokens[iPoly].c_str(), '/' );
-				v3.parseFromText( tokens[iPoly+1].c_str(), '/' );
+//counts how many corners of a chunk will have uvs or normals (a stream starts with the first face after its first element)
+static unsigned int countOBJStreamCorners(unsigned int num_corners, unsigned int previous_elements, unsigned int first_corner)
+{
+	if (previous_elements)
+		return num_corners;
+	if (first_corner >= num_corners)
+		return 0;
+	first_corner = ((first_corner + 2) / 3) * 3; //rounded to the next face
+	return first_corner < num_corners ? num_corners - first_corner : 0;
+}
 
-				vertices.push_back( indexed_positions[ (unsigned int)(v1.x) -1 ] );
-				vertices.push_back( indexed_positions[ (unsigned int)(v2.x) -1] );
-				vertices.push_back( indexed_positions[ (unsigned int)(v3.x) -1] );
-				//triangles.push_back( VECTOR_INDICES_TYPE(vertex_i, vertex_i+1, vertex_i+2) ); //not needed
-				vertex_i += 3;
+bool Mesh::loadOBJ(const char* filename)
+{
+	std::string data;
+	if(!readFile(filename,data))
+		return false;
 
-				if (indexed_uvs.size() > 0)
-				{
-					uvs.push_back( indexed_uvs[(unsigned int)(v1.y) -1] );
-					uvs.push_back( indexed_uvs[(unsigned int)(v2.y) -1] );
-					uvs.push_back( indexed_uvs[(unsigned int)(v3.y) -1] );
-				}
+	//split in chunks at line boundaries
+	const char* start = data.c_str();
+	const char* end = start + data.size();
+	size_t num_chunks = std::max<size_t>(1, std::min<size_t>(TaskManager::background.getNumThreads() + 1, data.size() / OBJ_CHUNK_MIN_SIZE));
+	std::vector<sOBJChunk> chunks(num_chunks);
+	const char* pos = start;
+	for (size_t i = 0; i < num_chunks; ++i)
+	{
+		const char* chunk_end = i == num_chunks - 1 ? end : (std::max)(pos, start + (data.size() * (i + 1)) / num_chunks);
+		while (chunk_end < end && !isOBJEndLine(*chunk_end)) chunk_end++;
+		chunks[i].start = pos;
+		chunks[i].end = chunk_end;
+		pos = chunk_end;
+	}
 
-				if (indexed_normals.size() > 0)
-				{
-					normals.push_back( indexed_normals[(unsigned int)(v1.z) -1] );
-					normals.push_back( indexed_normals[(unsigned int)(v2.z) -1] );
-					normals.push_back( indexed_normals[(unsigned int)(v3.z) -1] );
-				}
+	//scan
+	TaskManager::background.parallelFor(num_chunks, [&](size_t i) { parseOBJChunk(&chunks[i]); });
+
+	//stitch: global offsets of every chunk
+	const float max_float = 10000000;
+	const float min_float = -10000000;
+	aabb_min.set(max_float, max_float, max_float);
+	aabb_max.set(min_float, min_float, min_float);
+
+	unsigned int num_positions = 0, num_uvs = 0, num_normals = 0;
+	unsigned int num_corners = 0, num_out_uvs = 0, num_out_normals = 0;
+	for (auto& chunk : chunks)
+	{
+		unsigned int chunk_corners = (unsigned int)chunk.corners.size() / 3;
+		chunk.positions_offset = num_positions;
+		chunk.uvs_offset = num_uvs;
+		chunk.normals_offset = num_normals;
+		chunk.corners_offset = num_corners;
+		chunk.out_uvs_offset = num_out_uvs;
+		chunk.out_normals_offset = num_out_normals;
+		num_out_uvs += countOBJStreamCorners(chunk_corners, num_uvs, chunk.first_uv_corner);
+		num_out_normals += countOBJStreamCorners(chunk_corners, num_normals, chunk.first_normal_corner);
+		num_positions += (unsigned int)chunk.positions.size();
+		num_uvs += (unsigned int)chunk.uvs.size();
+		num_normals += (unsigned int)chunk.normals.size();
+		num_corners += chunk_corners;
+		if (chunk.positions.size())
+		{
+			aabb_min.setMin(chunk.aabb_min);
+			aabb_max.setMax(chunk.aabb_max);
+		}
+	}
+
+	std::vector<Vector3f> indexed_positions(num_positions);
+	std::vector<Vector3f> indexed_normals(num_normals);
+	std::vector<Vector2f> indexed_uvs(num_uvs);
+	for (auto& chunk : chunks)
+	{
+		if (chunk.positions.size())
+			memcpy(&indexed_positions[chunk.positions_offset], &chunk.positions[0], chunk.positions.size() * sizeof(Vector3f));
+		if (chunk.uvs.size())
+			memcpy(&indexed_uvs[chunk.uvs_offset], &chunk.uvs[0], chunk.uvs.size() * sizeof(Vector2f));
+		if (chunk.normals.size())
+			memcpy(&indexed_normals[chunk.normals_offset], &chunk.normals[0], chunk.normals.size() * sizeof(Vector3f));
+		chunk.positions.clear(); chunk.positions.shrink_to_fit();
+		chunk.uvs.clear(); chunk.uvs.shrink_to_fit();
+		chunk.normals.clear(); chunk.normals.shrink_to_fit();
+	}
+
+	//gather final streams
+	vertices.resize(num_corners);
+	uvs.resize(num_out_uvs);
+	normals.resize(num_out_normals);
+	TaskManager::background.parallelFor(num_chunks, [&](size_t i) {
+		gatherOBJChunk(this, &chunks[i], indexed_positions, indexed_uvs, indexed_normals);
+	});
+
+	//submeshes, events are processed in file order
+	sSubmeshInfo submesh_info;
+	unsigned int last_submesh_vertex = 0;
+	memset(&submesh_info, 0, sizeof(submesh_info));
+	for (auto& chunk : chunks)
+	{
+		for (auto& event : chunk.events)
+		{
+			unsigned int num_vertices = chunk.corners_offset + event.corner;
+			if (last_submesh_vertex != num_vertices)
+			{
+				submesh_info.length = num_vertices - submesh_info.start;
+				last_submesh_vertex = num_vertices;
+				submeshes.push_back(submesh_info);
+				memset(&submesh_info, 0, sizeof(submesh_info));
+				strcpy(submesh_info.name, event.name);
+				submesh_info.start = last_submesh_vertex;
 			}
+			else if (event.type == 'u')
+				strcpy(submesh_info.material, event.name);
 		}
 	}
 
@@ -1293,22 +1637,11 @@ bool Mesh::loadOBJTiny(const char* filename)
 
 bool Mesh::loadMESH(const char* filename)
 {
-	struct stat stbuffer;
-
-	FILE* f = fopen(filename, "rb");
-	if (f == NULL)
-	{
-		std::cerr << "File not found: " << filename << std::endl;
+	//the string keeps a null at the end, it can be inside a pak
+	std::string content;
+	if (!readFile(filename, content))
 		return false;
-	}
-	stat(filename, &stbuffer);
-
-	unsigned int size = stbuffer.st_size;
-	char* data = new char[size + 1];
-	fread(data, size, 1, f);
-	fclose(f);
-	data[size] = 0;
-	char* pos = data;
+	char* pos = &content[0];
 	char word[255];
 
 	while (*pos)
@@ -1367,7 +1700,6 @@ bool Mesh::loadMESH(const char* filename)
 			pos = fetchEndLine(pos);
 	}
 
-	delete[] data;
 
 	return true;
 }
@@ -1598,30 +1930,56 @@ void Mesh::createGrid(float dist)
 	}
 }
 
-void Mesh::updateBoundingBox()
+#define MESH_UV_DENSITY_SAMPLES 4096 //triangles used to estimate it
+
+//ratio between the size in UV space and in object space, averaged by area
+float Mesh::getUVDensity()
 {
-	if (vertices.size())
-	{
-		aabb_max = aabb_min = vertices[0];
-		for (int i = 1; i < vertices.size(); ++i)
+	if (uv_density >= 0)
+		return uv_density;
+
+	uv_density = 0;
+	bool use_interleaved = interleaved.size() > 0;
+	size_t num_vertices = use_interleaved ? interleaved.size() : vertices.size();
+	if (!num_vertices || (!use_interleaved && uvs.size() != vertices.size()))
+		return uv_density;
+
+	size_t num_triangles = (m_indices.size() ? m_indices.size() : num_vertices) / 3;
+	size_t step = (std::max)((size_t)1, num_triangles / MESH_UV_DENSITY_SAMPLES);
+	double uv_area = 0;
+	double area = 0;
+	for (size_t i = 0; i < num_triangles; i += step)
+	{
+		Vector3f p[3];
+		Vector2f uv[3];
+		for (int j = 0; j < 3; ++j)
 		{
-			aabb_min.setMin(vertices[i]);
-			aabb_max.setMax(vertices[i]);
+			size_t v = m_indices.size() ? m_indices[i * 3 + j] : i * 3 + j;
+			p[j] = use_interleaved ? interleaved[v].vertex : vertices[v];
+			uv[j] = use_interleaved ? interleaved[v].uv : uvs[v];
 		}
+		area += (p[1] - p[0]).cross(p[2] - p[0]).length() * 0.5;
+		uv_area += fabs((uv[1].x - uv[0].x) * (uv[2].y - uv[0].y) - (uv[2].x - uv[0].x) * (uv[1].y - uv[0].y)) * 0.5;
 	}
+
+	if (area > 0)
+		uv_density = (float)sqrt(uv_area / area);
+	return uv_density;
+}
+
+void Mesh::updateBoundingBox()
+{
+	if (vertices.size())
+		box = computeBoundingBox(&vertices[0], vertices.size());
 	else if (interleaved.size())
-	{
-		aabb_max = aabb_min = interleaved[0].vertex;
-		for (int i = 1; i < interleaved.size(); ++i)
-		{
-			aabb_min.setMin(interleaved[i].vertex);
-			aabb_max.setMax(interleaved[i].vertex);
-		}
-	}
-	box.center = (aabb_max + aabb_min) * 0.5f;
-	box.halfsize = aabb_max - box.center;
+		box = computeBoundingBox(&interleaved[0].vertex, interleaved.size(), sizeof(interleaved[0]));
+	else
+		box = BoundingBox((aabb_max + aabb_min) * 0.5f, (aabb_max - aabb_min) * 0.5f);
+	aabb_min = box.center - box.halfsize;
+	aabb_max = box.center + box.halfsize;
 }
 
+#ifndef SKIP_GL
 Mesh* wire_box = NULL;
 
 void Mesh::renderBounding( const Matrix44& model, bool world_bounding )
@@ -1672,6 +2030,19 @@ Mesh* Mesh::getQuad()
 	}
 	return quad;
 }
+#endif //SKIP_GL
+
+bool Mesh::load(const char* filename)
+{
+	std::string ext = toLowerCase(getExtension(filename));
+	if (ext == "obj")
+		return loadOBJ(filename);
+	if (ext == "ase")
+		return loadASE(filename);
+	if (ext == "mesh")
+		return loadMESH(filename);
+	return false;
+}
 
 Mesh* Mesh::Get(const char* filename, bool skip_load)
 {
@@ -1711,8 +2082,9 @@ Mesh* Mesh::Get(const char* filename, bool skip_load)
 	if (file_format != FORMAT_MBIN)
 		binfilename = binfilename + ".mbin";
 
-	//try loading the binary version
-	if (use_binary && m->readBin(binfilename.c_str()) )
+	//try loading the binary version, first the one from the cooker
+	bool cooked = use_cooked_assets && m->readBin(getCookedFilename(binfilename).c_str());
+	if (cooked || (use_binary && m->readBin(binfilename.c_str())) )
 	{
 		if (interleave_meshes && m->interleaved.size() == 0)
 		{
@@ -1726,21 +2098,13 @@ Mesh* Mesh::Get(const char* filename, bool skip_load)
 			m->uploadToVRAM();
 		}
 
-		std::cout << "[OK BIN]  Faces: " << (m->interleaved.size() ? m->interleaved.size() : m->vertices.size()) / 3 << " Time: " << (getTime() - time) * 0.001 << "sec" << std::endl;
+		std::cout << (cooked ? "[OK COOKED]  Faces: " : "[OK BIN]  Faces: ") << (m->interleaved.size() ? m->interleaved.size() : m->vertices.size()) / 3 << " Time: " << (getTime() - time) * 0.001 << "sec" << std::endl;
 		sMeshesLoaded[filename] = m;
 		return m;
 	}
 
 	//load the ascii version
-	bool loaded = false;
-	if (file_format == FORMAT_OBJ)
-		loaded = m->loadOBJ(filename);
-	else if (file_format == FORMAT_ASE)
-		loaded = m->loadASE(filename);
-	else if (file_format == FORMAT_MESH)
-		loaded = m->loadMESH(filename);
-
-	if (!loaded)
+	if (!m->load(filename))
 	{
 		delete m;
 		std::cout << "[ERROR]: Mesh not found" << std::endl;
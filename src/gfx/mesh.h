@@ -16,9 +16,11 @@ namespace GFX {
 
 	class Shader; //for binding
 	class Skeleton; //for skinned meshes
+	class TriangleBVH;
+	struct sRayHit;
 
 	//version from 11/5/2020
-#define MESH_BIN_VERSION 11 //this is used to regenerate bins if the format changes
+#define MESH_BIN_VERSION 12 //this is used to regenerate bins if the format changes
 
 	struct sSubmeshInfo
 	{
@@ -72,6 +74,7 @@ namespace GFX {
 		BoundingBox box;
 
 		float radius;
+		float uv_density; //UV units per object unit, computed when needed, -1 until then
 
 		unsigned int vao_id; //Vertex Array Object
 
@@ -81,6 +84,7 @@ namespace GFX {
 		unsigned int colors_vbo_id;
 
 		unsigned int indices_vbo_id;
+		unsigned int index_size; //bytes per index in the VRAM, 2 when every index fits in 16 bits, otherwise 4
 		unsigned int interleaved_vbo_id;
 		unsigned int bones_vbo_id;
 		unsigned int weights_vbo_id;
@@ -92,7 +96,7 @@ namespace GFX {
 		void clear();
 
 		void render(unsigned int primitive, int submesh_id = -1, int num_instances = 0);
-		void renderInstanced(unsigned int primitive, const Matrix44* instanced_models, int number);
+		void renderInstanced(unsigned int primitive, const Matrix44* instanced_models, int number, const Vector4f* instanced_data = nullptr); //data goes to the attribute a_instance
 		void renderBounding(const Matrix44& model, bool world_bounding = true);
 		void renderFixedPipeline(int primitive); //sloooooooow
 		//void renderAnimated(unsigned int primitive, Skeleton *sk);
@@ -100,21 +104,28 @@ namespace GFX {
 		void enableBuffers(Shader* shader); //if shader is null the attrib locations must be POS=0, NORM=1, COORD=2, COORD1=3, COLOR=4, BONES=5, WEIGHTS=6
 		void drawCall(unsigned int primitive, int submesh_id = -1, int num_instances = 0);
 		void disableBuffers(Shader* shader);
+		unsigned int getIndexType(); //GL_UNSIGNED_SHORT or GL_UNSIGNED_INT depending on the index buffer uploaded
 
 		void getSubmeshStartAndSize(int submesh_id, unsigned int& start, unsigned int& size);
 
+		bool load(const char* filename); //parses the source file (ASE, OBJ, MESH) without uploading it, used by the cooker
 		bool readBin(const char* filename);
 		bool writeBin(const char* filename);
 
 		unsigned int getNumSubmeshes() { return (unsigned int)submeshes.size(); }
 		unsigned int getNumVertices() { return (unsigned int)interleaved.size() ? (unsigned int)interleaved.size() : (unsigned int)vertices.size(); }
 
-		//collision testing
-		void* collision_model;
-		bool createCollisionModel(bool is_static = false); //is_static sets if the inv matrix should be computed after setTransform (true) or before rayCollision (false)
+		//collision testing, against a BVH of the triangles in object space built the first time it is needed (or in the background)
+		TriangleBVH* collision_bvh;
+		bool collision_bvh_pending; //being built in the background
+		void buildCollisionBVH(bool in_background = false);
+		const TriangleBVH* getCollisionBVH(bool wait = true); //without wait it is built in the background and it is NULL until it finishes
 		//help: model is the transform of the mesh, ray origin and direction, a Vector3 where to store the collision if found, a Vector3 where to store the normal if there was a collision, max ray distance in case the ray should go to infintiy, and in_object_space to get the collision point in object space or world space
-		bool testRayCollision(Matrix44 model, Vector3f ray_origin, Vector3f ray_direction, Vector3f& collision, Vector3f& normal, float max_ray_dist = 3.4e+38F, bool in_object_space = false);
-		bool testSphereCollision(Matrix44 model, Vector3f center, float radius, Vector3f& collision, Vector3f& normal);
+		bool testRayCollision(const Matrix44& model, const Vector3f& ray_origin, const Vector3f& ray_direction, Vector3f& collision, Vector3f& normal, float max_ray_dist = 3.4e+38F, bool in_object_space = false);
+		//many rays in world space at once (the model is inverted once), hits[i].t is in units of directions[i] and the normals are in world space. Returns how many hit
+		int testRaysCollision(const Matrix44& model, int count, const Vector3f* origins, const Vector3f* directions, sRayHit* hits, float max_t = 3.4e+38F);
+		//exact with uniform scales, the sphere becomes bigger in the shorter axis of a non uniform scale
+		bool testSphereCollision(const Matrix44& model, const Vector3f& center, float radius, Vector3f& collision, Vector3f& normal);
 
 		//loader
 		static Mesh* Get(const char* filename, bool skip_load = false);
@@ -133,9 +144,11 @@ namespace GFX {
 		static Mesh* getQuad(); //get global quad
 
 		void updateBoundingBox();
+		float getUVDensity(); //used to estimate the mip needed, 0 if it has no uvs
 
 		//optimize meshes
 		void uploadToVRAM();
+		void updateVerticesInVRAM(); //reuploads only vertices and normals, for meshes deformed in the CPU every frame
 		void drawUsingVAO(unsigned int primitive, int submesh_id = -1);
 		bool interleaveBuffers();
 
@@ -0,0 +1,315 @@
+#include "mipmaps.h"
+
+#include <cmath>
+#include <cstring>
+#include <algorithm>
+
+#include "texture.h"
+#include "../core/task.h"
+#include "../utils/utils.h"
+
+#if defined(__SSE__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 1)
+	#define MIPS_USE_SSE
+	#include <xmmintrin.h>
+#endif
+
+#define MIPS_MAX_TAPS 6
+#define MIPS_SRGB_LUT_SIZE 16384 //linear to sRGB, fine enough for the darkest values
+
+namespace {
+
+	struct sFilter {
+		int num_taps;
+		int first; //offset of the first tap from 2 * x
+		float weights[MIPS_MAX_TAPS];
+	};
+
+	double besselI0(double x)
+	{
+		double sum = 1.0, term = 1.0;
+		for (int k = 1; k < 32; ++k)
+		{
+			term *= (x * 0.5 / k) * (x * 0.5 / k);
+			sum += term;
+		}
+		return sum;
+	}
+
+	sFilter createFilter(GFX::MipGenerator::eFilter type)
+	{
+		sFilter filter;
+		if (type == GFX::MipGenerator::BOX)
+		{
+			filter.num_taps = 2;
+			filter.first = 0;
+			filter.weights[0] = filter.weights[1] = 0.5f;
+			return filter;
+		}
+
+		//sinc at the frequency of the destination with a Kaiser window of 3 destination pixels
+		const double alpha = 4.0, radius = 1.5;
+		filter.num_taps = 6;
+		filter.first = -2;
+		double total = 0;
+		double weights[MIPS_MAX_TAPS];
+		for (int i = 0; i < filter.num_taps; ++i)
+		{
+			double t = (filter.first + i + 0.5 - 1.0) * 0.5; //distance between centers, in destination pixels
+			double sinc = t == 0 ? 1.0 : sin(PI * t) / (PI * t);
+			double window = besselI0(alpha * sqrt((std::max)(0.0, 1.0 - (t / radius) * (t / radius)))) / besselI0(alpha);
+			weights[i] = sinc * window;
+			total += weights[i];
+		}
+		for (int i = 0; i < filter.num_taps; ++i)
+			filter.weights[i] = (float)(weights[i] / total);
+		return filter;
+	}
+
+	struct sTables {
+		float to_linear[256];
+		uint8 to_srgb[MIPS_SRGB_LUT_SIZE];
+		float to_float[256];
+
+		sTables()
+		{
+			for (int i = 0; i < 256; ++i)
+			{
+				float c = i / 255.0f;
+				to_linear[i] = c <= 0.04045f ? c / 12.92f : powf((c + 0.055f) / 1.055f, 2.4f);
+				to_float[i] = c;
+			}
+			for (int i = 0; i < MIPS_SRGB_LUT_SIZE; ++i)
+			{
+				float c = (i + 0.5f) / MIPS_SRGB_LUT_SIZE;
+				c = c <= 0.0031308f ? c * 12.92f : 1.055f * powf(c, 1.0f / 2.4f) - 0.055f;
+				to_srgb[i] = (uint8)(c * 255.0f + 0.5f);
+			}
+		}
+	};
+
+	const sTables& getTables()
+	{
+		static sTables tables;
+		return tables;
+	}
+
+	inline int wrapIndex(int i, int size, bool wrap)
+	{
+		if (wrap)
+			return ((i % size) + size) % size;
+		return (std::min)((std::max)(i, 0), size - 1);
+	}
+
+	//one level in linear floats, always RGBA
+	struct sLevel {
+		int width = 0;
+		int height = 0;
+		std::vector<float> pixels;
+	};
+
+	void toFloat(const Image* image, sLevel& level, bool srgb)
+	{
+		const sTables& tables = getTables();
+		const float* lut = srgb ? tables.to_linear : tables.to_float;
+		int nc = image->num_channels;
+		level.width = image->width;
+		level.height = image->height;
+		level.pixels.resize((size_t)level.width * level.height * 4);
+		size_t num_pixels = (size_t)level.width * level.height;
+		for (size_t i = 0; i < num_pixels; ++i)
+		{
+			const uint8* src = image->data + i * nc;
+			float* dst = &level.pixels[i * 4];
+			dst[0] = lut[src[0]];
+			dst[1] = lut[src[nc > 1 ? 1 : 0]];
+			dst[2] = lut[src[nc > 2 ? 2 : 0]];
+			dst[3] = nc == 4 ? tables.to_float[src[3]] : 1.0f;
+		}
+	}
+
+	//dst += weight * src, for count floats
+	inline void accumulate(float* dst, const float* src, float weight, int count)
+	{
+		int i = 0;
+#ifdef MIPS_USE_SSE
+		__m128 w = _mm_set1_ps(weight);
+		for (; i + 4 <= count; i += 4)
+			_mm_storeu_ps(dst + i, _mm_add_ps(_mm_loadu_ps(dst + i), _mm_mul_ps(_mm_loadu_ps(src + i), w)));
+#endif
+		for (; i < count; ++i)
+			dst[i] += src[i] * weight;
+	}
+
+	//vertical pass of every destination row into a temporary row, then horizontal
+	void downsample(const sLevel& src, sLevel& dst, const sFilter& filter, bool wrap)
+	{
+		dst.width = (std::max)(1, src.width / 2);
+		dst.height = (std::max)(1, src.height / 2);
+		dst.pixels.resize((size_t)dst.width * dst.height * 4);
+		sFilter identity = { 1, 0, { 1.0f } };
+		const sFilter& vertical = src.height > 1 ? filter : identity;
+		const sFilter& horizontal = src.width > 1 ? filter : identity;
+		int row_floats = src.width * 4;
+
+		TaskManager::background.parallelFor(dst.height, [&](size_t y) {
+			std::vector<float> temp(row_floats, 0.0f);
+			int sy = src.height > 1 ? (int)y * 2 : (int)y;
+			for (int k = 0; k < vertical.num_taps; ++k)
+			{
+				int row = wrapIndex(sy + vertical.first + k, src.height, wrap);
+				accumulate(&temp[0], &src.pixels[(size_t)row * row_floats], vertical.weights[k], row_floats);
+			}
+
+			float* out = &dst.pixels[y * dst.width * 4];
+			for (int x = 0; x < dst.width; ++x)
+			{
+				int sx = src.width > 1 ? x * 2 : x;
+#ifdef MIPS_USE_SSE
+				__m128 acc = _mm_setzero_ps();
+				for (int k = 0; k < horizontal.num_taps; ++k)
+				{
+					int col = wrapIndex(sx + horizontal.first + k, src.width, wrap);
+					acc = _mm_add_ps(acc, _mm_mul_ps(_mm_loadu_ps(&temp[col * 4]), _mm_set1_ps(horizontal.weights[k])));
+				}
+				_mm_storeu_ps(out + x * 4, acc);
+#else
+				float acc[4] = { 0,0,0,0 };
+				for (int k = 0; k < horizontal.num_taps; ++k)
+				{
+					int col = wrapIndex(sx + horizontal.first + k, src.width, wrap);
+					for (int c = 0; c < 4; ++c)
+						acc[c] += temp[col * 4 + c] * horizontal.weights[k];
+				}
+				memcpy(out + x * 4, acc, sizeof(acc));
+#endif
+			}
+		}, 8);
+	}
+
+	//stored as [0..1], the length is 1 in [-1..1]
+	void renormalize(sLevel& level)
+	{
+		size_t num_pixels = (size_t)level.width * level.height;
+		for (size_t i = 0; i < num_pixels; ++i)
+		{
+			float* p = &level.pixels[i * 4];
+			float x = p[0] * 2.0f - 1.0f, y = p[1] * 2.0f - 1.0f, z = p[2] * 2.0f - 1.0f;
+			float length = sqrtf(x * x + y * y + z * z);
+			if (length < 1e-6f)
+			{
+				x = y = 0.0f; z = length = 1.0f;
+			}
+			p[0] = x / length * 0.5f + 0.5f;
+			p[1] = y / length * 0.5f + 0.5f;
+			p[2] = z / length * 0.5f + 0.5f;
+		}
+	}
+
+	float getCoverage(const sLevel& level, float cutoff, float scale)
+	{
+		size_t num_pixels = (size_t)level.width * level.height, count = 0;
+		for (size_t i = 0; i < num_pixels; ++i)
+			if (level.pixels[i * 4 + 3] * scale > cutoff)
+				count++;
+		return count / (float)num_pixels;
+	}
+
+	//the alpha scale that gives the same coverage than the first level
+	float findAlphaScale(const sLevel& level, float cutoff, float coverage)
+	{
+		float low = 0.0f, high = 4.0f;
+		for (int i = 0; i < 12; ++i)
+		{
+			float middle = (low + high) * 0.5f;
+			if (getCoverage(level, cutoff, middle) < coverage)
+				low = middle;
+			else
+				high = middle;
+		}
+		//the coverage jumps when many pixels share the same alpha, the closest side
+		float low_error = coverage - getCoverage(level, cutoff, low);
+		float high_error = getCoverage(level, cutoff, high) - coverage;
+		return low_error < high_error ? low : high;
+	}
+
+	void toImage(const sLevel& level, Image* image, int num_channels, bool srgb, float alpha_scale)
+	{
+		const sTables& tables = getTables();
+		image->resize(level.width, level.height, num_channels);
+		size_t num_pixels = (size_t)level.width * level.height;
+		for (size_t i = 0; i < num_pixels; ++i)
+		{
+			const float* src = &level.pixels[i * 4];
+			uint8* dst = image->data + i * num_channels;
+			for (int c = 0; c < (std::min)(num_channels, 3); ++c)
+			{
+				float v = clamp(src[c], 0.0f, 1.0f);
+				dst[c] = srgb ? tables.to_srgb[(std::min)((int)(v * MIPS_SRGB_LUT_SIZE), MIPS_SRGB_LUT_SIZE - 1)] : (uint8)(v * 255.0f + 0.5f);
+			}
+			if (num_channels == 4)
+				dst[3] = (uint8)(clamp(src[3] * alpha_scale, 0.0f, 1.0f) * 255.0f + 0.5f);
+		}
+	}
+};
+
+GFX::MipGenerator::MipGenerator()
+{
+	default_filter = KAISER;
+}
+
+void GFX::MipGenerator::build(Image* image, std::vector<Image*>& levels, const sOptions& options)
+{
+	levels.push_back(image);
+	if (!isPowerOfTwo(image->width) || !isPowerOfTwo(image->height) || (image->width == 1 && image->height == 1))
+		return;
+
+	sFilter filter = createFilter(options.filter);
+	bool alpha_test = options.alpha_cutoff >= 0 && image->num_channels == 4;
+	sLevel current, next;
+	toFloat(image, current, options.srgb && !options.normal_map);
+	float coverage = alpha_test ? getCoverage(current, options.alpha_cutoff, 1.0f) : 0.0f;
+
+	while (current.width > 1 || current.height > 1)
+	{
+		downsample(current, next, filter, options.wrap);
+		if (options.normal_map)
+			renormalize(next);
+
+		float alpha_scale = alpha_test ? findAlphaScale(next, options.alpha_cutoff, coverage) : 1.0f;
+		Image* mip = new Image();
+		toImage(next, mip, image->num_channels, options.srgb && !options.normal_map, alpha_scale);
+		levels.push_back(mip);
+		std::swap(current, next);
+	}
+}
+
+void GFX::MipGenerator::setOptions(const std::string& filename, const sOptions& options)
+{
+	MipGenerator& generator = instance();
+	std::lock_guard<std::mutex> lock(generator.mutex);
+	generator.options[filename] = options;
+}
+
+GFX::MipGenerator::sOptions GFX::MipGenerator::getOptions(const std::string& filename)
+{
+	MipGenerator& generator = instance();
+	{
+		std::lock_guard<std::mutex> lock(generator.mutex);
+		auto it = generator.options.find(filename);
+		if (it != generator.options.end())
+			return it->second;
+	}
+	return guessOptions(filename);
+}
+
+//conventions of the texture names, color unless it looks like data
+GFX::MipGenerator::sOptions GFX::MipGenerator::guessOptions(const std::string& filename)
+{
+	sOptions options;
+	options.filter = instance().default_filter;
+	std::string name = toLowerCase(filename.substr(filename.find_last_of("/\\") + 1));
+	auto has = [&](const char* word) { return name.find(word) != std::string::npos; };
+	options.normal_map = has("normal") || has("_nrm") || has("_nor");
+	options.srgb = !options.normal_map && !has("rough") && !has("metal") && !has("_ao") && !has("occlusion") && !has("height") && !has("disp") && !has("mask") && !has("brdf");
+	return options;
+}
@@ -0,0 +1,57 @@
+/*  Mip generator
+	Builds the whole mip chain on the CPU so the GPU receives it ready (no glGenerateMipmap):
+	 + the pixels are filtered in linear space (sRGB textures are converted before and after) with floats,
+	   SSE works on the four channels of a pixel at once and the rows of a level are split between the threads
+	 + Kaiser windowed sinc (6 taps, sharper) or box filter (2 taps)
+	 + normal maps are renormalized in every level
+	 + alpha tested textures (MASK) keep the same coverage of the cutoff in every level, so they do not vanish with the distance
+	How an image is used is only known by the material, the glTF importer registers it before loading (see setOptions).
+*/
+#pragma once
+
+#include <map>
+#include <mutex>
+#include <string>
+#include <vector>
+
+class Image;
+
+namespace GFX {
+
+	class MipGenerator {
+	private:
+		MipGenerator();
+
+	public:
+		static MipGenerator& instance()
+		{
+			static MipGenerator INSTANCE;
+			return INSTANCE;
+		}
+
+		enum eFilter {
+			BOX,
+			KAISER
+		};
+
+		struct sOptions {
+			eFilter filter = KAISER;
+			bool srgb = false; //color data (albedo, emissive)
+			bool normal_map = false;
+			bool wrap = true; //how the filter reads beyond the borders
+			float alpha_cutoff = -1.0f; //negative when the alpha is not tested
+		};
+
+		eFilter default_filter;
+		std::map<std::string, sOptions> options; //by filename
+		std::mutex mutex;
+
+		//levels[0] is the image itself, the rest until 1x1 are new. Non power of two images do not have mips
+		static void build(Image* image, std::vector<Image*>& levels, const sOptions& options);
+
+		//the loaders ask for the options of a file, if nobody registered them they are guessed from the name
+		static void setOptions(const std::string& filename, const sOptions& options);
+		static sOptions getOptions(const std::string& filename);
+		static sOptions guessOptions(const std::string& filename);
+	};
+};
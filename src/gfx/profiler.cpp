@@ -0,0 +1,146 @@
+#include "profiler.h"
+
+#include <algorithm>
+
+#include "gfx.h"
+
+GFX::Profiler::Profiler()
+{
+	is_active = false;
+	keep_history = false;
+	current_slot = -1;
+	last.frame = -1;
+	for (int i = 0; i < PROFILER_FRAMES; ++i)
+		slots[i].pending = false;
+}
+
+void GFX::Profiler::beginFrame(long frame)
+{
+	Profiler& profiler = instance();
+	profiler.current_slot = -1;
+	profiler.stack.clear();
+	if (!profiler.is_active)
+	{
+		startGPULabel("Frame");
+		return;
+	}
+
+	int index = (int)(frame % PROFILER_FRAMES);
+	sSlot& slot = profiler.slots[index];
+	if (slot.pending) //issued PROFILER_FRAMES frames ago, it should be ready
+		profiler.resolve(slot);
+
+	slot.times.frame = frame;
+	slot.times.passes.clear();
+	slot.starts.clear();
+	profiler.current_slot = index;
+	begin("Frame");
+}
+
+void GFX::Profiler::endFrame()
+{
+	Profiler& profiler = instance();
+	if (profiler.current_slot == -1)
+	{
+		endGPULabel();
+		return;
+	}
+	//the passes left open are closed with the frame
+	while (profiler.stack.size())
+		end();
+	profiler.slots[profiler.current_slot].pending = true;
+	profiler.current_slot = -1;
+}
+
+void GFX::Profiler::begin(const char* name)
+{
+	startGPULabel(name);
+	Profiler& profiler = instance();
+	if (profiler.current_slot == -1)
+		return;
+
+	sSlot& slot = profiler.slots[profiler.current_slot];
+	int index = (int)slot.times.passes.size();
+	while (slot.queries.size() < (size_t)(index + 1) * 2)
+	{
+		GLuint query = 0;
+		glGenQueries(1, &query);
+		slot.queries.push_back(query);
+	}
+
+	slot.times.passes.push_back({ name, (int)profiler.stack.size(), 0.0, 0.0 });
+	slot.starts.push_back(std::chrono::steady_clock::now());
+	glQueryCounter(slot.queries[index * 2], GL_TIMESTAMP);
+	profiler.stack.push_back(index);
+}
+
+void GFX::Profiler::end()
+{
+	endGPULabel();
+	Profiler& profiler = instance();
+	if (profiler.current_slot == -1 || profiler.stack.empty())
+		return;
+
+	sSlot& slot = profiler.slots[profiler.current_slot];
+	int index = profiler.stack.back();
+	profiler.stack.pop_back();
+	glQueryCounter(slot.queries[index * 2 + 1], GL_TIMESTAMP);
+	slot.times.passes[index].cpu_time = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - slot.starts[index]).count();
+}
+
+void GFX::Profiler::resolve(sSlot& slot)
+{
+	for (size_t i = 0; i < slot.times.passes.size(); ++i)
+	{
+		GLuint64 start = 0, finish = 0;
+		glGetQueryObjectui64v(slot.queries[i * 2], GL_QUERY_RESULT, &start);
+		glGetQueryObjectui64v(slot.queries[i * 2 + 1], GL_QUERY_RESULT, &finish);
+		slot.times.passes[i].gpu_time = finish > start ? (finish - start) * 0.000001 : 0.0; //ns to ms
+	}
+	slot.pending = false;
+
+	last = slot.times;
+	if (keep_history)
+		history.push_back(slot.times);
+}
+
+void GFX::Profiler::flush()
+{
+	Profiler& profiler = instance();
+
+	//oldest first, so the history stays in order
+	std::vector<sSlot*> pending;
+	for (int i = 0; i < PROFILER_FRAMES; ++i)
+		if (profiler.slots[i].pending)
+			pending.push_back(&profiler.slots[i]);
+	std::sort(pending.begin(), pending.end(), [](const sSlot* a, const sSlot* b) { return a->times.frame < b->times.frame; });
+	for (sSlot* slot : pending)
+		profiler.resolve(*slot);
+}
+
+void GFX::Profiler::clear()
+{
+	Profiler& profiler = instance();
+	for (int i = 0; i < PROFILER_FRAMES; ++i)
+		profiler.slots[i].pending = false;
+	profiler.history.clear();
+	profiler.last.frame = -1;
+	profiler.last.passes.clear();
+}
+
+void GFX::Profiler::showUI()
+{
+#ifndef SKIP_IMGUI
+	Profiler& profiler = instance();
+
+	ImGui::Checkbox("Profiler", &profiler.is_active);
+	if (profiler.is_active) {
+		if (ImGui::TreeNode("Profiler times")) {
+			ImGui::Text("Frame %d (ms)", (int)profiler.last.frame);
+			for (sPass& pass : profiler.last.passes)
+				ImGui::Text("%*s%-20s CPU %6.2f  GPU %6.2f", pass.depth * 2, "", pass.name.c_str(), pass.cpu_time, pass.gpu_time);
+			ImGui::TreePop();
+		}
+	}
+#endif
+}
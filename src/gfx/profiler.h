@@ -0,0 +1,73 @@
+/*  Profiler: CPU and GPU time of the passes of every frame
+	+ every pass is marked with begin(name) and end(), they can be nested, the frame itself is the first pass
+	+ the CPU time is measured with the steady clock, the GPU time with two timestamp queries (GL_TIMESTAMP),
+	  unlike GL_TIME_ELAPSED they can be nested
+	+ the queries of a frame are read PROFILER_FRAMES frames later so the CPU never waits for the GPU
+	+ the passes also open a debug group (startGPULabel) so they appear in the frame debuggers
+	The benchmark (see benchmark.h) keeps the times of every frame in the history.
+*/
+#pragma once
+
+#include <vector>
+#include <string>
+#include <chrono>
+
+#include "../core/includes.h"
+
+namespace GFX {
+
+	#define PROFILER_FRAMES 4 //in flight, the results of a frame arrive this number of frames later
+
+	class Profiler {
+	private:
+		Profiler();
+
+	public:
+		static Profiler& instance()
+		{
+			static Profiler INSTANCE;
+			return INSTANCE;
+		}
+
+		struct sPass {
+			std::string name;
+			int depth; //0 is the frame
+			double cpu_time; //ms
+			double gpu_time; //ms
+		};
+
+		struct sFrame {
+			long frame;
+			std::vector<sPass> passes; //in the order they started
+		};
+
+		struct sSlot {
+			sFrame times;
+			std::vector<GLuint> queries; //begin and end of every pass
+			std::vector<std::chrono::steady_clock::time_point> starts;
+			bool pending;
+		};
+
+		bool is_active;
+		bool keep_history; //every frame is stored in the history, otherwise only the last one
+
+		sFrame last; //the last frame with all its times
+		std::vector<sFrame> history;
+
+		sSlot slots[PROFILER_FRAMES];
+		int current_slot; //-1 outside of a frame
+		std::vector<int> stack; //passes open
+
+		static void beginFrame(long frame);
+		static void endFrame();
+		static void begin(const char* name);
+		static void end();
+
+		static void flush(); //waits for the frames in flight
+		static void clear(); //drops the frames in flight and the history
+		static void showUI();
+
+	private:
+		void resolve(sSlot& slot);
+	};
+};
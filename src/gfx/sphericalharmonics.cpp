@@ -1,5 +1,19 @@
 #include "sphericalharmonics.h"
 
+#include <map>
+#include <mutex>
+#include <memory>
+#include <cstring>
+
+#include "../core/task.h"
+
+#if defined(__SSE__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 1)
+    #define SH_USE_SSE
+    #include <xmmintrin.h>
+#endif
+
+#define SH_ROWS_PER_TASK 8
+
 //system axis
 Vector3f cubemapFaceNormals[6][3] = {
     {{0, 0, -1} ,{0, -1, 0},{1, 0, 0} },  // posx
@@ -13,8 +27,6 @@ Vector3f cubemapFaceNormals[6][3] = {
 };
 
 const int sh_length = 9;
-std::vector< std::vector<Vector3f> > cubeMapVecs;
-int cubeMapVecs_size = 0;
 
 float areaElement(float x, float y) {
     return atan2(x * y, sqrtf(x * x + y * y + 1.0f));
@@ -40,86 +52,164 @@ float texelSolidAngle(float aU, float aV, float width, float height) {
     return angle;
 }
 
-// give me a cubemap, its size and number of channels
-// and i'll give you spherical harmonics
-SphericalHarmonics computeSH( FloatImage images[], bool degamma ) {
-	assert(images[0].width == images[0].height && images[0].width != 0 && "Image is not square");
-    int size = images[0].width;
-    int channels = 3;
-    SphericalHarmonics sh;
+namespace {
 
-    // generate cube map vectors
-    if (cubeMapVecs_size != size)
+    // the same for the six faces: (u, v) of the texel center, 1 / length(u, v, 1) and the solid angle
+    struct sSHTable {
+        int size;
+        std::vector<float> texels;
+        float total_weight; // of the six faces
+    };
+
+    std::mutex tables_mutex;
+    std::map<int, std::shared_ptr<const sSHTable>> tables;
+
+    std::shared_ptr<const sSHTable> getTable(int size)
     {
-        cubeMapVecs_size = size;
-        cubeMapVecs.clear();
-        for (int index = 0; index < 6; ++index)
-        {
-            std::vector<Vector3f> faceVecs;
-            for (int v = 0; v < size; v++) {
-                for (int u = 0; u < size; u++)
-                {
-                    float fU = (2.0f * u / (size - 1.0f)) - 1.0f;
-                    float fV = (2.0f * v / (size - 1.0f)) - 1.0f;
-
-                    Vector3f vecX = cubemapFaceNormals[index][0] * fU;
-                    Vector3f vecY = cubemapFaceNormals[index][1] * fV;
-                    Vector3f vecZ = cubemapFaceNormals[index][2];
-
-                    Vector3f res = normalize(vecX + vecY + vecZ);
-                    faceVecs.push_back(res);
-                }
+        std::lock_guard<std::mutex> lock(tables_mutex);
+        auto it = tables.find(size);
+        if (it != tables.end())
+            return it->second;
+
+        std::shared_ptr<sSHTable> table = std::make_shared<sSHTable>();
+        table->size = size;
+        table->texels.resize((size_t)size * size * 4);
+        double total = 0;
+        for (int y = 0; y < size; ++y)
+            for (int x = 0; x < size; ++x)
+            {
+                float* texel = &table->texels[((size_t)y * size + x) * 4];
+                texel[0] = 2.0f * (x + 0.5f) / size - 1.0f;
+                texel[1] = 2.0f * (y + 0.5f) / size - 1.0f;
+                texel[2] = 1.0f / sqrtf(texel[0] * texel[0] + texel[1] * texel[1] + 1.0f);
+                texel[3] = texelSolidAngle(x, y, size, size);
+                total += texel[3];
             }
-            cubeMapVecs.push_back(faceVecs);
-        }
+        table->total_weight = (float)(total * 6.0);
+        tables[size] = table;
+        return table;
     }
 
-    // generate spherical harmonics
-    float weightAccum = 0;
+    // a block of rows of one face of one probe
+    struct sSHJob {
+        int probe;
+        int face;
+        int first_row;
+        int num_rows;
+        float sums[sh_length][4] = {};
+    };
 
-    for (int index = 0; index < 6; ++index)
+    void projectRows(const sSHCubemap& cubemap, const sSHTable& table, sSHJob& job, bool degamma)
     {
-        FloatImage& face = images[index];
-        float* pixels = face.data;
-        bool gammaCorrect = degamma;
-        for (int y = 0; y < size; y++) {
-            for (int x = 0; x < size; x++) {
-                Vector3f texelVect = cubeMapVecs[index][y * size + x];
-                float weight = texelSolidAngle(x, y, size, size);
-                    // forsyths weights
-                float weight1 = weight * 4 / 17;
-                float weight2 = weight * 8 / 17;
-                float weight3 = weight * 15 / 17;
-                float weight4 = weight * 5 / 68;
-                float weight5 = weight * 15 / 68;
-
-                float dx = texelVect[0];
-                float dy = texelVect[1];
-                float dz = texelVect[2];
-
-                Vector3f value = face.getPixel(x,y).xyz();
-                if (gammaCorrect)
-                    value = Vector3f(pow(value.x, 2.2), pow(value.y, 2.2), pow(value.z, 2.2));
-                    
-                sh.coeffs[0] += value * weight1;
-                sh.coeffs[1] += value * weight2 * dy;
-                sh.coeffs[2] += value * weight2 * dz;
-                sh.coeffs[3] += value * weight2 * dx;
-
-                sh.coeffs[4] += value * weight3 * dx * dy;
-                sh.coeffs[5] += value * weight3 * dy * dz;
-                sh.coeffs[6] += value * weight4 * (3.0f * dz * dz - 1.0f);
-
-                sh.coeffs[7] += value * weight3 * dx * dz;
-                sh.coeffs[8] += value * weight5 * (dx * dx - dy * dy);
-
-                weightAccum += weight * 3.0f;
+        int size = cubemap.size;
+        int nc = cubemap.num_channels;
+        const Vector3f* axis = cubemapFaceNormals[job.face];
+        const float* pixels = cubemap.faces[job.face];
+
+#ifdef SH_USE_SSE
+        __m128 acc[sh_length];
+        for (int i = 0; i < sh_length; ++i)
+            acc[i] = _mm_setzero_ps();
+#else
+        memset(job.sums, 0, sizeof(job.sums));
+#endif
+
+        for (int y = job.first_row; y < job.first_row + job.num_rows; ++y)
+            for (int x = 0; x < size; ++x)
+            {
+                const float* texel = &table.texels[((size_t)y * size + x) * 4];
+                float dx = (axis[0].x * texel[0] + axis[1].x * texel[1] + axis[2].x) * texel[2];
+                float dy = (axis[0].y * texel[0] + axis[1].y * texel[1] + axis[2].y) * texel[2];
+                float dz = (axis[0].z * texel[0] + axis[1].z * texel[1] + axis[2].z) * texel[2];
+                float weight = texel[3];
+
+                // forsyths weights
+                float basis[sh_length] = {
+                    weight * 4 / 17,
+                    weight * 8 / 17 * dy,
+                    weight * 8 / 17 * dz,
+                    weight * 8 / 17 * dx,
+                    weight * 15 / 17 * dx * dy,
+                    weight * 15 / 17 * dy * dz,
+                    weight * 5 / 68 * (3.0f * dz * dz - 1.0f),
+                    weight * 15 / 17 * dx * dz,
+                    weight * 15 / 68 * (dx * dx - dy * dy)
+                };
+
+                const float* pixel = pixels + ((size_t)y * size + x) * nc;
+                float value[4] = { pixel[0], pixel[1], pixel[2], 0.0f };
+                if (degamma)
+                    for (int c = 0; c < 3; ++c)
+                        value[c] = powf(value[c], 2.2f);
+
+#ifdef SH_USE_SSE
+                __m128 color = _mm_loadu_ps(value);
+                for (int i = 0; i < sh_length; ++i)
+                    acc[i] = _mm_add_ps(acc[i], _mm_mul_ps(color, _mm_set1_ps(basis[i])));
+#else
+                for (int i = 0; i < sh_length; ++i)
+                    for (int c = 0; c < 3; ++c)
+                        job.sums[i][c] += value[c] * basis[i];
+#endif
             }
-        }
-    };
 
-    SphericalHarmonics linear_sh;
-    for (int i = 0; i < sh_length; i++)
-        linear_sh.coeffs[i] = sh.coeffs[i] * (float)(4 * PI / weightAccum);
-    return linear_sh;
+#ifdef SH_USE_SSE
+        for (int i = 0; i < sh_length; ++i)
+            _mm_storeu_ps(job.sums[i], acc[i]);
+#endif
+    }
+};
+
+void computeSH(const std::vector<sSHCubemap>& probes, SphericalHarmonics* results, bool degamma)
+{
+    // every face of every probe split in blocks of rows
+    std::vector<sSHJob> jobs;
+    std::vector<std::shared_ptr<const sSHTable>> probe_tables(probes.size());
+    for (int i = 0; i < (int)probes.size(); ++i)
+    {
+        const sSHCubemap& cubemap = probes[i];
+        assert(cubemap.size > 0 && cubemap.num_channels >= 3 && "Invalid cubemap");
+        probe_tables[i] = getTable(cubemap.size);
+        for (int face = 0; face < 6; ++face)
+            for (int row = 0; row < cubemap.size; row += SH_ROWS_PER_TASK)
+                jobs.push_back({ i, face, row, (std::min)(SH_ROWS_PER_TASK, cubemap.size - row) });
+    }
+
+    TaskManager::background.parallelFor(jobs.size(), [&](size_t i) {
+        sSHJob& job = jobs[i];
+        projectRows(probes[job.probe], *probe_tables[job.probe], job, degamma);
+    });
+
+    // the partial sums are added always in the same order, the result does not depend on the threads
+    for (int i = 0; i < (int)probes.size(); ++i)
+        results[i] = SphericalHarmonics();
+    for (const sSHJob& job : jobs)
+        for (int i = 0; i < sh_length; ++i)
+            results[job.probe].coeffs[i] += Vector3f(job.sums[i][0], job.sums[i][1], job.sums[i][2]);
+
+    for (int i = 0; i < (int)probes.size(); ++i)
+    {
+        float normalization = (float)(4 * PI / (probe_tables[i]->total_weight * 3.0f));
+        for (int j = 0; j < sh_length; j++)
+            results[i].coeffs[j] = results[i].coeffs[j] * normalization;
+    }
+}
+
+SphericalHarmonics computeSH(const sSHCubemap& cubemap, bool degamma)
+{
+    SphericalHarmonics sh;
+    computeSH(std::vector<sSHCubemap>{ cubemap }, &sh, degamma);
+    return sh;
+}
+
+// give me a cubemap, its size and number of channels
+// and i'll give you spherical harmonics
+SphericalHarmonics computeSH( FloatImage images[], bool degamma ) {
+	assert(images[0].width == images[0].height && images[0].width != 0 && "Image is not square");
+    sSHCubemap cubemap;
+    for (int i = 0; i < 6; ++i)
+        cubemap.faces[i] = images[i].data;
+    cubemap.size = images[0].width;
+    cubemap.num_channels = images[0].num_channels;
+    return computeSH(cubemap, degamma);
 }
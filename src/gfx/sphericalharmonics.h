@@ -1,5 +1,7 @@
 #pragma once
 
+#include <vector>
+
 #include "../core/math.h"
 #include "texture.h"
 
@@ -9,4 +11,17 @@ struct SphericalHarmonics {
 	Vector3f coeffs[9];
 };
 
+//the faces of a cubemap to project (GL order), RGB or RGBA floats
+struct sSHCubemap {
+	const float* faces[6];
+	int size;
+	int num_channels;
+};
+
+//reentrant: the directions and solid angles of every resolution are computed once and shared,
+//the rows of the faces are projected in parallel (TaskManager::background) accumulating with SSE
 SphericalHarmonics computeSH( FloatImage images[], bool degamma = false);
+SphericalHarmonics computeSH(const sSHCubemap& cubemap, bool degamma = false);
+
+//many probes at once (all their faces and rows go to the same parallelFor), results has probes.size() elements
+void computeSH(const std::vector<sSHCubemap>& probes, SphericalHarmonics* results, bool degamma = false);
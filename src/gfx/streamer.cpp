@@ -0,0 +1,267 @@
+#include "streamer.h"
+
+#include <iostream>
+#include <algorithm>
+#include <cfloat>
+#include <cmath>
+
+#include "gfx.h"
+#include "texture.h"
+#include "uploader.h"
+
+GFX::TextureStreamer::TextureStreamer()
+{
+	is_active = true;
+	budget_mb = 256;
+	lod_bias = 0;
+	frame = 0;
+	resident_bytes = 0;
+	wanted_bytes = 0;
+}
+
+bool GFX::TextureStreamer::addTexture(Texture* texture, const std::vector<Image*>& levels, bool wrap)
+{
+	TextureStreamer& streamer = instance();
+	if (!streamer.is_active || !texture || levels.size() < 2 || (std::max)(levels[0]->width, levels[0]->height) < STREAMING_MIN_SIZE)
+		return false;
+
+	sStreamedTexture* st = new sStreamedTexture();
+	st->texture = texture;
+	st->levels = levels;
+	st->wrap = wrap;
+	st->base = 0;
+	while (st->base < (int)levels.size() - 1 && (std::max)(levels[st->base]->width, levels[st->base]->height) > STREAMING_BASE_SIZE)
+		st->base++;
+	st->resident = (int)levels.size();
+	st->desired = st->base;
+	st->wanted = FLT_MAX;
+	st->last_frame = streamer.frame;
+	st->staging = 0;
+	st->staging_level = -1;
+	st->upload_level = -1;
+	st->row = 0;
+
+	texture->streaming = st;
+	streamer.textures.push_back(st);
+
+	//the base levels are tiny, they will be ready in the next update
+	streamer.startStaging(st, st->base);
+	return true;
+}
+
+void GFX::TextureStreamer::removeTexture(Texture* texture)
+{
+	TextureStreamer& streamer = instance();
+	sStreamedTexture* st = texture->streaming;
+	if (!st)
+		return;
+
+	streamer.cancelStaging(st);
+	for (Image* level : st->levels)
+		delete level;
+	streamer.textures.erase(std::remove(streamer.textures.begin(), streamer.textures.end(), st), streamer.textures.end());
+	delete st;
+	texture->streaming = NULL;
+}
+
+void GFX::TextureStreamer::requestMip(Texture* texture, float uv_per_pixel)
+{
+	sStreamedTexture* st = texture ? texture->streaming : NULL;
+	if (!st)
+		return;
+
+	float size = (float)(std::max)(st->levels[0]->width, st->levels[0]->height);
+	float lod = uv_per_pixel > 0 ? log2(uv_per_pixel * size) : 0;
+	st->wanted = (std::min)(st->wanted, lod);
+	st->last_frame = instance().frame;
+}
+
+size_t GFX::TextureStreamer::getLevelsSize(sStreamedTexture* st, int first_level)
+{
+	size_t total = 0;
+	for (int i = (std::max)(0, first_level); i < (int)st->levels.size(); ++i)
+		total += st->levels[i]->width * st->levels[i]->height * 4; //RGB is stored as RGBA by most drivers
+	return total;
+}
+
+//drops the finest level of the texture that wastes more memory until everything fits
+void GFX::TextureStreamer::applyBudget()
+{
+	size_t budget = (size_t)(std::max)(1, budget_mb) * 1024 * 1024;
+	size_t total = 0;
+	for (sStreamedTexture* st : textures)
+		total += getLevelsSize(st, st->desired);
+	wanted_bytes = total;
+
+	while (total > budget)
+	{
+		sStreamedTexture* biggest = NULL;
+		size_t biggest_size = 0;
+		for (sStreamedTexture* st : textures)
+		{
+			if (st->desired >= st->base)
+				continue;
+			size_t size = st->levels[st->desired]->width * st->levels[st->desired]->height * 4;
+			if (size > biggest_size)
+			{
+				biggest = st;
+				biggest_size = size;
+			}
+		}
+		if (!biggest)
+			break;
+		biggest->desired++;
+		total -= biggest_size;
+	}
+}
+
+void GFX::TextureStreamer::startStaging(sStreamedTexture* st, int level)
+{
+	int num_levels = (int)st->levels.size();
+	Image* image = st->levels[level];
+	GLenum internal_format = image->num_channels == 3 ? GL_RGB8 : GL_RGBA8;
+
+	glGenTextures(1, &st->staging);
+	glBindTexture(GL_TEXTURE_2D, st->staging);
+	glTexStorage2D(GL_TEXTURE_2D, num_levels - level, internal_format, image->width, image->height);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, Texture::default_mag_filter);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, Texture::default_min_filter);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, st->wrap ? GL_REPEAT : GL_CLAMP_TO_EDGE);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, st->wrap ? GL_REPEAT : GL_CLAMP_TO_EDGE);
+	glBindTexture(GL_TEXTURE_2D, 0);
+
+	//the levels already in VRAM do not go through the bus again
+	if (st->resident < num_levels)
+		for (int i = (std::max)(level, st->resident); i < num_levels; ++i)
+			glCopyImageSubData(st->texture->texture_id, GL_TEXTURE_2D, i - st->resident, 0, 0, 0,
+				st->staging, GL_TEXTURE_2D, i - level, 0, 0, 0, st->levels[i]->width, st->levels[i]->height, 1);
+
+	st->staging_level = level;
+	st->upload_level = (std::min)(st->resident, num_levels) - 1; //the missing ones, from coarse to fine
+	st->row = 0;
+}
+
+void GFX::TextureStreamer::cancelStaging(sStreamedTexture* st)
+{
+	if (st->staging)
+		glDeleteTextures(1, &st->staging);
+	st->staging = 0;
+	st->staging_level = -1;
+}
+
+bool GFX::TextureStreamer::uploadStaging(sStreamedTexture* st)
+{
+	Uploader& uploader = Uploader::instance();
+	while (st->upload_level >= st->staging_level)
+	{
+		if (!Uploader::hasBudget())
+			return false;
+
+		size_t budget = Uploader::getBudgetBytes();
+		size_t max_bytes = uploader.uploaded_bytes < budget ? budget - uploader.uploaded_bytes : UPLOADER_SLOT_SIZE;
+		Image* image = st->levels[st->upload_level];
+		if (!Uploader::uploadRows(st->staging, st->upload_level - st->staging_level, image, st->row, max_bytes))
+			return false;
+
+		if (st->row == image->height)
+		{
+			st->upload_level--;
+			st->row = 0;
+		}
+	}
+	return true;
+}
+
+void GFX::TextureStreamer::swapStaging(sStreamedTexture* st)
+{
+	Texture* texture = st->texture;
+	Image* image = st->levels[st->staging_level];
+
+	if (texture->texture_id)
+		glDeleteTextures(1, &texture->texture_id);
+	texture->texture_id = st->staging;
+	texture->texture_type = GL_TEXTURE_2D;
+	texture->width = (float)image->width;
+	texture->height = (float)image->height;
+	texture->format = image->num_channels == 3 ? GL_RGB : GL_RGBA;
+	texture->internal_format = image->num_channels == 3 ? GL_RGB8 : GL_RGBA8;
+	texture->type = GL_UNSIGNED_BYTE;
+	texture->mipmaps = true;
+	texture->loading = false;
+
+	st->resident = st->staging_level;
+	st->staging = 0;
+	st->staging_level = -1;
+}
+
+void GFX::TextureStreamer::update()
+{
+	TextureStreamer& streamer = instance();
+	streamer.frame++;
+	if (streamer.textures.empty())
+		return;
+
+	//what every texture needs, textures not seen for a while go back to the base
+	for (sStreamedTexture* st : streamer.textures)
+	{
+		if (!streamer.is_active)
+			st->desired = 0;
+		else if (st->wanted != FLT_MAX)
+			st->desired = (std::min)((std::max)((int)floor(st->wanted + streamer.lod_bias), 0), st->base);
+		else if (streamer.frame - st->last_frame > STREAMING_UNUSED_FRAMES)
+			st->desired = st->base;
+		st->wanted = FLT_MAX;
+	}
+
+	if (streamer.is_active)
+		streamer.applyBudget();
+
+	//one level at a time, so the refinement goes from coarse to fine
+	std::vector<sStreamedTexture*> pending;
+	for (sStreamedTexture* st : streamer.textures)
+	{
+		if (st->staging && st->staging_level < st->desired)
+			streamer.cancelStaging(st); //not needed anymore
+
+		if (!st->staging)
+		{
+			if (st->desired > st->resident)
+				streamer.startStaging(st, st->desired); //evict, only copies
+			else if (st->desired < st->resident)
+				streamer.startStaging(st, st->resident == (int)st->levels.size() ? st->base : st->resident - 1);
+		}
+
+		if (st->staging)
+			pending.push_back(st);
+	}
+
+	//the most blurry first
+	std::sort(pending.begin(), pending.end(), [](sStreamedTexture* a, sStreamedTexture* b) {
+		return (a->resident - a->desired) > (b->resident - b->desired);
+	});
+	for (sStreamedTexture* st : pending)
+		if (streamer.uploadStaging(st))
+			streamer.swapStaging(st);
+
+	streamer.resident_bytes = 0;
+	for (sStreamedTexture* st : streamer.textures)
+		streamer.resident_bytes += getLevelsSize(st, st->resident);
+}
+
+void GFX::TextureStreamer::showUI()
+{
+#ifndef SKIP_IMGUI
+	TextureStreamer& streamer = instance();
+
+	ImGui::Checkbox("Mip streaming", &streamer.is_active);
+	if (streamer.is_active) {
+		if (ImGui::TreeNode("Mip streaming settings")) {
+			ImGui::SliderInt("VRAM budget (MB)", &streamer.budget_mb, 16, 4096);
+			ImGui::SliderFloat("LOD bias", &streamer.lod_bias, -2.f, 4.f);
+			ImGui::Text("Streamed textures: %d", (int)streamer.textures.size());
+			ImGui::Text("Resident: %.2f MB, wanted: %.2f MB", streamer.resident_bytes / (1024.0f * 1024.0f), streamer.wanted_bytes / (1024.0f * 1024.0f));
+			ImGui::TreePop();
+		}
+	}
+#endif
+}
@@ -0,0 +1,83 @@
+/*  Texture streamer
+	Big textures do not stay in VRAM at full resolution, only the mips the camera needs:
+	 + every frame the renderer tells the finest mip needed by the samplers of the visible draws (see requestMip),
+	   estimated from the UV density of the mesh and its distance to the camera
+	 + the whole mip chain stays in RAM. To refine, the texture is rebuilt with one more level: the resident levels are
+	   copied in the GPU (glCopyImageSubData) and only the new one is uploaded through the Uploader, sharing its budget.
+	   To evict, it is rebuilt with one level less
+	 + if the wanted levels do not fit in the VRAM budget the biggest levels are dropped first
+*/
+#pragma once
+
+#include <vector>
+
+#include "../core/includes.h"
+
+class Image;
+
+namespace GFX {
+
+	class Texture;
+
+	#define STREAMING_MIN_SIZE 256 //smaller textures are uploaded whole
+	#define STREAMING_BASE_SIZE 64 //the levels up to this size are always resident
+	#define STREAMING_UNUSED_FRAMES 120 //frames without being requested before going back to the base level
+
+	struct sStreamedTexture {
+		Texture* texture;
+		std::vector<Image*> levels; //whole chain in RAM, [0] is the full resolution
+		bool wrap;
+		int base; //coarsest level that is always resident
+		int resident; //finest level in VRAM, levels.size() when there is nothing yet
+		int desired; //after applying the budget
+		float wanted; //finest mip requested this frame
+		int last_frame; //last frame it was requested
+
+		//texture being built to replace the resident one
+		GLuint staging;
+		int staging_level; //finest level of the staging texture
+		int upload_level; //level being uploaded to the staging texture
+		unsigned int row;
+	};
+
+	class TextureStreamer {
+	private:
+		TextureStreamer();
+
+	public:
+		static TextureStreamer& instance()
+		{
+			static TextureStreamer INSTANCE;
+			return INSTANCE;
+		}
+
+		bool is_active;
+		int budget_mb; //VRAM for the streamed textures
+		float lod_bias; //positive values save memory
+
+		int frame;
+		std::vector<sStreamedTexture*> textures;
+
+		//stats
+		size_t resident_bytes;
+		size_t wanted_bytes;
+
+		//returns false if the texture is not worth streaming (small, without mips), then the caller keeps the levels
+		static bool addTexture(Texture* texture, const std::vector<Image*>& levels, bool wrap = true);
+		static void removeTexture(Texture* texture); //called from the destructor of the texture
+		//uv_per_pixel: how many UV units cover one pixel of the screen, 0 to request the full resolution
+		static void requestMip(Texture* texture, float uv_per_pixel);
+
+		static void update(); //in the main thread once per frame, after the Uploader
+		static void showUI();
+
+		static size_t getLevelsSize(sStreamedTexture* st, int first_level); //bytes in VRAM of the levels [first_level, last]
+
+	private:
+		void applyBudget();
+		void startStaging(sStreamedTexture* st, int level);
+		void cancelStaging(sStreamedTexture* st);
+		bool uploadStaging(sStreamedTexture* st); //true when finished
+		void swapStaging(sStreamedTexture* st);
+	};
+};
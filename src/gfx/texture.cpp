@@ -3,11 +3,17 @@
 #include <iostream> //to output
 #include <cmath>
 #include <cassert>
+#include <algorithm>
 
 #include "texture.h"
-#include "fbo.h"
-#include "mesh.h"
-#include "shader.h"
+#include "mipmaps.h"
+#ifndef SKIP_GL
+	#include "fbo.h"
+	#include "mesh.h"
+	#include "shader.h"
+	#include "uploader.h"
+	#include "streamer.h"
+#endif
 
 #include "../utils/utils.h"
 #include "../extra/picopng.h"
@@ -48,6 +54,7 @@ Vector4f Image::getPixelInterpolatedHigh(float x, float y, bool repeat) {
 	return lerp(top, bottom, fy);
 };
 
+#ifndef SKIP_GL //the assets library only has the images
 namespace GFX
 {
 
@@ -70,6 +77,7 @@ namespace GFX
 		type = 0;
 		texture_type = GL_TEXTURE_2D;
 		loading = false;
+		streaming = NULL;
 		index = s_last_index++;
 		sTextures.insert(std::pair<unsigned int, Texture*>(index, this));
 		near_far.set(0.1f, 1000.0f);
@@ -78,6 +86,7 @@ namespace GFX
 	Texture::Texture(unsigned int width, unsigned int height, unsigned int format, unsigned int type, bool mipmaps, Uint8* data, unsigned int internal_format)
 	{
 		loading = false;
+		streaming = NULL;
 		texture_id = 0;
 		index = s_last_index++;
 		sTextures.insert(std::pair<unsigned int, Texture*>(index, this));
@@ -88,6 +97,7 @@ namespace GFX
 	Texture::Texture(::Image* img)
 	{
 		loading = false;
+		streaming = NULL;
 		texture_id = 0;
 		index = s_last_index++;
 		sTextures.insert(std::pair<unsigned int, Texture*>(index,this));
@@ -97,6 +107,8 @@ namespace GFX
 
 	Texture::~Texture()
 	{
+		if (streaming)
+			TextureStreamer::removeTexture(this);
 		clear();
 		auto it = sTextures.find(index);
 		if (it != sTextures.end())
@@ -178,7 +190,6 @@ namespace GFX
 		upload(format, type, mipmaps, data, internal_format);
 	}
 
-	/*
 	void Texture::create3D(unsigned int width, unsigned int height, unsigned int depth, unsigned int format, unsigned int type, bool mipmaps, Uint8* data, unsigned int internal_format)
 	{
 		assert(width && height && depth && "texture must have a size");
@@ -204,7 +215,6 @@ namespace GFX
 
 		upload3D(format, type, mipmaps, data, internal_format);
 	}
-	*/
 
 	void Texture::createCubemap(unsigned int width, unsigned int height, Uint8** data, unsigned int format, unsigned int type, bool mipmaps, unsigned int internal_format)
 	{
@@ -229,6 +239,54 @@ namespace GFX
 		uploadCubemap(format, type, mipmaps, data, internal_format);
 	}
 
+	void Texture::createCubemapArray(unsigned int size, unsigned int num_cubemaps, int num_levels, unsigned int internal_format)
+	{
+		assert(size && num_cubemaps && num_levels > 0 && "texture must have a size");
+
+		//the storage is immutable, a new size needs a new texture
+		if (this->texture_id != 0)
+			clear();
+
+		this->width = (float)size;
+		this->height = (float)size;
+		this->depth = (float)num_cubemaps;
+		this->format = GL_RGBA;
+		this->internal_format = internal_format;
+		this->type = GL_HALF_FLOAT;
+		this->texture_type = GL_TEXTURE_CUBE_MAP_ARRAY;
+		this->mipmaps = num_levels > 1;
+		this->wrapS = GL_CLAMP_TO_EDGE;
+		this->wrapT = GL_CLAMP_TO_EDGE;
+
+		glGenTextures(1, &texture_id);
+		glBindTexture(this->texture_type, texture_id);
+		glEnable(GL_TEXTURE_CUBE_MAP_SEAMLESS);
+		glTexStorage3D(this->texture_type, num_levels, internal_format, size, size, num_cubemaps * 6);
+		glTexParameteri(this->texture_type, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+		glTexParameteri(this->texture_type, GL_TEXTURE_MIN_FILTER, this->mipmaps ? GL_LINEAR_MIPMAP_LINEAR : GL_LINEAR);
+		glTexParameteri(this->texture_type, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+		glTexParameteri(this->texture_type, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+		glTexParameteri(this->texture_type, GL_TEXTURE_BASE_LEVEL, 0);
+		glTexParameteri(this->texture_type, GL_TEXTURE_MAX_LEVEL, num_levels - 1);
+		glBindTexture(this->texture_type, 0);
+		assert(checkGLErrors() && "Error creating texture");
+	}
+
+	void Texture::uploadCubemapArray(int cubemap, Uint8** data, unsigned int format, unsigned int type, int level)
+	{
+		assert(texture_id && texture_type == GL_TEXTURE_CUBE_MAP_ARRAY && "Texture type does not match.");
+		assert(cubemap >= 0 && cubemap < (int)depth);
+
+		int size = (std::max)(1, (int)width >> level);
+		glBindTexture(this->texture_type, texture_id);
+		glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+		//the layer of a face is cubemap * 6 + face
+		for (int face = 0; face < 6; ++face)
+			glTexSubImage3D(this->texture_type, level, 0, 0, cubemap * 6 + face, size, size, 1, format, type, data[face]);
+		glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+		glBindTexture(this->texture_type, 0);
+	}
+
 	Texture* Texture::Find(const char* filename)
 	{
 		assert(filename);
@@ -318,6 +376,16 @@ namespace GFX
 			return true;
 		}
 
+		//block compressed by the cooker
+		std::string cooked = use_cooked_assets ? getCookedFilename(str, ".ktx") : "";
+		if (ext == "ktx" || ext == "dds" || (cooked.size() && fileExists(cooked)))
+		{
+			if (!loadKTX(ext == "ktx" || ext == "dds" ? filename : cooked.c_str()))
+				return false;
+			setName(filename);
+			return true;
+		}
+
 		//image based textures
 		::Image* image = new ::Image();
 		if (!image->load(filename))
@@ -396,13 +464,20 @@ namespace GFX
 		assert(checkGLErrors() && "Error uploading texture");
 	}
 
-	/*
 	void Texture::upload3D(unsigned int format, unsigned int type, bool mipmaps, Uint8* data, unsigned int internal_format) {
 		assert(texture_id && "Must create texture before uploading data.");
 		assert(texture_type == GL_TEXTURE_3D && "Texture type does not match.");
 
 		glBindTexture(this->texture_type, texture_id);	//we activate this id to tell opengl we are going to use this texture
 
+		if (internal_format == 0)
+		{
+			if (type == GL_FLOAT)
+				internal_format = format == GL_RGB ? GL_RGB32F : GL_RGBA32F;
+			else if (type == GL_HALF_FLOAT)
+				internal_format = format == GL_RGB ? GL_RGB16F : GL_RGBA16F;
+		}
+
 		glTexImage3D(this->texture_type, 0, internal_format == 0 ? format : internal_format, width, height, depth, 0, format, type, data);
 
 		glTexParameteri(this->texture_type, GL_TEXTURE_MAG_FILTER, Texture::default_mag_filter);	//set the min filter
@@ -417,7 +492,6 @@ namespace GFX
 		glBindTexture(this->texture_type, 0);
 		assert(checkGLErrors() && "Error uploading texture");
 	}
-	*/
 
 	void Texture::uploadCubemap(unsigned int format, unsigned int t, bool mips, Uint8** data, unsigned int intFormat, int level) {
 
@@ -556,36 +630,81 @@ namespace GFX
 
 	bool Texture::loadKTX(std::vector<unsigned char>& buffer)
 	{
-		std::vector<unsigned char> out_image;
-
 		ddsktx_texture_info tc = { 0 };
-		if (!ddsktx_parse(&tc, &buffer[0], buffer.size(), NULL))
+		ddsktx_error error;
+		if (buffer.empty() || !ddsktx_parse(&tc, &buffer[0], (int)buffer.size(), &error))
 			return false;
 
-		this->texture_type = GL_TEXTURE_2D;
-		if (tc.flags & DDSKTX_TEXTURE_FLAG_CUBEMAP)
-			this->texture_type = GL_TEXTURE_CUBE_MAP;
-		else if (tc.flags & DDSKTX_TEXTURE_FLAG_VOLUME)
-			this->texture_type = GL_TEXTURE_3D;
+		//the formats written by the cooker (see BlockCompressor) and plain RGB/RGBA
+		unsigned int gl_format = 0;
+		switch (tc.format)
+		{
+			case DDSKTX_FORMAT_BC1: gl_format = GL_COMPRESSED_RGB_S3TC_DXT1_EXT; break;
+			case DDSKTX_FORMAT_BC3: gl_format = GL_COMPRESSED_RGBA_S3TC_DXT5_EXT; break;
+			case DDSKTX_FORMAT_BC4: gl_format = GL_COMPRESSED_RED_RGTC1; break;
+			case DDSKTX_FORMAT_BC5: gl_format = GL_COMPRESSED_RG_RGTC2; break;
+			case DDSKTX_FORMAT_BC7: gl_format = GL_COMPRESSED_RGBA_BPTC_UNORM; break;
+			case DDSKTX_FORMAT_RGB8: gl_format = GL_RGB; break;
+			case DDSKTX_FORMAT_RGBA8: gl_format = GL_RGBA; break;
+			default:
+				std::cout << TermColor::RED << "[ERROR] KTX format not supported: " << ddsktx_format_str(tc.format) << TermColor::DEFAULT << std::endl;
+				return false;
+		}
+		bool compressed = ddsktx_format_compressed(tc.format);
+		bool cubemap = (tc.flags & DDSKTX_TEXTURE_FLAG_CUBEMAP) != 0;
+		if (tc.flags & DDSKTX_TEXTURE_FLAG_VOLUME)
+			return false;
+
+		//replaces the temporary texture when loaded in the background
+		if (texture_id && this->texture_type != (cubemap ? GL_TEXTURE_CUBE_MAP : GL_TEXTURE_2D))
+		{
+			glDeleteTextures(1, &texture_id);
+			texture_id = 0;
+		}
+		this->texture_type = cubemap ? GL_TEXTURE_CUBE_MAP : GL_TEXTURE_2D;
+		this->width = (float)tc.width;
+		this->height = (float)tc.height;
+		this->depth = 0;
+		this->format = gl_format;
+		if (compressed)
+			this->format = tc.format == DDSKTX_FORMAT_BC1 ? GL_RGB : (tc.format == DDSKTX_FORMAT_BC4 ? GL_RED : (tc.format == DDSKTX_FORMAT_BC5 ? GL_RG : GL_RGBA));
+		this->internal_format = gl_format;
+		this->type = GL_UNSIGNED_BYTE;
+		this->mipmaps = tc.num_mips > 1;
 
 		if (texture_id == 0)
 			glGenTextures(1, &texture_id); //we need to create an unique ID for the texture
 		glBindTexture(this->texture_type, texture_id);	//we activate this id to tell opengl we are going to use this texture
+		glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+
+		int num_faces = cubemap ? 6 : 1;
+		for (int face = 0; face < num_faces; ++face)
+			for (int mip = 0; mip < tc.num_mips; mip++) {
+				ddsktx_sub_data sub_data;
+				ddsktx_get_sub(&tc, &sub_data, &buffer[0], (int)buffer.size(), 0, face, mip);
+				unsigned int target = cubemap ? GL_TEXTURE_CUBE_MAP_POSITIVE_X + face : GL_TEXTURE_2D;
+				if (compressed)
+					glCompressedTexImage2D(target, mip, gl_format, sub_data.width, sub_data.height, 0, sub_data.size_bytes, sub_data.buff);
+				else
+					glTexImage2D(target, mip, gl_format, sub_data.width, sub_data.height, 0, gl_format, GL_UNSIGNED_BYTE, sub_data.buff);
+			}
+		glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
 
-		for (int mip = 0; mip < tc.num_mips; mip++) {
-			ddsktx_sub_data sub_data;
-			ddsktx_get_sub(&tc, &sub_data, &buffer[0], buffer.size(), 0, 0, mip);
-			// Fill/Set texture sub resource data (mips in this case)
-			/*
-			if (ddsktx_format_compressed(tc.format))
-				//glCompressedTexImage2D(this->texture_type,mip,
-			else
-				glTexImage2D(this->texture_type, mip, internal_format == 0 ? format : internal_format, width, height, 0, format, type, data);
-				//glTexImage2D(..);
-			*/
+		glTexParameteri(this->texture_type, GL_TEXTURE_MAX_LEVEL, tc.num_mips - 1);
+		glTexParameteri(this->texture_type, GL_TEXTURE_MAG_FILTER, Texture::default_mag_filter);
+		glTexParameteri(this->texture_type, GL_TEXTURE_MIN_FILTER, this->mipmaps ? Texture::default_min_filter : GL_LINEAR);
+		glTexParameteri(this->texture_type, GL_TEXTURE_WRAP_S, (this->mipmaps && !cubemap) ? GL_REPEAT : GL_CLAMP_TO_EDGE);
+		glTexParameteri(this->texture_type, GL_TEXTURE_WRAP_T, (this->mipmaps && !cubemap) ? GL_REPEAT : GL_CLAMP_TO_EDGE);
+
+		//single channel maps are read as grayscale
+		if (tc.format == DDSKTX_FORMAT_BC4)
+		{
+			glTexParameteri(this->texture_type, GL_TEXTURE_SWIZZLE_G, GL_RED);
+			glTexParameteri(this->texture_type, GL_TEXTURE_SWIZZLE_B, GL_RED);
 		}
 
-		return true;
+		glBindTexture(this->texture_type, 0);
+		return checkGLErrors();
 	}
 
 
@@ -760,6 +879,7 @@ void Image::fromTexture(GFX::Texture* texture)
 	texture->bind();
 	glGetTexImage(GL_TEXTURE_2D, 0, GL_RGBA, GL_UNSIGNED_BYTE, data);
 }
+#endif //SKIP_GL
 
 bool Image::load(const char* filename)
 {
@@ -768,6 +888,13 @@ bool Image::load(const char* filename)
 	double time = getTime();
 	std::cout << " + Image loading: " << TermColor::YELLOW << filename << TermColor::DEFAULT << " ... ";
 
+	//already decoded by the cooker
+	if (use_cooked_assets && loadIBIN(getCookedFilename(filename, ".ibin").c_str()))
+	{
+		std::cout << "[OK COOKED] Size: " << width << "x" << height << " Time: " << (getTime() - time) * 0.001 << "sec" << std::endl;
+		return true;
+	}
+
 	bool found = false;
 
 	if (ext == ".tga" || ext == ".TGA")
@@ -907,16 +1034,161 @@ bool Image::loadJPG(const char* filename, bool flip_y)
 	return loadJPG(buffer);
 }
 
+//Baseline JPEGs with restart markers (DRI) are split in bands of MCU rows decoded in parallel.
+//Every band is a valid JPEG on its own: the same tables, a smaller height in the SOF and the
+//entropy data between two restart markers (renumbered from RST0). Bands also decode the intervals
+//touching the MCU rows above and below, discarded after, so the chroma upsampling is the same as
+//decoding the whole image.
+#define JPG_PARALLEL_MIN_PIXELS (512 * 512)
+#define JPG_PARALLEL_MAX_BANDS 8
+
+static bool loadJPGParallel(std::vector<unsigned char>& buffer, Image* image)
+{
+	const uint8* data = &buffer[0];
+	size_t size = buffer.size();
+	if (size < 4 || data[0] != 0xFF || data[1] != 0xD8)
+		return false;
+
+	size_t sof_pos = 0, sos_end = 0;
+	int width = 0, height = 0, num_components = 0, max_h = 1, max_v = 1, restart_interval = 0;
+	size_t pos = 2;
+	while (!sos_end && pos + 4 <= size)
+	{
+		if (data[pos] != 0xFF)
+			return false;
+		uint8 marker = data[pos + 1];
+		if (marker == 0xFF) { pos++; continue; } //fill byte
+		size_t length = (data[pos + 2] << 8) | data[pos + 3];
+		if (pos + 2 + length > size)
+			return false;
+		const uint8* segment = data + pos + 4;
+		if (marker == 0xC0 || marker == 0xC1) //baseline or extended sequential, huffman
+		{
+			sof_pos = pos;
+			height = (segment[1] << 8) | segment[2];
+			width = (segment[3] << 8) | segment[4];
+			num_components = segment[5];
+			for (int i = 0; i < num_components; ++i)
+			{
+				max_h = (std::max)(max_h, segment[7 + i * 3] >> 4);
+				max_v = (std::max)(max_v, segment[7 + i * 3] & 15);
+			}
+		}
+		else if ((marker >= 0xC2 && marker <= 0xCF && marker != 0xC4 && marker != 0xC8 && marker != 0xCC) || marker == 0xDC)
+			return false; //progressive, lossless, arithmetic or DNL
+		else if (marker == 0xDD)
+			restart_interval = (segment[0] << 8) | segment[1];
+		else if (marker == 0xDA)
+		{
+			if (segment[0] != num_components)
+				return false; //one scan per component
+			sos_end = pos + 2 + length;
+		}
+		pos += 2 + length;
+	}
+	if (!sof_pos || !sos_end || !restart_interval || height == 0 || width * height < JPG_PARALLEL_MIN_PIXELS)
+		return false;
+
+	int mcu_w = num_components == 1 ? 8 : max_h * 8;
+	int mcu_h = num_components == 1 ? 8 : max_v * 8;
+	int mcus_x = (width + mcu_w - 1) / mcu_w;
+	int mcus_y = (height + mcu_h - 1) / mcu_h;
+	int num_intervals = (mcus_x * mcus_y + restart_interval - 1) / restart_interval;
+
+	//where every interval starts, the RST markers are the only markers allowed in the entropy data
+	std::vector<size_t> starts;
+	starts.push_back(sos_end);
+	size_t scan_end = 0;
+	for (pos = sos_end; pos + 1 < size; ++pos)
+	{
+		if (data[pos] != 0xFF || data[pos + 1] == 0x00 || data[pos + 1] == 0xFF)
+			continue;
+		if (data[pos + 1] < 0xD0 || data[pos + 1] > 0xD7)
+		{
+			scan_end = pos;
+			break;
+		}
+		starts.push_back(pos + 2);
+		pos++;
+	}
+	if (!scan_end || (int)starts.size() != num_intervals || (data[scan_end + 1] != 0xD9))
+		return false; //more scans or a broken file
+
+	//the bands can only start at a row that is also the start of an interval
+	int rows_per_band = (std::max)((height / JPG_PARALLEL_MAX_BANDS + mcu_h - 1) / mcu_h, 64 / mcu_h);
+	std::vector<int> start_rows; //MCU rows that start an interval
+	std::vector<int> band_rows; //first MCU row of every band
+	for (int row = 0; row < mcus_y; ++row)
+	{
+		if ((row * mcus_x) % restart_interval)
+			continue;
+		if (band_rows.empty() || row - band_rows.back() >= rows_per_band)
+			band_rows.push_back(row);
+		start_rows.push_back(row);
+	}
+	if (band_rows.size() < 2)
+		return false;
+	band_rows.push_back(mcus_y);
+
+	image->resize(width, height, 3);
+	std::atomic<bool> failed(false);
+	TaskManager::background.parallelFor(band_rows.size() - 1, [&](size_t band) {
+		int first_row = band_rows[band];
+		int decode_row = first_row > 0 ? *(std::lower_bound(start_rows.begin(), start_rows.end(), first_row) - 1) : 0;
+		auto next = std::lower_bound(start_rows.begin(), start_rows.end(), band_rows[band + 1] + 1);
+		int decode_end = next == start_rows.end() ? mcus_y : *next;
+		int band_height = (std::min)(decode_end * mcu_h, height) - decode_row * mcu_h;
+		int first_interval = decode_row * mcus_x / restart_interval;
+		int last_interval = decode_end == mcus_y ? num_intervals : decode_end * mcus_x / restart_interval;
+		size_t begin = starts[first_interval];
+		size_t end = last_interval == num_intervals ? scan_end : starts[last_interval] - 2; //without its RST
+
+		std::vector<unsigned char> band_jpg;
+		band_jpg.reserve(sos_end + (end - begin) + 2);
+		band_jpg.insert(band_jpg.end(), data, data + sos_end);
+		band_jpg[sof_pos + 5] = (uint8)(band_height >> 8);
+		band_jpg[sof_pos + 6] = (uint8)(band_height & 0xFF);
+		band_jpg.insert(band_jpg.end(), data + begin, data + end);
+		int num_restart = 0;
+		for (int i = first_interval + 1; i < last_interval; ++i)
+			band_jpg[sos_end + (starts[i] - 1 - begin)] = (uint8)(0xD0 + (num_restart++ & 7));
+		band_jpg.push_back(0xFF);
+		band_jpg.push_back(0xD9);
+
+		int w, h, channels;
+		unsigned char* pixels = stbi_load_from_memory(&band_jpg[0], (int)band_jpg.size(), &w, &h, &channels, STBI_rgb);
+		if (!pixels || w != width || h != band_height)
+			failed = true;
+		else
+		{
+			int skip = (first_row - decode_row) * mcu_h;
+			int rows = (std::min)(band_rows[band + 1] * mcu_h, height) - first_row * mcu_h;
+			memcpy(image->data + (size_t)first_row * mcu_h * width * 3, pixels + (size_t)skip * width * 3, (size_t)rows * width * 3);
+		}
+		if (pixels)
+			stbi_image_free(pixels);
+	});
+
+	return !failed;
+}
+
 bool Image::loadJPG(std::vector<unsigned char>& buffer, bool flip_y)
 {
-	std::vector<unsigned char> out_image;
+	if (buffer.empty())
+		return false;
+
+	if (loadJPGParallel(buffer, this))
+	{
+		if (flip_y)
+			flipY();
+		return true;
+	}
 
 	int width;
 	int height;
-	int actual_comps;
 	int channels;
 
-	//stb_image
+	//stb_image (SSE2 IDCT and color conversion)
 	unsigned char* image_data = stbi_load_from_memory( (stbi_uc*) &buffer[0], (unsigned long)buffer.size(), &width, &height, &channels, STBI_rgb);
 	if (!image_data)
 		return false;
@@ -1038,6 +1310,43 @@ bool FloatImage::loadIBIN(const char* filename)
 	return true;
 }
 
+bool Image::saveIBIN(const char* filename)
+{
+	tImageHeader header;
+	memset(&header, 0, sizeof(header));
+	header.width = width;
+	header.height = height;
+	header.layers = 1;
+	header.bytesperchannel = 1;
+	header.channels = num_channels;
+	header.flags[0] = origin_topleft ? 1 : 0;
+	FILE* file = fopen(filename, "wb");
+	if (file == NULL)
+		return false;
+	fwrite(&header, 1, sizeof(header), file);
+	fwrite(data, 1, width * height * num_channels, file);
+	fclose(file);
+	return true;
+}
+
+bool Image::loadIBIN(const char* filename)
+{
+	//it can be inside a pak
+	std::vector<unsigned char> buffer;
+	if (!readFileBin(filename, buffer) || buffer.size() < sizeof(tImageHeader))
+		return false;
+	tImageHeader header;
+	memcpy(&header, &buffer[0], sizeof(header));
+	size_t size = (size_t)header.width * header.height * header.channels;
+	if (header.bytesperchannel != 1 || header.layers != 1 || buffer.size() < sizeof(header) + size)
+		return false;
+	resize(header.width, header.height, header.channels);
+	origin_topleft = header.flags[0] != 0;
+	memcpy(data, &buffer[sizeof(header)], size);
+	return true;
+}
+
+#ifndef SKIP_GL
 void FloatImage::fromTexture(GFX::Texture* texture)
 {
 	assert(texture);
@@ -1069,12 +1378,15 @@ void FloatImage::fromScreen(int width, int height)
 
 	glReadPixels(0, 0, width, height, GL_RGBA, GL_FLOAT, data);
 }
+#endif //SKIP_GL
 
 bool isPowerOfTwo( int n )
 {
 	return (n & (n - 1)) == 0;
 }
 
+#ifndef SKIP_GL
+
 GFX::Texture* CubemapFromHDRE(const char* filename, GFX::Texture* output)
 {
 	HDRE* hdre = HDRE::Get(filename);
@@ -1120,6 +1432,18 @@ LoadTextureTask::LoadTextureTask(const char* filename, std::vector<uint8>& buffe
 
 void LoadTextureTask::onExecute()
 {
+	//compressed by the cooker, the blocks go straight to the GPU
+	if (buffer.empty() && use_cooked_assets)
+	{
+		std::string cooked = getCookedFilename(filename, ".ktx");
+		std::vector<uint8> ktx;
+		if (fileExists(cooked) && readFileBin(cooked, ktx))
+		{
+			TaskManager::foreground.addTask(new UploadTextureTask(filename.c_str(), ktx));
+			return;
+		}
+	}
+
 	image = new Image();
 
 	if (buffer.size())
@@ -1127,6 +1451,13 @@ void LoadTextureTask::onExecute()
 		double time = getTime();
 		std::cout << " + Image decoding: " << TermColor::YELLOW << filename << TermColor::DEFAULT << " ... ";
 		std::string ext = toLowerCase(getExtension(filename));
+		if (ext != "png" && ext != "jpg" && ext != "jpeg" && buffer.size() > 4) //embedded images may not have extension, check the signature
+		{
+			if (buffer[0] == 0x89 && buffer[1] == 'P' && buffer[2] == 'N' && buffer[3] == 'G')
+				ext = "png";
+			else if (buffer[0] == 0xFF && buffer[1] == 0xD8)
+				ext = "jpg";
+		}
 		if(ext == "png")
 			image->loadPNG(buffer);
 		else if(ext == "jpg" || ext == "jpeg")
@@ -1147,27 +1478,46 @@ void LoadTextureTask::onExecute()
 		return;
 	}
 
+	//the mips are computed here so the main thread only copies
+	std::vector<Image*> levels;
+	GFX::MipGenerator::build(image, levels, GFX::MipGenerator::getOptions(filename));
+
 	//image loaded, ready to go back to main thread
-	UploadTextureTask* upload_task = new UploadTextureTask(filename.c_str(), image);
+	UploadTextureTask* upload_task = new UploadTextureTask(filename.c_str(), levels);
 	TaskManager::foreground.addTask(upload_task);
 }
 
-UploadTextureTask::UploadTextureTask(const char* filename, Image* image)
+UploadTextureTask::UploadTextureTask(const char* filename, const std::vector<Image*>& levels)
+{
+	this->filename = filename;
+	this->levels = levels;
+	assert(levels.size() && levels[0] && "image cannot be null");
+}
+
+UploadTextureTask::UploadTextureTask(const char* filename, std::vector<uint8>& ktx)
 {
 	this->filename = filename;
-	this->image = image;
-	assert(image && "image cannot be null");
+	this->ktx.swap(ktx);
 }
 
 void UploadTextureTask::onExecute()
 {
-	GFX::Texture* texture = NULL;
-	if (!image)
+	if (ktx.size())
+	{
+		auto it = GFX::Texture::sTexturesLoaded.find(filename);
+		if (it == GFX::Texture::sTexturesLoaded.end())
+			return;
+		if (!it->second->loadKTX(ktx))
+			std::cout << TermColor::RED << "[ERROR] cannot load compressed texture: " << filename << TermColor::DEFAULT << std::endl;
+		it->second->loading = false;
+		return;
+	}
+
+	if (levels.empty() || !levels[0])
 	{
 		std::cerr << "Image is null: " << filename << std::endl;
 		return;
 	}
-	assert(image && "image cant be null");
 
 	//in case somehow it got loaded while I was loading it in the background
 	auto it = GFX::Texture::sTexturesLoaded.find(filename);
@@ -1178,17 +1528,14 @@ void UploadTextureTask::onExecute()
 		if (!texture)
 			texture = new Texture();
 		*/
-		delete image;
+		for (Image* level : levels)
+			delete level;
 		std::cout << "Warning: image loaded in background not found foreground thread" << std::endl;
 		return;
 	}
 
-	texture = it->second;
-
-	//upload to GPU
-	texture->loadFromImage(image);
-	texture->loading = false;
-
-	//delete image
-	delete image;
+	//big textures only keep in VRAM the mips needed, the rest are uploaded progressively. They own the images now
+	if (!GFX::TextureStreamer::addTexture(it->second, levels))
+		GFX::Uploader::addTexture(filename.c_str(), levels);
 }
+#endif //SKIP_GL
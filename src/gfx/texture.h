@@ -17,6 +17,7 @@ namespace GFX {
 	class Shader;
 	class FBO;
 	class Texture;
+	struct sStreamedTexture;
 };
 
 #ifndef OPENGL_ES3
@@ -27,6 +28,19 @@ namespace GFX {
 #define GL_RGBA16F 0x881A
 #endif
 
+//block compressed formats (see BlockCompressor)
+#ifndef GL_COMPRESSED_RGB_S3TC_DXT1_EXT
+	#define GL_COMPRESSED_RGB_S3TC_DXT1_EXT 0x83F0
+	#define GL_COMPRESSED_RGBA_S3TC_DXT5_EXT 0x83F3
+#endif
+#ifndef GL_COMPRESSED_RED_RGTC1
+	#define GL_COMPRESSED_RED_RGTC1 0x8DBB
+	#define GL_COMPRESSED_RG_RGTC2 0x8DBD
+#endif
+#ifndef GL_COMPRESSED_RGBA_BPTC_UNORM
+	#define GL_COMPRESSED_RGBA_BPTC_UNORM 0x8E8C
+#endif
+
 #ifndef GL_TEXTURE_EXTERNAL_OES
 	#define GL_TEXTURE_EXTERNAL_OES 0x8D65
 #endif
@@ -78,6 +92,8 @@ public:
 	bool loadJPG(const char* filename, bool flip_y = false);
 	bool loadJPG(std::vector<unsigned char>& buffer, bool flip_y = false);
 	bool saveTGA(const char* filename, bool flip_y = false);
+	bool loadIBIN(const char* filename); //raw pixels, used for cooked images
+	bool saveIBIN(const char* filename);
 };
 
 class FloatImage : public tImage<float>
@@ -132,8 +148,9 @@ namespace GFX {
 		unsigned int format; //GL_RGB, GL_RGBA, GL_DEPTH_COMPONENT
 		unsigned int type; //GL_UNSIGNED_INT, GL_FLOAT
 		unsigned int internal_format;
-		unsigned int texture_type; //GL_TEXTURE_2D, GL_TEXTURE_CUBE, GL_TEXTURE_2D_ARRAY
+		unsigned int texture_type; //GL_TEXTURE_2D, GL_TEXTURE_CUBE, GL_TEXTURE_2D_ARRAY, GL_TEXTURE_CUBE_MAP_ARRAY
 		bool mipmaps;
+		sStreamedTexture* streaming; //only the mips needed are resident, see TextureStreamer
 
 		unsigned int wrapS;
 		unsigned int wrapT;
@@ -152,14 +169,18 @@ namespace GFX {
 		void clear();
 
 		void create(unsigned int width, unsigned int height, unsigned int format = GL_RGB, unsigned int type = GL_UNSIGNED_BYTE, bool mipmaps = true, Uint8* data = NULL, unsigned int internal_format = 0);
-		//void create3D(unsigned int width, unsigned int height, unsigned int depth, unsigned int format = GL_RED, unsigned int type = GL_UNSIGNED_BYTE, bool mipmaps = true, Uint8* data = NULL, unsigned int internal_format = 0);
+		void create3D(unsigned int width, unsigned int height, unsigned int depth, unsigned int format = GL_RED, unsigned int type = GL_UNSIGNED_BYTE, bool mipmaps = true, Uint8* data = NULL, unsigned int internal_format = 0);
 		void createCubemap(unsigned int width, unsigned int height, Uint8** data = NULL, unsigned int format = GL_RGBA, unsigned int type = GL_UNSIGNED_BYTE, bool mipmaps = true, unsigned int internal_format = 0);
+		//immutable storage for num_cubemaps cubemaps of size x size, depth is the number of cubemaps
+		void createCubemapArray(unsigned int size, unsigned int num_cubemaps, int num_levels = 1, unsigned int internal_format = GL_RGBA16F);
 
 		void upload(::Image* img);
 		void upload(::FloatImage* img);
 		void upload(unsigned int format = GL_RGB, unsigned int type = GL_UNSIGNED_BYTE, bool mipmaps = true, const Uint8* data = NULL, unsigned int internal_format = 0);
-		//void upload3D(unsigned int format = GL_RED, unsigned int type = GL_UNSIGNED_BYTE, bool mipmaps = true, Uint8* data = NULL, unsigned int internal_format = 0);
+		void upload3D(unsigned int format = GL_RED, unsigned int type = GL_UNSIGNED_BYTE, bool mipmaps = true, Uint8* data = NULL, unsigned int internal_format = 0);
 		void uploadCubemap(unsigned int format = GL_RGB, unsigned int type = GL_UNSIGNED_BYTE, bool mipmaps = true, Uint8** data = NULL, unsigned int internal_format = 0, int level = 0);
+		//the 6 faces of one cubemap of the array (GL order)
+		void uploadCubemapArray(int cubemap, Uint8** data, unsigned int format = GL_RGBA, unsigned int type = GL_HALF_FLOAT, int level = 0);
 		void uploadAsArray(unsigned int texture_size, bool mipmaps = true);
 
 		bool loadKTX(const char* filename);
@@ -222,12 +243,15 @@ public:
 	void onExecute();
 };
 
+//hands the image and its mips to the GFX::Uploader, that streams them to VRAM in the next frames
 class UploadTextureTask : public Task {
 public:
 	std::string filename;
-	Image* image;
+	std::vector<Image*> levels;
+	std::vector<uint8> ktx; //when cooked the compressed file is uploaded as it is
 
-	UploadTextureTask(const char* filename, Image* image);
+	UploadTextureTask(const char* filename, const std::vector<Image*>& levels);
+	UploadTextureTask(const char* filename, std::vector<uint8>& ktx);
 	void onExecute();
 };
 
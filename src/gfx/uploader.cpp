@@ -0,0 +1,300 @@
+#include "uploader.h"
+
+#include <iostream>
+#include <chrono>
+#include <cstring>
+
+#include "gfx.h"
+#include "texture.h"
+#include "../utils/utils.h"
+
+GFX::Uploader::Uploader()
+{
+	is_active = true;
+	persistent = false;
+	slots_failed = false;
+	budget_ms = 2.0f;
+	budget_kb = 8 * 1024;
+	uploaded_bytes = 0;
+	upload_time = 0;
+	current_slot = 0;
+	memset(slots, 0, sizeof(slots));
+}
+
+void GFX::Uploader::addTexture(const char* filename, const std::vector<Image*>& levels, bool wrap)
+{
+	assert(levels.size() && levels[0] && "texture without image");
+	instance().jobs.push_back({ filename, levels, wrap, -1, 0 });
+}
+
+bool GFX::Uploader::initSlots()
+{
+	if (slots[0].pbo)
+		return true;
+	if (slots_failed)
+		return false;
+
+	glGenBuffers(1, &slots[0].pbo);
+	for (int i = 1; i < UPLOADER_NUM_SLOTS; ++i)
+		glGenBuffers(1, &slots[i].pbo);
+
+#ifdef GL_MAP_PERSISTENT_BIT
+	persistent = SDL_GL_ExtensionSupported("GL_ARB_buffer_storage");
+#endif
+
+	for (int i = 0; i < UPLOADER_NUM_SLOTS; ++i)
+	{
+		sSlot& slot = slots[i];
+		glBindBuffer(GL_PIXEL_UNPACK_BUFFER, slot.pbo);
+#ifdef GL_MAP_PERSISTENT_BIT
+		if (persistent)
+		{
+			GLbitfield flags = GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+			glBufferStorage(GL_PIXEL_UNPACK_BUFFER, UPLOADER_SLOT_SIZE, NULL, flags);
+			slot.data = (unsigned char*)glMapBufferRange(GL_PIXEL_UNPACK_BUFFER, 0, UPLOADER_SLOT_SIZE, flags);
+			continue;
+		}
+#endif
+		glBufferData(GL_PIXEL_UNPACK_BUFFER, UPLOADER_SLOT_SIZE, NULL, GL_STREAM_DRAW);
+	}
+	glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+
+	if (!checkGLErrors())
+	{
+		//never retried, every band goes straight from RAM
+		std::cout << "[WARN] Texture uploader: PBOs not available, uploading from RAM" << std::endl;
+		for (int i = 0; i < UPLOADER_NUM_SLOTS; ++i)
+			glDeleteBuffers(1, &slots[i].pbo);
+		memset(slots, 0, sizeof(slots));
+		slots_failed = true;
+		return false;
+	}
+
+	std::cout << " * Texture uploader: " << UPLOADER_NUM_SLOTS << " PBOs of " << (UPLOADER_SLOT_SIZE >> 20) << "MB" << (persistent ? " persistently mapped" : "") << std::endl;
+	return true;
+}
+
+//the slot can be reused once the GPU has consumed its previous band, never waits
+GFX::Uploader::sSlot* GFX::Uploader::getFreeSlot()
+{
+	sSlot& slot = slots[current_slot];
+	if (slot.fence)
+	{
+		GLenum status = glClientWaitSync(slot.fence, 0, 0);
+		if (status == GL_TIMEOUT_EXPIRED)
+			return NULL;
+		glDeleteSync(slot.fence);
+		slot.fence = 0;
+	}
+	return &slot;
+}
+
+bool GFX::Uploader::uploadBand(sJob& job, Texture* texture, size_t max_bytes)
+{
+	Image* base = job.levels[0];
+	unsigned int format = base->num_channels == 3 ? GL_RGB : GL_RGBA;
+	int num_levels = (int)job.levels.size();
+
+	//first band: allocate all the levels, only the coarsest is visible
+	if (job.level == -1)
+	{
+		texture->create(base->width, base->height, format, GL_UNSIGNED_BYTE, num_levels > 1, NULL);
+		texture->setName(job.filename.c_str()); //create unregisters it when replacing the temporary texture
+		glBindTexture(GL_TEXTURE_2D, texture->texture_id);
+		for (int i = 1; i < num_levels; ++i)
+			glTexImage2D(GL_TEXTURE_2D, i, format, job.levels[i]->width, job.levels[i]->height, 0, format, GL_UNSIGNED_BYTE, NULL);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAX_LEVEL, num_levels - 1);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_BASE_LEVEL, num_levels - 1);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, (texture->mipmaps && job.wrap) ? GL_REPEAT : GL_CLAMP_TO_EDGE);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, (texture->mipmaps && job.wrap) ? GL_REPEAT : GL_CLAMP_TO_EDGE);
+		job.level = num_levels - 1;
+		job.row = 0;
+	}
+
+	unsigned int row = job.row;
+	if (!uploadRows(texture->texture_id, job.level, job.levels[job.level], row, max_bytes))
+		return false;
+	job.row = row;
+
+	//level completed, expose it
+	if (job.row == job.levels[job.level]->height)
+	{
+		glBindTexture(GL_TEXTURE_2D, texture->texture_id);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_BASE_LEVEL, job.level);
+		glBindTexture(GL_TEXTURE_2D, 0);
+		job.level--;
+		job.row = 0;
+	}
+	return true;
+}
+
+bool GFX::Uploader::uploadRows(GLuint texture_id, int level, Image* image, unsigned int& row, size_t max_bytes)
+{
+	Uploader& uploader = instance();
+	bool use_slots = uploader.initSlots();
+
+	unsigned int format = image->num_channels == 3 ? GL_RGB : GL_RGBA;
+	size_t row_size = image->width * image->num_channels;
+	unsigned int rows = (unsigned int)((std::min)(max_bytes, (size_t)UPLOADER_SLOT_SIZE) / row_size);
+	rows = (std::max)(1u, (std::min)(rows, image->height - row));
+	size_t size = rows * row_size;
+	const uint8* src = image->data + row * row_size;
+
+	sSlot* slot = NULL;
+	if (use_slots && size <= UPLOADER_SLOT_SIZE)
+	{
+		slot = uploader.getFreeSlot();
+		if (!slot)
+			return false;
+	}
+
+	glBindTexture(GL_TEXTURE_2D, texture_id);
+	glPixelStorei(GL_UNPACK_ALIGNMENT, 1); //RGB rows of the small mips are not multiple of 4
+	if (slot)
+	{
+		glBindBuffer(GL_PIXEL_UNPACK_BUFFER, slot->pbo);
+		if (slot->data)
+			memcpy(slot->data, src, size);
+		else
+		{
+			//orphan the previous content so the driver does not sync
+			void* data = glMapBufferRange(GL_PIXEL_UNPACK_BUFFER, 0, size, GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_BUFFER_BIT | GL_MAP_UNSYNCHRONIZED_BIT);
+			if (data)
+				memcpy(data, src, size);
+			glUnmapBuffer(GL_PIXEL_UNPACK_BUFFER);
+		}
+		glTexSubImage2D(GL_TEXTURE_2D, level, 0, row, image->width, rows, format, GL_UNSIGNED_BYTE, NULL);
+		glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+
+		slot->fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+		uploader.current_slot = (uploader.current_slot + 1) % UPLOADER_NUM_SLOTS;
+	}
+	else //no PBOs or a single row bigger than a slot, straight from RAM
+		glTexSubImage2D(GL_TEXTURE_2D, level, 0, row, image->width, rows, format, GL_UNSIGNED_BYTE, src);
+	glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+	glBindTexture(GL_TEXTURE_2D, 0);
+
+	uploader.uploaded_bytes += size;
+	row += rows;
+	return true;
+}
+
+void GFX::Uploader::waitSlot()
+{
+	Uploader& uploader = instance();
+	sSlot& slot = uploader.slots[uploader.current_slot];
+	if (slot.fence)
+		glClientWaitSync(slot.fence, GL_SYNC_FLUSH_COMMANDS_BIT, 1000000000);
+}
+
+bool GFX::Uploader::hasBudget()
+{
+	Uploader& uploader = instance();
+	if (!uploader.is_active)
+		return true;
+	uploader.upload_time = std::chrono::duration<float, std::milli>(std::chrono::steady_clock::now() - uploader.frame_start).count();
+	return uploader.uploaded_bytes < getBudgetBytes() && uploader.upload_time < uploader.budget_ms;
+}
+
+size_t GFX::Uploader::getBudgetBytes()
+{
+	return (size_t)(std::max)(1, instance().budget_kb) * 1024;
+}
+
+void GFX::Uploader::finish(sJob& job)
+{
+	auto it = Texture::sTexturesLoaded.find(job.filename);
+	if (it != Texture::sTexturesLoaded.end())
+		it->second->loading = false;
+	for (Image* level : job.levels)
+		delete level;
+	job.levels.clear();
+}
+
+void GFX::Uploader::update()
+{
+	Uploader& uploader = instance();
+	uploader.uploaded_bytes = 0;
+	uploader.upload_time = 0;
+	uploader.frame_start = std::chrono::steady_clock::now();
+	if (uploader.jobs.empty())
+		return;
+
+	if (!uploader.is_active)
+	{
+		flush();
+		return;
+	}
+
+	while (uploader.jobs.size() && hasBudget())
+	{
+		sJob& job = uploader.jobs.front();
+		auto it = Texture::sTexturesLoaded.find(job.filename);
+		if (it == Texture::sTexturesLoaded.end())
+		{
+			std::cout << "Warning: image loaded in background not found foreground thread" << std::endl;
+			uploader.finish(job);
+			uploader.jobs.pop_front();
+			continue;
+		}
+
+		if (!uploader.uploadBand(job, it->second, getBudgetBytes() - uploader.uploaded_bytes))
+			break; //all the PBOs in use, next frame
+
+		if (job.level < 0) //level 0 completed
+		{
+			uploader.finish(job);
+			uploader.jobs.pop_front();
+		}
+	}
+}
+
+void GFX::Uploader::flush()
+{
+	Uploader& uploader = instance();
+	while (uploader.jobs.size())
+	{
+		sJob& job = uploader.jobs.front();
+		auto it = Texture::sTexturesLoaded.find(job.filename);
+		if (it != Texture::sTexturesLoaded.end())
+			do {
+				if (!uploader.uploadBand(job, it->second, UPLOADER_SLOT_SIZE))
+					waitSlot();
+			} while (job.level >= 0); //the first band allocates it, so -1 means done from here
+		uploader.finish(job);
+		uploader.jobs.pop_front();
+	}
+}
+
+size_t GFX::Uploader::getPendingBytes()
+{
+	size_t total = 0;
+	for (sJob& job : instance().jobs)
+	{
+		int first = job.level == -1 ? (int)job.levels.size() - 1 : job.level;
+		for (int i = 0; i <= first; ++i)
+			total += job.levels[i]->width * job.levels[i]->height * job.levels[i]->num_channels;
+		if (job.level >= 0)
+			total -= job.row * job.levels[job.level]->width * job.levels[job.level]->num_channels;
+	}
+	return total;
+}
+
+void GFX::Uploader::showUI()
+{
+#ifndef SKIP_IMGUI
+	Uploader& uploader = instance();
+
+	ImGui::Checkbox("Texture streaming", &uploader.is_active);
+	if (uploader.is_active) {
+		if (ImGui::TreeNode("Texture streaming settings")) {
+			ImGui::SliderFloat("Budget (ms)", &uploader.budget_ms, 0.25f, 16.f);
+			ImGui::SliderInt("Budget (KB)", &uploader.budget_kb, 256, 64 * 1024);
+			ImGui::Text("PBOs: %d x %dMB %s", UPLOADER_NUM_SLOTS, UPLOADER_SLOT_SIZE >> 20, uploader.persistent ? "(persistent)" : "");
+			ImGui::Text("Pending: %d textures, %.2f MB", (int)uploader.jobs.size(), getPendingBytes() / (1024.0f * 1024.0f));
+			ImGui::Text("Last frame: %.2f MB in %.2f ms", uploader.uploaded_bytes / (1024.0f * 1024.0f), uploader.upload_time);
+			ImGui::TreePop();
+		}
+	}
+#endif
+}
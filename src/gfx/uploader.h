@@ -0,0 +1,88 @@
+/*  Texture uploader
+	The images decoded in the background reach the GPU a little bit every frame, so loading a scene never causes a spike:
+	 + every frame the pending textures are copied to a ring of PBOs until the time or the bytes budget is spent
+	 + the PBOs are persistently mapped when the driver supports it (GL_ARB_buffer_storage), a fence per slot tells when it can be reused
+	 + the mips are computed in the background (see MipGenerator) and uploaded from the coarsest to the finest, GL_TEXTURE_BASE_LEVEL
+	   only exposes the levels already in VRAM, so the texture is usable (blurry) from the first frame
+	 + big levels are split in bands of rows that fit in a slot
+*/
+#pragma once
+
+#include <deque>
+#include <vector>
+#include <string>
+#include <chrono>
+
+#include "../core/includes.h"
+
+class Image;
+
+namespace GFX {
+
+	class Texture;
+
+	#define UPLOADER_NUM_SLOTS 3
+	#define UPLOADER_SLOT_SIZE (4 * 1024 * 1024) //bytes
+
+	class Uploader {
+	private:
+		Uploader();
+
+	public:
+		static Uploader& instance()
+		{
+			static Uploader INSTANCE;
+			return INSTANCE;
+		}
+
+		struct sJob {
+			std::string filename; //the texture is searched every time, it could be destroyed while uploading
+			std::vector<Image*> levels; //[0] is the full resolution
+			bool wrap;
+			int level; //being uploaded, from the coarsest. -1 before allocating the storage and again once level 0 is done
+			unsigned int row; //first row of the level not uploaded yet
+		};
+
+		struct sSlot {
+			GLuint pbo;
+			GLsync fence;
+			unsigned char* data; //only when persistently mapped
+		};
+
+		bool is_active;
+		bool persistent; //mapped once using buffer storage
+		bool slots_failed; //the PBOs could not be created, uploads from RAM
+		float budget_ms;
+		int budget_kb; //per frame
+
+		//stats of the last frame
+		size_t uploaded_bytes;
+		float upload_time;
+		std::chrono::steady_clock::time_point frame_start;
+
+		std::deque<sJob> jobs;
+		sSlot slots[UPLOADER_NUM_SLOTS];
+		int current_slot;
+
+		//takes ownership of the levels (it can be only the first one), the texture must be registered with this filename
+		static void addTexture(const char* filename, const std::vector<Image*>& levels, bool wrap = true);
+
+		static void update(); //in the main thread once per frame
+		static void flush(); //uploads everything pending ignoring the budget
+		static size_t getPendingBytes();
+
+		//low level, also used by the TextureStreamer to share the budget of the frame
+		static bool hasBudget();
+		static size_t getBudgetBytes();
+		//copies as many rows as fit in max_bytes (at least one) through a PBO (from RAM if there are none), false if all the slots are in use
+		static bool uploadRows(GLuint texture_id, int level, Image* image, unsigned int& row, size_t max_bytes);
+		static void waitSlot(); //blocks until the next slot is free
+		static void showUI();
+
+	private:
+		bool initSlots();
+		sSlot* getFreeSlot();
+		bool uploadBand(sJob& job, Texture* texture, size_t max_bytes);
+		void finish(sJob& job);
+	};
+};
@@ -20,5 +20,10 @@
 #include "pipeline/scene.h"
 #include "pipeline/renderer.h"
 #include "pipeline/light.h"
+#include "pipeline/irradiance.h"
+#include "pipeline/reflections.h"
+#include "pipeline/lightmap.h"
+#include "pipeline/animator.h"
+#include "pipeline/crowd.h"
 
 
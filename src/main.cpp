@@ -10,9 +10,12 @@
 #include "litengine.h"
 
 #include "application.h"
+#include "benchmark.h"
+#include "pipeline/skinning.h"
 
 
 #include <iostream> //to output
+#include <cstring>
 
 Application* app = NULL;
 
@@ -21,6 +24,35 @@ Application* app = NULL;
 //The application main loop
 int main(int argc, char **argv)
 {
+	//times the math kernels, no window needed
+	if (argc > 1 && strcmp(argv[1], "--math-benchmark") == 0)
+	{
+		benchmarkMath(argc > 2 ? atoi(argv[2]) : 1000000);
+		return 0;
+	}
+
+	//GPU and CPU skinning of 100 to 1000 characters, in an offscreen context
+	if (argc > 1 && strcmp(argv[1], "--skinning-benchmark") == 0)
+	{
+		CORE::init(true);
+#ifdef __APPLE__
+		const char* shader_atlas_filename = "data/shader_atlas_osx.glsl";
+#else
+		const char* shader_atlas_filename = "data/shader_atlas.glsl";
+#endif
+		if (!CORE::createWindow("GTR", 256, 256) || !GFX::Shader::LoadAtlas(shader_atlas_filename))
+			return 1;
+		SCN::Skinning::benchmark(argc > 2 ? atoi(argv[2]) : 20);
+		CORE::destroy();
+		return 0;
+	}
+
+	//renders a scene offscreen along a camera path and saves the times of every pass, no display needed
+	//  --benchmark [scene.json] [--frames N] [--warmup N] [--width W] [--height H] [--fps F] [--path camera_path.json] [--output benchmark.json]
+	sBenchmarkSettings benchmark;
+	if (Benchmark::parseArgs(argc, argv, benchmark))
+		return Benchmark::run(benchmark);
+
 	std::cout << "Initiating app..." << std::endl;
 	CORE::init();
 
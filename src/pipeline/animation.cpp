@@ -8,6 +8,191 @@
 #include "../gfx/mesh.h"
 
 #include <sys/stat.h>
+#include <cmath>
+
+#if defined(__SSE__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 1)
+	#define ANIMATION_USE_SSE
+	#include <xmmintrin.h>
+#endif
+
+#define ANIM_QUAT_RANGE 0.70710678f //the three smallest components of a unit quaternion are in [-1/sqrt(2), 1/sqrt(2)]
+
+bool Animation::reduce_keyframes = true;
+float Animation::rotation_tolerance = 0.001f;
+float Animation::translation_tolerance = 0.001f;
+
+namespace {
+
+	//quaternions as x,y,z,w, not the Quaternion class: here only the decomposition of the bone matrices matters
+
+	//the matrix as scale, rotation and translation: the rows 0,1,2 are the axes multiplied by the scale and the row 3 the translation
+	void decomposeMatrix(const Matrix44& m, float* t, float* q, float* s)
+	{
+		float axes[3][3];
+		for (int i = 0; i < 3; ++i)
+		{
+			s[i] = sqrtf(m.m[i * 4] * m.m[i * 4] + m.m[i * 4 + 1] * m.m[i * 4 + 1] + m.m[i * 4 + 2] * m.m[i * 4 + 2]);
+			for (int j = 0; j < 3; ++j)
+				axes[i][j] = s[i] > 0.0f ? m.m[i * 4 + j] / s[i] : (i == j ? 1.0f : 0.0f);
+			t[i] = m.m[12 + i];
+		}
+
+		//a mirror goes to the scale
+		float det = axes[0][0] * (axes[1][1] * axes[2][2] - axes[1][2] * axes[2][1]) - axes[0][1] * (axes[1][0] * axes[2][2] - axes[1][2] * axes[2][0]) + axes[0][2] * (axes[1][0] * axes[2][1] - axes[1][1] * axes[2][0]);
+		if (det < 0.0f)
+		{
+			s[0] = -s[0];
+			for (int j = 0; j < 3; ++j)
+				axes[0][j] = -axes[0][j];
+		}
+
+		//r(row, col) of the rotation that has the axes as columns
+		auto r = [&](int row, int col) { return axes[col][row]; };
+		float trace = r(0, 0) + r(1, 1) + r(2, 2);
+		if (trace > 0.0f)
+		{
+			float k = sqrtf(trace + 1.0f) * 2.0f;
+			q[3] = 0.25f * k; q[0] = (r(2, 1) - r(1, 2)) / k; q[1] = (r(0, 2) - r(2, 0)) / k; q[2] = (r(1, 0) - r(0, 1)) / k;
+		}
+		else if (r(0, 0) > r(1, 1) && r(0, 0) > r(2, 2))
+		{
+			float k = sqrtf(1.0f + r(0, 0) - r(1, 1) - r(2, 2)) * 2.0f;
+			q[3] = (r(2, 1) - r(1, 2)) / k; q[0] = 0.25f * k; q[1] = (r(0, 1) + r(1, 0)) / k; q[2] = (r(0, 2) + r(2, 0)) / k;
+		}
+		else if (r(1, 1) > r(2, 2))
+		{
+			float k = sqrtf(1.0f + r(1, 1) - r(0, 0) - r(2, 2)) * 2.0f;
+			q[3] = (r(0, 2) - r(2, 0)) / k; q[0] = (r(0, 1) + r(1, 0)) / k; q[1] = 0.25f * k; q[2] = (r(1, 2) + r(2, 1)) / k;
+		}
+		else
+		{
+			float k = sqrtf(1.0f + r(2, 2) - r(0, 0) - r(1, 1)) * 2.0f;
+			q[3] = (r(1, 0) - r(0, 1)) / k; q[0] = (r(0, 2) + r(2, 0)) / k; q[1] = (r(1, 2) + r(2, 1)) / k; q[2] = 0.25f * k;
+		}
+		float length = sqrtf(q[0] * q[0] + q[1] * q[1] + q[2] * q[2] + q[3] * q[3]);
+		for (int i = 0; i < 4; ++i)
+			q[i] /= length;
+	}
+
+	void composeMatrix(const float* t, const float* q, const float* s, Matrix44& m)
+	{
+		float xx = q[0] * q[0], yy = q[1] * q[1], zz = q[2] * q[2];
+		float xy = q[0] * q[1], xz = q[0] * q[2], yz = q[1] * q[2];
+		float wx = q[3] * q[0], wy = q[3] * q[1], wz = q[3] * q[2];
+		m.m[0] = (1.0f - 2.0f * (yy + zz)) * s[0]; m.m[1] = 2.0f * (xy + wz) * s[0]; m.m[2] = 2.0f * (xz - wy) * s[0]; m.m[3] = 0.0f;
+		m.m[4] = 2.0f * (xy - wz) * s[1]; m.m[5] = (1.0f - 2.0f * (xx + zz)) * s[1]; m.m[6] = 2.0f * (yz + wx) * s[1]; m.m[7] = 0.0f;
+		m.m[8] = 2.0f * (xz + wy) * s[2]; m.m[9] = 2.0f * (yz - wx) * s[2]; m.m[10] = (1.0f - 2.0f * (xx + yy)) * s[2]; m.m[11] = 0.0f;
+		m.m[12] = t[0]; m.m[13] = t[1]; m.m[14] = t[2]; m.m[15] = 1.0f;
+	}
+
+	//smallest three: the biggest component is dropped (made positive, q and -q are the same rotation), its index goes in the high bits
+	void encodeQuaternion(const float* q, uint16* key)
+	{
+		int biggest = 0;
+		for (int i = 1; i < 4; ++i)
+			if (fabs(q[i]) > fabs(q[biggest]))
+				biggest = i;
+		float sign = q[biggest] < 0.0f ? -1.0f : 1.0f;
+		for (int i = 0, j = 0; i < 4; ++i)
+		{
+			if (i == biggest)
+				continue;
+			float v = clamp(q[i] * sign / ANIM_QUAT_RANGE * 0.5f + 0.5f, 0.0f, 1.0f);
+			key[j++] = (uint16)(v * 32767.0f + 0.5f);
+		}
+		key[0] |= (biggest >> 1) << 15;
+		key[1] |= (biggest & 1) << 15;
+	}
+
+	void decodeQuaternion(const uint16* key, float* q)
+	{
+		int biggest = ((key[0] >> 15) << 1) | (key[1] >> 15);
+		float sum = 0.0f;
+		for (int i = 0, j = 0; i < 4; ++i)
+		{
+			if (i == biggest)
+				continue;
+			q[i] = ((key[j++] & 0x7FFF) / 32767.0f * 2.0f - 1.0f) * ANIM_QUAT_RANGE;
+			sum += q[i] * q[i];
+		}
+		q[biggest] = sqrtf((std::max)(0.0f, 1.0f - sum));
+	}
+
+	//what the sampling does between two keys
+	void nlerpQuaternion(const float* a, const float* b, float f, float* result)
+	{
+		float d = a[0] * b[0] + a[1] * b[1] + a[2] * b[2] + a[3] * b[3];
+		float fb = d < 0.0f ? -f : f;
+#ifdef ANIMATION_USE_SSE
+		__m128 q = _mm_add_ps(_mm_mul_ps(_mm_loadu_ps(a), _mm_set1_ps(1.0f - f)), _mm_mul_ps(_mm_loadu_ps(b), _mm_set1_ps(fb)));
+		__m128 q2 = _mm_mul_ps(q, q);
+		q2 = _mm_add_ps(q2, _mm_shuffle_ps(q2, q2, _MM_SHUFFLE(2, 3, 0, 1)));
+		q2 = _mm_add_ps(q2, _mm_shuffle_ps(q2, q2, _MM_SHUFFLE(1, 0, 3, 2)));
+		_mm_storeu_ps(result, _mm_div_ps(q, _mm_sqrt_ps(q2)));
+#else
+		float length = 0.0f;
+		for (int i = 0; i < 4; ++i)
+		{
+			result[i] = a[i] * (1.0f - f) + b[i] * fb;
+			length += result[i] * result[i];
+		}
+		length = sqrtf(length);
+		for (int i = 0; i < 4; ++i)
+			result[i] /= length;
+#endif
+	}
+
+	bool isConstant(const std::vector<float>& values, int channel_type, int num_keys, float tolerance)
+	{
+		int size = channel_type == Animation::ROTATION ? 4 : 3;
+		float cos_tolerance = cosf(tolerance * 0.5f);
+		const float* a = &values[0];
+		for (int k = 1; k < num_keys; ++k)
+		{
+			const float* v = &values[k * size];
+			if (channel_type == Animation::ROTATION)
+			{
+				if (fabs(a[0] * v[0] + a[1] * v[1] + a[2] * v[2] + a[3] * v[3]) < cos_tolerance)
+					return false;
+			}
+			else
+			{
+				for (int i = 0; i < 3; ++i)
+					if (fabs(v[i] - a[i]) > tolerance)
+						return false;
+			}
+		}
+		return true;
+	}
+
+	//the error of interpolating the keys from..to instead of keeping the ones between them
+	bool canInterpolate(const std::vector<float>& values, int channel_type, int from, int to, float tolerance)
+	{
+		int size = channel_type == Animation::ROTATION ? 4 : 3;
+		float cos_tolerance = cosf(tolerance * 0.5f);
+		for (int k = from + 1; k < to; ++k)
+		{
+			float f = (k - from) / (float)(to - from);
+			const float* a = &values[from * size];
+			const float* b = &values[to * size];
+			const float* v = &values[k * size];
+			if (channel_type == Animation::ROTATION)
+			{
+				float q[4];
+				nlerpQuaternion(a, b, f, q);
+				if (fabs(q[0] * v[0] + q[1] * v[1] + q[2] * v[2] + q[3] * v[3]) < cos_tolerance)
+					return false;
+			}
+			else
+			{
+				for (int i = 0; i < 3; ++i)
+					if (fabs(a[i] + (b[i] - a[i]) * f - v[i]) > tolerance)
+						return false;
+			}
+		}
+		return true;
+	}
+};
 
 Skeleton::Skeleton()
 {
@@ -93,7 +278,7 @@ void blendSkeleton(Skeleton* a, Skeleton* b, float w, Skeleton* result, uint8 la
 	}
 }
 
-void Skeleton::renderSkeleton(Camera* camera, Matrix44 model, Vector4f color, bool render_points)
+void Skeleton::renderSkeleton(Camera* camera, const Matrix44& model, Vector4f color, bool render_points)
 {
 	GFX::Mesh m;
 
@@ -126,7 +311,7 @@ void Skeleton::renderSkeleton(Camera* camera, Matrix44 model, Vector4f color, bo
 	shader->disable();
 }
 
-void Skeleton::applyTransformToBones(const char* root, Matrix44 transform)
+void Skeleton::applyTransformToBones(const char* root, const Matrix44& transform)
 {
 	Bone* bone = getBone(root);
 	if (!bone)
@@ -161,24 +346,269 @@ void Skeleton::assignLayer( Bone* bone, uint8 layer )
 	}
 }
 
+void Skeleton::initPose(Pose& pose) const
+{
+	assert(pose.capacity >= num_bones);
+	pose.num_bones = num_bones;
+	for (int i = 0; i < num_bones; ++i)
+		pose.local[i] = bones[i].model;
+}
+
+void Skeleton::updateGlobalMatrices(Pose& pose) const
+{
+	pose.global[0] = pose.local[0];
+	//order dependant, parents go first
+	for (int i = 1; i < pose.num_bones; ++i)
+		pose.global[i] = pose.local[i] * pose.global[bones[i].parent];
+}
+
+void Skeleton::findMeshBones(GFX::Mesh* mesh, std::vector<int>& bone_indices)
+{
+	bone_indices.resize(mesh->bones_info.size());
+	for (size_t i = 0; i < mesh->bones_info.size(); ++i)
+	{
+		auto it = bones_by_name.find(mesh->bones_info[i].name);
+		bone_indices[i] = it == bones_by_name.end() ? -1 : it->second;
+	}
+}
+
+void Skeleton::computeFinalBoneMatrices(const Pose& pose, GFX::Mesh* mesh, const std::vector<int>& bone_indices, const Matrix44& transform, Matrix44* bone_matrices) const
+{
+	assert(mesh && bone_indices.size() <= mesh->bones_info.size());
+	for (size_t i = 0; i < bone_indices.size(); ++i)
+	{
+		if (bone_indices[i] == -1)
+		{
+			bone_matrices[i].setIdentity();
+			continue;
+		}
+		const BoneInfo& bone_info = mesh->bones_info[i];
+		bone_matrices[i] = mesh->bind_matrix * bone_info.bind_pose * pose.global[bone_indices[i]] * transform;
+	}
+}
+
+void blendPoses(const Pose& a, const Pose& b, float w, Pose& result, const Skeleton* skeleton, uint8 layer)
+{
+	assert(a.num_bones == b.num_bones && result.capacity >= a.num_bones && "poses must contain the same number of bones");
+	assert((layer == 0xFF || skeleton) && "the layers are in the skeleton");
+
+	w = clamp(w, 0.0f, 1.0f);
+	result.num_bones = a.num_bones;
+
+	for (int i = 0; i < a.num_bones; ++i)
+	{
+		const float* ma = a.local[i].m;
+		const float* mb = b.local[i].m;
+		float* mr = result.local[i].m;
+		if (layer != 0xFF && !(skeleton->bones[i].layer & layer))
+		{
+			if (mr != ma)
+				result.local[i] = a.local[i];
+			continue;
+		}
+#ifdef ANIMATION_USE_SSE
+		__m128 vw = _mm_set1_ps(w);
+		for (int j = 0; j < 16; j += 4)
+		{
+			__m128 va = _mm_loadu_ps(ma + j);
+			_mm_storeu_ps(mr + j, _mm_add_ps(va, _mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(mb + j), va), vw)));
+		}
+#else
+		for (int j = 0; j < 16; ++j)
+			mr[j] = lerp(ma[j], mb[j], w);
+#endif
+	}
+}
+
+PosePool::~PosePool()
+{
+	for (Pose* pose : poses)
+	{
+		delete[] pose->local;
+		delete pose;
+	}
+}
+
+Pose* PosePool::acquire(int num_bones)
+{
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		for (size_t i = 0; i < free_poses.size(); ++i)
+		{
+			Pose* pose = free_poses[i];
+			if (pose->capacity < num_bones)
+				continue;
+			free_poses[i] = free_poses.back();
+			free_poses.pop_back();
+			pose->num_bones = num_bones;
+			return pose;
+		}
+	}
+
+	//local and global in the same block
+	Pose* pose = new Pose();
+	pose->num_bones = pose->capacity = num_bones;
+	pose->local = new Matrix44[num_bones * 2];
+	pose->global = pose->local + num_bones;
+
+	std::lock_guard<std::mutex> lock(mutex);
+	poses.push_back(pose);
+	memory_size += sizeof(Matrix44) * num_bones * 2;
+	return pose;
+}
+
+void PosePool::release(Pose* pose)
+{
+	if (!pose)
+		return;
+	std::lock_guard<std::mutex> lock(mutex);
+	free_poses.push_back(pose);
+}
+
 Animation::Animation()
 {
 	duration = 0.0f;
-	keyframes = NULL;
+	samples_per_second = 0.0f;
 	num_keyframes = 0;
 	num_animated_bones = 0;
 }
 
 Animation::~Animation()
 {
-	if (keyframes)
-		delete[] keyframes;
 }
 
-void Animation::assignTime(float t, bool loop, bool interpolate, uint8 layers)
+void Animation::compress(const Matrix44* keyframes)
 {
-	assert(keyframes && skeleton.num_bones);
+	channels.resize(num_animated_bones * NUM_CHANNELS);
+	key_frames.clear();
+	key_values.clear();
+
+	std::vector<float> values[NUM_CHANNELS];
+	for (int bone = 0; bone < num_animated_bones; ++bone)
+	{
+		values[TRANSLATION].resize(num_keyframes * 3);
+		values[ROTATION].resize(num_keyframes * 4);
+		values[SCALE].resize(num_keyframes * 3);
+		for (int k = 0; k < num_keyframes; ++k)
+			decomposeMatrix(keyframes[k * num_animated_bones + bone], &values[TRANSLATION][k * 3], &values[ROTATION][k * 4], &values[SCALE][k * 3]);
+
+		for (int type = 0; type < NUM_CHANNELS; ++type)
+		{
+			sChannel& channel = channels[bone * NUM_CHANNELS + type];
+			const std::vector<float>& channel_values = values[type];
+			int size = type == ROTATION ? 4 : 3;
 
+			//range of the quantization
+			float tolerance = rotation_tolerance;
+			if (type != ROTATION)
+			{
+				float max_extent = 0.0f;
+				for (int i = 0; i < 3; ++i)
+				{
+					float min_value = channel_values[i], max_value = channel_values[i];
+					for (int k = 1; k < num_keyframes; ++k)
+					{
+						min_value = (std::min)(min_value, channel_values[k * 3 + i]);
+						max_value = (std::max)(max_value, channel_values[k * 3 + i]);
+					}
+					channel.min[i] = min_value;
+					channel.extent[i] = max_value - min_value;
+					max_extent = (std::max)(max_extent, channel.extent[i]);
+				}
+				tolerance = translation_tolerance * max_extent;
+			}
+			else
+				for (int i = 0; i < 3; ++i)
+					channel.min[i] = channel.extent[i] = 0.0f;
+
+			//the keys kept: one if it is constant, the first and the last ones, and the ones that cannot be interpolated
+			std::vector<int> keys;
+			keys.push_back(0);
+			if (!isConstant(channel_values, type, num_keyframes, tolerance))
+			{
+				if (!reduce_keyframes)
+					for (int k = 1; k < num_keyframes; ++k)
+						keys.push_back(k);
+				else
+				{
+					int from = 0;
+					while (from < num_keyframes - 1)
+					{
+						int to = from + 1;
+						while (to + 1 < num_keyframes && canInterpolate(channel_values, type, from, to + 1, tolerance))
+							to++;
+						keys.push_back(to);
+						from = to;
+					}
+				}
+			}
+
+			channel.first_key = (int)key_frames.size();
+			channel.num_keys = (int)keys.size();
+			for (int k : keys)
+			{
+				key_frames.push_back((uint16)k);
+				uint16 key[3];
+				const float* v = &channel_values[k * size];
+				if (type == ROTATION)
+					encodeQuaternion(v, key);
+				else
+					for (int i = 0; i < 3; ++i)
+						key[i] = channel.extent[i] > 0.0f ? (uint16)(clamp((v[i] - channel.min[i]) / channel.extent[i], 0.0f, 1.0f) * 65535.0f + 0.5f) : 0;
+				key_values.insert(key_values.end(), key, key + 3);
+			}
+		}
+	}
+}
+
+size_t Animation::getMemorySize() const
+{
+	return channels.size() * sizeof(sChannel) + key_frames.size() * sizeof(uint16) + key_values.size() * sizeof(uint16);
+}
+
+//the value of the channel in the keyframe index + f, between the keys around it (the last keyframe goes to the first one)
+void Animation::sampleChannel(const sChannel& channel, int channel_type, int index, float f, float* result) const
+{
+	const uint16* frames = &key_frames[channel.first_key];
+	const uint16* values = &key_values[channel.first_key * 3];
+
+	int key = 0, next_key = 0;
+	float key_f = 0.0f;
+	if (channel.num_keys > 1)
+	{
+		key = (int)(std::upper_bound(frames, frames + channel.num_keys, (uint16)index) - frames) - 1;
+		next_key = key + 1 < channel.num_keys ? key + 1 : 0;
+		int next_frame = key + 1 < channel.num_keys ? frames[next_key] : num_keyframes;
+		key_f = (index - frames[key] + f) / (float)(next_frame - frames[key]);
+	}
+	const uint16* a = values + key * 3;
+	const uint16* b = values + next_key * 3;
+
+	if (channel_type == ROTATION)
+	{
+		float qa[4], qb[4];
+		decodeQuaternion(a, qa);
+		decodeQuaternion(b, qb);
+		nlerpQuaternion(qa, qb, key_f, result);
+		return;
+	}
+
+#ifdef ANIMATION_USE_SSE
+	__m128 va = _mm_setr_ps(a[0], a[1], a[2], 0.0f);
+	__m128 vb = _mm_setr_ps(b[0], b[1], b[2], 0.0f);
+	__m128 v = _mm_add_ps(va, _mm_mul_ps(_mm_sub_ps(vb, va), _mm_set1_ps(key_f)));
+	__m128 scale = _mm_mul_ps(_mm_setr_ps(channel.extent[0], channel.extent[1], channel.extent[2], 0.0f), _mm_set1_ps(1.0f / 65535.0f));
+	float out[4];
+	_mm_storeu_ps(out, _mm_add_ps(_mm_mul_ps(v, scale), _mm_setr_ps(channel.min[0], channel.min[1], channel.min[2], 0.0f)));
+	result[0] = out[0]; result[1] = out[1]; result[2] = out[2];
+#else
+	for (int i = 0; i < 3; ++i)
+		result[i] = channel.min[i] + (a[i] + (b[i] - a[i]) * key_f) * (channel.extent[i] / 65535.0f);
+#endif
+}
+
+void Animation::getKeyframe(float t, bool loop, int& index, float& f) const
+{
 	if (loop)
 	{
 		t = fmod(t, duration);
@@ -188,14 +618,27 @@ void Animation::assignTime(float t, bool loop, bool interpolate, uint8 layers)
 	else
 		t = clamp( t, 0.0f, duration - (1.0/samples_per_second) );
 	float v = samples_per_second * t;
-	int index = clamp(floor(v), 0, num_keyframes - 1);
-	int index2 = index + 1;
-	if (index2 >= num_keyframes)
-		index2 = 0;
-	float f = v - floor(v);
+	index = clamp(floor(v), 0, num_keyframes - 1);
+	f = v - floor(v);
+}
+
+void Animation::sampleBone(int animated_bone, int index, float f, Matrix44& model) const
+{
+	const sChannel* bone_channels = &channels[animated_bone * NUM_CHANNELS];
+	float translation[3], rotation[4], scale[3];
+	sampleChannel(bone_channels[TRANSLATION], TRANSLATION, index, f, translation);
+	sampleChannel(bone_channels[ROTATION], ROTATION, index, f, rotation);
+	sampleChannel(bone_channels[SCALE], SCALE, index, f, scale);
+	composeMatrix(translation, rotation, scale, model);
+}
+
+void Animation::assignTime(float t, bool loop, bool interpolate, uint8 layers)
+{
+	assert(channels.size() && skeleton.num_bones);
 
-	Matrix44* k = keyframes + index * num_animated_bones;
-	Matrix44* k2 = keyframes + index2 * num_animated_bones;
+	int index;
+	float f;
+	getKeyframe(t, loop, index, f);
 
 	//compute local bones
 	#pragma omp for  
@@ -205,18 +648,41 @@ void Animation::assignTime(float t, bool loop, bool interpolate, uint8 layers)
 		Skeleton::Bone& bone = skeleton.bones[bone_index];
 		if (layers != 0xFF && !(bone.layer & layers))
 			continue;
-		for (int j = 0; j < 16; ++j)
-			bone.model.m[j] = lerp(k[i].m[j], k2[i].m[j], f);
+		sampleBone(i, index, f, bone.model);
 	}
 
 	skeleton.updateGlobalMatrices();
 }
 
+void Animation::samplePose(float t, Pose& pose, bool loop, uint8 layers) const
+{
+	assert(channels.size() && pose.num_bones == skeleton.num_bones);
+
+	int index;
+	float f;
+	getKeyframe(t, loop, index, f);
+
+	for (int i = 0; i < num_animated_bones; ++i)
+	{
+		int bone_index = bones_map[i];
+		if (layers != 0xFF && !(skeleton.bones[bone_index].layer & layers))
+			continue;
+		sampleBone(i, index, f, pose.local[bone_index]);
+	}
+}
+
 
 void Animation::operator = (Animation* anim)
 {
-	memcpy(this, anim, sizeof(Animation));
-	this->keyframes = NULL;
+	skeleton = anim->skeleton;
+	duration = anim->duration;
+	samples_per_second = anim->samples_per_second;
+	num_animated_bones = anim->num_animated_bones;
+	num_keyframes = anim->num_keyframes;
+	memcpy(bones_map, anim->bones_map, sizeof(bones_map));
+	channels = anim->channels;
+	key_frames = anim->key_frames;
+	key_values = anim->key_values;
 }
 
 bool Animation::load(const char* filename)
@@ -251,7 +717,7 @@ bool Animation::load(const char* filename)
 		}
 	}
 
-	std::cout << "[OK] Num. Bones: " << skeleton.num_bones << " Time: " << (getTime() - time) * 0.001 << "sec" << std::endl;
+	std::cout << "[OK] Num. Bones: " << skeleton.num_bones << " Keys: " << key_frames.size() << " (" << getMemorySize() / 1024 << "KB) Time: " << (getTime() - time) * 0.001 << "sec" << std::endl;
 	return true;
 }
 
@@ -264,9 +730,34 @@ struct sAnimHeader {
 	int num_keyframes;
 	int num_bones;
 	int8 bones_map[128];
-	char extra[16];
+	int num_keys; //from version 4
+	char extra[12];
 };
 
+//the bones are stored as they were before Matrix44 was aligned to 16 bytes, the files do not depend on the alignment
+#define ABIN_BONE_SIZE 120
+
+static void writeABINBone(const Skeleton::Bone& bone, char* dst)
+{
+	memset(dst, 0, ABIN_BONE_SIZE);
+	dst[0] = bone.parent;
+	memcpy(dst + 1, bone.name, sizeof(bone.name));
+	memcpy(dst + 36, bone.model.m, sizeof(bone.model.m));
+	dst[100] = (char)bone.layer;
+	dst[101] = (char)bone.num_children;
+	memcpy(dst + 102, bone.children, sizeof(bone.children));
+}
+
+static void readABINBone(Skeleton::Bone& bone, const char* src)
+{
+	bone.parent = src[0];
+	memcpy(bone.name, src + 1, sizeof(bone.name));
+	memcpy(bone.model.m, src + 36, sizeof(bone.model.m));
+	bone.layer = (uint8)src[100];
+	bone.num_children = (uint8)src[101];
+	memcpy(bone.children, src + 102, sizeof(bone.children));
+}
+
 bool Animation::writeABIN(const char* filename)
 {
 	std::string s_filename = filename;
@@ -291,15 +782,23 @@ bool Animation::writeABIN(const char* filename)
 	header.num_keyframes = num_keyframes;
 	header.num_bones = skeleton.num_bones;
 	memcpy( header.bones_map, bones_map, sizeof(bones_map)  );
+	header.num_keys = (int)key_frames.size();
+	memset(header.extra, 0, sizeof(header.extra));
 
 	//write header
 	fwrite((void*)&header, sizeof(sAnimHeader), 1, f);
 
 	//write skeleton
-	fwrite((void*)skeleton.bones, sizeof(skeleton.bones), 1, f);
+	const int max_bones = sizeof(skeleton.bones) / sizeof(Skeleton::Bone);
+	std::vector<char> bones_data(max_bones * ABIN_BONE_SIZE);
+	for (int i = 0; i < max_bones; ++i)
+		writeABINBone(skeleton.bones[i], &bones_data[i * ABIN_BONE_SIZE]);
+	fwrite((void*)&bones_data[0], bones_data.size(), 1, f);
 
-	//write keyframes
-	fwrite((void*)keyframes, sizeof(Matrix44) * num_keyframes * num_animated_bones, 1, f);
+	//write channels and keys
+	fwrite((void*)&channels[0], sizeof(sChannel) * channels.size(), 1, f);
+	fwrite((void*)&key_frames[0], sizeof(uint16) * key_frames.size(), 1, f);
+	fwrite((void*)&key_values[0], sizeof(uint16) * key_values.size(), 1, f);
 
 	fclose(f);
 	return true;
@@ -319,24 +818,52 @@ bool Animation::loadABIN(const char* filename)
 
 	unsigned int size = (unsigned int)stbuffer.st_size;
 	char* data = new char[size];
-	fread(data, size, 1, f);
+	size = (unsigned int)fread(data, 1, size, f);
 	fclose(f);
 
+	//false (and the data released) if the file is shorter than what the header says
+	char* pos = data;
+	auto available = [&](size_t bytes) {
+		if (pos + bytes <= data + size)
+			return true;
+		std::cout << "[ERROR] loading BIN: truncated file: " << filename << std::endl;
+		delete[] data;
+		return false;
+	};
+
 	//watermark
+	if (!available(4 + sizeof(sAnimHeader)))
+		return false;
 	if (memcmp(data, "ABIN", 4) != 0)
 	{
 		std::cout << "[ERROR] loading BIN: invalid content: " << filename << std::endl;
+		delete[] data;
 		return false;
 	}
 
-	char* pos = data + 4;
+	pos = data + 4;
 	sAnimHeader header;
 	memcpy(&header, pos, sizeof(sAnimHeader));
 	pos += sizeof(sAnimHeader);
 
-	if (header.version != ANIM_BIN_VERSION || header.header_bytes != sizeof(sAnimHeader))
+	if ((header.version != ANIM_BIN_VERSION && header.version != 3) || header.header_bytes != sizeof(sAnimHeader))
 	{
 		std::cout << "[WARN] loading BIN: old version: " << filename << std::endl;
+		delete[] data;
+		return false;
+	}
+
+	const int max_bones = sizeof(skeleton.bones) / sizeof(Skeleton::Bone);
+	const int max_animated_bones = sizeof(header.bones_map) / sizeof(header.bones_map[0]);
+	bool valid = header.num_bones >= 0 && header.num_bones <= max_bones && header.num_animated_bones >= 0 && header.num_animated_bones <= max_animated_bones &&
+		header.num_keyframes >= 0 && header.num_keys >= 0;
+	//every animated bone is sampled into the bone it maps to
+	for (int i = 0; valid && i < header.num_animated_bones; ++i)
+		valid = header.bones_map[i] >= 0 && header.bones_map[i] < header.num_bones;
+	if (!valid)
+	{
+		std::cout << "[ERROR] loading BIN: invalid content: " << filename << std::endl;
+		delete[] data;
 		return false;
 	}
 
@@ -349,14 +876,44 @@ bool Animation::loadABIN(const char* filename)
 	memcpy(bones_map, header.bones_map, sizeof(bones_map));
 
 	//extract skeleton
-	memcpy( skeleton.bones, pos, sizeof(skeleton.bones) );
-	pos += sizeof(skeleton.bones);
+	if (!available(max_bones * ABIN_BONE_SIZE))
+		return false;
+	for (int i = 0; i < max_bones; ++i)
+		readABINBone(skeleton.bones[i], pos + i * ABIN_BONE_SIZE);
+	pos += max_bones * ABIN_BONE_SIZE;
 
 	//extract keyframes
-	assert(keyframes == NULL);
-	keyframes = new Matrix44[num_keyframes * num_animated_bones];
-	memcpy( keyframes, pos, sizeof(Matrix44)*num_keyframes * num_animated_bones );
-	pos += sizeof(Matrix44) * num_keyframes * num_animated_bones;
+	if (header.version == 3)
+	{
+		std::vector<Matrix44> keyframes((size_t)num_keyframes * num_animated_bones);
+		if (!available(sizeof(Matrix44) * keyframes.size()))
+			return false;
+		memcpy(&keyframes[0], pos, sizeof(Matrix44) * keyframes.size());
+		pos += sizeof(Matrix44) * keyframes.size();
+		compress(&keyframes[0]);
+	}
+	else
+	{
+		channels.resize(num_animated_bones * NUM_CHANNELS);
+		if (!available(sizeof(sChannel) * channels.size() + sizeof(uint16) * (size_t)header.num_keys * 4))
+			return false;
+		memcpy(&channels[0], pos, sizeof(sChannel) * channels.size());
+		pos += sizeof(sChannel) * channels.size();
+		//the keys of every channel must be inside the arrays, sampleChannel reads at least one
+		for (const sChannel& channel : channels)
+			if (channel.first_key < 0 || channel.num_keys < 1 || channel.num_keys > header.num_keys - channel.first_key)
+			{
+				std::cout << "[ERROR] loading BIN: invalid channel: " << filename << std::endl;
+				delete[] data;
+				return false;
+			}
+		key_frames.resize(header.num_keys);
+		memcpy(&key_frames[0], pos, sizeof(uint16) * key_frames.size());
+		pos += sizeof(uint16) * key_frames.size();
+		key_values.resize(header.num_keys * 3);
+		memcpy(&key_values[0], pos, sizeof(uint16) * key_values.size());
+		pos += sizeof(uint16) * key_values.size();
+	}
 
 	//compute bone names map
 	for (int i = 0; i < skeleton.num_bones; ++i)
@@ -396,6 +953,7 @@ bool Animation::loadSKANIM(const char* filename)
 	num_animated_bones = 0;
 
 	int current_keyframe = 0;
+	std::vector<Matrix44> keyframes; //compressed at the end
 
 	while (*pos)
 	{
@@ -432,14 +990,13 @@ bool Animation::loadSKANIM(const char* filename)
 			for (int j = 0; j < (int)bones_map_info.size(); ++j)
 				bones_map[j] = bones_map_info[j];
 			num_animated_bones = (int)bones_map_info.size();
-			assert(keyframes == NULL);
-			keyframes = new Matrix44[num_animated_bones * num_keyframes];
+			keyframes.resize(num_animated_bones * num_keyframes);
 		}
 		else if (type == 'K')
 		{
 			pos = fetchWord(pos, word);
 			//float time = atof(word);
-			Matrix44* k = keyframes + current_keyframe * num_animated_bones;
+			Matrix44* k = &keyframes[current_keyframe * num_animated_bones];
 			current_keyframe++;
 			for (int j = 0; j < num_animated_bones; ++j)
 				pos = fetchMatrix44(pos, *(k + j));
@@ -468,6 +1025,7 @@ bool Animation::loadSKANIM(const char* filename)
 		skeleton.assignLayer(skeleton.getBone("mixamorig_LeftShoulder"), LEFT_ARM);
 	}
 
+	compress(&keyframes[0]);
 	assignTime(0); //reset pose
 
 	delete[] data;
@@ -4,12 +4,13 @@
 #include <cstring>
 #include <algorithm>
 #include <iostream>
+#include <mutex>
 #include "../gfx/mesh.h"
 
 
 class Camera;
 
-#define ANIM_BIN_VERSION 3
+#define ANIM_BIN_VERSION 4 //3 had a Matrix44 per animated bone and keyframe, it is still loaded (and compressed)
 
 //defined layers for every body
 enum BODY_LAYERS {
@@ -27,6 +28,32 @@ enum BODY_LAYERS {
 struct cmp_str { bool operator()(char const *a, char const *b) const { return std::strcmp(a, b) < 0; } };
 
 
+//the local and global matrices of one skeleton without its structure, so many characters can share the same clips
+//(sampling a clip into a pose does not modify the clip), they are allocated from a PosePool
+struct Pose {
+	int num_bones;
+	int capacity; //of the matrices, a released pose can be reused by any skeleton up to this size
+	Matrix44* local; //according to the parent bone
+	Matrix44* global; //according to the root of the skeleton (the 0,0,0)
+};
+
+//the poses of all the characters, the released ones are kept to be reused. Thread safe
+class PosePool {
+public:
+	~PosePool();
+
+	Pose* acquire(int num_bones);
+	void release(Pose* pose);
+	int getNumPoses() const { return (int)poses.size(); }
+	size_t getMemorySize() const { return memory_size; }
+
+private:
+	std::vector<Pose*> poses; //all of them, deleted with the pool
+	std::vector<Pose*> free_poses;
+	std::mutex mutex;
+	size_t memory_size = 0;
+};
+
 //This class contains the bone structure hierarchy
 class Skeleton {
 public:
@@ -49,21 +76,42 @@ public:
 
 	Bone* getBone(const char* name); //returns the bone pointer
 	Matrix44& getBoneMatrix(const char* name, bool local = true); //returns the local matrix of a bone
-	void applyTransformToBones(const char* root, Matrix44 transform); //given a bone name and matrix, it multiplies the matrix to the bone
+	void applyTransformToBones(const char* root, const Matrix44& transform); //given a bone name and matrix, it multiplies the matrix to the bone
 	void updateGlobalMatrices(); //updates the list of global matrices according to the local matrices
 
-	void renderSkeleton(Camera* camera, Matrix44 model, Vector4f color = Vector4f(0.5, 0, 0.5, 1), bool render_points = false); //renders the skeleton with lines
+	void renderSkeleton(Camera* camera, const Matrix44& model, Vector4f color = Vector4f(0.5, 0, 0.5, 1), bool render_points = false); //renders the skeleton with lines
 	void computeFinalBoneMatrices(std::vector<Matrix44>& bones, GFX::Mesh* mesh); //fills the std::vector with the bones ready for the shader
 	void assignLayer(Bone* bone, uint8 layer); //assigns a layer to a node and all its children
+
+	//the same using a pose instead of the bones of the skeleton, they only read the skeleton so they can run in parallel
+	void initPose(Pose& pose) const; //copies the local matrices of the skeleton, the bones without keyframes keep them
+	void updateGlobalMatrices(Pose& pose) const;
+	void findMeshBones(GFX::Mesh* mesh, std::vector<int>& bone_indices); //index of the bone of every bones_info of the mesh, -1 if not found
+	void computeFinalBoneMatrices(const Pose& pose, GFX::Mesh* mesh, const std::vector<int>& bone_indices, const Matrix44& transform, Matrix44* bone_matrices) const;
 };
 
 //this function takes skeleton A and blends it with skeleton B and stores the result in result
 void blendSkeleton(Skeleton* a, Skeleton* b, float w, Skeleton* result, uint8 layer = 0xFF);
+//the same with poses, the skeleton is only needed to know the layer of every bone
+void blendPoses(const Pose& a, const Pose& b, float w, Pose& result, const Skeleton* skeleton = NULL, uint8 layer = 0xFF);
 
 //This class contains one animation loaded from a file (it also uses a skeleton to store the current snapshot)
+//The keyframes are compressed: every animated bone has a translation, a rotation and a scale channel, each one with its own keys
+// + a channel with one key is constant, and the keys that can be interpolated from their neighbours are removed (reduce_keyframes)
+// + every key is 3 values of 16 bits: the translation and the scale in the range of the channel,
+//   the rotation as the three smallest components of the quaternion (15 bits each) and which one was dropped (2 bits)
 class Animation {
 public:
 
+	enum eChannel { TRANSLATION, ROTATION, SCALE, NUM_CHANNELS };
+
+	struct sChannel {
+		int first_key; //in key_frames and key_values
+		int num_keys;
+		float min[3]; //range of the translation and the scale
+		float extent[3];
+	};
+
 	Skeleton skeleton;
 
 	float duration;
@@ -72,13 +120,25 @@ public:
 	int num_keyframes;
 	int8 bones_map[128]; //maps from keyframe data index to bone
 
-	Matrix44* keyframes;
+	std::vector<sChannel> channels; //NUM_CHANNELS per animated bone
+	std::vector<uint16> key_frames; //keyframe of every key, increasing inside a channel
+	std::vector<uint16> key_values; //3 per key
+
+	static bool reduce_keyframes; //when compressing
+	static float rotation_tolerance; //radians, error allowed when removing keys
+	static float translation_tolerance; //fraction of the range of the channel (also for the scale)
 
 	Animation();
-	~Animation();	//we need the dtor to remove the keyframes memory
+	~Animation();
 
 	//change the skeleton to the given pose according to time
 	void assignTime(float time, bool loop = true, bool interpolate = true, uint8 layers = 0xFF);
+	//the local matrices of the animated bones in the pose (the global ones are not updated), the animation is not modified
+	void samplePose(float time, Pose& pose, bool loop = true, uint8 layers = 0xFF) const;
+
+	//from num_keyframes * num_animated_bones local matrices (keyframe by keyframe), the format of SKANIM and ABIN 3
+	void compress(const Matrix44* keyframes);
+	size_t getMemorySize() const; //bytes of the keys and channels
 
 	//storage
 	bool load(const char* filename);
@@ -91,5 +151,11 @@ public:
 
 	//copy operator to copy the keyframes
 	void operator = (Animation* anim);
+
+private:
+	void getKeyframe(float time, bool loop, int& index, float& f) const;
+	void sampleBone(int animated_bone, int index, float f, Matrix44& model) const;
+	void sampleChannel(const sChannel& channel, int channel_type, int index, float f, float* result) const;
+
 };
 
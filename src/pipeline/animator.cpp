@@ -0,0 +1,289 @@
+#include "animator.h"
+
+#include <cmath>
+#include <chrono>
+#include <algorithm>
+
+#include "camera.h"
+#include "prefab.h"
+#include "skinning.h"
+#include "../gfx/mesh.h"
+#include "../utils/utils.h"
+#include "../core/ui.h"
+#include "../core/task.h"
+
+using namespace SCN;
+
+CharacterEntity::CharacterEntity()
+{
+	blend = 0.0f;
+	speed = 1.0f;
+	loop = true;
+	animation = nullptr;
+	blend_animation = nullptr;
+	time = 0.0f;
+	pose = nullptr;
+	blend_pose = nullptr;
+	update_interval = 1;
+	pose_frame = -1;
+}
+
+CharacterEntity::~CharacterEntity()
+{
+	Animator::release(this);
+}
+
+CharacterEntity& CharacterEntity::operator = (const CharacterEntity& other)
+{
+	if (this == &other)
+		return *this;
+	Animator::release(this);
+	PrefabEntity::operator = (other);
+	animation_filename = other.animation_filename;
+	blend_animation_filename = other.blend_animation_filename;
+	blend = other.blend;
+	speed = other.speed;
+	loop = other.loop;
+	//the clips are shared, the poses are computed again
+	animation = other.animation;
+	blend_animation = other.blend_animation;
+	time = other.time;
+	return *this;
+}
+
+void CharacterEntity::configure(cJSON* json)
+{
+	PrefabEntity::configure(json);
+	Animator::release(this);
+	blend = clamp(readJSONNumber(json, "blend", blend), 0.0f, 1.0f);
+	speed = readJSONNumber(json, "speed", speed);
+	loop = readJSONBool(json, "loop", loop);
+	animation_filename = readJSONString(json, "animation", animation_filename.c_str());
+	blend_animation_filename = readJSONString(json, "blend_animation", blend_animation_filename.c_str());
+	if (animation_filename.size())
+		loadAnimation(animation_filename.c_str());
+	if (blend_animation_filename.size())
+		loadAnimation(blend_animation_filename.c_str(), true);
+}
+
+void CharacterEntity::serialize(cJSON* json)
+{
+	PrefabEntity::serialize(json);
+	if (animation_filename.size())
+		writeJSONString(json, "animation", animation_filename.c_str());
+	if (blend_animation_filename.size())
+	{
+		writeJSONString(json, "blend_animation", blend_animation_filename.c_str());
+		writeJSONNumber(json, "blend", blend);
+	}
+	writeJSONNumber(json, "speed", speed);
+	if (!loop)
+		writeJSONBool(json, "loop", loop);
+}
+
+void CharacterEntity::loadAnimation(const char* filename, bool blended)
+{
+	assert(scene && "Cannot assign filename without scene (to extract base folder)");
+	std::string fullpath = scene->base_folder + "/" + filename;
+	Animation* anim = Animation::Get(fullpath.c_str());
+	if (blended)
+		blend_animation = anim;
+	else
+		animation = anim;
+	//the skeleton may be another one
+	Animator::release(this);
+}
+
+const std::vector<Matrix44>* CharacterEntity::getBones(Node* node)
+{
+	if (pose_frame == -1)
+		return nullptr;
+	for (sSkinnedNode& skinned_node : skinned_nodes)
+		if (skinned_node.node == node)
+			return &skinned_node.bones;
+	return nullptr;
+}
+
+Animator::Animator()
+{
+	is_active = true;
+	lod_distance = 20.0f;
+	max_interval = 8;
+	offscreen_interval = 16;
+	frame = 0;
+	num_characters = 0;
+	num_updated = 0;
+	update_time = 0;
+}
+
+void Animator::release(CharacterEntity* character)
+{
+	Animator& animator = instance();
+	animator.poses.release(character->pose);
+	animator.poses.release(character->blend_pose);
+	character->pose = nullptr;
+	character->blend_pose = nullptr;
+	character->pose_frame = -1;
+	character->skinned_nodes.clear();
+}
+
+void Animator::collectSkinnedNodes(CharacterEntity* character)
+{
+	character->skinned_nodes.clear();
+
+	std::vector<Node*> stack;
+	stack.push_back(&character->root);
+	while (stack.size())
+	{
+		Node* node = stack.back();
+		stack.pop_back();
+		for (Node* child : node->children)
+			stack.push_back(child);
+		GFX::Mesh* mesh = node->mesh;
+		if (!mesh || !mesh->bones_info.size() || !mesh->bones.size() || !mesh->weights.size())
+			continue;
+
+		CharacterEntity::sSkinnedNode skinned_node;
+		skinned_node.node = node;
+		character->animation->skeleton.findMeshBones(mesh, skinned_node.bone_indices);
+		if ((int)skinned_node.bone_indices.size() > SKINNING_MAX_BONES)
+			skinned_node.bone_indices.resize(SKINNING_MAX_BONES);
+		skinned_node.bones.resize(skinned_node.bone_indices.size());
+		character->skinned_nodes.push_back(skinned_node);
+	}
+}
+
+void Animator::updateCharacter(CharacterEntity* character)
+{
+	const Skeleton& skeleton = character->animation->skeleton;
+	Pose& pose = *character->pose;
+
+	skeleton.initPose(pose);
+	character->animation->samplePose(character->time, pose, character->loop);
+
+	//the second clip in sync with the first one, like a walk and a run
+	if (character->blend_pose && character->blend > 0.0f)
+	{
+		Animation* blend_animation = character->blend_animation;
+		float duration = character->animation->duration;
+		float blend_time = duration > 0.0f ? character->time / duration * blend_animation->duration : 0.0f;
+		blend_animation->skeleton.initPose(*character->blend_pose);
+		blend_animation->samplePose(blend_time, *character->blend_pose, character->loop);
+		blendPoses(pose, *character->blend_pose, character->blend, pose);
+	}
+
+	skeleton.updateGlobalMatrices(pose);
+
+	for (CharacterEntity::sSkinnedNode& skinned_node : character->skinned_nodes)
+		skeleton.computeFinalBoneMatrices(pose, skinned_node.node->mesh, skinned_node.bone_indices, skinned_node.transform, &skinned_node.bones[0]);
+}
+
+void Animator::advance(Scene* scene, float elapsed_time)
+{
+	Animator& animator = instance();
+	if (!animator.is_active || !scene)
+		return;
+
+	for (BaseEntity* entity : scene->entities)
+	{
+		if (entity->getType() != eEntityType::CHARACTER)
+			continue;
+		CharacterEntity* character = static_cast<CharacterEntity*>(entity);
+		Animation* animation = character->animation;
+		if (!animation || !animation->num_keyframes)
+			continue;
+
+		character->time += elapsed_time * character->speed;
+		if (character->loop && animation->duration > 0.0f)
+		{
+			character->time = fmod(character->time, animation->duration);
+			if (character->time < 0.0f)
+				character->time += animation->duration;
+		}
+	}
+}
+
+void Animator::update(const std::vector<CharacterEntity*>& characters, Camera* camera)
+{
+	Animator& animator = instance();
+	animator.frame++;
+	animator.num_characters = (int)characters.size();
+	animator.num_updated = 0;
+	animator.update_time = 0;
+	if (!animator.is_active || characters.empty())
+		return;
+
+	auto start = std::chrono::steady_clock::now();
+
+	//in the main thread: the LOD and everything that touches the nodes
+	std::vector<CharacterEntity*> pending;
+	for (size_t i = 0; i < characters.size(); ++i)
+	{
+		CharacterEntity* character = characters[i];
+		Animation* animation = character->animation;
+		if (!animation || !animation->num_keyframes || !character->prefab || character->prefab_pending)
+			continue;
+
+		if (!character->pose)
+		{
+			character->pose = animator.poses.acquire(animation->skeleton.num_bones);
+			Animation* blend_animation = character->blend_animation;
+			if (blend_animation && blend_animation->num_keyframes && blend_animation->skeleton.num_bones == animation->skeleton.num_bones)
+				character->blend_pose = animator.poses.acquire(animation->skeleton.num_bones);
+			animator.collectSkinnedNodes(character);
+		}
+
+		//far away or out of the frustum the pose is updated less often, spread between the frames
+		Matrix44 model = character->root.getGlobalMatrix();
+		BoundingBox box = transformBoundingBox(model, character->prefab->bounding);
+		int interval = 1;
+		if (!camera->testBoxInFrustum(box.center, box.halfsize))
+			interval = animator.offscreen_interval;
+		else
+		{
+			float distance = box.center.distance(camera->eye) - box.halfsize.length();
+			while (distance > animator.lod_distance * interval && interval < animator.max_interval)
+				interval *= 2;
+		}
+		character->update_interval = (std::max)(1, interval);
+		if (character->pose_frame != -1 && (animator.frame + (int)i) % character->update_interval != 0)
+			continue;
+
+		//the skeleton is placed like the entity, the shader applies the model of the node after the bones
+		for (CharacterEntity::sSkinnedNode& skinned_node : character->skinned_nodes)
+		{
+			Matrix44 inv_node = skinned_node.node->getGlobalMatrix();
+			inv_node.inverse();
+			skinned_node.transform = model * inv_node;
+		}
+		character->pose_frame = animator.frame;
+		pending.push_back(character);
+	}
+
+	//one job per character, the clips are only read
+	TaskManager::background.parallelFor(pending.size(), [&](size_t i) {
+		animator.updateCharacter(pending[i]);
+	});
+
+	animator.num_updated = (int)pending.size();
+	animator.update_time = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+}
+
+void Animator::showUI()
+{
+#ifndef SKIP_IMGUI
+	Animator& animator = instance();
+
+	ImGui::Checkbox("Animator", &animator.is_active);
+	if (animator.is_active) {
+		if (ImGui::TreeNode("Animator settings")) {
+			ImGui::DragFloat("LOD distance", &animator.lod_distance, 0.1f, 0.1f, 10000.0f);
+			ImGui::SliderInt("Max interval", &animator.max_interval, 1, 32);
+			ImGui::SliderInt("Offscreen interval", &animator.offscreen_interval, 1, 64);
+			ImGui::Text("%d characters, %d updated in %.2fms", animator.num_characters, animator.num_updated, animator.update_time);
+			ImGui::Text("%d poses, %d KB", animator.poses.getNumPoses(), (int)(animator.poses.getMemorySize() / 1024));
+			ImGui::TreePop();
+		}
+	}
+#endif
+}
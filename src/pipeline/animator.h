@@ -0,0 +1,99 @@
+/*  Animator: plays the clips (Animation) of all the characters of the scene in parallel
+	+ the clips are shared and never modified, every character samples them into its own Pose from the PosePool
+	+ the clocks of the clips advance in the update of the app (advance), the renderer only samples the poses for the current time
+	+ one job per character: sample, blend the second clip, compute the global matrices and the final bones of its skinned nodes
+	+ update-rate LOD: the characters far from the camera or out of the frustum keep their pose for a few frames,
+	  the updates are spread between the frames so the cost stays flat
+	The final bones are used by the renderer instead of the joints of the nodes (see Skinning), so GPU and CPU skinning work the same.
+*/
+#pragma once
+
+#include <string>
+#include <vector>
+
+#include "scene.h"
+#include "animation.h"
+
+class Camera;
+
+namespace SCN {
+
+	class CharacterEntity : public PrefabEntity
+	{
+	public:
+		std::string animation_filename; //relative to the folder of the scene
+		std::string blend_animation_filename; //optional, blended with the first one using blend
+		float blend;
+		float speed;
+		bool loop;
+
+		Animation* animation;
+		Animation* blend_animation;
+		float time; //of the clips, in seconds
+
+		//state of the animator
+		Pose* pose;
+		Pose* blend_pose;
+		int update_interval; //frames between updates, chosen by the LOD
+		int pose_frame; //of the animator when the pose was computed, -1 when it has none
+
+		struct sSkinnedNode {
+			Node* node;
+			std::vector<int> bone_indices; //in the skeleton, for every bone of the mesh
+			Matrix44 transform; //from the entity to the node, the skeleton is placed like the entity
+			std::vector<Matrix44> bones; //final, valid until the next update
+		};
+		std::vector<sSkinnedNode> skinned_nodes;
+
+		ENTITY_METHODS(CharacterEntity, CHARACTER, 10, 0);
+
+		CharacterEntity();
+		~CharacterEntity();
+		CharacterEntity& operator = (const CharacterEntity& other); //the poses are not shared
+
+		void configure(cJSON* json);
+		void serialize(cJSON* json);
+
+		void loadAnimation(const char* filename, bool blended = false);
+
+		//the final bones of a skinned node of the entity, NULL if the node has no pose yet
+		const std::vector<Matrix44>* getBones(Node* node);
+	};
+
+	class Animator {
+	private:
+		Animator();
+
+	public:
+		static Animator& instance()
+		{
+			static Animator INSTANCE;
+			return INSTANCE;
+		}
+
+		bool is_active;
+		float lod_distance; //the update interval doubles every time the distance to the camera doubles from here
+		int max_interval; //the farthest ones
+		int offscreen_interval; //out of the frustum
+
+		PosePool poses;
+		int frame;
+
+		//stats of the last frame
+		int num_characters;
+		int num_updated;
+		double update_time;
+
+		//advances the clocks of the characters of the scene, called from the update of the app
+		static void advance(Scene* scene, float elapsed_time);
+		//updates the poses of the characters that need it this frame for their current time, in parallel
+		static void update(const std::vector<CharacterEntity*>& characters, Camera* camera);
+		static void release(CharacterEntity* character); //gives its poses back to the pool
+		static void showUI();
+
+	private:
+		void collectSkinnedNodes(CharacterEntity* character);
+		void updateCharacter(CharacterEntity* character);
+	};
+
+};
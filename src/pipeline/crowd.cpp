@@ -0,0 +1,530 @@
+#include "crowd.h"
+
+#include <cmath>
+#include <cstring>
+#include <chrono>
+#include <iostream>
+#include <algorithm>
+
+#include "camera.h"
+#include "prefab.h"
+#include "animation.h"
+#include "skinning.h"
+#include "../gfx/gfx.h"
+#include "../gfx/mesh.h"
+#include "../gfx/texture.h"
+#include "../gfx/shader.h"
+#include "../core/core.h"
+#include "../core/task.h"
+#include "../utils/utils.h"
+
+using namespace SCN;
+
+namespace {
+
+	struct sVATHeader {
+		char signature[4];
+		int version;
+		int num_vertices;
+		int width;
+		int rows_per_frame;
+		int num_frames;
+		int num_clips;
+		float fps;
+		float bounding[6]; //center and halfsize
+	};
+
+	//the instances are scattered the same way every time
+	inline uint32_t nextRandom(uint32_t& state)
+	{
+		state ^= state << 13;
+		state ^= state >> 17;
+		state ^= state << 5;
+		return state;
+	}
+
+	inline float randomFloat(uint32_t& state)
+	{
+		return (nextRandom(state) >> 8) * (1.0f / 16777216.0f);
+	}
+};
+
+VertexAnimation::VertexAnimation()
+{
+	positions_texture = nullptr;
+	normals_texture = nullptr;
+	last_bake_time = 0;
+	clear();
+}
+
+VertexAnimation::~VertexAnimation()
+{
+	delete positions_texture;
+	delete normals_texture;
+}
+
+VertexAnimation& VertexAnimation::operator = (const VertexAnimation& other)
+{
+	if (this == &other)
+		return *this;
+	fps = other.fps;
+	num_vertices = other.num_vertices;
+	width = other.width;
+	rows_per_frame = other.rows_per_frame;
+	num_frames = other.num_frames;
+	clips = other.clips;
+	positions = other.positions;
+	normals = other.normals;
+	bounding = other.bounding;
+	last_bake_time = other.last_bake_time;
+	textures_dirty = true;
+	return *this;
+}
+
+void VertexAnimation::clear()
+{
+	fps = 30.0f;
+	num_vertices = 0;
+	width = 0;
+	rows_per_frame = 0;
+	num_frames = 0;
+	clips.clear();
+	positions.clear();
+	normals.clear();
+	bounding.center.set(0, 0, 0);
+	bounding.halfsize.set(0, 0, 0);
+	textures_dirty = true;
+}
+
+size_t VertexAnimation::getMemorySize() const
+{
+	return (positions.size() + normals.size()) * sizeof(uint16_t);
+}
+
+bool VertexAnimation::bake(GFX::Mesh* mesh, const std::vector<Animation*>& animations, float fps)
+{
+	clear();
+	if (!mesh || !mesh->vertices.size() || !mesh->bones_info.size() || !mesh->bones.size() || !mesh->weights.size() || fps <= 0.0f)
+		return false;
+
+	auto start = std::chrono::steady_clock::now();
+
+	this->fps = fps;
+	num_vertices = (int)mesh->vertices.size();
+	width = (std::min)(num_vertices, VAT_MAX_WIDTH);
+	rows_per_frame = (num_vertices + width - 1) / width;
+
+	//every frame of every clip, the last one goes back to the first
+	struct sFrame {
+		Animation* animation;
+		int clip;
+		float time;
+	};
+	std::vector<sFrame> frames;
+	std::vector<std::vector<int>> bone_indices;
+	for (Animation* animation : animations)
+	{
+		if (!animation || !animation->num_keyframes)
+			continue;
+		sClip clip;
+		clip.first_frame = (int)frames.size();
+		clip.num_frames = (std::max)(1, (int)(animation->duration * fps + 0.5f));
+		clip.duration = animation->duration;
+		for (int i = 0; i < clip.num_frames; ++i)
+			frames.push_back({ animation, (int)clips.size(), i / fps });
+		clips.push_back(clip);
+
+		bone_indices.push_back(std::vector<int>());
+		animation->skeleton.findMeshBones(mesh, bone_indices.back());
+		if ((int)bone_indices.back().size() > SKINNING_MAX_BONES)
+			bone_indices.back().resize(SKINNING_MAX_BONES);
+	}
+	num_frames = (int)frames.size();
+	if (!num_frames)
+		return false;
+
+	size_t frame_values = (size_t)width * rows_per_frame * 4;
+	positions.assign(frame_values * num_frames, 0);
+	normals.assign(frame_values * num_frames, 0);
+	std::vector<BoundingBox> boxes(num_frames);
+
+	//one frame per task: sample the pose, skin the vertices and store them as halfs
+	TaskManager::background.parallelFor(frames.size(), [&](size_t i) {
+		const sFrame& frame = frames[i];
+		const Skeleton& skeleton = frame.animation->skeleton;
+
+		std::vector<Matrix44> matrices(skeleton.num_bones * 2);
+		Pose pose;
+		pose.num_bones = pose.capacity = skeleton.num_bones;
+		pose.local = &matrices[0];
+		pose.global = pose.local + skeleton.num_bones;
+		skeleton.initPose(pose);
+		frame.animation->samplePose(frame.time, pose);
+		skeleton.updateGlobalMatrices(pose);
+
+		const std::vector<int>& indices = bone_indices[frame.clip];
+		std::vector<Matrix44> bones(indices.size());
+		skeleton.computeFinalBoneMatrices(pose, mesh, indices, Matrix44(), &bones[0]);
+
+		std::vector<Vector3f> skinned_vertices(num_vertices);
+		std::vector<Vector3f> skinned_normals(mesh->normals.size());
+		Skinning::skinVertices(mesh, &bones[0], &skinned_vertices[0], skinned_normals.size() ? &skinned_normals[0] : NULL, 0, num_vertices);
+
+		uint16_t* frame_positions = &positions[i * frame_values];
+		uint16_t* frame_normals = &normals[i * frame_values];
+		Vector3f min_v = skinned_vertices[0], max_v = skinned_vertices[0];
+		for (int j = 0; j < num_vertices; ++j)
+		{
+			const Vector3f& v = skinned_vertices[j];
+			min_v.set((std::min)(min_v.x, v.x), (std::min)(min_v.y, v.y), (std::min)(min_v.z, v.z));
+			max_v.set((std::max)(max_v.x, v.x), (std::max)(max_v.y, v.y), (std::max)(max_v.z, v.z));
+			for (int k = 0; k < 3; ++k)
+				frame_positions[j * 4 + k] = floatToHalf(v.v[k]);
+			frame_positions[j * 4 + 3] = floatToHalf(1.0f);
+			if (skinned_normals.size())
+				for (int k = 0; k < 3; ++k)
+					frame_normals[j * 4 + k] = floatToHalf(skinned_normals[j].v[k]);
+		}
+		boxes[i].center = (min_v + max_v) * 0.5f;
+		boxes[i].halfsize = (max_v - min_v) * 0.5f;
+	});
+
+	bounding = boxes[0];
+	for (int i = 1; i < num_frames; ++i)
+		bounding = mergeBoundingBoxes(bounding, boxes[i]);
+
+	textures_dirty = true;
+	last_bake_time = std::chrono::duration<float, std::milli>(std::chrono::steady_clock::now() - start).count();
+	std::cout << " + VAT baked: " << clips.size() << " clips, " << num_frames << " frames of " << num_vertices << " vertices (" << getMemorySize() / 1024 << "KB) in " << last_bake_time << "ms" << std::endl;
+	return true;
+}
+
+bool VertexAnimation::save(const char* filename)
+{
+	if (isEmpty())
+		return false;
+
+	sVATHeader header;
+	memset(&header, 0, sizeof(header));
+	memcpy(header.signature, "VAT ", 4);
+	header.version = VAT_VERSION;
+	header.num_vertices = num_vertices;
+	header.width = width;
+	header.rows_per_frame = rows_per_frame;
+	header.num_frames = num_frames;
+	header.num_clips = (int)clips.size();
+	header.fps = fps;
+	memcpy(header.bounding, bounding.center.v, sizeof(float) * 3);
+	memcpy(header.bounding + 3, bounding.halfsize.v, sizeof(float) * 3);
+
+	FILE* file = fopen(filename, "wb");
+	if (file == NULL)
+		return false;
+	fwrite(&header, 1, sizeof(header), file);
+	fwrite(&clips[0], sizeof(sClip), clips.size(), file);
+	fwrite(&positions[0], sizeof(uint16_t), positions.size(), file);
+	fwrite(&normals[0], sizeof(uint16_t), normals.size(), file);
+	fclose(file);
+	return true;
+}
+
+bool VertexAnimation::load(const char* filename, GFX::Mesh* mesh)
+{
+	std::vector<unsigned char> buffer;
+	if (!readFileBin(filename, buffer) || buffer.size() < sizeof(sVATHeader))
+		return false;
+
+	sVATHeader header;
+	memcpy(&header, &buffer[0], sizeof(header));
+	if (memcmp(header.signature, "VAT ", 4) != 0 || header.version != VAT_VERSION || header.num_frames <= 0 || header.num_clips <= 0 || header.width <= 0)
+		return false;
+	//baked for another mesh
+	if (!mesh || header.num_vertices != (int)mesh->vertices.size())
+		return false;
+	size_t frame_values = (size_t)header.width * header.rows_per_frame * 4;
+	size_t clips_size = header.num_clips * sizeof(sClip);
+	size_t values = frame_values * header.num_frames;
+	if (buffer.size() < sizeof(header) + clips_size + values * 2 * sizeof(uint16_t))
+		return false;
+
+	clear();
+	num_vertices = header.num_vertices;
+	width = header.width;
+	rows_per_frame = header.rows_per_frame;
+	num_frames = header.num_frames;
+	fps = header.fps;
+	bounding.center.set(header.bounding[0], header.bounding[1], header.bounding[2]);
+	bounding.halfsize.set(header.bounding[3], header.bounding[4], header.bounding[5]);
+
+	const unsigned char* pos = &buffer[sizeof(header)];
+	clips.resize(header.num_clips);
+	memcpy(&clips[0], pos, clips_size);
+	pos += clips_size;
+	const uint16_t* data = (const uint16_t*)pos;
+	positions.assign(data, data + values);
+	normals.assign(data + values, data + values * 2);
+	textures_dirty = true;
+	return true;
+}
+
+void VertexAnimation::upload()
+{
+	if (!positions_texture)
+		positions_texture = new GFX::Texture();
+	if (!normals_texture)
+		normals_texture = new GFX::Texture();
+	//read with texelFetch, no mips
+	int height = num_frames * rows_per_frame;
+	if (height > 16384)
+		std::cout << "[WARN] VAT texture taller than most GPUs support: " << height << " rows, bake at lower fps" << std::endl;
+	positions_texture->create(width, height, GL_RGBA, GL_HALF_FLOAT, false, (Uint8*)&positions[0], GL_RGBA16F);
+	normals_texture->create(width, height, GL_RGBA, GL_HALF_FLOAT, false, (Uint8*)&normals[0], GL_RGBA16F);
+	textures_dirty = false;
+}
+
+void VertexAnimation::bind(GFX::Shader* shader, float time)
+{
+	if (textures_dirty)
+		upload();
+
+	shader->setTexture("u_vat_positions", positions_texture, 15);
+	shader->setTexture("u_vat_normals", normals_texture, 16);
+	shader->setUniform("u_vat_size", Vector2<int>(width, rows_per_frame));
+	shader->setUniform("u_vat_fps", fps);
+	shader->setUniform("u_vat_time", time);
+}
+
+CrowdEntity::CrowdEntity()
+{
+	count = 100;
+	size.set(20, 0, 20);
+	fps = 30.0f;
+	speed_variation = 0.1f;
+	seed = 1;
+	prefab = nullptr;
+	instances_dirty = true;
+	bake_failed = false;
+}
+
+CrowdEntity& CrowdEntity::operator = (const CrowdEntity& other)
+{
+	if (this == &other)
+		return *this;
+	BaseEntity::operator = (other);
+	filename = other.filename;
+	animation_filenames = other.animation_filenames;
+	vat_filename = other.vat_filename;
+	count = other.count;
+	size = other.size;
+	fps = other.fps;
+	speed_variation = other.speed_variation;
+	seed = other.seed;
+	prefab = other.prefab;
+	animations = other.animations;
+	vertex_animation = other.vertex_animation;
+	instances_dirty = true;
+	bake_failed = false;
+	return *this;
+}
+
+void CrowdEntity::configure(cJSON* json)
+{
+	count = (std::max)(0, (int)readJSONNumber(json, "count", (float)count));
+	size = readJSONVector3(json, "size", size);
+	fps = (std::max)(1.0f, readJSONNumber(json, "fps", fps));
+	speed_variation = clamp(readJSONNumber(json, "speed_variation", speed_variation), 0.0f, 1.0f);
+	seed = (int)readJSONNumber(json, "seed", (float)seed);
+	vat_filename = readJSONString(json, "vat", vat_filename.c_str());
+
+	cJSON* animations_json = cJSON_GetObjectItem(json, "animations");
+	if (animations_json)
+	{
+		animation_filenames.clear();
+		cJSON* animation_json;
+		cJSON_ArrayForEach(animation_json, animations_json)
+			if (animation_json->valuestring)
+				animation_filenames.push_back(animation_json->valuestring);
+	}
+	loadAnimations();
+
+	if (cJSON_GetObjectItem(json, "filename"))
+		loadPrefab(cJSON_GetObjectItem(json, "filename")->valuestring);
+}
+
+void CrowdEntity::serialize(cJSON* json)
+{
+	cJSON_AddStringToObject(json, "filename", filename.c_str());
+	cJSON* animations_json = cJSON_CreateArray();
+	for (const std::string& animation_filename : animation_filenames)
+		cJSON_AddItemToArray(animations_json, cJSON_CreateString(animation_filename.c_str()));
+	cJSON_AddItemToObject(json, "animations", animations_json);
+	if (vat_filename.size())
+		writeJSONString(json, "vat", vat_filename.c_str());
+	writeJSONNumber(json, "count", (float)count);
+	writeJSONVector3(json, "size", size);
+	writeJSONNumber(json, "fps", fps);
+	writeJSONNumber(json, "speed_variation", speed_variation);
+	writeJSONNumber(json, "seed", (float)seed);
+}
+
+std::string CrowdEntity::getFullFilename(const std::string& filename)
+{
+	if (scene && scene->base_folder.size())
+		return scene->base_folder + "/" + filename;
+	return filename;
+}
+
+void CrowdEntity::loadPrefab(const char* filename)
+{
+	this->filename = filename;
+	prefab = SCN::Prefab::GetAsync(getFullFilename(filename).c_str());
+	vertex_animation.clear();
+	instances_dirty = true;
+	bake_failed = false;
+}
+
+void CrowdEntity::loadAnimations()
+{
+	animations.clear();
+	for (const std::string& animation_filename : animation_filenames)
+	{
+		if (animation_filename.empty())
+			continue;
+		Animation* animation = Animation::Get(getFullFilename(animation_filename).c_str());
+		if (animation)
+			animations.push_back(animation);
+	}
+	vertex_animation.clear();
+	instances_dirty = true;
+	bake_failed = false;
+}
+
+Node* CrowdEntity::getSkinnedNode()
+{
+	if (!prefab || prefab->loading)
+		return nullptr;
+
+	std::vector<Node*> stack;
+	stack.push_back(&prefab->root);
+	while (stack.size())
+	{
+		Node* node = stack.back();
+		stack.pop_back();
+		GFX::Mesh* mesh = node->mesh;
+		if (mesh && mesh->bones_info.size() && mesh->bones.size() && mesh->weights.size() && node->material)
+			return node;
+		for (Node* child : node->children)
+			stack.push_back(child);
+	}
+	return nullptr;
+}
+
+void CrowdEntity::bake(bool use_cache)
+{
+	Node* node = getSkinnedNode();
+	if (!node)
+		return;
+
+	std::string vat_fullpath = getFullFilename(vat_filename);
+	if (use_cache && vat_filename.size() && vertex_animation.load(vat_fullpath.c_str(), node->mesh) && (int)vertex_animation.clips.size() == (int)animations.size())
+		return;
+
+	bake_failed = !vertex_animation.bake(node->mesh, animations, fps);
+	if (bake_failed)
+	{
+		std::cout << "[WARN] crowd " << name << ": no skinned mesh or clips to bake" << std::endl;
+		return;
+	}
+	if (vat_filename.size())
+		vertex_animation.save(vat_fullpath.c_str());
+	instances_dirty = true;
+}
+
+void CrowdEntity::scatter()
+{
+	models.resize(count);
+	instance_data.resize(count);
+	centers.resize(count);
+	instances_dirty = false;
+	if (!count || vertex_animation.clips.empty())
+		return;
+
+	//a jittered grid, so they do not overlap too much
+	uint32_t state = (uint32_t)seed * 747796405u + 2891336453u;
+	if (!state)
+		state = 1;
+	int side = (int)ceilf(sqrtf((float)count));
+	float cell_x = size.x / side;
+	float cell_z = size.z / side;
+	for (int i = 0; i < count; ++i)
+	{
+		float x = -size.x * 0.5f + ((i % side) + 0.25f + randomFloat(state) * 0.5f) * cell_x;
+		float z = -size.z * 0.5f + ((i / side) + 0.25f + randomFloat(state) * 0.5f) * cell_z;
+		float y = (randomFloat(state) - 0.5f) * size.y;
+		models[i].setRotation(randomFloat(state) * 2.0f * (float)PI, Vector3f(0, 1, 0));
+		models[i].translateGlobal(x, y, z);
+
+		int clip_index = (int)(nextRandom(state) % vertex_animation.clips.size());
+		const VertexAnimation::sClip& clip = vertex_animation.clips[clip_index];
+		float speed = 1.0f + (randomFloat(state) * 2.0f - 1.0f) * speed_variation;
+		instance_data[i] = Vector4f((float)clip.first_frame, (float)clip.num_frames, randomFloat(state) * clip.duration, speed);
+		centers[i] = models[i] * vertex_animation.bounding.center;
+	}
+}
+
+int CrowdEntity::update(Camera* camera)
+{
+	visible_models.clear();
+	visible_data.clear();
+
+	if (vertex_animation.isEmpty() && animations.size() && !bake_failed)
+		bake();
+	if (vertex_animation.isEmpty())
+		return 0;
+	if (instances_dirty || (int)models.size() != count)
+		scatter();
+
+	world_centers.resize(centers.size());
+	if (centers.size())
+		transformPoints(root.getGlobalMatrix(), &centers[0], &world_centers[0], centers.size());
+	cull(camera, visible_models, visible_data);
+	return (int)visible_models.size();
+}
+
+void CrowdEntity::cull(Camera* camera, std::vector<Matrix44>& result_models, std::vector<Vector4f>& result_data)
+{
+	result_models.clear();
+	result_data.clear();
+	if (world_centers.size() != models.size())
+		return;
+
+	//the box of all the frames around every instance
+	Matrix44 model = root.getGlobalMatrix();
+	float radius = vertex_animation.bounding.halfsize.length() * (std::max)({ model.getScale().x, model.getScale().y, model.getScale().z });
+	result_models.reserve(models.size());
+	result_data.reserve(models.size());
+	for (size_t i = 0; i < models.size(); ++i)
+	{
+		if (camera && !camera->testSphereInFrustum(world_centers[i], radius))
+			continue;
+		result_models.push_back(models[i] * model);
+		result_data.push_back(instance_data[i]);
+	}
+}
+
+GFX::Shader* CrowdEntity::getShader(const char* name)
+{
+	return GFX::Shader::Get((std::string(name) + "_vat").c_str());
+}
+
+void CrowdEntity::render(GFX::Shader* shader, GFX::Mesh* mesh, Camera* camera)
+{
+	if (camera)
+		cull(camera, culled_models, culled_data);
+	std::vector<Matrix44>& instances = camera ? culled_models : visible_models;
+	std::vector<Vector4f>& data = camera ? culled_data : visible_data;
+	if (instances.empty())
+		return;
+	vertex_animation.bind(shader, CORE::BaseApplication::instance->time);
+	mesh->renderInstanced(GL_TRIANGLES, &instances[0], (int)instances.size(), &data[0]);
+}
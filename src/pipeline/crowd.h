@@ -0,0 +1,133 @@
+/*  Crowds: thousands of animated instances of one skinned mesh drawn with a single instanced draw call
+	+ the VertexAnimation bakes the clips on the CPU: every frame of every clip is sampled, skinned and the positions and
+	  normals of all the vertices are stored in two half float textures (vertex animation textures)
+	+ the vertex shader (VAT macro) reads the two frames around the time of every instance and blends them,
+	  no skeleton is evaluated and no bones are uploaded per character
+	+ every instance has its model, its clip, its time offset and its speed, they are culled by the CPU every frame
+	  against the camera and again against every light that draws them in its shadowmap
+	The baked textures can be cached to disk, they depend on the mesh, the clips and the fps.
+*/
+#pragma once
+
+#include <string>
+#include <vector>
+#include <cstdint>
+
+#include "scene.h"
+
+#define VAT_VERSION 1
+#define VAT_MAX_WIDTH 4096 //of the textures, the vertices of one frame take several rows when there are more
+
+class Animation;
+class Camera;
+
+namespace GFX {
+	class Texture;
+	class Shader;
+	class Mesh;
+}
+
+namespace SCN {
+
+	class VertexAnimation {
+	public:
+		struct sClip {
+			int first_frame;
+			int num_frames;
+			float duration; //seconds
+		};
+
+		float fps;
+		int num_vertices;
+		int width; //of the textures
+		int rows_per_frame;
+		int num_frames; //of all the clips
+		std::vector<sClip> clips;
+		std::vector<uint16_t> positions; //RGBA half floats, frame after frame
+		std::vector<uint16_t> normals;
+		BoundingBox bounding; //of the vertices in all the frames
+		float last_bake_time; //ms
+
+		GFX::Texture* positions_texture;
+		GFX::Texture* normals_texture;
+		bool textures_dirty;
+
+		VertexAnimation();
+		~VertexAnimation();
+		VertexAnimation& operator = (const VertexAnimation& other); //the textures are not shared
+
+		//plays the clips over the mesh (it must have bones) and stores all the frames, in parallel
+		bool bake(GFX::Mesh* mesh, const std::vector<Animation*>& animations, float fps);
+
+		bool load(const char* filename, GFX::Mesh* mesh);
+		bool save(const char* filename);
+		void upload();
+		void clear();
+		bool isEmpty() const { return !num_frames; }
+		size_t getMemorySize() const;
+
+		//the textures and uniforms of the VAT macro of basic.vs
+		void bind(GFX::Shader* shader, float time);
+	};
+
+	class CrowdEntity : public BaseEntity
+	{
+	public:
+		std::string filename; //of the prefab, the first node with a skinned mesh is used
+		std::vector<std::string> animation_filenames; //the clips, every instance plays one of them
+		std::string vat_filename; //cache of the baked frames, relative to the folder of the scene
+		int count;
+		Vector3f size; //of the area where the instances are scattered, centered in the entity
+		float fps; //of the baked frames
+		float speed_variation; //random speed of every instance, 0 all play at the same speed
+		int seed;
+
+		Prefab* prefab;
+		std::vector<Animation*> animations;
+		VertexAnimation vertex_animation;
+
+		//instances, in the space of the entity
+		std::vector<Matrix44> models;
+		std::vector<Vector4f> instance_data; //first frame of its clip, frames of its clip, time offset, speed
+		std::vector<Vector3f> centers; //of the bounding of every instance
+		bool instances_dirty;
+
+		//visible this frame, in world space
+		std::vector<Matrix44> visible_models;
+		std::vector<Vector4f> visible_data;
+		std::vector<Vector3f> world_centers;
+
+		//culled against another camera while drawing (the shadows)
+		std::vector<Matrix44> culled_models;
+		std::vector<Vector4f> culled_data;
+
+		bool bake_failed; //not tried again until the prefab or the clips change
+
+		ENTITY_METHODS(CrowdEntity, CROWD, 10, 1);
+
+		CrowdEntity();
+		CrowdEntity& operator = (const CrowdEntity& other);
+
+		void configure(cJSON* json);
+		void serialize(cJSON* json);
+
+		void loadPrefab(const char* filename);
+		void loadAnimations();
+		std::string getFullFilename(const std::string& filename);
+
+		Node* getSkinnedNode(); //NULL while the prefab is loading
+		void bake(bool use_cache = true); //the frames of the clips, from the cache if it has a filename, saved to it after baking
+		void scatter(); //places the instances
+
+		//bakes and scatters when needed and culls the instances, returns the visible ones
+		int update(Camera* camera);
+		//the instances in the frustum of the camera (all without camera), after update
+		void cull(Camera* camera, std::vector<Matrix44>& result_models, std::vector<Vector4f>& result_data);
+
+		//the crowd version of a shader of the atlas (name + "_vat")
+		static GFX::Shader* getShader(const char* name);
+		//the uniforms and the instanced draw of the visible instances, or of the ones in the frustum of camera if any
+		void render(GFX::Shader* shader, GFX::Mesh* mesh, Camera* camera = nullptr);
+	};
+
+};
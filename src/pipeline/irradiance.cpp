@@ -0,0 +1,700 @@
+#include "irradiance.h"
+
+#include <cmath>
+#include <cstring>
+#include <iostream>
+#include <algorithm>
+
+#include "tracer.h"
+#include "light.h"
+#include "material.h"
+#include "../gfx/gfx.h"
+#include "../gfx/texture.h"
+#include "../gfx/shader.h"
+#include "../gfx/ibl.h"
+#include "../core/task.h"
+#include "../utils/utils.h"
+
+using namespace SCN;
+
+namespace {
+
+	struct sIrradianceHeader {
+		char signature[4];
+		int version;
+		int dims[3];
+		float start[3];
+		float end[3];
+	};
+
+	//one ray per texel of the cubemap, in the same directions that computeSH expects
+	void getRayDirections(int resolution, std::vector<Vector3f>& directions)
+	{
+		directions.resize((size_t)resolution * resolution * 6);
+		for (int face = 0; face < 6; ++face)
+		{
+			const Vector3f* axis = cubemapFaceNormals[face];
+			for (int y = 0; y < resolution; ++y)
+				for (int x = 0; x < resolution; ++x)
+				{
+					float u = 2.0f * (x + 0.5f) / resolution - 1.0f;
+					float v = 2.0f * (y + 0.5f) / resolution - 1.0f;
+					directions[((size_t)face * resolution + y) * resolution + x] = normalize(axis[0] * u + axis[1] * v + axis[2]);
+				}
+		}
+	}
+
+	//same as the shaders
+	Vector3f evalSH(const SphericalHarmonics& sh, const Vector3f& N)
+	{
+		Vector3f result = sh.coeffs[0]
+			+ sh.coeffs[1] * N.y + sh.coeffs[2] * N.z + sh.coeffs[3] * N.x
+			+ sh.coeffs[4] * (N.x * N.y) + sh.coeffs[5] * (N.y * N.z) + sh.coeffs[6] * (3.0f * N.z * N.z - 1.0f)
+			+ sh.coeffs[7] * (N.x * N.z) + sh.coeffs[8] * (N.x * N.x - N.y * N.y);
+		return Vector3f((std::max)(result.x, 0.0f), (std::max)(result.y, 0.0f), (std::max)(result.z, 0.0f));
+	}
+};
+
+IrradianceVolumeEntity::IrradianceVolumeEntity()
+{
+	dims.set(8, 4, 8);
+	size.set(400, 200, 400);
+	resolution = 8;
+	bounces = 2;
+	normal_distance = 1.0f;
+	auto_update = true;
+	last_bake_time = 0;
+	last_update_probes = 0;
+	lights_hash = 0;
+	texture = nullptr;
+	texture_dirty = false;
+	baking = nullptr;
+	baking_tracer = nullptr;
+	baking_all = false;
+}
+
+IrradianceVolumeEntity::~IrradianceVolumeEntity()
+{
+	finishBake(false);
+	if (texture)
+		delete texture;
+}
+
+IrradianceVolumeEntity& IrradianceVolumeEntity::operator = (const IrradianceVolumeEntity& other)
+{
+	if (this == &other)
+		return *this;
+	BaseEntity::operator = (other);
+	dims = other.dims;
+	size = other.size;
+	resolution = other.resolution;
+	bounces = other.bounces;
+	normal_distance = other.normal_distance;
+	auto_update = other.auto_update;
+	filename = other.filename;
+	baked_dims = other.baked_dims;
+	start = other.start;
+	end = other.end;
+	probes = other.probes;
+	last_bake_time = other.last_bake_time;
+	last_update_probes = other.last_update_probes;
+	tracked = other.tracked;
+	probe_entities = other.probe_entities;
+	ray_distances = other.ray_distances;
+	lights_hash = other.lights_hash;
+	texture_dirty = true;
+	return *this;
+}
+
+void IrradianceVolumeEntity::configure(cJSON* json)
+{
+	Vector3f dims_json = readJSONVector3(json, "dims", Vector3f((float)dims.x, (float)dims.y, (float)dims.z));
+	dims.set((std::max)(1, (int)dims_json.x), (std::max)(1, (int)dims_json.y), (std::max)(1, (int)dims_json.z));
+	size = readJSONVector3(json, "size", size);
+	resolution = (std::max)(1, (int)readJSONNumber(json, "resolution", (float)resolution));
+	bounces = (std::max)(1, (int)readJSONNumber(json, "bounces", (float)bounces));
+	normal_distance = readJSONNumber(json, "normal_distance", normal_distance);
+	auto_update = readJSONBool(json, "auto_update", auto_update);
+	filename = readJSONString(json, "filename", filename.c_str());
+
+	if (filename.size() && !load(getFullFilename().c_str()))
+		std::cout << " - Irradiance volume not baked yet: " << TermColor::YELLOW << filename << TermColor::DEFAULT << std::endl;
+}
+
+void IrradianceVolumeEntity::serialize(cJSON* json)
+{
+	writeJSONVector3(json, "dims", Vector3f((float)dims.x, (float)dims.y, (float)dims.z));
+	writeJSONVector3(json, "size", size);
+	writeJSONNumber(json, "resolution", (float)resolution);
+	writeJSONNumber(json, "bounces", (float)bounces);
+	writeJSONNumber(json, "normal_distance", normal_distance);
+	writeJSONBool(json, "auto_update", auto_update);
+	if (filename.size())
+		writeJSONString(json, "filename", filename.c_str());
+}
+
+std::string IrradianceVolumeEntity::getFullFilename()
+{
+	if (scene && scene->base_folder.size())
+		return scene->base_folder + "/" + filename;
+	return filename;
+}
+
+void IrradianceVolumeEntity::computeGrid(Vector3f& grid_start, Vector3f& grid_end)
+{
+	Vector3f center = root.getGlobalMatrix().getTranslation();
+	grid_start = center - size * 0.5f;
+	grid_end = center + size * 0.5f;
+}
+
+Vector3f IrradianceVolumeEntity::getProbePosition(int index) const
+{
+	int coords[3] = { (int)(index % baked_dims.x), (int)((index / baked_dims.x) % baked_dims.y), (int)(index / (baked_dims.x * baked_dims.y)) };
+	Vector3f position;
+	for (int axis = 0; axis < 3; ++axis)
+	{
+		float f = baked_dims.v[axis] > 1 ? coords[axis] / (float)(baked_dims.v[axis] - 1) : 0.5f;
+		position.v[axis] = start.v[axis] + (end.v[axis] - start.v[axis]) * f;
+	}
+	return position;
+}
+
+Vector3f IrradianceVolumeEntity::sampleIrradiance(const Vector3f& position, const Vector3f& normal) const
+{
+	if (probes.empty())
+		return Vector3f();
+
+	//position in probes, the same clamp as the shaders
+	Vector3f p = position + normal * normal_distance;
+	int base[3];
+	float f[3];
+	for (int axis = 0; axis < 3; ++axis)
+	{
+		int n = baked_dims.v[axis];
+		float extent = end.v[axis] - start.v[axis];
+		float coord = n > 1 && extent > 0.0f ? (p.v[axis] - start.v[axis]) / extent * (n - 1) : 0.0f;
+		coord = clamp(coord, 0.0f, (float)(n - 1));
+		base[axis] = (std::min)((int)coord, (std::max)(0, n - 2));
+		f[axis] = n > 1 ? coord - base[axis] : 0.0f;
+	}
+
+	SphericalHarmonics sh;
+	for (int corner = 0; corner < 8; ++corner)
+	{
+		int c[3];
+		float weight = 1.0f;
+		for (int axis = 0; axis < 3; ++axis)
+		{
+			int offset = (corner >> axis) & 1;
+			c[axis] = (std::min)(base[axis] + offset, (int)baked_dims.v[axis] - 1);
+			weight *= offset ? f[axis] : 1.0f - f[axis];
+		}
+		if (weight <= 0.0f)
+			continue;
+		const SphericalHarmonics& probe = probes[(c[2] * baked_dims.y + c[1]) * baked_dims.x + c[0]];
+		for (int i = 0; i < 9; ++i)
+			sh.coeffs[i] += probe.coeffs[i] * weight;
+	}
+	return evalSH(sh, normal);
+}
+
+uint64_t IrradianceVolumeEntity::computeLightsHash()
+{
+	uint64_t hash = GFX::IBL::computeHash(&scene->ambient_light, sizeof(Vector3f));
+	hash = GFX::IBL::computeHash(&resolution, sizeof(resolution), hash);
+	hash = GFX::IBL::computeHash(&bounces, sizeof(bounces), hash);
+	for (BaseEntity* entity : scene->entities)
+	{
+		if (!entity->visible || entity->getType() != eEntityType::LIGHT)
+			continue;
+		LightEntity* light = (LightEntity*)entity;
+		Matrix44 global = light->root.getGlobalMatrix();
+		float values[] = { (float)light->light_type, light->intensity, light->color.x, light->color.y, light->color.z, light->cone_info.x, light->cone_info.y, light->max_distance };
+		hash = GFX::IBL::computeHash(global.m, sizeof(global.m), hash);
+		hash = GFX::IBL::computeHash(values, sizeof(values), hash);
+	}
+	return hash;
+}
+
+//the models of the visible prefabs and the boxes of their instances
+void IrradianceVolumeEntity::track(const SceneTracer* tracer, std::map<BaseEntity*, sTrackedEntity>& result)
+{
+	result.clear();
+	for (BaseEntity* entity : scene->entities)
+	{
+		if (!entity->visible || entity->getType() != eEntityType::PREFAB)
+			continue;
+		sTrackedEntity& tracked_entity = result[entity];
+		tracked_entity.model = entity->root.getGlobalMatrix();
+		tracked_entity.num_children = (int)entity->root.children.size();
+		tracked_entity.min = Vector3f(FLT_MAX);
+		tracked_entity.max = Vector3f(-FLT_MAX);
+	}
+	if (!tracer)
+		return;
+	for (const SceneTracer::sInstance& instance : tracer->instances)
+	{
+		sTrackedEntity& tracked_entity = result[instance.entity];
+		tracked_entity.min.set((std::min)(tracked_entity.min.x, instance.min.x), (std::min)(tracked_entity.min.y, instance.min.y), (std::min)(tracked_entity.min.z, instance.min.z));
+		tracked_entity.max.set((std::max)(tracked_entity.max.x, instance.max.x), (std::max)(tracked_entity.max.y, instance.max.y), (std::max)(tracked_entity.max.z, instance.max.z));
+	}
+}
+
+void IrradianceVolumeEntity::bakeProbes(const SceneTracer& tracer, const std::vector<int>& indices, bool use_previous)
+{
+	if (indices.empty())
+		return;
+
+	std::vector<Vector3f> directions;
+	getRayDirections(resolution, directions);
+	int num_rays = (int)directions.size();
+
+	//the radiance of every ray, every probe is a cubemap of RGB floats
+	std::vector<float> radiance(indices.size() * num_rays * 3);
+	TaskManager::background.parallelFor(indices.size(), [&](size_t i) {
+		int probe = indices[i];
+		Vector3f origin = getProbePosition(probe);
+		std::vector<BaseEntity*>& seen = probe_entities[probe];
+		std::vector<int> occluders;
+		seen.clear();
+		for (int ray = 0; ray < num_rays; ++ray)
+		{
+			sSceneHit hit;
+			Vector3f color = tracer.ambient_light;
+			float& distance = ray_distances[(size_t)probe * num_rays + ray];
+			distance = FLT_MAX;
+			if (tracer.testRay(origin, directions[ray], FLT_MAX, hit))
+			{
+				distance = hit.t;
+				occluders.clear();
+				//the previous bake already has the ambient (the misses and the first bounce), adding it again grows every bounce
+				color = tracer.shade(hit, use_previous ? sampleIrradiance(hit.position, hit.normal) : tracer.ambient_light, &occluders);
+				seen.push_back(tracer.instances[hit.instance].entity);
+				for (int occluder : occluders)
+					seen.push_back(tracer.instances[occluder].entity);
+			}
+			float* texel = &radiance[(i * num_rays + ray) * 3];
+			texel[0] = color.x;
+			texel[1] = color.y;
+			texel[2] = color.z;
+		}
+		std::sort(seen.begin(), seen.end());
+		seen.erase(std::unique(seen.begin(), seen.end()), seen.end());
+	});
+
+	std::vector<sSHCubemap> cubemaps(indices.size());
+	for (size_t i = 0; i < indices.size(); ++i)
+	{
+		for (int face = 0; face < 6; ++face)
+			cubemaps[i].faces[face] = &radiance[(i * num_rays + (size_t)face * resolution * resolution) * 3];
+		cubemaps[i].size = resolution;
+		cubemaps[i].num_channels = 3;
+	}
+
+	//written after tracing, every ray reads the previous probes
+	std::vector<SphericalHarmonics> results(indices.size());
+	computeSH(cubemaps, &results[0]);
+	for (size_t i = 0; i < indices.size(); ++i)
+		probes[indices[i]] = results[i];
+	texture_dirty = true;
+}
+
+void IrradianceVolumeEntity::bake()
+{
+	if (!scene)
+		return;
+
+	//replaces whatever was being baked
+	finishBake(false);
+
+	SceneTracer* tracer = new SceneTracer();
+	tracer->build(scene);
+	track(tracer, tracked);
+	lights_hash = computeLightsHash();
+
+	std::vector<int> indices(dims.x * dims.y * dims.z);
+	for (int i = 0; i < (int)indices.size(); ++i)
+		indices[i] = i;
+	startBake(tracer, indices, true);
+	finishBake(true);
+}
+
+bool IrradianceVolumeEntity::checkWhiteBox()
+{
+	//the constructor makes it the current scene
+	Scene* current = Scene::instance;
+	Scene box_scene;
+	Scene::instance = current;
+	box_scene.ambient_light.set(0.5f, 0.5f, 0.5f);
+
+	GFX::Mesh cube;
+	cube.createCube(Vector3f(10.0f, 10.0f, 10.0f));
+	Material white; //no emission
+	PrefabEntity* walls = new PrefabEntity();
+	walls->root.mesh = &cube;
+	walls->root.material = &white;
+	box_scene.addEntity(walls);
+
+	IrradianceVolumeEntity* volume = new IrradianceVolumeEntity();
+	volume->dims.set(2, 2, 2);
+	volume->size.set(6.0f, 6.0f, 6.0f);
+	volume->resolution = 8;
+	volume->bounces = 4;
+	box_scene.addEntity(volume);
+
+	//every bounce of the full bake reads the previous one, then an update of all the probes reads the full bake
+	volume->bake();
+	SceneTracer* tracer = new SceneTracer();
+	tracer->build(&box_scene);
+	Vector3f ambient = tracer->ambient_light;
+	std::vector<int> indices(volume->probes.size());
+	for (int i = 0; i < (int)indices.size(); ++i)
+		indices[i] = i;
+	volume->startBake(tracer, indices, false);
+	volume->finishBake(true);
+
+	//the SH window loses around 1.5% every bounce, double counting the ambient doubles it in the second one
+	float max_error = 0.0f;
+	for (const SphericalHarmonics& probe : volume->probes)
+		for (int face = 0; face < 6; ++face)
+		{
+			Vector3f irradiance = evalSH(probe, cubemapFaceNormals[face][2]);
+			max_error = (std::max)(max_error, fabsf(irradiance.x - ambient.x) / ambient.x);
+		}
+	bool ok = !volume->probes.empty() && max_error < 0.1f;
+	std::cout << " + Irradiance white box: " << (ok ? TermColor::GREEN : TermColor::RED) << (ok ? "[OK]" : "[ERROR]") << TermColor::DEFAULT << " max error " << (max_error * 100.0f) << "% after " << volume->bounces << " bounces and an update" << std::endl;
+
+	for (BaseEntity* entity : box_scene.entities)
+	{
+		entity->scene = nullptr;
+		delete entity;
+	}
+	return ok;
+}
+
+void IrradianceVolumeEntity::startBake(SceneTracer* tracer, const std::vector<int>& indices, bool all)
+{
+	assert(!baking);
+	baking = new IrradianceVolumeEntity();
+	*baking = *this;
+	baking->scene = nullptr; //not in the scene, like a clone
+	baking_tracer = tracer;
+	baking_all = all;
+	if (all)
+	{
+		baking->baked_dims = dims;
+		computeGrid(baking->start, baking->end);
+		int num_probes = dims.x * dims.y * dims.z;
+		baking->probes.assign(num_probes, SphericalHarmonics());
+		baking->probe_entities.assign(num_probes, std::vector<BaseEntity*>());
+		baking->ray_distances.assign((size_t)num_probes * resolution * resolution * 6, FLT_MAX);
+	}
+
+	//all: every bounce traces all the probes again, otherwise the other probes give the indirect light of the bounces
+	IrradianceVolumeEntity* volume = baking;
+	int passes = all ? bounces : 1;
+	bool use_previous = !all && bounces > 1;
+	TaskManager::background.addTask(new Task([volume, tracer, indices, passes, use_previous]() {
+		long time = getTime();
+		for (int pass = 0; pass < passes; ++pass)
+			volume->bakeProbes(*tracer, indices, use_previous || pass > 0);
+		volume->last_bake_time = (float)(getTime() - time);
+		volume->last_update_probes = (int)indices.size();
+	}), &baking_group);
+}
+
+void IrradianceVolumeEntity::finishBake(bool apply)
+{
+	if (!baking)
+		return;
+	baking_group.wait();
+
+	if (apply)
+	{
+		baked_dims = baking->baked_dims;
+		start = baking->start;
+		end = baking->end;
+		probes.swap(baking->probes);
+		probe_entities.swap(baking->probe_entities);
+		ray_distances.swap(baking->ray_distances);
+		last_bake_time = baking->last_bake_time;
+		last_update_probes = baking->last_update_probes;
+		texture_dirty = true;
+
+		if (baking_all)
+		{
+			std::cout << " + Irradiance volume baked: " << probes.size() << " probes, " << baking_tracer->instances.size() << " instances in " << last_bake_time << "ms" << std::endl;
+			if (filename.size() && !save(getFullFilename().c_str()))
+				std::cout << " - ERROR: cannot save the irradiance volume: " << TermColor::RED << filename << TermColor::DEFAULT << std::endl;
+		}
+	}
+
+	delete baking;
+	baking = nullptr;
+	delete baking_tracer;
+	baking_tracer = nullptr;
+}
+
+bool IrradianceVolumeEntity::hasChanged()
+{
+	if (!scene)
+		return false;
+	if (probes.empty() || !(baked_dims.x == dims.x && baked_dims.y == dims.y && baked_dims.z == dims.z))
+		return true;
+
+	Vector3f grid_start, grid_end;
+	computeGrid(grid_start, grid_end);
+	if (grid_start.distance(start) > 0.0001f || grid_end.distance(end) > 0.0001f)
+		return true;
+
+	//loaded from disk, what the scene is now is what was baked
+	if (ray_distances.empty() && tracked.empty())
+	{
+		track(nullptr, tracked);
+		lights_hash = computeLightsHash();
+		return false;
+	}
+
+	if (computeLightsHash() != lights_hash)
+		return true;
+
+	int num_prefabs = 0;
+	for (BaseEntity* entity : scene->entities)
+	{
+		if (!entity->visible || entity->getType() != eEntityType::PREFAB)
+			continue;
+		num_prefabs++;
+		auto it = tracked.find(entity);
+		if (it == tracked.end() || it->second.num_children != (int)entity->root.children.size())
+			return true;
+		Matrix44 model = entity->root.getGlobalMatrix();
+		if (memcmp(model.m, it->second.model.m, sizeof(model.m)) != 0)
+			return true;
+	}
+	return num_prefabs != (int)tracked.size();
+}
+
+int IrradianceVolumeEntity::update()
+{
+	if (!scene)
+		return 0;
+
+	//the changes made while it was running are traced by the next one
+	if (baking)
+	{
+		if (!baking_group.isDone())
+			return 0;
+		finishBake(true);
+	}
+
+	SceneTracer* tracer = new SceneTracer();
+	tracer->build(scene);
+
+	//what was baked cannot be reused
+	Vector3f grid_start, grid_end;
+	computeGrid(grid_start, grid_end);
+	int num_probes = baked_dims.x * baked_dims.y * baked_dims.z;
+	if (probes.empty() || !(baked_dims.x == dims.x && baked_dims.y == dims.y && baked_dims.z == dims.z) ||
+		grid_start.distance(start) > 0.0001f || grid_end.distance(end) > 0.0001f ||
+		ray_distances.size() != (size_t)num_probes * resolution * resolution * 6 || computeLightsHash() != lights_hash)
+	{
+		track(tracer, tracked);
+		lights_hash = computeLightsHash();
+		std::vector<int> indices(dims.x * dims.y * dims.z);
+		for (int i = 0; i < (int)indices.size(); ++i)
+			indices[i] = i;
+		startBake(tracer, indices, true);
+		return (int)indices.size();
+	}
+
+	std::map<BaseEntity*, sTrackedEntity> current;
+	track(tracer, current);
+
+	std::vector<BaseEntity*> changed;
+	for (auto& it : current)
+	{
+		auto previous = tracked.find(it.first);
+		if (previous == tracked.end() || previous->second.num_children != it.second.num_children ||
+			memcmp(previous->second.model.m, it.second.model.m, sizeof(it.second.model.m)) != 0)
+			changed.push_back(it.first);
+	}
+	for (auto& it : tracked)
+		if (current.find(it.first) == current.end()) //removed or hidden
+			changed.push_back(it.first);
+	tracked = current;
+	if (changed.empty())
+	{
+		delete tracer;
+		return 0;
+	}
+
+	std::vector<Vector3f> directions;
+	getRayDirections(resolution, directions);
+	int num_rays = (int)directions.size();
+
+	//the probes that saw the entities where they were (or their shadows) and the ones with a ray that reaches
+	//where they are now or that hits a surface in their new shadow
+	std::vector<char> affected(num_probes, 0);
+	for (BaseEntity* entity : changed)
+	{
+		for (int probe = 0; probe < num_probes; ++probe)
+			if (std::binary_search(probe_entities[probe].begin(), probe_entities[probe].end(), entity))
+				affected[probe] = 1;
+
+		auto it = current.find(entity);
+		if (it == current.end() || it->second.min.x > it->second.max.x)
+			continue;
+		TaskManager::background.parallelFor(num_probes, [&](size_t probe) {
+			if (affected[probe])
+				return;
+			const Vector3f& min = it->second.min;
+			const Vector3f& max = it->second.max;
+			Vector3f origin = getProbePosition((int)probe);
+			Vector3f L;
+			float t, distance;
+			for (int ray = 0; ray < num_rays; ++ray)
+			{
+				const Vector3f& d = directions[ray];
+				float t_hit = ray_distances[probe * num_rays + ray];
+				bool hit = GFX::BVH::intersectBox(min, max, origin, Vector3f(1.0f / d.x, 1.0f / d.y, 1.0f / d.z), t_hit, t);
+				if (!hit && t_hit != FLT_MAX)
+				{
+					Vector3f position = origin + d * t_hit;
+					for (const SceneTracer::sLight& light : tracer->lights)
+						if (tracer->getLightDirection(light, position, L, distance) && GFX::BVH::intersectBox(min, max, position, Vector3f(1.0f / L.x, 1.0f / L.y, 1.0f / L.z), distance, t))
+						{
+							hit = true;
+							break;
+						}
+				}
+				if (hit)
+				{
+					affected[probe] = 1;
+					break;
+				}
+			}
+		}, 16);
+	}
+
+	std::vector<int> indices;
+	for (int probe = 0; probe < num_probes; ++probe)
+		if (affected[probe])
+			indices.push_back(probe);
+	if (indices.empty())
+	{
+		delete tracer;
+		return 0;
+	}
+
+	startBake(tracer, indices, false);
+	return (int)indices.size();
+}
+
+bool IrradianceVolumeEntity::save(const char* filename)
+{
+	sIrradianceHeader header;
+	memset(&header, 0, sizeof(header));
+	memcpy(header.signature, "IRRV", 4);
+	header.version = IRRADIANCE_VERSION;
+	for (int axis = 0; axis < 3; ++axis)
+	{
+		header.dims[axis] = baked_dims.v[axis];
+		header.start[axis] = start.v[axis];
+		header.end[axis] = end.v[axis];
+	}
+
+	std::vector<uint16_t> data(probes.size() * 27);
+	for (size_t i = 0; i < probes.size(); ++i)
+		for (int j = 0; j < 27; ++j)
+			data[i * 27 + j] = floatToHalf(probes[i].coeffs[j / 3].v[j % 3]);
+
+	FILE* file = fopen(filename, "wb");
+	if (file == NULL)
+		return false;
+	fwrite(&header, 1, sizeof(header), file);
+	fwrite(&data[0], sizeof(uint16_t), data.size(), file);
+	fclose(file);
+	return true;
+}
+
+bool IrradianceVolumeEntity::load(const char* filename)
+{
+	std::vector<unsigned char> buffer;
+	if (!readFileBin(filename, buffer) || buffer.size() < sizeof(sIrradianceHeader))
+		return false;
+
+	sIrradianceHeader header;
+	memcpy(&header, &buffer[0], sizeof(header));
+	if (memcmp(header.signature, "IRRV", 4) != 0 || header.version != IRRADIANCE_VERSION || header.dims[0] <= 0 || header.dims[1] <= 0 || header.dims[2] <= 0)
+		return false;
+	size_t num_probes = (size_t)header.dims[0] * header.dims[1] * header.dims[2];
+	if (buffer.size() < sizeof(header) + num_probes * 27 * sizeof(uint16_t))
+		return false;
+
+	baked_dims.set(header.dims[0], header.dims[1], header.dims[2]);
+	start.set(header.start[0], header.start[1], header.start[2]);
+	end.set(header.end[0], header.end[1], header.end[2]);
+	probes.resize(num_probes);
+	const uint16_t* data = (const uint16_t*)&buffer[sizeof(header)];
+	for (size_t i = 0; i < num_probes; ++i)
+		for (int j = 0; j < 27; ++j)
+			probes[i].coeffs[j / 3].v[j % 3] = halfToFloat(data[i * 27 + j]);
+
+	//the bookkeeping of the incremental bakes is not saved, the first change bakes all the probes
+	probe_entities.assign(num_probes, std::vector<BaseEntity*>());
+	ray_distances.clear();
+	tracked.clear();
+	texture_dirty = true;
+	return true;
+}
+
+//coefficient k of all the probes in the slices [k * dims.z, (k + 1) * dims.z) of the 3D texture
+void IrradianceVolumeEntity::upload()
+{
+	int nx = baked_dims.x, ny = baked_dims.y, nz = baked_dims.z;
+	std::vector<uint16_t> data((size_t)nx * ny * nz * 9 * 3);
+	for (int k = 0; k < 9; ++k)
+		for (int z = 0; z < nz; ++z)
+			for (int y = 0; y < ny; ++y)
+				for (int x = 0; x < nx; ++x)
+				{
+					const Vector3f& coeff = probes[((size_t)z * ny + y) * nx + x].coeffs[k];
+					uint16_t* texel = &data[((((size_t)k * nz + z) * ny + y) * nx + x) * 3];
+					texel[0] = floatToHalf(coeff.x);
+					texel[1] = floatToHalf(coeff.y);
+					texel[2] = floatToHalf(coeff.z);
+				}
+
+	if (!texture)
+		texture = new GFX::Texture();
+	texture->create3D(nx, ny, nz * 9, GL_RGB, GL_HALF_FLOAT, false, (Uint8*)&data[0], GL_RGB16F);
+	texture_dirty = false;
+}
+
+void IrradianceVolumeEntity::bind(GFX::Shader* shader, IrradianceVolumeEntity* volume)
+{
+	if (volume && volume->probes.size() && (!volume->texture || volume->texture_dirty))
+		volume->upload();
+
+	bool active = volume && volume->texture && volume->probes.size();
+	shader->setUniform("u_irr_active", active ? 1 : 0);
+	if (!active)
+	{
+		//the samplers of different types cannot share the unit 0
+		shader->setUniform("u_irr_texture", 5);
+		return;
+	}
+
+	//from world to probe coordinates
+	Vector3f scale;
+	for (int axis = 0; axis < 3; ++axis)
+	{
+		float extent = volume->end.v[axis] - volume->start.v[axis];
+		scale.v[axis] = volume->baked_dims.v[axis] > 1 && extent > 0.0f ? (volume->baked_dims.v[axis] - 1) / extent : 0.0f;
+	}
+	shader->setUniform("u_irr_start", volume->start);
+	shader->setUniform("u_irr_scale", scale);
+	shader->setUniform("u_irr_dims", Vector3f((float)volume->baked_dims.x, (float)volume->baked_dims.y, (float)volume->baked_dims.z));
+	shader->setUniform("u_irr_normal_distance", volume->normal_distance);
+	shader->setTexture("u_irr_texture", volume->texture, 5);
+}
@@ -0,0 +1,111 @@
+/*  Irradiance volume: a 3D grid of probes that store the light that arrives to them as 9 spherical harmonics
+	+ baked on the CPU: every probe traces a small cubemap of rays against the scene (SceneTracer), all the probes in parallel,
+	  then all the cubemaps are projected at once with computeSH (the same coefficients as the IBL)
+	+ incremental: when an entity moves only the probes that saw it (before or after moving) are baked again
+	+ the automatic updates are traced in the background on a copy of the volume, the probes are swapped in when it finishes
+	+ the shaders read the probes from a 3D texture (trilinear between probes), see \irradiance in the shader atlas
+	The grid is aligned to the world axis, centered in the position of the entity.
+*/
+#pragma once
+
+#include <map>
+#include <string>
+#include <vector>
+#include <cstdint>
+
+#include "scene.h"
+#include "../gfx/sphericalharmonics.h"
+#include "../core/task.h"
+
+#define IRRADIANCE_VERSION 1
+
+namespace GFX {
+	class Texture;
+	class Shader;
+}
+
+namespace SCN {
+
+	class SceneTracer;
+
+	class IrradianceVolumeEntity : public BaseEntity
+	{
+	public:
+		Vector3u dims; //probes in every axis
+		Vector3f size; //of the grid in world units
+		int resolution; //of the faces of the cubemap traced by every probe
+		int bounces; //1 is only direct light, every extra bounce traces the probes again using the previous result
+		float normal_distance; //the shaders read the probes this far from the surface, avoids the probes behind walls
+		bool auto_update; //bakes again the probes affected by the changes of the scene
+		std::string filename; //of the baked probes, relative to the folder of the scene
+
+		//baked
+		Vector3u baked_dims;
+		Vector3f start, end; //first and last probe
+		std::vector<SphericalHarmonics> probes; //x first, then y, then z
+		float last_bake_time; //ms
+		int last_update_probes;
+
+		GFX::Texture* texture;
+		bool texture_dirty; //the probes changed since the upload
+
+		ENTITY_METHODS(IrradianceVolumeEntity, IRRADIANCE_VOLUME, 12, 4);
+
+		IrradianceVolumeEntity();
+		~IrradianceVolumeEntity();
+		IrradianceVolumeEntity& operator = (const IrradianceVolumeEntity& other); //the texture is not shared
+
+		void configure(cJSON* json);
+		void serialize(cJSON* json);
+
+		//all the probes, in the calling thread
+		void bake();
+		//starts baking in the background the probes affected by the entities moved (or lights changed) since the last bake,
+		//all of them if what was baked cannot be reused. Returns how many, 0 while the previous one is still running
+		int update();
+		bool hasChanged();
+		bool isBaking() const { return baking != nullptr; }
+
+		bool load(const char* filename);
+		bool save(const char* filename);
+		void upload();
+
+		Vector3f getProbePosition(int index) const;
+		//trilinear between the 8 closest probes, irradiance / PI like the shaders
+		Vector3f sampleIrradiance(const Vector3f& position, const Vector3f& normal) const;
+
+		//the uniforms of \irradiance, volume can be NULL to disable it
+		static void bind(GFX::Shader* shader, IrradianceVolumeEntity* volume);
+		//bakes a closed white box lit only by the ambient (full bake and an update), every probe must keep the ambient
+		//whatever the bounces, the light must not grow with them. Prints the result
+		static bool checkWhiteBox();
+
+	private:
+		struct sTrackedEntity {
+			Matrix44 model;
+			int num_children; //changes when the prefab finishes loading
+			Vector3f min, max; //of its instances
+		};
+
+		//to know what has changed since the last bake
+		std::map<BaseEntity*, sTrackedEntity> tracked; //only compared, never dereferenced
+		std::vector<std::vector<BaseEntity*>> probe_entities; //seen by every probe (hit or shadowing what was hit)
+		std::vector<float> ray_distances; //of every ray of every probe, FLT_MAX for the misses
+		uint64_t lights_hash;
+
+		//the bake running in the background
+		IrradianceVolumeEntity* baking; //traces on its own probes, never the ones being rendered
+		SceneTracer* baking_tracer;
+		TaskGroup baking_group;
+		bool baking_all;
+
+		uint64_t computeLightsHash();
+		void computeGrid(Vector3f& grid_start, Vector3f& grid_end);
+		void bakeProbes(const SceneTracer& tracer, const std::vector<int>& indices, bool use_previous);
+		void track(const SceneTracer* tracer, std::map<BaseEntity*, sTrackedEntity>& result);
+		void startBake(SceneTracer* tracer, const std::vector<int>& indices, bool all);
+		void finishBake(bool apply); //waits for it
+		std::string getFullFilename();
+	};
+
+};
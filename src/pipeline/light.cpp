@@ -17,6 +17,7 @@ SCN::LightEntity::LightEntity()
 	shadow_bias = 0.001;
 	near_distance = 0.1;
 	area = 1000;
+	baked = false;
 }
 
 void SCN::LightEntity::configure(cJSON* json)
@@ -30,6 +31,7 @@ void SCN::LightEntity::configure(cJSON* json)
 	cone_info.y = readJSONNumber(json, "cone_end", cone_info.y );
 	area = readJSONNumber(json, "area", area);
 	near_distance = readJSONNumber(json, "near_dist", near_distance);
+	baked = readJSONBool(json, "baked", baked);
 
 	std::string light_type_str = readJSONString(json, "light_type", "");
 	if (light_type_str == "POINT")
@@ -47,6 +49,8 @@ void SCN::LightEntity::serialize(cJSON* json)
 	writeJSONNumber(json, "max_dist", max_distance);
 	writeJSONBool(json, "cast_shadows", cast_shadows);
 	writeJSONNumber(json, "near_dist", near_distance);
+	if (baked)
+		writeJSONBool(json, "baked", baked);
 
 	if (light_type == eLightType::SPOT)
 	{
@@ -84,6 +88,8 @@ void SCN::LightUniforms::bind(GFX::Shader* shader) const
 	shader->setMatrix44Array("u_shadowmap_viewprojections", (Matrix44*)viewprojections, MAX_LIGHTS);
 	shader->setUniform1Array("u_light_cast_shadowss", cast_shadows, MAX_LIGHTS);
 	shader->setUniform1Array("u_shadowmap_biases", shadow_biases, MAX_LIGHTS);
+
+	shader->setUniform1Array("u_lights_baked", baked, MAX_LIGHTS);
 }
 
 void SCN::LightUniforms::bind_single(GFX::Shader* shader, int i) const
@@ -110,6 +116,10 @@ void SCN::LightUniforms::bind_single(GFX::Shader* shader, int i) const
 	shader->setUniform("u_light_cast_shadows", cast_shadows[i]);
 	shader->setUniform("u_shadowmap_viewprojection", viewprojections[i]);
 	shader->setUniform("u_shadowmap_bias", entities[i]->shadow_bias);
+
+	// the lightmaps replace the ambient of the first pass
+	shader->setUniform("u_light_pass", i);
+	shader->setUniform("u_light_baked", baked[i]);
 }
 
 void SCN::LightUniforms::add_light(LightEntity* light)
@@ -135,6 +145,9 @@ void SCN::LightUniforms::add_light(LightEntity* light)
 	cast_shadows[i] = static_cast<int>(light->cast_shadows);
 	shadow_biases[i] = light->shadow_bias;
 
+	// for lightmaps
+	baked[i] = static_cast<int>(light->baked);
+
 	i++; // increase counter
 	
 	if (types[i-1] == eLightType::POINT || !cast_shadows[i-1])
@@ -30,6 +30,7 @@ namespace SCN {
 		float shadow_bias;
 		vec2 cone_info;
 		float area; //for direct;
+		bool baked; //its light is in the lightmaps, the lightmapped surfaces do not evaluate it
 
 		ENTITY_METHODS(LightEntity, LIGHT, 14,4);
 
@@ -62,6 +63,9 @@ namespace SCN {
 		float shadow_biases[MAX_LIGHTS];
 		std::vector<int> shadow_lights_idxs;
 
+		// Lights skipped by the lightmapped surfaces
+		int baked[MAX_LIGHTS];
+
 		void bind(GFX::Shader* shader) const;
 		void bind_single(GFX::Shader* shader, int i) const;
 		void add_light(LightEntity* light);
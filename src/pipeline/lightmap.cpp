@@ -0,0 +1,704 @@
+#include "lightmap.h"
+
+#include <cmath>
+#include <cstring>
+#include <iostream>
+#include <algorithm>
+
+#include "tracer.h"
+#include "prefab.h"
+#include "material.h"
+#include "../gfx/gfx.h"
+#include "../gfx/mesh.h"
+#include "../gfx/texture.h"
+#include "../gfx/shader.h"
+#include "../core/task.h"
+#include "../utils/utils.h"
+
+using namespace SCN;
+
+namespace {
+
+	struct sLightmapHeader {
+		char signature[4];
+		int version;
+		int page_size;
+		int num_pages;
+		int num_nodes;
+	};
+
+	struct sLightmapRecord {
+		int entity;
+		int node;
+		int num_vertices;
+		int page;
+		float rect[4];
+	};
+
+	//position, normal and uvs1 of the three vertices of every triangle, false if the mesh has no uvs1 for all its vertices
+	bool getLightmapTriangles(GFX::Mesh* mesh, std::vector<Vector3f>& positions, std::vector<Vector3f>& normals, std::vector<Vector2f>& uvs)
+	{
+		size_t num_vertices = mesh->interleaved.size() ? mesh->interleaved.size() : mesh->vertices.size();
+		if (!num_vertices || mesh->m_uvs1.size() != num_vertices)
+			return false;
+		bool has_normals = mesh->interleaved.size() || mesh->normals.size() == num_vertices;
+
+		size_t count = mesh->m_indices.size() ? mesh->m_indices.size() : num_vertices;
+		count -= count % 3;
+		positions.resize(count);
+		normals.resize(count);
+		uvs.resize(count);
+		for (size_t i = 0; i < count; ++i)
+		{
+			size_t index = mesh->m_indices.size() ? mesh->m_indices[i] : i;
+			if (index >= num_vertices)
+				return false;
+			positions[i] = mesh->interleaved.size() ? mesh->interleaved[index].vertex : mesh->vertices[index];
+			normals[i] = !has_normals ? Vector3f() : mesh->interleaved.size() ? mesh->interleaved[index].normal : mesh->normals[index];
+			uvs[i] = mesh->m_uvs1[index];
+		}
+		return true;
+	}
+
+	//random numbers of every texel, the bake gives the same result every time
+	inline uint32_t nextRandom(uint32_t& state)
+	{
+		state ^= state << 13;
+		state ^= state >> 17;
+		state ^= state << 5;
+		return state;
+	}
+
+	inline float randomFloat(uint32_t& state)
+	{
+		return (nextRandom(state) >> 8) * (1.0f / 16777216.0f);
+	}
+
+	//cosine weighted, the pdf cancels the cosine of the irradiance so every path has the same weight
+	Vector3f sampleHemisphere(const Vector3f& N, uint32_t& state)
+	{
+		float r = sqrtf(randomFloat(state));
+		float phi = 2.0f * (float)PI * randomFloat(state);
+		Vector3f T = normalize(cross(fabs(N.x) > 0.9f ? Vector3f(0, 1, 0) : Vector3f(1, 0, 0), N));
+		Vector3f B = cross(N, T);
+		return T * (r * cosf(phi)) + B * (r * sinf(phi)) + N * sqrtf((std::max)(0.0f, 1.0f - r * r));
+	}
+
+	//radiance that arrives to the origin from the direction, the ambient is the sky and what the last bounce does not trace
+	Vector3f tracePath(const SceneTracer& tracer, Vector3f origin, Vector3f direction, int bounces, uint32_t& state)
+	{
+		Vector3f radiance;
+		Vector3f weight(1.0f, 1.0f, 1.0f);
+		float bias = tracer.getBias();
+		for (int bounce = 1; ; ++bounce)
+		{
+			sSceneHit hit;
+			if (!tracer.testRay(origin, direction, FLT_MAX, hit))
+				return radiance + weight * tracer.ambient_light;
+			if (bounce >= bounces)
+				return radiance + weight * tracer.shade(hit, tracer.ambient_light);
+
+			Vector3f albedo, emission;
+			tracer.getSurface(hit, albedo, emission);
+			radiance += weight * (emission + albedo * tracer.computeDirect(hit.position, hit.normal));
+			weight = weight * albedo;
+			if ((std::max)({ weight.x, weight.y, weight.z }) < 0.001f)
+				return radiance;
+			origin = hit.position + hit.normal * bias;
+			direction = sampleHemisphere(hit.normal, state);
+		}
+	}
+
+	inline float cross2D(float ax, float ay, float bx, float by)
+	{
+		return ax * by - ay * bx;
+	}
+};
+
+LightmapEntity::LightmapEntity()
+{
+	texels_per_unit = 2.0f;
+	min_size = 4;
+	max_size = 256;
+	page_size = 1024;
+	samples = 64;
+	bounces = 2;
+	denoise_iterations = 3;
+	baked_page_size = 0;
+	last_bake_time = 0;
+	last_bake_texels = 0;
+	assigned = false;
+	textures_dirty = false;
+}
+
+LightmapEntity::~LightmapEntity()
+{
+	for (GFX::Texture* texture : textures)
+		delete texture;
+}
+
+LightmapEntity& LightmapEntity::operator = (const LightmapEntity& other)
+{
+	if (this == &other)
+		return *this;
+	BaseEntity::operator = (other);
+	texels_per_unit = other.texels_per_unit;
+	min_size = other.min_size;
+	max_size = other.max_size;
+	page_size = other.page_size;
+	samples = other.samples;
+	bounces = other.bounces;
+	denoise_iterations = other.denoise_iterations;
+	filename = other.filename;
+	baked_page_size = other.baked_page_size;
+	nodes = other.nodes;
+	pages = other.pages;
+	last_bake_time = other.last_bake_time;
+	last_bake_texels = other.last_bake_texels;
+	assigned = false;
+	textures_dirty = true;
+	return *this;
+}
+
+void LightmapEntity::configure(cJSON* json)
+{
+	texels_per_unit = (std::max)(0.001f, readJSONNumber(json, "texels_per_unit", texels_per_unit));
+	min_size = (std::max)(1, (int)readJSONNumber(json, "min_size", (float)min_size));
+	max_size = (std::max)(min_size, (int)readJSONNumber(json, "max_size", (float)max_size));
+	page_size = (std::max)(64, (int)readJSONNumber(json, "page_size", (float)page_size));
+	samples = (std::max)(1, (int)readJSONNumber(json, "samples", (float)samples));
+	bounces = (std::max)(1, (int)readJSONNumber(json, "bounces", (float)bounces));
+	denoise_iterations = (std::max)(0, (int)readJSONNumber(json, "denoise_iterations", (float)denoise_iterations));
+	filename = readJSONString(json, "filename", filename.c_str());
+
+	if (filename.size() && !load(getFullFilename().c_str()))
+		std::cout << " - Lightmaps not baked yet: " << TermColor::YELLOW << filename << TermColor::DEFAULT << std::endl;
+}
+
+void LightmapEntity::serialize(cJSON* json)
+{
+	writeJSONNumber(json, "texels_per_unit", texels_per_unit);
+	writeJSONNumber(json, "min_size", (float)min_size);
+	writeJSONNumber(json, "max_size", (float)max_size);
+	writeJSONNumber(json, "page_size", (float)page_size);
+	writeJSONNumber(json, "samples", (float)samples);
+	writeJSONNumber(json, "bounces", (float)bounces);
+	writeJSONNumber(json, "denoise_iterations", (float)denoise_iterations);
+	if (filename.size())
+		writeJSONString(json, "filename", filename.c_str());
+}
+
+std::string LightmapEntity::getFullFilename()
+{
+	if (scene && scene->base_folder.size())
+		return scene->base_folder + "/" + filename;
+	return filename;
+}
+
+//depth first, the same order every time the prefab is loaded
+void LightmapEntity::listNodes(Node* node, std::vector<Node*>& result)
+{
+	result.push_back(node);
+	for (Node* child : node->children)
+		listNodes(child, result);
+}
+
+void LightmapEntity::collectNodes(std::vector<sBakeNode>& result)
+{
+	result.clear();
+	std::vector<Node*> list;
+	for (size_t i = 0; i < scene->entities.size(); ++i)
+	{
+		BaseEntity* entity = scene->entities[i];
+		if (!entity->visible || entity->getType() != eEntityType::PREFAB)
+			continue;
+		PrefabEntity* prefab_entity = (PrefabEntity*)entity;
+		if (!prefab_entity->is_static || prefab_entity->prefab_pending)
+			continue;
+
+		list.clear();
+		listNodes(&entity->root, list);
+		for (size_t j = 0; j < list.size(); ++j)
+		{
+			Node* node = list[j];
+			//the characters move and the transparent surfaces are lit by what is behind
+			if (!node->visible || !node->mesh || !node->material || node->material->alpha_mode == eAlphaMode::BLEND ||
+				node->mesh->bones_info.size() || node->mesh->m_uvs1.empty())
+				continue;
+			sBakeNode bake_node;
+			bake_node.node = node;
+			bake_node.model = node->getGlobalMatrix();
+			bake_node.entity = (int)i;
+			bake_node.index = (int)j;
+			bake_node.size = 0;
+			bake_node.x = bake_node.y = bake_node.page = 0;
+			result.push_back(bake_node);
+		}
+	}
+
+	//as many texels as the surface needs, the part of the uvs that is empty is wasted
+	int biggest = page_size - LIGHTMAP_PADDING * 2;
+	TaskManager::background.parallelFor(result.size(), [&](size_t i) {
+		sBakeNode& bake_node = result[i];
+		std::vector<Vector3f> positions, normals;
+		std::vector<Vector2f> uvs;
+		if (!getLightmapTriangles(bake_node.node->mesh, positions, normals, uvs) || uvs.empty())
+			return;
+
+		Vector2f uv_min(FLT_MAX, FLT_MAX), uv_max(-FLT_MAX, -FLT_MAX);
+		for (const Vector2f& uv : uvs)
+		{
+			uv_min.set((std::min)(uv_min.x, uv.x), (std::min)(uv_min.y, uv.y));
+			uv_max.set((std::max)(uv_max.x, uv.x), (std::max)(uv_max.y, uv.y));
+		}
+		float uv_width = uv_max.x - uv_min.x;
+		float uv_height = uv_max.y - uv_min.y;
+		if (uv_width <= 0.0f || uv_height <= 0.0f)
+			return;
+
+		transformPoints(bake_node.model, positions.data(), positions.data(), positions.size());
+		float world_area = 0.0f, uv_area = 0.0f;
+		for (size_t t = 0; t + 2 < positions.size(); t += 3)
+		{
+			const Vector3f& a = positions[t], &b = positions[t + 1], &c = positions[t + 2];
+			world_area += cross(b - a, c - a).length() * 0.5f;
+			uv_area += fabs(cross2D(uvs[t + 1].x - uvs[t].x, uvs[t + 1].y - uvs[t].y, uvs[t + 2].x - uvs[t].x, uvs[t + 2].y - uvs[t].y)) * 0.5f;
+		}
+		if (world_area <= 0.0f || uv_area <= 0.0f)
+			return;
+
+		float coverage = (std::max)(0.01f, (std::min)(1.0f, uv_area / (uv_width * uv_height)));
+		int size = (int)ceilf(sqrtf(world_area / coverage) * texels_per_unit);
+		bake_node.size = (std::min)((std::max)(size, min_size), (std::min)(max_size, biggest));
+		bake_node.uv_min = uv_min;
+		bake_node.uv_max = uv_max;
+	});
+
+	result.erase(std::remove_if(result.begin(), result.end(), [](const sBakeNode& bake_node) { return bake_node.size <= 0; }), result.end());
+}
+
+//shelves from the biggest to the smallest, a new page when the current one is full
+void LightmapEntity::packNodes(std::vector<sBakeNode>& bake_nodes, int& num_pages)
+{
+	std::sort(bake_nodes.begin(), bake_nodes.end(), [](const sBakeNode& a, const sBakeNode& b) { return a.size > b.size; });
+
+	num_pages = 0;
+	int x = 0, y = 0, shelf_height = 0;
+	for (sBakeNode& bake_node : bake_nodes)
+	{
+		int size = bake_node.size + LIGHTMAP_PADDING * 2;
+		if (x + size > page_size)
+		{
+			x = 0;
+			y += shelf_height;
+			shelf_height = 0;
+		}
+		if (num_pages == 0 || y + size > page_size)
+		{
+			num_pages++;
+			x = y = shelf_height = 0;
+		}
+		bake_node.page = num_pages - 1;
+		bake_node.x = x;
+		bake_node.y = y;
+		x += size;
+		shelf_height = (std::max)(shelf_height, size);
+	}
+}
+
+//every texel whose center is inside a triangle gets the position and normal of that point, only inside the rect of the node
+void LightmapEntity::rasterizeNode(const sBakeNode& bake_node, std::vector<sTexel>& texels)
+{
+	Node* node = bake_node.node;
+	std::vector<Vector3f> positions, normals;
+	std::vector<Vector2f> uvs;
+	if (!getLightmapTriangles(node->mesh, positions, normals, uvs))
+		return;
+
+	const Matrix44& model = bake_node.model;
+	Matrix44 normal_matrix = model;
+	normal_matrix.inverse();
+	normal_matrix.transpose();
+
+	//all the vertices to world space at once
+	transformPoints(model, positions.data(), positions.data(), positions.size());
+	transformNormals(normal_matrix, normals.data(), normals.data(), normals.size());
+
+	float scale_x = bake_node.size / (bake_node.uv_max.x - bake_node.uv_min.x);
+	float scale_y = bake_node.size / (bake_node.uv_max.y - bake_node.uv_min.y);
+	float offset_x = (float)(bake_node.x + LIGHTMAP_PADDING);
+	float offset_y = (float)(bake_node.y + LIGHTMAP_PADDING);
+	int end_x = bake_node.x + bake_node.size + LIGHTMAP_PADDING * 2;
+	int end_y = bake_node.y + bake_node.size + LIGHTMAP_PADDING * 2;
+
+	for (size_t t = 0; t + 2 < positions.size(); t += 3)
+	{
+		float px[3], py[3];
+		Vector3f world_positions[3], world_normals[3];
+		for (int k = 0; k < 3; ++k)
+		{
+			px[k] = offset_x + (uvs[t + k].x - bake_node.uv_min.x) * scale_x;
+			py[k] = offset_y + (uvs[t + k].y - bake_node.uv_min.y) * scale_y;
+			world_positions[k] = positions[t + k];
+			world_normals[k] = normals[t + k];
+		}
+
+		Vector3f face_normal = cross(world_positions[1] - world_positions[0], world_positions[2] - world_positions[0]);
+		float area = cross2D(px[1] - px[0], py[1] - py[0], px[2] - px[0], py[2] - py[0]);
+		if (face_normal.length() <= 0.0f || fabs(area) < 1e-8f)
+			continue;
+		face_normal = normalize(face_normal);
+
+		int min_x = (std::max)(bake_node.x, (int)floorf((std::min)({ px[0], px[1], px[2] })));
+		int min_y = (std::max)(bake_node.y, (int)floorf((std::min)({ py[0], py[1], py[2] })));
+		int max_x = (std::min)(end_x - 1, (int)ceilf((std::max)({ px[0], px[1], px[2] })));
+		int max_y = (std::min)(end_y - 1, (int)ceilf((std::max)({ py[0], py[1], py[2] })));
+		for (int y = min_y; y <= max_y; ++y)
+			for (int x = min_x; x <= max_x; ++x)
+			{
+				float cx = x + 0.5f, cy = y + 0.5f;
+				float w0 = cross2D(px[2] - px[1], py[2] - py[1], cx - px[1], cy - py[1]) / area;
+				float w1 = cross2D(px[0] - px[2], py[0] - py[2], cx - px[2], cy - py[2]) / area;
+				float w2 = 1.0f - w0 - w1;
+				if (w0 < -0.0001f || w1 < -0.0001f || w2 < -0.0001f)
+					continue;
+
+				sTexel& texel = texels[(size_t)y * baked_page_size + x];
+				texel.position = world_positions[0] * w0 + world_positions[1] * w1 + world_positions[2] * w2;
+				Vector3f normal = world_normals[0] * w0 + world_normals[1] * w1 + world_normals[2] * w2;
+				texel.normal = normal.length() > 0.0001f ? normalize(normal) : face_normal;
+				texel.node = bake_node.index;
+			}
+	}
+}
+
+void LightmapEntity::traceTexels(const SceneTracer& tracer, const std::vector<sTexel>& texels, std::vector<Vector3f>& direct, std::vector<Vector3f>& indirect)
+{
+	float bias = tracer.getBias();
+	TaskManager::background.parallelFor(texels.size(), [&](size_t i) {
+		const sTexel& texel = texels[i];
+		if (texel.node < 0)
+			return;
+
+		uint32_t state = (uint32_t)(i * 2654435761u) ^ 0x9E3779B9u;
+		if (!state)
+			state = 1;
+
+		direct[i] = tracer.computeDirect(texel.position, texel.normal);
+
+		Vector3f origin = texel.position + texel.normal * bias;
+		Vector3f sum;
+		for (int sample = 0; sample < samples; ++sample)
+			sum += tracePath(tracer, origin, sampleHemisphere(texel.normal, state), bounces, state);
+		indirect[i] = sum * (1.0f / samples);
+	}, 64);
+}
+
+//a-trous with the B3 spline, the neighbours count less when they are far in the world or face another direction
+void LightmapEntity::denoise(const std::vector<sTexel>& texels, std::vector<Vector3f>& indirect)
+{
+	const float kernel[5] = { 1.0f / 16.0f, 1.0f / 4.0f, 3.0f / 8.0f, 1.0f / 4.0f, 1.0f / 16.0f };
+	int size = baked_page_size;
+	std::vector<Vector3f> result(indirect.size());
+
+	for (int iteration = 0; iteration < denoise_iterations; ++iteration)
+	{
+		int step = 1 << iteration;
+		float sigma = step / texels_per_unit; //world distance between the texels read
+		float inv_two_sigma2 = 1.0f / (2.0f * sigma * sigma);
+		TaskManager::background.parallelFor(size, [&](size_t row) {
+			int y = (int)row;
+			for (int x = 0; x < size; ++x)
+			{
+				size_t index = (size_t)y * size + x;
+				const sTexel& texel = texels[index];
+				result[index] = indirect[index];
+				if (texel.node < 0)
+					continue;
+
+				Vector3f sum;
+				float total_weight = 0.0f;
+				for (int j = -2; j <= 2; ++j)
+				{
+					int ny = y + j * step;
+					if (ny < 0 || ny >= size)
+						continue;
+					for (int i = -2; i <= 2; ++i)
+					{
+						int nx = x + i * step;
+						if (nx < 0 || nx >= size)
+							continue;
+						size_t neighbour = (size_t)ny * size + nx;
+						const sTexel& other = texels[neighbour];
+						if (other.node < 0)
+							continue;
+						float NdotN = (std::max)(0.0f, dot(texel.normal, other.normal));
+						NdotN *= NdotN; NdotN *= NdotN; NdotN *= NdotN; NdotN *= NdotN; //^16
+						Vector3f D = texel.position - other.position;
+						float weight = kernel[i + 2] * kernel[j + 2] * NdotN * expf(-dot(D, D) * inv_two_sigma2);
+						sum += indirect[neighbour] * weight;
+						total_weight += weight;
+					}
+				}
+				if (total_weight > 0.0f)
+					result[index] = sum * (1.0f / total_weight);
+			}
+		});
+		indirect.swap(result);
+	}
+}
+
+//the empty texels take the average of the ones around them, ring by ring
+void LightmapEntity::dilate(const std::vector<sTexel>& texels, std::vector<Vector3f>& light)
+{
+	int size = baked_page_size;
+	std::vector<char> filled(texels.size());
+	for (size_t i = 0; i < texels.size(); ++i)
+		filled[i] = texels[i].node >= 0;
+	std::vector<char> next_filled;
+	std::vector<Vector3f> result;
+
+	for (int iteration = 0; iteration < LIGHTMAP_PADDING * 2; ++iteration)
+	{
+		next_filled = filled;
+		result = light;
+		TaskManager::background.parallelFor(size, [&](size_t row) {
+			int y = (int)row;
+			for (int x = 0; x < size; ++x)
+			{
+				size_t index = (size_t)y * size + x;
+				if (filled[index])
+					continue;
+				Vector3f sum;
+				int count = 0;
+				for (int j = (std::max)(0, y - 1); j <= (std::min)(size - 1, y + 1); ++j)
+					for (int i = (std::max)(0, x - 1); i <= (std::min)(size - 1, x + 1); ++i)
+						if (filled[(size_t)j * size + i])
+						{
+							sum += light[(size_t)j * size + i];
+							count++;
+						}
+				if (!count)
+					continue;
+				result[index] = sum * (1.0f / count);
+				next_filled[index] = 1;
+			}
+		});
+		light.swap(result);
+		filled.swap(next_filled);
+	}
+}
+
+void LightmapEntity::bake()
+{
+	if (!scene)
+		return;
+
+	long time = getTime();
+
+	std::vector<sBakeNode> bake_nodes;
+	collectNodes(bake_nodes);
+	int num_pages = 0;
+	packNodes(bake_nodes, num_pages);
+
+	SceneTracer tracer;
+	tracer.build(scene, true);
+
+	baked_page_size = page_size;
+	size_t num_texels = (size_t)baked_page_size * baked_page_size;
+	pages.assign(num_pages, std::vector<uint16_t>());
+	last_bake_texels = 0;
+
+	//one page at a time, every node only writes in its own rect
+	std::vector<sTexel> texels;
+	std::vector<Vector3f> direct, indirect;
+	std::vector<int> page_nodes;
+	for (int page = 0; page < num_pages; ++page)
+	{
+		sTexel empty;
+		empty.node = -1;
+		texels.assign(num_texels, empty);
+		direct.assign(num_texels, Vector3f());
+		indirect.assign(num_texels, Vector3f());
+
+		page_nodes.clear();
+		for (size_t i = 0; i < bake_nodes.size(); ++i)
+			if (bake_nodes[i].page == page)
+				page_nodes.push_back((int)i);
+		TaskManager::background.parallelFor(page_nodes.size(), [&](size_t i) {
+			rasterizeNode(bake_nodes[page_nodes[i]], texels);
+		});
+
+		traceTexels(tracer, texels, direct, indirect);
+		denoise(texels, indirect);
+		for (size_t i = 0; i < num_texels; ++i)
+		{
+			direct[i] += indirect[i];
+			if (texels[i].node >= 0)
+				last_bake_texels++;
+		}
+		dilate(texels, direct);
+
+		std::vector<uint16_t>& pixels = pages[page];
+		pixels.resize(num_texels * 3);
+		for (size_t i = 0; i < num_texels; ++i)
+		{
+			pixels[i * 3] = floatToHalf(direct[i].x);
+			pixels[i * 3 + 1] = floatToHalf(direct[i].y);
+			pixels[i * 3 + 2] = floatToHalf(direct[i].z);
+		}
+	}
+
+	//from the uvs1 of every node to its rect in the page
+	nodes.clear();
+	for (const sBakeNode& bake_node : bake_nodes)
+	{
+		sLightmapNode record;
+		record.entity = bake_node.entity;
+		record.node = bake_node.index;
+		record.num_vertices = bake_node.node->mesh->getNumVertices();
+		record.page = bake_node.page;
+		record.rect.x = bake_node.size / ((bake_node.uv_max.x - bake_node.uv_min.x) * baked_page_size);
+		record.rect.y = bake_node.size / ((bake_node.uv_max.y - bake_node.uv_min.y) * baked_page_size);
+		record.rect.z = (bake_node.x + LIGHTMAP_PADDING) / (float)baked_page_size - bake_node.uv_min.x * record.rect.x;
+		record.rect.w = (bake_node.y + LIGHTMAP_PADDING) / (float)baked_page_size - bake_node.uv_min.y * record.rect.y;
+		nodes.push_back(record);
+	}
+	textures_dirty = true;
+	assign();
+
+	last_bake_time = (float)(getTime() - time);
+	std::cout << " + Lightmaps baked: " << nodes.size() << " nodes, " << num_pages << " pages, " << last_bake_texels << " texels in " << last_bake_time << "ms" << std::endl;
+
+	if (filename.size() && !save(getFullFilename().c_str()))
+		std::cout << " - ERROR: cannot save the lightmaps: " << TermColor::RED << filename << TermColor::DEFAULT << std::endl;
+}
+
+void LightmapEntity::assign()
+{
+	if (!scene)
+		return;
+	assigned = true;
+
+	//the nodes of every prefab in the same order as the bake
+	std::vector<std::vector<Node*>> lists(scene->entities.size());
+	for (size_t i = 0; i < scene->entities.size(); ++i)
+	{
+		BaseEntity* entity = scene->entities[i];
+		if (entity->getType() != eEntityType::PREFAB)
+			continue;
+		listNodes(&entity->root, lists[i]);
+		for (Node* node : lists[i])
+			node->lightmap_page = -1;
+	}
+
+	for (const sLightmapNode& record : nodes)
+	{
+		if (record.entity < 0 || record.entity >= (int)lists.size() || record.node < 0 || record.node >= (int)lists[record.entity].size())
+			continue;
+		Node* node = lists[record.entity][record.node];
+		if (!node->mesh || (int)node->mesh->getNumVertices() != record.num_vertices || record.page >= (int)pages.size())
+			continue;
+		node->lightmap_page = record.page;
+		node->lightmap_rect = record.rect;
+	}
+}
+
+bool LightmapEntity::save(const char* filename)
+{
+	sLightmapHeader header;
+	memset(&header, 0, sizeof(header));
+	memcpy(header.signature, "LMAP", 4);
+	header.version = LIGHTMAP_VERSION;
+	header.page_size = baked_page_size;
+	header.num_pages = (int)pages.size();
+	header.num_nodes = (int)nodes.size();
+
+	std::vector<sLightmapRecord> records(nodes.size());
+	for (size_t i = 0; i < nodes.size(); ++i)
+	{
+		records[i].entity = nodes[i].entity;
+		records[i].node = nodes[i].node;
+		records[i].num_vertices = nodes[i].num_vertices;
+		records[i].page = nodes[i].page;
+		memcpy(records[i].rect, nodes[i].rect.v, sizeof(records[i].rect));
+	}
+
+	FILE* file = fopen(filename, "wb");
+	if (file == NULL)
+		return false;
+	fwrite(&header, 1, sizeof(header), file);
+	if (records.size())
+		fwrite(&records[0], sizeof(sLightmapRecord), records.size(), file);
+	for (const std::vector<uint16_t>& pixels : pages)
+		fwrite(&pixels[0], sizeof(uint16_t), pixels.size(), file);
+	fclose(file);
+	return true;
+}
+
+bool LightmapEntity::load(const char* filename)
+{
+	std::vector<unsigned char> buffer;
+	if (!readFileBin(filename, buffer) || buffer.size() < sizeof(sLightmapHeader))
+		return false;
+
+	sLightmapHeader header;
+	memcpy(&header, &buffer[0], sizeof(header));
+	if (memcmp(header.signature, "LMAP", 4) != 0 || header.version != LIGHTMAP_VERSION || header.page_size <= 0 || header.num_pages < 0 || header.num_nodes < 0)
+		return false;
+	size_t page_values = (size_t)header.page_size * header.page_size * 3;
+	size_t records_size = header.num_nodes * sizeof(sLightmapRecord);
+	if (buffer.size() < sizeof(header) + records_size + header.num_pages * page_values * sizeof(uint16_t))
+		return false;
+
+	baked_page_size = header.page_size;
+	nodes.resize(header.num_nodes);
+	const sLightmapRecord* records = (const sLightmapRecord*)&buffer[sizeof(header)];
+	for (int i = 0; i < header.num_nodes; ++i)
+	{
+		nodes[i].entity = records[i].entity;
+		nodes[i].node = records[i].node;
+		nodes[i].num_vertices = records[i].num_vertices;
+		nodes[i].page = records[i].page;
+		nodes[i].rect = Vector4f(records[i].rect);
+	}
+
+	pages.resize(header.num_pages);
+	const uint16_t* data = (const uint16_t*)&buffer[sizeof(header) + records_size];
+	for (int i = 0; i < header.num_pages; ++i)
+		pages[i].assign(data + i * page_values, data + (i + 1) * page_values);
+
+	//the prefabs may still be loading, the renderer assigns the nodes when they are ready
+	assigned = false;
+	textures_dirty = true;
+	return true;
+}
+
+void LightmapEntity::upload()
+{
+	for (size_t i = pages.size(); i < textures.size(); ++i)
+		delete textures[i];
+	textures.resize(pages.size(), nullptr);
+	for (size_t i = 0; i < pages.size(); ++i)
+	{
+		if (!textures[i])
+			textures[i] = new GFX::Texture();
+		//no mips, they would mix the nodes of the page
+		textures[i]->create(baked_page_size, baked_page_size, GL_RGB, GL_HALF_FLOAT, false, (Uint8*)&pages[i][0], GL_RGB16F);
+	}
+	textures_dirty = false;
+}
+
+void LightmapEntity::bind(GFX::Shader* shader, LightmapEntity* lightmap, int page, const Vector4f& rect)
+{
+	if (lightmap && (lightmap->textures_dirty || lightmap->textures.size() != lightmap->pages.size()))
+		lightmap->upload();
+
+	bool active = lightmap && page >= 0 && page < (int)lightmap->textures.size();
+	shader->setUniform("u_lightmap_active", active ? 1 : 0);
+	if (!active)
+		return;
+
+	shader->setUniform("u_lightmap_rect", rect);
+	shader->setTexture("u_lightmap_texture", lightmap->textures[page], 3);
+}
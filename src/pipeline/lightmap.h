@@ -0,0 +1,111 @@
+/*  Lightmaps: the light of the static prefabs baked in their second set of uvs (TEXCOORD_1)
+	+ baked on the CPU with the SceneTracer: the triangles of every node are rasterized in uv space, every texel traces
+	  the direct light of the baked lights and a few paths for the bounces and the ambient, all the texels in parallel
+	+ the noise of the paths is filtered (a-trous, guided by the positions and normals) and the texels outside the
+	  triangles are dilated so the bilinear filter never reads an empty texel
+	+ the nodes are packed in square pages (shelves), every node knows its page and where its uvs are in it
+	+ the shaders use the lightmap as the diffuse ambient and skip the baked lights, in deferred it goes through the gbuffer
+	Only the nodes of the prefabs marked as static and the lights marked as baked are part of the lightmaps.
+	The texels store irradiance / PI (linear), like ibl_diffuse, the same units as the PBR shaders.
+*/
+#pragma once
+
+#include <string>
+#include <vector>
+#include <cstdint>
+
+#include "scene.h"
+
+#define LIGHTMAP_VERSION 1
+#define LIGHTMAP_PADDING 2 //texels around every node in the page
+
+namespace GFX {
+	class Texture;
+	class Shader;
+}
+
+namespace SCN {
+
+	class SceneTracer;
+
+	class LightmapEntity : public BaseEntity
+	{
+	public:
+		float texels_per_unit; //density of the lightmaps in the world
+		int min_size, max_size; //of the nodes in the pages, in texels
+		int page_size;
+		int samples; //paths per texel for the indirect light
+		int bounces; //of every path, 1 is only the light reflected once
+		int denoise_iterations; //of the a-trous filter, every one doubles the radius
+		std::string filename; //of the baked pages, relative to the folder of the scene
+
+		//where every node is, the node is the position in a depth first walk of the root of the entity
+		struct sLightmapNode {
+			int entity; //index in the scene
+			int node;
+			int num_vertices; //to detect that the prefab is not the one baked
+			int page;
+			Vector4f rect;
+		};
+
+		//baked
+		int baked_page_size;
+		std::vector<sLightmapNode> nodes;
+		std::vector<std::vector<uint16_t>> pages; //RGB half floats
+		float last_bake_time; //ms
+		int last_bake_texels;
+		bool assigned; //the nodes of the scene know their lightmap
+
+		std::vector<GFX::Texture*> textures;
+		bool textures_dirty;
+
+		ENTITY_METHODS(LightmapEntity, LIGHTMAP, 15, 4);
+
+		LightmapEntity();
+		~LightmapEntity();
+		LightmapEntity& operator = (const LightmapEntity& other); //the textures are not shared
+
+		void configure(cJSON* json);
+		void serialize(cJSON* json);
+
+		//all the static nodes of the scene, it takes a while
+		void bake();
+		//tells every node of the scene its page and rect, once the prefabs are loaded
+		void assign();
+
+		bool load(const char* filename);
+		bool save(const char* filename);
+		void upload();
+		std::string getFullFilename();
+
+		//the uniforms of \lightmap for one node, lightmap can be NULL to disable it
+		static void bind(GFX::Shader* shader, LightmapEntity* lightmap, int page, const Vector4f& rect);
+
+	private:
+		struct sBakeNode {
+			Node* node;
+			Matrix44 model;
+			int entity;
+			int index;
+			int size; //of the uvs in the page, without padding
+			int x, y; //corner of the node in the page, with padding
+			int page;
+			Vector2f uv_min, uv_max;
+		};
+
+		struct sTexel {
+			Vector3f position;
+			Vector3f normal;
+			int node; //-1 when no triangle covers it
+		};
+
+		static void listNodes(Node* node, std::vector<Node*>& result);
+		void collectNodes(std::vector<sBakeNode>& result);
+		void packNodes(std::vector<sBakeNode>& bake_nodes, int& num_pages);
+		void rasterizeNode(const sBakeNode& bake_node, std::vector<sTexel>& texels);
+		void traceTexels(const SceneTracer& tracer, const std::vector<sTexel>& texels, std::vector<Vector3f>& direct, std::vector<Vector3f>& indirect);
+		void denoise(const std::vector<sTexel>& texels, std::vector<Vector3f>& indirect);
+		void dilate(const std::vector<sTexel>& texels, std::vector<Vector3f>& light);
+	};
+
+};
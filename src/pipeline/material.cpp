@@ -3,7 +3,9 @@
 
 #include "../core/includes.h"
 #include "../gfx/texture.h"
-#include "../gfx/shader.h"
+#ifndef SKIP_GL
+	#include "../gfx/shader.h"
+#endif
 
 using namespace SCN;
 
@@ -56,6 +58,7 @@ void Material::Release()
 	sMaterials.clear();
 }
 
+#ifndef SKIP_GL //the assets library does not render
 void Material::bind(GFX::Shader* shader) {
 	// First, configure the OpenGL state with the material settings =======================
 	{
@@ -130,3 +133,4 @@ void Material::bind(GFX::Shader* shader) {
 		//shader->setUniform("u_metallic", metallic_factor);
 	}
 }
+#endif
@@ -18,7 +18,7 @@ using namespace SCN;
 int Node::s_NodeID = 0;
 Node* Node::s_selected = nullptr;
 
-Node::Node() : parent(nullptr), mesh(nullptr), material(nullptr), visible(true)
+Node::Node() : visible(true), mesh(nullptr), material(nullptr), skinned_mesh(nullptr), lightmap_page(-1), parent(nullptr)
 {
 	m_Id = s_NodeID++;
 }
@@ -35,6 +35,9 @@ Node::~Node()
 	mesh = nullptr;
 	material = nullptr;
 
+	delete skinned_mesh;
+	skinned_mesh = nullptr;
+
 	if (s_selected == this)
 		s_selected = nullptr;
 }
@@ -133,10 +136,15 @@ void Node::operator = (const Node& node)
 
 	mesh = node.mesh;
 	material = node.material;
+	joints.clear(); //they point to the other tree
+	delete skinned_mesh;
+	skinned_mesh = nullptr;
 	name = node.name;
 	visible = node.visible;
 	model = node.model;
 	aabb = node.aabb;
+	lightmap_page = node.lightmap_page;
+	lightmap_rect = node.lightmap_rect;
 
 	//clone children
 	for (int i = 0; i < node.children.size(); ++i)
@@ -158,6 +166,8 @@ bool SCN::Node::isTransparent() const
 
 Prefab::Prefab()
 {
+	loading = false;
+	failed = false;
 }
 
 Prefab::~Prefab()
@@ -200,12 +210,35 @@ Prefab* Prefab::Get(const char* filename)
 	return prefab;
 }
 
+Prefab* Prefab::GetAsync(const char* filename)
+{
+	assert(filename);
+	std::map<std::string, Prefab*>::iterator it = sPrefabsLoaded.find(filename);
+	if (it != sPrefabsLoaded.end())
+		return it->second;
+
+	//registered now so the same file is not imported twice
+	Prefab* prefab = new Prefab();
+	prefab->registerPrefab(filename);
+	prefab->bounding = BoundingBox(Vector3f(0, 0, 0), Vector3f(0.5f, 0.5f, 0.5f)); //placeholder until the geometry is parsed
+	loadGLTFAsync(filename, prefab);
+	return prefab;
+}
+
 void Prefab::registerPrefab(std::string name)
 {
 	this->name = name;
 	sPrefabsLoaded[name] = this;
 }
 
+void Prefab::unregisterPrefab()
+{
+	auto it = sPrefabsLoaded.find(name);
+	if (it != sPrefabsLoaded.end() && it->second == this)
+		sPrefabsLoaded.erase(it);
+	name.clear();
+}
+
 Node* Prefab::getNodeByName(const char* name)
 {
 	auto it = nodes_by_name.find(name);
@@ -3,6 +3,7 @@
 #include <cassert>
 #include <map>
 #include <string>
+#include <vector>
 
 #include "../core/math.h"
 #include "material.h"
@@ -38,11 +39,19 @@ namespace SCN {
 		GFX::Mesh* mesh;
 		Material* material;
 
+		//skinned meshes
+		std::vector<Node*> joints; //nodes that move every bone of the mesh, found by name the first time
+		GFX::Mesh* skinned_mesh; //owned, result of the CPU skinning
+
 		Matrix44 model;	//the matrix that defines where is the object (in relation to its parent)
 		Matrix44 global_model;	//the matrix that defines where is the object (in relation to the world)
 
 		BoundingBox aabb; //node bounding box in world space
 
+		//baked by the LightmapEntity
+		int lightmap_page; //-1 when it has no lightmap
+		Vector4f lightmap_rect; //the uvs1 are scaled by xy and moved by zw to read the page
+
 		//info to create the tree
 		Node* parent;
 		std::vector<Node*> children;
@@ -78,6 +87,7 @@ namespace SCN {
 
 		bool testRay(const Ray& ray, Vector3f& result, int layers = 0xFF, float max_dist = 3.4e+38F);
 		Vector3f localToGlobal(Vector3f v) { return global_model * v; }
+		void localToGlobal(const Vector3f* points, Vector3f* result, size_t count) { transformPoints(global_model, points, result, count); }
 
 		void operator = (const Node& node);
 
@@ -99,6 +109,9 @@ namespace SCN {
 		Node root;
 		BoundingBox bounding;
 
+		bool loading; //still being imported in the background, the tree is not ready
+		bool failed; //the import failed, it is not registered anymore (like Get returning NULL)
+
 		//ctor and dtor
 		Prefab();
 		~Prefab();
@@ -110,7 +123,9 @@ namespace SCN {
 		//Manager to cache loaded prefabs
 		static std::map<std::string, Prefab*> sPrefabsLoaded;
 		static Prefab* Get(const char* filename);
+		static Prefab* GetAsync(const char* filename); //returns an empty prefab that is filled in the next frames
 		void registerPrefab(std::string name);
+		void unregisterPrefab();
 	};
 
 };
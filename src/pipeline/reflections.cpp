@@ -0,0 +1,533 @@
+#include "reflections.h"
+
+#include <cmath>
+#include <cstring>
+#include <chrono>
+#include <iostream>
+#include <algorithm>
+
+#include "camera.h"
+#include "prefab.h"
+#include "material.h"
+#include "irradiance.h"
+#include "lightmap.h"
+#include "../gfx/gfx.h"
+#include "../gfx/texture.h"
+#include "../gfx/shader.h"
+#include "../gfx/mesh.h"
+#include "../gfx/ibl.h"
+#include "../utils/utils.h"
+
+using namespace SCN;
+
+namespace {
+
+	struct sReflectionProbeHeader {
+		char signature[4];
+		int version;
+		int size;
+		int num_levels;
+		float position[3];
+	};
+
+	//cameras of the faces in GL order, the up vectors turn the image so its rows follow the texture coordinates of the cubemap
+	const Vector3f face_fronts[6] = { Vector3f(1, 0, 0), Vector3f(-1, 0, 0), Vector3f(0, 1, 0), Vector3f(0, -1, 0), Vector3f(0, 0, 1), Vector3f(0, 0, -1) };
+	const Vector3f face_ups[6] = { Vector3f(0, -1, 0), Vector3f(0, -1, 0), Vector3f(0, 0, 1), Vector3f(0, 0, -1), Vector3f(0, -1, 0), Vector3f(0, -1, 0) };
+
+	inline int getLevelSize(int size, int level)
+	{
+		return (std::max)(1, size >> level);
+	}
+
+	//RGBA halfs from the start of the file data to a face of a level, the levels one after the other and the faces inside
+	size_t getFaceOffset(int size, int level, int face)
+	{
+		size_t offset = 0;
+		for (int i = 0; i < level; ++i)
+			offset += (size_t)getLevelSize(size, i) * getLevelSize(size, i) * 4 * 6;
+		return offset + (size_t)getLevelSize(size, level) * getLevelSize(size, level) * 4 * face;
+	}
+
+	inline float getElapsed(std::chrono::steady_clock::time_point start)
+	{
+		return std::chrono::duration<float, std::milli>(std::chrono::steady_clock::now() - start).count();
+	}
+};
+
+ReflectionProbeEntity::ReflectionProbeEntity()
+{
+	radius = 20.0f;
+	falloff = 0.2f;
+	auto_update = true;
+	layer = -1;
+	ready = false;
+	capture_requested = false;
+	capture_step = 0;
+	last_capture_time = 0;
+}
+
+ReflectionProbeEntity::~ReflectionProbeEntity()
+{
+	ReflectionProbes::release(this);
+}
+
+ReflectionProbeEntity& ReflectionProbeEntity::operator = (const ReflectionProbeEntity& other)
+{
+	if (this == &other)
+		return *this;
+	ReflectionProbes::release(this);
+	BaseEntity::operator = (other);
+	radius = other.radius;
+	falloff = other.falloff;
+	auto_update = other.auto_update;
+	filename = other.filename;
+	captured_position = other.captured_position;
+	last_capture_time = other.last_capture_time;
+	//loaded or captured again in its own layer
+	layer = -1;
+	ready = false;
+	capture_requested = false;
+	capture_step = 0;
+	return *this;
+}
+
+void ReflectionProbeEntity::configure(cJSON* json)
+{
+	radius = (std::max)(0.001f, readJSONNumber(json, "radius", radius));
+	falloff = clamp(readJSONNumber(json, "falloff", falloff), 0.001f, 1.0f);
+	auto_update = readJSONBool(json, "auto_update", auto_update);
+	filename = readJSONString(json, "filename", filename.c_str());
+}
+
+void ReflectionProbeEntity::serialize(cJSON* json)
+{
+	writeJSONNumber(json, "radius", radius);
+	writeJSONNumber(json, "falloff", falloff);
+	writeJSONBool(json, "auto_update", auto_update);
+	if (filename.size())
+		writeJSONString(json, "filename", filename.c_str());
+}
+
+std::string ReflectionProbeEntity::getFullFilename()
+{
+	if (scene && scene->base_folder.size())
+		return scene->base_folder + "/" + filename;
+	return filename;
+}
+
+void ReflectionProbeEntity::capture()
+{
+	capture_requested = true;
+	capture_step = 0; //starts again if it was being captured
+}
+
+//into its layer, the cache is only valid for the current size of the probes
+bool ReflectionProbeEntity::load(const char* filename)
+{
+	ReflectionProbes& probes = ReflectionProbes::instance();
+	if (layer == -1 || !probes.probes_texture)
+		return false;
+
+	std::vector<unsigned char> buffer;
+	sReflectionProbeHeader header;
+	if (!readFileBin(filename, buffer) || buffer.size() < sizeof(header))
+		return false;
+	memcpy(&header, &buffer[0], sizeof(header));
+	if (memcmp(header.signature, "RPRB", 4) != 0 || header.version != REFLECTION_PROBE_VERSION || header.size != probes.size || header.num_levels != probes.num_levels)
+		return false;
+	size_t num_halfs = getFaceOffset(header.size, header.num_levels, 0);
+	if (buffer.size() < sizeof(header) + num_halfs * sizeof(uint16_t))
+		return false;
+
+	uint16_t* data = (uint16_t*)&buffer[sizeof(header)];
+	for (int level = 0; level < header.num_levels; ++level)
+	{
+		Uint8* faces[6];
+		for (int face = 0; face < 6; ++face)
+			faces[face] = (Uint8*)(data + getFaceOffset(header.size, level, face));
+		probes.probes_texture->uploadCubemapArray(layer, faces, GL_RGBA, GL_HALF_FLOAT, level);
+	}
+	captured_position.set(header.position[0], header.position[1], header.position[2]);
+	ready = true;
+	return true;
+}
+
+bool ReflectionProbeEntity::save(const char* filename, const std::vector<uint16_t>& pixels)
+{
+	ReflectionProbes& probes = ReflectionProbes::instance();
+	if (pixels.size() != getFaceOffset(probes.size, probes.num_levels, 0))
+		return false;
+
+	sReflectionProbeHeader header;
+	memset(&header, 0, sizeof(header));
+	memcpy(header.signature, "RPRB", 4);
+	header.version = REFLECTION_PROBE_VERSION;
+	header.size = probes.size;
+	header.num_levels = probes.num_levels;
+	header.position[0] = captured_position.x;
+	header.position[1] = captured_position.y;
+	header.position[2] = captured_position.z;
+
+	FILE* file = fopen(filename, "wb");
+	if (file == NULL)
+		return false;
+	fwrite(&header, 1, sizeof(header), file);
+	fwrite(&pixels[0], sizeof(uint16_t), pixels.size(), file);
+	fclose(file);
+	return true;
+}
+
+ReflectionProbes::ReflectionProbes()
+{
+	is_active = true;
+	size = 128;
+	num_levels = 0;
+	budget_ms = 1.0f;
+	capture_texture = nullptr;
+	probes_texture = nullptr;
+	prefilter_fbo = 0;
+	capturing = nullptr;
+	memset(layers, 0, sizeof(layers));
+	steps = 0;
+	capture_time = 0;
+}
+
+//also when the size changes, the probes lose their layers and are loaded or captured again
+void ReflectionProbes::createTextures()
+{
+	num_levels = (std::min)(REFLECTION_PROBE_LEVELS, (int)log2f((float)size) + 1);
+
+	if (!capture_texture)
+		capture_texture = new GFX::Texture();
+	capture_texture->createCubemap(size, size, NULL, GL_RGBA, GL_HALF_FLOAT, true, GL_RGBA16F);
+
+	if (!probes_texture)
+		probes_texture = new GFX::Texture();
+	probes_texture->createCubemapArray(size, MAX_REFLECTION_PROBES, num_levels, GL_RGBA16F);
+
+	if (!prefilter_fbo)
+		glGenFramebuffers(1, &prefilter_fbo);
+
+	for (int i = 0; i < MAX_REFLECTION_PROBES; ++i)
+		if (layers[i])
+			release(layers[i]);
+}
+
+void ReflectionProbes::release(ReflectionProbeEntity* probe)
+{
+	ReflectionProbes& rp = instance();
+	if (probe->layer >= 0 && probe->layer < MAX_REFLECTION_PROBES && rp.layers[probe->layer] == probe)
+		rp.layers[probe->layer] = nullptr;
+	rp.blended.erase(std::remove(rp.blended.begin(), rp.blended.end(), probe), rp.blended.end());
+	if (rp.capturing == probe)
+	{
+		rp.capturing = nullptr;
+		rp.capture_commands.clear();
+		rp.capture_boxes.clear();
+		probe->capture_step = 0;
+	}
+	probe->layer = -1;
+	probe->ready = false;
+}
+
+//a free layer, or the layer of a probe that is not in the scene this frame
+bool ReflectionProbes::assignLayer(ReflectionProbeEntity* probe, const std::vector<ReflectionProbeEntity*>& probes)
+{
+	int free_layer = -1;
+	for (int i = 0; i < MAX_REFLECTION_PROBES && free_layer == -1; ++i)
+		if (!layers[i])
+			free_layer = i;
+	for (int i = 0; i < MAX_REFLECTION_PROBES && free_layer == -1; ++i)
+		if (std::find(probes.begin(), probes.end(), layers[i]) == probes.end())
+		{
+			release(layers[i]);
+			free_layer = i;
+		}
+	if (free_layer == -1)
+		return false;
+
+	layers[free_layer] = probe;
+	probe->layer = free_layer;
+	probe->ready = false;
+	return true;
+}
+
+void ReflectionProbes::collectNodes(Node* node)
+{
+	if (!node->visible)
+		return;
+
+	for (Node* child : node->children)
+		collectNodes(child);
+
+	//the transparent surfaces and the characters are not part of the environment
+	if (!node->mesh || !node->material || node->isTransparent() || node->mesh->bones_info.size())
+		return;
+
+	s_DrawCommand command{ node->getGlobalMatrix(), node->mesh, node->material };
+	command.lightmap_page = node->lightmap_page;
+	command.lightmap_rect = node->lightmap_rect;
+	capture_commands.push_back(command);
+	capture_boxes.push_back(node->aabb);
+}
+
+void ReflectionProbes::renderFace(Renderer* renderer, Camera* camera, ReflectionProbeEntity* probe, int face)
+{
+	if (face == 0)
+	{
+		probe->captured_position = probe->root.getGlobalMatrix().getTranslation();
+		probe->last_capture_time = 0;
+		capture_commands.clear();
+		capture_boxes.clear();
+		capture_pixels.clear();
+		for (BaseEntity* entity : renderer->scene->entities)
+			if (entity->visible && entity->getType() == eEntityType::PREFAB)
+				collectNodes(&entity->root);
+	}
+
+	Camera face_camera;
+	face_camera.lookAt(probe->captured_position, probe->captured_position + face_fronts[face], face_ups[face]);
+	face_camera.setPerspective(90.0f, 1.0f, camera->near_plane, camera->far_plane);
+
+	capture_fbo.setTexture(capture_texture, face);
+	capture_fbo.bind();
+
+	//the alpha stays 0 where the sky is seen
+	glClearColor(0.0f, 0.0f, 0.0f, 0.0f);
+	glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+	glEnable(GL_DEPTH_TEST);
+	glDepthFunc(GL_LESS);
+
+	GFX::Shader* shader = GFX::Shader::Get("reflection_probe_capture");
+	if (shader)
+	{
+		shader->enable();
+
+		shader->setUniform("u_viewprojection", face_camera.viewprojection_matrix);
+		shader->setUniform("u_camera_position", face_camera.eye);
+		shader->setUniform("u_time", (float)getTime());
+
+		renderer->light_info.bind(shader);
+		renderer->shadow_info.bindShadowAtlasPositions(shader, renderer->light_info.shadow_lights_idxs);
+		shader->setTexture("u_shadow_atlas", renderer->shadow_info.shadow_atlas->depth_texture, 8);
+		shader->setUniform("u_shadow_atlas_dims", renderer->shadow_info.shadow_atlas_dims);
+
+		shader->setUniform("u_lgc_active", (int)renderer->linear_gamma_correction);
+
+		GFX::IBL::bind(shader, renderer->use_ibl ? renderer->ibl : nullptr);
+		IrradianceVolumeEntity::bind(shader, renderer->use_irradiance ? renderer->irradiance_volume : nullptr);
+		bind(shader, false);
+
+		for (size_t i = 0; i < capture_commands.size(); ++i)
+		{
+			if (face_camera.testBoxInFrustum(capture_boxes[i].center, capture_boxes[i].halfsize) == CLIP_OUTSIDE)
+				continue;
+			s_DrawCommand& command = capture_commands[i];
+			command.material->bind(shader);
+			LightmapEntity::bind(shader, renderer->use_lightmaps ? renderer->lightmap : nullptr, command.lightmap_page, command.lightmap_rect);
+			shader->setUniform("u_model", command.model);
+			command.mesh->render(GL_TRIANGLES);
+		}
+
+		shader->disable();
+	}
+
+	glDisable(GL_BLEND);
+	glDisable(GL_CULL_FACE);
+	capture_fbo.unbind();
+}
+
+//all the levels of one face of the layer, the first face builds the mips of the capture
+void ReflectionProbes::prefilterFace(ReflectionProbeEntity* probe, int face)
+{
+	if (face == 0)
+	{
+		capture_texture->generateMipmaps();
+		capture_commands.clear();
+		capture_boxes.clear();
+	}
+
+	GFX::Shader* shader = GFX::Shader::Get("reflection_probe_prefilter");
+	if (!shader)
+		return;
+
+	//reading the pixels stalls a little, but only once per capture and when the probe is cached
+	bool read_back = probe->filename.size() > 0;
+	if (read_back && face == 0)
+		capture_pixels.resize(getFaceOffset(size, num_levels, 0));
+
+	GLint viewport[4];
+	glGetIntegerv(GL_VIEWPORT, viewport);
+	glBindFramebuffer(GL_FRAMEBUFFER, prefilter_fbo);
+	glDisable(GL_DEPTH_TEST);
+	glDisable(GL_BLEND);
+	glDisable(GL_CULL_FACE);
+
+	shader->enable();
+	shader->setTexture("u_texture", capture_texture, 0);
+	shader->setUniform("u_face", face);
+	shader->setUniform("u_size", (float)size);
+	shader->setUniform("u_samples", REFLECTION_PROBE_SAMPLES);
+
+	GFX::Mesh* quad = GFX::Mesh::getQuad();
+	for (int level = 0; level < num_levels; ++level)
+	{
+		int level_size = getLevelSize(size, level);
+		glFramebufferTextureLayer(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, probes_texture->texture_id, level, probe->layer * 6 + face);
+		glViewport(0, 0, level_size, level_size);
+		shader->setUniform("u_roughness", num_levels > 1 ? level / (float)(num_levels - 1) : 0.0f);
+		quad->render(GL_TRIANGLES);
+		if (read_back)
+			glReadPixels(0, 0, level_size, level_size, GL_RGBA, GL_HALF_FLOAT, &capture_pixels[getFaceOffset(size, level, face)]);
+	}
+
+	shader->disable();
+	glBindFramebuffer(GL_FRAMEBUFFER, 0);
+	glViewport(viewport[0], viewport[1], viewport[2], viewport[3]);
+	glEnable(GL_DEPTH_TEST);
+}
+
+void ReflectionProbes::finishCapture(ReflectionProbeEntity* probe)
+{
+	probe->ready = true;
+	probe->capture_requested = false;
+	probe->capture_step = 0;
+	capturing = nullptr;
+
+	if (probe->filename.size())
+	{
+		if (!probe->save(probe->getFullFilename().c_str(), capture_pixels))
+			std::cout << " - ERROR: cannot save the reflection probe: " << TermColor::RED << probe->filename << TermColor::DEFAULT << std::endl;
+		capture_pixels.clear();
+	}
+	std::cout << " + Reflection probe captured in " << probe->last_capture_time << "ms (CPU)" << std::endl;
+}
+
+void ReflectionProbes::update(Renderer* renderer, const std::vector<ReflectionProbeEntity*>& probes, Camera* camera, bool can_capture)
+{
+	ReflectionProbes& rp = instance();
+	rp.blended.clear();
+	rp.steps = 0;
+	rp.capture_time = 0;
+	if (!rp.is_active || probes.empty())
+		return;
+
+	if (!rp.probes_texture || (int)rp.probes_texture->width != rp.size)
+		rp.createTextures();
+
+	//the closest to the camera are loaded, captured and blended before the rest
+	std::vector<ReflectionProbeEntity*> sorted = probes;
+	Vector3f eye = camera->eye;
+	std::sort(sorted.begin(), sorted.end(), [&eye](ReflectionProbeEntity* a, ReflectionProbeEntity* b) {
+		return a->root.getGlobalMatrix().getTranslation().distance(eye) - a->radius < b->root.getGlobalMatrix().getTranslation().distance(eye) - b->radius;
+	});
+
+	for (ReflectionProbeEntity* probe : sorted)
+	{
+		if (probe->layer == -1)
+		{
+			if (!rp.assignLayer(probe, probes))
+				continue;
+			if (!probe->filename.size() || !probe->load(probe->getFullFilename().c_str()))
+				probe->capture_requested = true;
+		}
+		Vector3f position = probe->root.getGlobalMatrix().getTranslation();
+		if (probe->auto_update && probe->ready && !probe->capture_requested && position.distance(probe->captured_position) > 0.001f)
+			probe->capture();
+	}
+
+	//the scene is not captured until everything is loaded, the cache would keep the holes
+	if (can_capture)
+	{
+		auto start = std::chrono::steady_clock::now();
+		do {
+			if (!rp.capturing)
+			{
+				for (ReflectionProbeEntity* probe : sorted)
+					if (probe->layer != -1 && probe->capture_requested)
+					{
+						rp.capturing = probe;
+						probe->capture_step = 0;
+						break;
+					}
+				if (!rp.capturing)
+					break;
+			}
+
+			ReflectionProbeEntity* probe = rp.capturing;
+			auto step_start = std::chrono::steady_clock::now();
+			if (probe->capture_step < 6)
+				rp.renderFace(renderer, camera, probe, probe->capture_step);
+			else
+				rp.prefilterFace(probe, probe->capture_step - 6);
+			probe->capture_step++;
+			probe->last_capture_time += getElapsed(step_start);
+			rp.steps++;
+
+			if (probe->capture_step == REFLECTION_PROBE_STEPS)
+				rp.finishCapture(probe);
+			rp.capture_time = getElapsed(start);
+		} while (rp.capture_time < rp.budget_ms);
+	}
+
+	for (ReflectionProbeEntity* probe : sorted)
+	{
+		if (rp.blended.size() == MAX_BLENDED_PROBES)
+			break;
+		if (probe->ready && probe->layer != -1)
+			rp.blended.push_back(probe);
+	}
+}
+
+void ReflectionProbes::bind(GFX::Shader* shader, bool enabled)
+{
+	ReflectionProbes& rp = instance();
+	int count = enabled && rp.is_active && rp.probes_texture ? (int)rp.blended.size() : 0;
+	shader->setUniform("u_probes_count", count);
+	if (!count)
+	{
+		//the samplers of different types cannot share the unit 0
+		shader->setUniform("u_probes_texture", 4);
+		return;
+	}
+
+	//where they were captured, the parallax is corrected from there
+	float spheres[MAX_BLENDED_PROBES * 4];
+	float info[MAX_BLENDED_PROBES * 2];
+	for (int i = 0; i < count; ++i)
+	{
+		ReflectionProbeEntity* probe = rp.blended[i];
+		spheres[i * 4 + 0] = probe->captured_position.x;
+		spheres[i * 4 + 1] = probe->captured_position.y;
+		spheres[i * 4 + 2] = probe->captured_position.z;
+		spheres[i * 4 + 3] = probe->radius;
+		info[i * 2 + 0] = (float)probe->layer;
+		info[i * 2 + 1] = probe->falloff;
+	}
+	shader->setUniform4Array("u_probes_spheres", spheres, count);
+	shader->setUniform2Array("u_probes_info", info, count);
+	shader->setUniform("u_probes_max_lod", (float)(rp.num_levels - 1));
+	shader->setTexture("u_probes_texture", rp.probes_texture, 4);
+	//the probes use the split sum also without IBL
+	shader->setTexture("u_ibl_brdf_lut", GFX::IBL::getBRDFLUT(), 7);
+}
+
+void ReflectionProbes::showUI()
+{
+#ifndef SKIP_IMGUI
+	ReflectionProbes& rp = instance();
+
+	ImGui::Checkbox("Reflection probes", &rp.is_active);
+	if (rp.is_active) {
+		if (ImGui::TreeNode("Reflection probes settings")) {
+			int exponent = (int)log2f((float)rp.size);
+			if (ImGui::SliderInt("Size exponent", &exponent, 4, 9))
+				rp.size = 1 << exponent;
+			ImGui::SliderFloat("Budget (ms)", &rp.budget_ms, 0.1f, 16.0f);
+			ImGui::Text("%d blended, %d capture steps in %.2fms", (int)rp.blended.size(), rp.steps, rp.capture_time);
+
+			ImGui::TreePop();
+		}
+	}
+#endif
+}
@@ -0,0 +1,116 @@
+/*  Reflection probes: the scene captured in a cubemap from some points, the glossy reflections that SSR cannot see
+	+ the GPU captures a probe a few steps per frame (a face rendered or a face prefiltered) until the time budget is spent
+	+ prefiltered with GGX in the GPU, one roughness per mip like the IBL, so the shaders use the same split sum
+	+ all the probes live in the layers of one cubemap array, the prefiltered cubemaps are cached to disk as half floats
+	+ the lighting reads the probes closest to the camera and blends them by distance (with a sphere parallax),
+	  the alpha of the capture marks the sky, where the IBL is used instead
+*/
+#pragma once
+
+#include <string>
+#include <vector>
+#include <cstdint>
+
+#include "scene.h"
+#include "renderer.h"
+#include "../gfx/fbo.h"
+
+#define REFLECTION_PROBE_VERSION 1
+#define REFLECTION_PROBE_LEVELS 6
+#define REFLECTION_PROBE_SAMPLES 64
+#define REFLECTION_PROBE_STEPS 12 //6 faces rendered and 6 faces prefiltered
+
+class Camera;
+
+namespace GFX {
+	class Texture;
+	class Shader;
+}
+
+namespace SCN {
+
+	const int MAX_REFLECTION_PROBES = 16; //layers of the cubemap array
+	const int MAX_BLENDED_PROBES = 4; //read by the shaders
+
+	class ReflectionProbeEntity : public BaseEntity
+	{
+	public:
+		float radius; //of influence, also the sphere used to correct the parallax
+		float falloff; //part of the radius where it fades out
+		bool auto_update; //captured again when it moves
+		std::string filename; //of the prefiltered cubemap, relative to the folder of the scene
+
+		//state of the capture
+		int layer; //in the cubemap array, -1 when it has none
+		bool ready; //the layer has the whole prefiltered cubemap
+		bool capture_requested;
+		int capture_step; //next step, from 0 to REFLECTION_PROBE_STEPS
+		Vector3f captured_position;
+		float last_capture_time; //ms of the CPU, summing all the frames
+
+		ENTITY_METHODS(ReflectionProbeEntity, REFLECTION_PROBE, 13, 4);
+
+		ReflectionProbeEntity();
+		~ReflectionProbeEntity();
+		ReflectionProbeEntity& operator = (const ReflectionProbeEntity& other); //the layer is not shared
+
+		void configure(cJSON* json);
+		void serialize(cJSON* json);
+
+		//captured again in the next frames
+		void capture();
+
+		bool load(const char* filename);
+		bool save(const char* filename, const std::vector<uint16_t>& pixels);
+		std::string getFullFilename();
+	};
+
+	class ReflectionProbes {
+	private:
+		ReflectionProbes();
+
+	public:
+		static ReflectionProbes& instance()
+		{
+			static ReflectionProbes INSTANCE;
+			return INSTANCE;
+		}
+
+		bool is_active;
+		int size; //of the faces
+		int num_levels;
+		float budget_ms; //per frame, at least one step is done every frame
+
+		GFX::Texture* capture_texture; //cubemap of the probe being captured, its mips are read by the prefilter
+		GFX::Texture* probes_texture; //cubemap array, one layer per probe
+		GFX::FBO capture_fbo;
+		GLuint prefilter_fbo;
+
+		ReflectionProbeEntity* layers[MAX_REFLECTION_PROBES]; //owner of every layer
+		ReflectionProbeEntity* capturing;
+		std::vector<s_DrawCommand> capture_commands; //opaque nodes without skinning, collected when a capture starts
+		std::vector<BoundingBox> capture_boxes; //world box of every command
+		std::vector<uint16_t> capture_pixels; //read back while prefiltering, only when the probe has a filename
+		std::vector<ReflectionProbeEntity*> blended; //this frame, the closest to the camera first
+
+		//stats of the last frame
+		int steps;
+		float capture_time;
+
+		//loads or captures the probes of this frame and chooses the ones blended, after the shadowmaps
+		static void update(Renderer* renderer, const std::vector<ReflectionProbeEntity*>& probes, Camera* camera, bool can_capture);
+		//the uniforms of \reflection_probes, disabled while capturing
+		static void bind(GFX::Shader* shader, bool enabled = true);
+		static void release(ReflectionProbeEntity* probe); //frees its layer
+		static void showUI();
+
+	private:
+		void createTextures();
+		bool assignLayer(ReflectionProbeEntity* probe, const std::vector<ReflectionProbeEntity*>& probes);
+		void collectNodes(Node* node);
+		void renderFace(Renderer* renderer, Camera* camera, ReflectionProbeEntity* probe, int face);
+		void prefilterFace(ReflectionProbeEntity* probe, int face);
+		void finishCapture(ReflectionProbeEntity* probe);
+	};
+
+};
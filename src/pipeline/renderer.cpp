@@ -8,6 +8,10 @@
 #include "../gfx/mesh.h"
 #include "../gfx/texture.h"
 #include "../gfx/fbo.h"
+#include "../gfx/uploader.h"
+#include "../gfx/streamer.h"
+#include "../gfx/profiler.h"
+#include "../gfx/ibl.h"
 #include "../pipeline/prefab.h"
 #include "../pipeline/material.h"
 #include "../pipeline/animation.h"
@@ -19,6 +23,12 @@
 #include "ssao.h"
 #include "volumetric.h"
 #include "ssr.h"
+#include "skinning.h"
+#include "animator.h"
+#include "crowd.h"
+#include "irradiance.h"
+#include "reflections.h"
+#include "lightmap.h"
 
 using namespace SCN;
 
@@ -31,6 +41,9 @@ Renderer::Renderer(const char* shader_atlas_filename)
 	render_boundaries = false;
 	scene = nullptr;
 	skybox_cubemap = nullptr;
+	ibl = nullptr;
+	irradiance_volume = nullptr;
+	lightmap = nullptr;
 
 	if (!GFX::Shader::LoadAtlas(shader_atlas_filename))
 		exit(1);
@@ -43,7 +56,7 @@ Renderer::Renderer(const char* shader_atlas_filename)
 
 	gbuffer_fbo.create(win_size.x,
 		win_size.y,
-		2, // Create two textures to render to
+		3, // Create three textures to render to (color, normal and the lightmap)
 		GL_RGBA, // Each texture has an R G B and A channels
 		GL_UNSIGNED_BYTE, // Uses 8 bits per channel
 		true); // Stores the depth, to a texture
@@ -79,15 +92,41 @@ void Renderer::setupScene()
 		skybox_cubemap = GFX::Texture::Get(std::string(scene->base_folder + "/" + scene->skybox_filename).c_str());
 	else
 		skybox_cubemap = nullptr;
+
+	//baked once per environment, then read from the cache
+	if (scene->skybox_filename.size() && toLowerCase(getExtension(scene->skybox_filename)) == "hdre")
+		ibl = GFX::IBL::Get(std::string(scene->base_folder + "/" + scene->skybox_filename).c_str());
+	else
+		ibl = nullptr;
 }
 
-void Renderer::parseNodes(SCN::Node* node, Camera* cam)
+// tells the texture streamer the mip needed by the textures of a visible node
+// from the UV density of the mesh and the size of one pixel at the distance of its bounding box
+static void requestTextureMips(SCN::Node* node, const Matrix44& model, Camera* cam)
+{
+	if (!node->material || !GFX::TextureStreamer::instance().is_active)
+		return;
+
+	float uv_per_pixel = 0;
+	if (cam->type == Camera::PERSPECTIVE) {
+		Vector3f scale = model.getScale();
+		float max_scale = (std::max)({ fabs(scale.x), fabs(scale.y), fabs(scale.z), 0.0001f });
+		float dist = (std::max)(cam->near_plane, node->aabb.center.distance(cam->eye) - node->aabb.halfsize.length());
+		float world_per_pixel = 2.0f * dist * tan(cam->fov * 0.5f * (float)DEG2RAD) / CORE::BaseApplication::instance->window_height;
+		uv_per_pixel = node->mesh->getUVDensity() * world_per_pixel / max_scale;
+	}
+
+	for (int i = 0; i < eTextureChannel::ALL; ++i)
+		GFX::TextureStreamer::requestMip(node->material->textures[i].texture, uv_per_pixel);
+}
+
+void Renderer::parseNodes(SCN::Node* node, Camera* cam, SCN::CharacterEntity* character)
 {
 	if (!node) return;
 
 	// parse all nodes including children
 	for (SCN::Node* child : node->children) {
-		parseNodes(child, cam);
+		parseNodes(child, cam, character);
 	}
 
 	if (!node->mesh) return;
@@ -106,6 +145,21 @@ void Renderer::parseNodes(SCN::Node* node, Camera* cam)
 			node->mesh,
 			node->material
 	};
+	draw_command.lightmap_page = node->lightmap_page;
+	draw_command.lightmap_rect = node->lightmap_rect;
+
+	requestTextureMips(node, draw_command.model, cam);
+
+	// skinned meshes are deformed by the pose of their joints, or by the pose of the character computed by the Animator
+	if (node->mesh->bones_info.size() && node->mesh->bones.size() && node->mesh->weights.size() && Skinning::instance().is_active) {
+		draw_command.bones = character ? character->getBones(node) : nullptr;
+		if (!draw_command.bones)
+			draw_command.bones = Skinning::computeBones(node);
+		if (Skinning::instance().method == Skinning::CPU) {
+			draw_command.mesh = Skinning::addJob(node, draw_command.bones);
+			draw_command.bones = nullptr;
+		}
+	}
 
 	// start transparencies
 	if (node->isTransparent()) {
@@ -124,11 +178,11 @@ void SCN::Renderer::fillGBuffer()
 	glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
 
 	for (s_DrawCommand& command : draw_commands_opaque) {
-		renderMeshWithMaterial(command.model, command.mesh, command.material);
+		renderMeshWithMaterial(command.model, command.mesh, command.material, command.bones, command.lightmap_page, command.lightmap_rect, command.crowd);
 	}
 
 	for (s_DrawCommand& command : draw_commands_transp) {
-		renderMeshWithMaterial(command.model, command.mesh, command.material);
+		renderMeshWithMaterial(command.model, command.mesh, command.material, command.bones, command.lightmap_page, command.lightmap_rect, command.crowd);
 	}
 
 	gbuffer_fbo.unbind();
@@ -152,6 +206,7 @@ void SCN::Renderer::fillLightingFBOMultipass(SCN::Scene* scene, Camera* camera)
 	shader->setTexture("u_gbuffer_color", gbuffer_fbo.color_textures[0], 9);
 	shader->setTexture("u_gbuffer_normal", gbuffer_fbo.color_textures[1], 10);
 	shader->setTexture("u_gbuffer_depth", gbuffer_fbo.depth_texture, 11);
+	shader->setTexture("u_gbuffer_lightmap", gbuffer_fbo.color_textures[2], 13);
 
 	shader->setUniform("u_res_inv",
 		vec2(1.0f / CORE::BaseApplication::instance->window_width,
@@ -202,6 +257,7 @@ void SCN::Renderer::fillLightingFBOMultipass(SCN::Scene* scene, Camera* camera)
 	shader->setTexture("u_gbuffer_color", gbuffer_fbo.color_textures[0], 9);
 	shader->setTexture("u_gbuffer_normal", gbuffer_fbo.color_textures[1], 10);
 	shader->setTexture("u_gbuffer_depth", gbuffer_fbo.depth_texture, 11);
+	shader->setTexture("u_gbuffer_lightmap", gbuffer_fbo.color_textures[2], 13);
 
 	shader->setUniform("u_res_inv",
 		vec2(1.0f / CORE::BaseApplication::instance->window_width,
@@ -284,6 +340,7 @@ void SCN::Renderer::fillLightingFBOSinglepass(SCN::Scene* scene, Camera* camera)
 	shader->setTexture("u_gbuffer_color", gbuffer_fbo.color_textures[0], 9);
 	shader->setTexture("u_gbuffer_normal", gbuffer_fbo.color_textures[1], 10);
 	shader->setTexture("u_gbuffer_depth", gbuffer_fbo.depth_texture, 11);
+	shader->setTexture("u_gbuffer_lightmap", gbuffer_fbo.color_textures[2], 13);
 
 	shader->setUniform("u_res_inv",
 		vec2(1.0f / CORE::BaseApplication::instance->window_width,
@@ -302,6 +359,12 @@ void SCN::Renderer::fillLightingFBOSinglepass(SCN::Scene* scene, Camera* camera)
 
 	shader->setUniform("u_lgc_active", (int)linear_gamma_correction);
 
+	if (reflectance_model == PBR) {
+		GFX::IBL::bind(shader, use_ibl ? ibl : nullptr);
+		IrradianceVolumeEntity::bind(shader, use_irradiance ? irradiance_volume : nullptr);
+		ReflectionProbes::bind(shader);
+	}
+
 	SSAO::bind(shader);
 
 	ScreenSpaceReflections::bind(shader);
@@ -367,6 +430,14 @@ void Renderer::parseSceneEntities(SCN::Scene* scene, Camera* cam)
 	draw_commands_transp.clear();
 	
 	light_info.clear();
+	irradiance_volume = nullptr;
+	lightmap = nullptr;
+	reflection_probes.clear();
+	prefabs_pending = false;
+
+	Skinning::beginFrame();
+
+	std::vector<CharacterEntity*> characters;
 
 	for (int i = 0; i < scene->entities.size(); i++) {
 		BaseEntity* entity = scene->entities[i];
@@ -382,10 +453,46 @@ void Renderer::parseSceneEntities(SCN::Scene* scene, Camera* cam)
 			// once we know it is a PREFAB entity perform static cast
 			PrefabEntity* prefab_entity = static_cast<PrefabEntity*>(entity);
 
+			// the prefab may have finished loading in the background
+			prefab_entity->updatePrefab();
+			prefabs_pending |= prefab_entity->prefab_pending;
+
 			// parse all nodes (including children)
 			parseNodes(&prefab_entity->root, cam);
 			break;
 		}
+		case eEntityType::CHARACTER:
+		{
+			// parsed once the Animator has their poses
+			CharacterEntity* character = static_cast<CharacterEntity*>(entity);
+			character->updatePrefab();
+			prefabs_pending |= character->prefab_pending;
+			characters.push_back(character);
+			break;
+		}
+		case eEntityType::CROWD:
+		{
+			// all the visible instances in one draw call, the vertices are animated by the shader
+			// drawn even when none is visible, the shadows cull the instances against the lights
+			CrowdEntity* crowd = static_cast<CrowdEntity*>(entity);
+			crowd->update(frustum_culling ? cam : nullptr);
+			if (crowd->vertex_animation.isEmpty() || crowd->models.empty())
+				break;
+			Node* node = crowd->getSkinnedNode();
+			if (!node)
+				break;
+			s_DrawCommand draw_command{
+					crowd->root.getGlobalMatrix(),
+					node->mesh,
+					node->material
+			};
+			draw_command.crowd = crowd;
+			if (node->isTransparent())
+				draw_commands_transp.push_back(draw_command);
+			else
+				draw_commands_opaque.push_back(draw_command);
+			break;
+		}
 		case eEntityType::LIGHT:
 		{
 			// Store Lights
@@ -395,11 +502,46 @@ void Renderer::parseSceneEntities(SCN::Scene* scene, Camera* cam)
 			light_info.add_light(light);
 			break;
 		}
+		case eEntityType::IRRADIANCE_VOLUME:
+		{
+			if (!irradiance_volume)
+				irradiance_volume = static_cast<IrradianceVolumeEntity*>(entity);
+			break;
+		}
+		case eEntityType::REFLECTION_PROBE:
+		{
+			reflection_probes.push_back(static_cast<ReflectionProbeEntity*>(entity));
+			break;
+		}
+		case eEntityType::LIGHTMAP:
+		{
+			if (!lightmap)
+				lightmap = static_cast<LightmapEntity*>(entity);
+			break;
+		}
 		default:
 			break;
 		}
 	}
 
+	// sample the clips of all the characters at once, their clocks were advanced by the update of the app
+	Animator::update(characters, cam);
+	for (CharacterEntity* character : characters)
+		parseNodes(&character->root, cam, character);
+
+	// deform all the meshes skinned in the CPU at once
+	Skinning::skinJobs();
+
+	// bake the probes once the scene is loaded, then only the ones affected by what changes (in the background, swapped in when done)
+	if (irradiance_volume && !prefabs_pending) {
+		if (irradiance_volume->isBaking() || irradiance_volume->probes.empty() || (irradiance_volume->auto_update && irradiance_volume->hasChanged()))
+			irradiance_volume->update();
+	}
+
+	// the nodes of the prefabs find their place in the lightmap once they are loaded (the next frame they are drawn with it)
+	if (lightmap && !prefabs_pending && !lightmap->assigned)
+		lightmap->assign();
+
 	// camera eye is used to sort both opaque and transparent entities
 	Vector3f ce = cam->eye;
 
@@ -419,9 +561,18 @@ void Renderer::renderScene(SCN::Scene* scene, Camera* camera)
 	this->scene = scene;
 	setupScene();
 
+	GFX::Profiler::begin("Parse");
 	parseSceneEntities(scene, camera);
+	GFX::Profiler::end();
 	
+	GFX::Profiler::begin("Shadows");
 	shadow_info.generateShadowMaps(draw_commands_opaque, draw_commands_transp, light_info, front_face_culling_on);
+	GFX::Profiler::end();
+
+	// the probes are captured a few faces per frame, with the lights and shadows of this frame
+	GFX::Profiler::begin("Probes");
+	ReflectionProbes::update(this, reflection_probes, camera, !prefabs_pending);
+	GFX::Profiler::end();
 
 	//set the clear color (the background color)
 	glClearColor(scene->background_color.x, scene->background_color.y, scene->background_color.z, 1.0);
@@ -432,10 +583,18 @@ void Renderer::renderScene(SCN::Scene* scene, Camera* camera)
 
 	//render skybox
 	if (skybox_cubemap)
+	{
+		GFX::Profiler::begin("Skybox");
 		renderSkybox(skybox_cubemap);
+		GFX::Profiler::end();
+	}
 
 	if (pipeline_mode == FORWARD)
+	{
+		GFX::Profiler::begin("Forward");
 		renderSceneForward(scene, camera);
+		GFX::Profiler::end();
+	}
 	else if (pipeline_mode == DEFERRED)
 		renderSceneDeferred(scene, camera);
 	else
@@ -446,26 +605,35 @@ void SCN::Renderer::renderSceneForward(SCN::Scene* scene, Camera* camera)
 {
 	// first render opaque entities
 	for (s_DrawCommand& command : draw_commands_opaque) {
-		renderMeshWithMaterial(command.model, command.mesh, command.material);
+		renderMeshWithMaterial(command.model, command.mesh, command.material, command.bones, command.lightmap_page, command.lightmap_rect, command.crowd);
 	}
 
 	// then render transparent entities
 	for (s_DrawCommand& command : draw_commands_transp) {
-		renderMeshWithMaterial(command.model, command.mesh, command.material);
+		renderMeshWithMaterial(command.model, command.mesh, command.material, command.bones, command.lightmap_page, command.lightmap_rect, command.crowd);
 	}
 }
 
 void SCN::Renderer::renderSceneDeferred(SCN::Scene* scene, Camera* camera)
 {
 	// compute SSR first pass before gbuffer is overwritten in current iteration (unless first iteration)
+	GFX::Profiler::begin("SSR");
 	ScreenSpaceReflections::fill(scene, gbuffer_fbo, final_frame, linear_gamma_correction);
+	GFX::Profiler::end();
 
+	GFX::Profiler::begin("GBuffer");
 	fillGBuffer();
+	GFX::Profiler::end();
 
+	GFX::Profiler::begin("SSAO");
 	SSAO::compute(scene, gbuffer_fbo);
+	GFX::Profiler::end();
 	
+	GFX::Profiler::begin("Volumetric");
 	VolumetricRendering::compute(scene, gbuffer_fbo, light_info, shadow_info, linear_gamma_correction);
+	GFX::Profiler::end();
 
+	GFX::Profiler::begin("Lighting");
 	gbuffer_fbo.depth_texture->copyTo(lighting_fbo.depth_texture);
 
 	lighting_fbo.bind();
@@ -485,8 +653,11 @@ void SCN::Renderer::renderSceneDeferred(SCN::Scene* scene, Camera* camera)
 	}
 
 	lighting_fbo.unbind();
+	GFX::Profiler::end();
 
+	GFX::Profiler::begin("Display");
 	displayScene(scene);
+	GFX::Profiler::end();
 }
 
 
@@ -531,7 +702,7 @@ void Renderer::renderSkybox(GFX::Texture* cubemap)
 }
 
 // Renders a mesh given its transform and material
-void Renderer::renderMeshWithMaterial(const Matrix44 model, GFX::Mesh* mesh, SCN::Material* material)
+void Renderer::renderMeshWithMaterial(const Matrix44& model, GFX::Mesh* mesh, SCN::Material* material, const std::vector<Matrix44>* bones, int lightmap_page, const Vector4f& lightmap_rect, SCN::CrowdEntity* crowd)
 {
 	//in case there is nothing to do
 	if (!mesh || !mesh->getNumVertices() || !material )
@@ -541,10 +712,10 @@ void Renderer::renderMeshWithMaterial(const Matrix44 model, GFX::Mesh* mesh, SCN
 	glEnable(GL_DEPTH_TEST);
 
 	if (pipeline_mode == FORWARD) {
-		renderMeshWithMaterialForward(model, mesh, material);
+		renderMeshWithMaterialForward(model, mesh, material, bones, lightmap_page, lightmap_rect, crowd);
 	}
 	else if (pipeline_mode == DEFERRED) {
-		renderMeshWithMaterialDeferred(model, mesh, material);
+		renderMeshWithMaterialDeferred(model, mesh, material, bones, lightmap_page, lightmap_rect, crowd);
 	}
 	else {
 		return;
@@ -563,10 +734,19 @@ void Renderer::renderMeshWithMaterial(const Matrix44 model, GFX::Mesh* mesh, SCN
 	glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
 }
 
-void SCN::Renderer::renderMeshWithMaterialDeferred(const Matrix44 model, GFX::Mesh* mesh, SCN::Material* material)
+// crowds draw all their visible instances at once
+static void renderMesh(GFX::Shader* shader, GFX::Mesh* mesh, SCN::CrowdEntity* crowd)
+{
+	if (crowd)
+		crowd->render(shader, mesh);
+	else
+		mesh->render(GL_TRIANGLES);
+}
+
+void SCN::Renderer::renderMeshWithMaterialDeferred(const Matrix44& model, GFX::Mesh* mesh, SCN::Material* material, const std::vector<Matrix44>* bones, int lightmap_page, const Vector4f& lightmap_rect, SCN::CrowdEntity* crowd)
 {
 	Camera* camera = Camera::current;
-	GFX::Shader* shader = GFX::Shader::Get("fill_gbuffer");
+	GFX::Shader* shader = crowd ? CrowdEntity::getShader("fill_gbuffer") : Skinning::getShader("fill_gbuffer", bones);
 
 	assert(glGetError() == GL_NO_ERROR);
 
@@ -584,6 +764,9 @@ void SCN::Renderer::renderMeshWithMaterialDeferred(const Matrix44 model, GFX::Me
 	shader->setUniform("u_viewprojection", camera->viewprojection_matrix);
 	shader->setUniform("u_camera_position", camera->eye);
 
+	if (bones)
+		Skinning::bind(shader, *bones);
+
 	// Upload time, for cool shader effects
 	float t = getTime();
 	shader->setUniform("u_time", t);
@@ -593,32 +776,40 @@ void SCN::Renderer::renderMeshWithMaterialDeferred(const Matrix44 model, GFX::Me
 
 	shader->setUniform("u_lgc_active", (int)linear_gamma_correction);
 
+	if (reflectance_model == PBR) {
+		GFX::IBL::bind(shader, use_ibl ? ibl : nullptr);
+		IrradianceVolumeEntity::bind(shader, use_irradiance ? irradiance_volume : nullptr);
+		ReflectionProbes::bind(shader);
+	}
+
+	LightmapEntity::bind(shader, use_lightmaps ? lightmap : nullptr, lightmap_page, lightmap_rect);
+
 	if (pass_setting == SINGLEPASS) {
 		//do the draw call that renders the mesh into the screen
-		mesh->render(GL_TRIANGLES);
+		renderMesh(shader, mesh, crowd);
 	}
 	else if (pass_setting == MULTIPASS) {
 		for (int i = 0; i < light_info.l_count; i++) {
-			mesh->render(GL_TRIANGLES);
+			renderMesh(shader, mesh, crowd);
 		}
 	}
 }
 
-void SCN::Renderer::renderMeshWithMaterialForward(const Matrix44 model, GFX::Mesh* mesh, SCN::Material* material)
+void SCN::Renderer::renderMeshWithMaterialForward(const Matrix44& model, GFX::Mesh* mesh, SCN::Material* material, const std::vector<Matrix44>* bones, int lightmap_page, const Vector4f& lightmap_rect, SCN::CrowdEntity* crowd)
 {
 	Camera* camera = Camera::current;
 	GFX::Shader* shader;
 	
 	if (pass_setting == SINGLEPASS && reflectance_model == PHONG) {
-		shader = GFX::Shader::Get("singlepass_phong_forward");
+		shader = crowd ? CrowdEntity::getShader("singlepass_phong_forward") : Skinning::getShader("singlepass_phong_forward", bones);
 	}
 	else if (pass_setting == MULTIPASS && reflectance_model == PHONG) {
-		shader = GFX::Shader::Get("multipass_phong_forward");
+		shader = crowd ? CrowdEntity::getShader("multipass_phong_forward") : Skinning::getShader("multipass_phong_forward", bones);
 		glDepthFunc(GL_LEQUAL);
 		glBlendFunc(GL_SRC_ALPHA, GL_ONE);
 	}
 	else if (pass_setting == SINGLEPASS && reflectance_model == PBR) {
-		shader = GFX::Shader::Get("singlepass_pbr_forward");
+		shader = crowd ? CrowdEntity::getShader("singlepass_pbr_forward") : Skinning::getShader("singlepass_pbr_forward", bones);
 	}
 	else {
 		return;
@@ -640,6 +831,9 @@ void SCN::Renderer::renderMeshWithMaterialForward(const Matrix44 model, GFX::Mes
 	shader->setUniform("u_viewprojection", camera->viewprojection_matrix);
 	shader->setUniform("u_camera_position", camera->eye);
 
+	if (bones)
+		Skinning::bind(shader, *bones);
+
 	// Upload time, for cool shader effects
 	float t = getTime();
 	shader->setUniform("u_time", t);
@@ -651,6 +845,14 @@ void SCN::Renderer::renderMeshWithMaterialForward(const Matrix44 model, GFX::Mes
 
 	shader->setUniform("u_lgc_active", (int)linear_gamma_correction);
 
+	if (reflectance_model == PBR) {
+		GFX::IBL::bind(shader, use_ibl ? ibl : nullptr);
+		IrradianceVolumeEntity::bind(shader, use_irradiance ? irradiance_volume : nullptr);
+		ReflectionProbes::bind(shader);
+	}
+
+	LightmapEntity::bind(shader, use_lightmaps ? lightmap : nullptr, lightmap_page, lightmap_rect);
+
 	if (pass_setting == SINGLEPASS) {
 		// Upload all uniforms related to lighting
 		light_info.bind(shader);
@@ -658,7 +860,7 @@ void SCN::Renderer::renderMeshWithMaterialForward(const Matrix44 model, GFX::Mes
 		shadow_info.bindShadowAtlasPositions(shader, light_info.shadow_lights_idxs);
 
 		//do the draw call that renders the mesh into the screen
-		mesh->render(GL_TRIANGLES);
+		renderMesh(shader, mesh, crowd);
 	}
 	else {
 		for (int i = 0; i < light_info.l_count; i++) {
@@ -673,7 +875,7 @@ void SCN::Renderer::renderMeshWithMaterialForward(const Matrix44 model, GFX::Mes
 
 			shadow_info.bindShadowAtlasPosition(shader, light_info.shadow_lights_idxs, i);
 
-			mesh->render(GL_TRIANGLES);
+			renderMesh(shader, mesh, crowd);
 		}
 	}
 }
@@ -707,6 +909,13 @@ void Renderer::showUI()
 
 	SSAO::showUI();
 
+	if (ibl)
+		ImGui::Checkbox("Image based lighting", &use_ibl);
+	if (irradiance_volume)
+		ImGui::Checkbox("Irradiance volume", &use_irradiance);
+	if (lightmap)
+		ImGui::Checkbox("Lightmaps", &use_lightmaps);
+
 	ImGui::Checkbox("Linear / Gamma correction", &linear_gamma_correction);
 	ImGui::Checkbox("Tonemapper", &tonemapper.active);
 	if (tonemapper.active) {
@@ -727,6 +936,17 @@ void Renderer::showUI()
 	Shadows::showUI(shadow_info);
 
 	ScreenSpaceReflections::showUI();
+
+	ReflectionProbes::showUI();
+
+	Skinning::showUI();
+
+	Animator::showUI();
+
+	GFX::Uploader::showUI();
+	GFX::TextureStreamer::showUI();
+
+	GFX::Profiler::showUI();
 }
 
 #else
@@ -12,18 +12,28 @@ class Skeleton;
 namespace GFX {
 	class Shader;
 	class Mesh;
+	class IBL;
 }
 
 namespace SCN {
 
 	class Prefab;
 	class Material;
+	class IrradianceVolumeEntity;
+	class ReflectionProbeEntity;
+	class LightmapEntity;
+	class CharacterEntity;
+	class CrowdEntity;
 
 	// minimal information for a draw call of a node
 	struct s_DrawCommand {
 		Matrix44 model;
-		GFX::Mesh* mesh;
-		SCN::Material* material;
+		GFX::Mesh* mesh = nullptr;
+		SCN::Material* material = nullptr;
+		const std::vector<Matrix44>* bones = nullptr; //for GPU skinning
+		int lightmap_page = -1; //of the node in the LightmapEntity
+		Vector4f lightmap_rect = Vector4f(0.0f, 0.0f, 0.0f, 0.0f); //scale and offset of the uvs1 in the page
+		SCN::CrowdEntity* crowd = nullptr; //drawn instanced with its baked vertex animation
 	};
 
 	struct s_TonemapperInfo {
@@ -69,6 +79,14 @@ namespace SCN {
 		e_ReflectanceModel reflectance_model = PBR;
 
 		GFX::Texture* skybox_cubemap;
+		GFX::IBL* ibl; //baked from the HDRE skybox, replaces the ambient light in PBR
+		bool use_ibl = true;
+		SCN::IrradianceVolumeEntity* irradiance_volume; //the first visible one, replaces the diffuse ambient in PBR
+		bool use_irradiance = true;
+		SCN::LightmapEntity* lightmap; //the first visible one, replaces the diffuse ambient and the baked lights
+		bool use_lightmaps = true;
+		std::vector<SCN::ReflectionProbeEntity*> reflection_probes; //visible this frame, see ReflectionProbes
+		bool prefabs_pending = false; //some prefab is still loading, nothing is baked or captured yet
 
 		Shadows shadow_info;
 
@@ -103,14 +121,14 @@ namespace SCN {
 		void renderSkybox(GFX::Texture* cubemap);
 
 		//to render one mesh given its material and transformation matrix
-		void renderMeshWithMaterial(const Matrix44 model, GFX::Mesh* mesh, SCN::Material* material);
-		void renderMeshWithMaterialDeferred(const Matrix44 model, GFX::Mesh* mesh, SCN::Material* material);
-		void renderMeshWithMaterialForward(const Matrix44 model, GFX::Mesh* mesh, SCN::Material* material);
+		void renderMeshWithMaterial(const Matrix44& model, GFX::Mesh* mesh, SCN::Material* material, const std::vector<Matrix44>* bones = nullptr, int lightmap_page = -1, const Vector4f& lightmap_rect = Vector4f(), SCN::CrowdEntity* crowd = nullptr);
+		void renderMeshWithMaterialDeferred(const Matrix44& model, GFX::Mesh* mesh, SCN::Material* material, const std::vector<Matrix44>* bones = nullptr, int lightmap_page = -1, const Vector4f& lightmap_rect = Vector4f(), SCN::CrowdEntity* crowd = nullptr);
+		void renderMeshWithMaterialForward(const Matrix44& model, GFX::Mesh* mesh, SCN::Material* material, const std::vector<Matrix44>* bones = nullptr, int lightmap_page = -1, const Vector4f& lightmap_rect = Vector4f(), SCN::CrowdEntity* crowd = nullptr);
 
 		void showUI();
 		
 		// Recursively iterate over all children of a node, adding the needed ones to renderables list
-		void parseNodes(SCN::Node* node, Camera* cam);
+		void parseNodes(SCN::Node* node, Camera* cam, SCN::CharacterEntity* character = nullptr);
 
 		// Fill the G-Buffer with the information from opaque and transparent geometry
 		void fillGBuffer();
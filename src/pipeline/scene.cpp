@@ -267,6 +267,8 @@ SCN::BaseEntity* SCN::BaseEntity::createEntity(const char* type)
 SCN::PrefabEntity::PrefabEntity()
 {
 	prefab = NULL;
+	prefab_pending = false;
+	is_static = false;
 }
 
 void SCN::PrefabEntity::configure(cJSON* json)
@@ -276,21 +278,50 @@ void SCN::PrefabEntity::configure(cJSON* json)
 		filename = cJSON_GetObjectItem(json, "filename")->valuestring;
 		loadPrefab( filename.c_str() );
 	}
+	is_static = readJSONBool(json, "static", is_static);
 }
 
 void SCN::PrefabEntity::serialize(cJSON* json)
 {
 	cJSON_AddStringToObject(json, "filename", filename.c_str());
+	if (is_static)
+		writeJSONBool(json, "static", is_static);
 }
 
-void SCN::PrefabEntity::loadPrefab(const char* filename)
+void SCN::PrefabEntity::loadPrefab(const char* filename, bool async)
 {
 	assert(scene && "Cannot assign filename without scene (to extract base folder)");
 	std::string fullpath = scene->base_folder + "/" + filename;
-	prefab = SCN::Prefab::Get(fullpath.c_str());
+	prefab = async ? SCN::Prefab::GetAsync(fullpath.c_str()) : SCN::Prefab::Get(fullpath.c_str());
+	root.clear();
 	if (!prefab)
 		return;
-	
+
+	//the entity stays empty until the prefab is ready
+	prefab_pending = true;
+	updatePrefab();
+}
+
+void SCN::PrefabEntity::updatePrefab()
+{
+	if (!prefab_pending)
+		return;
+
+	//meanwhile the bounding of the prefab is a placeholder
+	if (prefab->loading)
+	{
+		root.aabb = transformBoundingBox(root.getGlobalMatrix(), prefab->bounding);
+		return;
+	}
+	prefab_pending = false;
+
+	//same as Prefab::Get returning NULL
+	if (prefab->failed)
+	{
+		prefab = NULL;
+		return;
+	}
+
 	SCN::Node* child = new SCN::Node();
 	*child = prefab->root;
 	root.clear();
@@ -299,6 +330,13 @@ void SCN::PrefabEntity::loadPrefab(const char* filename)
 
 bool SCN::PrefabEntity::testRay(const Ray& ray, Vector3f& coll, float max_dist)
 {
+	//still loading, the placeholder can be picked
+	if (prefab_pending)
+	{
+		BoundingBox box = transformBoundingBox(root.getGlobalMatrix(), prefab->bounding);
+		return RayBoundingBoxCollision(box, ray.origin, ray.direction, coll) && ray.origin.distance(coll) < max_dist;
+	}
+
 	root.model = root.model;
 	return root.testRay(ray, coll, 0xFF, max_dist);
 }
@@ -31,10 +31,12 @@ namespace SCN {
 		VOXEL = 6,
 		PARTICLE_SYSTEM = 7,
 		CHARACTER = 8,
+		CROWD = 9,
 
 		REFLECTION_PROBE = 10,
 		PLANAR_REFLECTION = 11,
 		IRRADIANCE_VOLUME = 12,
+		LIGHTMAP = 13,
 
 		VOLUME = 20,
 		SPLINE = 21,
@@ -96,6 +98,8 @@ namespace SCN {
 	public:
 		std::string filename;
 		Prefab* prefab;
+		bool prefab_pending; //the prefab was still loading, its nodes have not been copied yet
+		bool is_static; //never moves, its nodes can be lightmapped
 		
 		PrefabEntity();
 
@@ -103,7 +107,8 @@ namespace SCN {
 
 		virtual void configure(cJSON* json);
 		virtual void serialize(cJSON* json);
-		void loadPrefab(const char* filename);
+		void loadPrefab(const char* filename, bool async = true);
+		void updatePrefab(); //copies the nodes once the prefab has been loaded, call it every frame
 
 		bool testRay(const Ray& ray, Vector3f& coll, float max_dist = 100000.0f);
 	};
@@ -7,6 +7,8 @@
 #include "gfx/mesh.h"
 
 #include "renderer.h"
+#include "skinning.h"
+#include "crowd.h"
 #include "camera.h"
 #include "material.h"
 
@@ -91,11 +93,11 @@ void SCN::Shadows::generateShadowMaps(std::vector<s_DrawCommand>& opaque, std::v
 		light_info.viewprojections[light_info.shadow_lights_idxs[i]] = light_camera.viewprojection_matrix;
 
 		for (s_DrawCommand command : opaque) {
-			renderPlain(&light_camera, command.model, command.mesh, command.material);
+			renderPlain(&light_camera, command.model, command.mesh, command.material, command.bones, command.crowd);
 		}
 
 		for (s_DrawCommand command : transparent) {
-			renderPlain(&light_camera, command.model, command.mesh, command.material);
+			renderPlain(&light_camera, command.model, command.mesh, command.material, command.bones, command.crowd);
 		}
 
 		//glDisable(GL_SCISSOR_TEST);
@@ -109,7 +111,7 @@ void SCN::Shadows::generateShadowMaps(std::vector<s_DrawCommand>& opaque, std::v
 	shadow_atlas->unbind();
 }
 
-void SCN::Shadows::renderPlain(Camera* light_camera, const Matrix44 model, GFX::Mesh* mesh, SCN::Material* material)
+void SCN::Shadows::renderPlain(Camera* light_camera, const Matrix44& model, GFX::Mesh* mesh, SCN::Material* material, const std::vector<Matrix44>* bones, SCN::CrowdEntity* crowd)
 {
 	//in case there is nothing to do
 	if (!mesh || !mesh->getNumVertices() || !material)
@@ -117,7 +119,7 @@ void SCN::Shadows::renderPlain(Camera* light_camera, const Matrix44 model, GFX::
 	assert(glGetError() == GL_NO_ERROR);
 
 	//define locals to simplify coding
-	GFX::Shader* shader = GFX::Shader::Get("shadows_plain");
+	GFX::Shader* shader = crowd ? CrowdEntity::getShader("shadows_plain") : Skinning::getShader("shadows_plain", bones);
 
 	//glDisable(GL_BLEND);
 	glEnable(GL_DEPTH_TEST);
@@ -152,7 +154,14 @@ void SCN::Shadows::renderPlain(Camera* light_camera, const Matrix44 model, GFX::
 	shader->setUniform("u_viewprojection", light_camera->viewprojection_matrix);
 	shader->setUniform("u_camera_position", light_camera->eye);
 
-	mesh->render(GL_TRIANGLES);
+	if (bones)
+		Skinning::bind(shader, *bones);
+
+	//the instances are culled again against the frustum of the light
+	if (crowd)
+		crowd->render(shader, mesh, light_camera);
+	else
+		mesh->render(GL_TRIANGLES);
 
 	//disable shader
 	shader->disable();
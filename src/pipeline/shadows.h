@@ -13,6 +13,7 @@ namespace GFX {
 namespace SCN {
 	class Material;
 	struct s_DrawCommand;
+	class CrowdEntity;
 
 	class Shadows {
 	public:
@@ -33,7 +34,7 @@ namespace SCN {
 			LightUniforms& light_info, bool ffc);
 
 		// Renders the mesh depth into the shadowmap
-		void renderPlain(Camera* light_camera, const Matrix44 model, GFX::Mesh* mesh, SCN::Material* material);
+		void renderPlain(Camera* light_camera, const Matrix44& model, GFX::Mesh* mesh, SCN::Material* material, const std::vector<Matrix44>* bones = nullptr, SCN::CrowdEntity* crowd = nullptr);
 
 		// Searches shadowmap position for a given light index and binds it with the shader
 		void bindShadowAtlasPosition(GFX::Shader* shader, std::vector<int>& shadow_indices, int light_index);
@@ -0,0 +1,343 @@
+#include "skinning.h"
+
+#include <iostream>
+#include <chrono>
+#include <cstdio>
+
+#include "prefab.h"
+
+#include "../gfx/gfx.h"
+#include "../gfx/mesh.h"
+#include "../utils/utils.h"
+#include "../core/ui.h"
+#include "../core/task.h"
+
+#if defined(__SSE__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 1)
+	#define SKINNING_USE_SSE
+	#include <xmmintrin.h>
+#endif
+
+#define SKINNING_BONES_UBO_INDEX 3 //binding point of u_bones_block
+#define SKINNING_VERTICES_PER_TASK 4096 //big meshes are split so all the threads get work
+
+SCN::Skinning::Skinning() : bones_ubo("u_bones_block") {
+	is_active = true;
+	method = GPU;
+	num_skinned = 0;
+	skinning_time = 0;
+}
+
+void SCN::Skinning::showUI()
+{
+#ifndef SKIP_IMGUI
+	Skinning& skinning = instance();
+
+	ImGui::Checkbox("Skinning", &skinning.is_active);
+	if (skinning.is_active) {
+		if (ImGui::TreeNode("Skinning Settings")) {
+			ImGui::Combo("Method", (int*)&skinning.method, "GPU\0CPU\0", eMethod::COUNT);
+			ImGui::Text("Skinned meshes: %d", skinning.num_skinned);
+			if (skinning.method == CPU)
+				ImGui::Text("CPU skinning time: %.2f ms", skinning.skinning_time);
+			ImGui::TreePop();
+		}
+	}
+#endif
+}
+
+void SCN::Skinning::beginFrame()
+{
+	Skinning& skinning = instance();
+	skinning.frame_bones.clear();
+	skinning.jobs.clear();
+	skinning.num_skinned = 0;
+}
+
+const std::vector<Matrix44>* SCN::Skinning::computeBones(Node* node)
+{
+	Skinning& skinning = instance();
+	GFX::Mesh* mesh = node->mesh;
+	assert(mesh && mesh->bones_info.size());
+
+	//find the nodes that act as bones (only the first time)
+	if (node->joints.size() != mesh->bones_info.size())
+	{
+		Node* root = node;
+		while (root->parent)
+			root = root->parent;
+		node->joints.resize(mesh->bones_info.size());
+		for (size_t i = 0; i < mesh->bones_info.size(); ++i)
+			node->joints[i] = root->findNode(mesh->bones_info[i].name);
+	}
+
+	//the node model is applied later in the shader, so remove it from the bones
+	Matrix44 inv_model = node->getGlobalMatrix();
+	inv_model.inverse();
+
+	skinning.frame_bones.push_back(std::vector<Matrix44>());
+	std::vector<Matrix44>& bones = skinning.frame_bones.back();
+	bones.resize((std::min)((int)mesh->bones_info.size(), SKINNING_MAX_BONES));
+	for (size_t i = 0; i < bones.size(); ++i)
+	{
+		BoneInfo& bone_info = mesh->bones_info[i];
+		Node* joint = node->joints[i];
+		if (joint)
+			bones[i] = mesh->bind_matrix * bone_info.bind_pose * joint->getGlobalMatrix() * inv_model;
+		else
+			bones[i].setIdentity();
+	}
+
+	skinning.num_skinned++;
+	return &bones;
+}
+
+GFX::Mesh* SCN::Skinning::addJob(Node* node, const std::vector<Matrix44>* bones)
+{
+	GFX::Mesh* mesh = node->mesh;
+	assert(!mesh->interleaved.size() && "skinned meshes cannot be interleaved");
+
+	//the output shares everything with the mesh except the deformed streams
+	if (!node->skinned_mesh)
+	{
+		GFX::Mesh* output = new GFX::Mesh();
+		output->vertices = mesh->vertices;
+		output->normals = mesh->normals;
+		output->uvs = mesh->uvs;
+		output->m_uvs1 = mesh->m_uvs1;
+		output->colors = mesh->colors;
+		output->m_indices = mesh->m_indices;
+		output->submeshes = mesh->submeshes;
+		output->aabb_min = mesh->aabb_min;
+		output->aabb_max = mesh->aabb_max;
+		output->box = mesh->box;
+		output->radius = mesh->radius;
+		output->uploadToVRAM();
+		node->skinned_mesh = output;
+	}
+
+	instance().jobs.push_back({ mesh, node->skinned_mesh, bones->size() ? &(*bones)[0] : NULL });
+	return node->skinned_mesh;
+}
+
+void SCN::Skinning::skinJobs()
+{
+	Skinning& skinning = instance();
+	if (skinning.jobs.empty())
+		return;
+
+	long time = getTime();
+
+	//split the work in ranges of vertices so big and small meshes are balanced between threads
+	struct sTask {
+		sJob* job;
+		size_t start;
+		size_t end;
+	};
+	std::vector<sTask> tasks;
+	for (sJob& job : skinning.jobs)
+	{
+		if (!job.bones)
+			continue;
+		size_t num_vertices = job.mesh->vertices.size();
+		for (size_t start = 0; start < num_vertices; start += SKINNING_VERTICES_PER_TASK)
+			tasks.push_back({ &job, start, (std::min)(start + SKINNING_VERTICES_PER_TASK, num_vertices) });
+	}
+
+	TaskManager::background.parallelFor(tasks.size(), [&](size_t i) {
+		sTask& task = tasks[i];
+		GFX::Mesh* output = task.job->output;
+		skinVertices(task.job->mesh, task.job->bones, &output->vertices[0],
+			output->normals.size() ? &output->normals[0] : NULL, task.start, task.end);
+	});
+
+	//upload in the main thread
+	for (sJob& job : skinning.jobs)
+		job.output->updateVerticesInVRAM();
+
+	skinning.skinning_time = (double)(getTime() - time);
+}
+
+void SCN::Skinning::skinVertices(const GFX::Mesh* mesh, const Matrix44* bones, Vector3f* out_vertices, Vector3f* out_normals, size_t start, size_t end)
+{
+	const Vector3f* vertices = &mesh->vertices[0];
+	const Vector3f* normals = mesh->normals.size() ? &mesh->normals[0] : NULL;
+	const Vector4ub* bone_ids = &mesh->bones[0];
+	const Vector4f* weights = &mesh->weights[0];
+	const int num_bones = (std::min)((int)mesh->bones_info.size(), SKINNING_MAX_BONES);
+
+	for (size_t i = start; i < end; ++i)
+	{
+		const Vector4ub& ids = bone_ids[i];
+		const Vector4f& w = weights[i];
+
+#ifdef SKINNING_USE_SSE
+		//blend the rows of the 4 bone matrices, then transform position and normal with the result while it is in registers
+		__m128 row0 = _mm_setzero_ps(), row1 = _mm_setzero_ps(), row2 = _mm_setzero_ps(), row3 = _mm_setzero_ps();
+		for (int j = 0; j < 4; ++j)
+		{
+			if (w.v[j] == 0.0f || ids.v[j] >= num_bones)
+				continue;
+			const float* m = bones[ids.v[j]].m;
+			__m128 weight = _mm_set1_ps(w.v[j]);
+			row0 = _mm_add_ps(row0, _mm_mul_ps(_mm_load_ps(m), weight));
+			row1 = _mm_add_ps(row1, _mm_mul_ps(_mm_load_ps(m + 4), weight));
+			row2 = _mm_add_ps(row2, _mm_mul_ps(_mm_load_ps(m + 8), weight));
+			row3 = _mm_add_ps(row3, _mm_mul_ps(_mm_load_ps(m + 12), weight));
+		}
+
+		const Vector3f& v = vertices[i];
+		__m128 result = _mm_add_ps(
+			_mm_add_ps(_mm_mul_ps(row0, _mm_set1_ps(v.x)), _mm_mul_ps(row1, _mm_set1_ps(v.y))),
+			_mm_add_ps(_mm_mul_ps(row2, _mm_set1_ps(v.z)), row3));
+		float out[4];
+		_mm_storeu_ps(out, result);
+		out_vertices[i].set(out[0], out[1], out[2]);
+
+		if (normals && out_normals)
+		{
+			const Vector3f& n = normals[i];
+			result = _mm_add_ps(
+				_mm_add_ps(_mm_mul_ps(row0, _mm_set1_ps(n.x)), _mm_mul_ps(row1, _mm_set1_ps(n.y))),
+				_mm_mul_ps(row2, _mm_set1_ps(n.z)));
+			_mm_storeu_ps(out, result);
+			out_normals[i].set(out[0], out[1], out[2]);
+		}
+#else
+		Vector3f position, normal;
+		for (int j = 0; j < 4; ++j)
+		{
+			if (w.v[j] == 0.0f || ids.v[j] >= num_bones)
+				continue;
+			const Matrix44& bone = bones[ids.v[j]];
+			position = position + (bone * vertices[i]) * w.v[j];
+			if (normals)
+				normal = normal + bone.rotateVector(normals[i]) * w.v[j];
+		}
+		out_vertices[i] = position;
+		if (normals && out_normals)
+			out_normals[i] = normal;
+#endif
+	}
+}
+
+GFX::Shader* SCN::Skinning::getShader(const char* name, const std::vector<Matrix44>* bones)
+{
+	if (bones)
+	{
+		GFX::Shader* shader = GFX::Shader::Get((std::string(name) + "_skinned").c_str());
+		if (shader)
+			return shader;
+	}
+	return GFX::Shader::Get(name);
+}
+
+void SCN::Skinning::bind(GFX::Shader* shader, const std::vector<Matrix44>& bones)
+{
+	//the block always has the max size, the buffer must be at least as big
+	static Matrix44 bones_data[SKINNING_MAX_BONES];
+	int num_bones = (std::min)((int)bones.size(), SKINNING_MAX_BONES);
+	memcpy(bones_data, &bones[0], num_bones * sizeof(Matrix44));
+	shader->setUniform("u_num_bones", num_bones);
+
+	Skinning& skinning = instance();
+	skinning.bones_ubo.updateFromPointer(bones_data, sizeof(bones_data));
+	skinning.bones_ubo.bind(shader, SKINNING_BONES_UBO_INDEX);
+}
+
+void SCN::Skinning::benchmark(int frames)
+{
+	Skinning& skinning = instance();
+	GFX::Shader* gpu_shader = GFX::Shader::Get("shadows_plain_skinned");
+	GFX::Shader* cpu_shader = GFX::Shader::Get("shadows_plain");
+	if (!gpu_shader || !cpu_shader)
+	{
+		std::cerr << "Skinning benchmark: the shader atlas is not loaded" << std::endl;
+		return;
+	}
+
+	//a sphere with the bones along its height, every vertex between two of them
+	const int num_bones = 64;
+	const int max_characters = 1000;
+	const int counts[] = { 100, 250, 500, 1000 };
+	GFX::Mesh mesh;
+	mesh.createSphere(1.0f, 64, 48);
+	mesh.bones.resize(mesh.vertices.size());
+	mesh.weights.resize(mesh.vertices.size());
+	for (size_t i = 0; i < mesh.vertices.size(); ++i)
+	{
+		float f = clamp((mesh.vertices[i].y * 0.5f + 0.5f) * (num_bones - 1), 0.0f, num_bones - 1.001f);
+		int bone = (int)f;
+		mesh.bones[i] = Vector4ub(bone, bone + 1, 0, 0);
+		mesh.weights[i] = Vector4f(1.0f - (f - bone), f - bone, 0.0f, 0.0f);
+	}
+	mesh.bones_info.resize(num_bones);
+	for (int i = 0; i < num_bones; ++i)
+	{
+		snprintf(mesh.bones_info[i].name, sizeof(mesh.bones_info[i].name), "bone%d", i);
+		mesh.bones_info[i].bind_pose.setIdentity();
+	}
+	mesh.uploadToVRAM();
+
+	//a different pose and place for every character, and the streaming meshes of the CPU path
+	std::vector<std::vector<Matrix44>> poses(max_characters);
+	std::vector<Matrix44> models(max_characters);
+	std::vector<GFX::Mesh*> outputs(max_characters);
+	for (int c = 0; c < max_characters; ++c)
+	{
+		poses[c].resize(num_bones);
+		for (int b = 0; b < num_bones; ++b)
+			poses[c][b].setRotation(sinf(c * 0.1f + b * 0.2f) * 0.3f, Vector3f(0, 0, 1));
+		models[c].setTranslation((c % 40) * 0.05f - 1.0f, (c / 40) * 0.08f - 1.0f, 0.0f);
+		models[c].scale(0.02f, 0.02f, 0.02f);
+		GFX::Mesh* output = new GFX::Mesh();
+		output->vertices = mesh.vertices;
+		output->normals = mesh.normals;
+		output->uploadToVRAM();
+		outputs[c] = output;
+	}
+
+	std::cout << " * Skinning benchmark: " << mesh.vertices.size() << " vertices and " << num_bones << " bones per character, " << frames << " frames" << std::endl;
+	Matrix44 viewprojection;
+	GFX::GPUQuery query(GL_TIME_ELAPSED);
+	for (int count : counts)
+		for (int method = 0; method < COUNT; ++method)
+		{
+			double cpu_time = 0, gpu_time = 0;
+			for (int frame = 0; frame < frames; ++frame)
+			{
+				auto start = std::chrono::steady_clock::now();
+				query.start();
+				GFX::Shader* shader = method == CPU ? cpu_shader : gpu_shader;
+				if (method == CPU)
+				{
+					beginFrame();
+					for (int c = 0; c < count; ++c)
+						skinning.jobs.push_back({ &mesh, outputs[c], &poses[c][0] });
+					skinJobs();
+				}
+				shader->enable();
+				shader->setUniform("u_viewprojection", viewprojection);
+				for (int c = 0; c < count; ++c)
+				{
+					shader->setUniform("u_model", models[c]);
+					if (method == CPU)
+						outputs[c]->render(GL_TRIANGLES);
+					else
+					{
+						bind(shader, poses[c]);
+						mesh.render(GL_TRIANGLES);
+					}
+				}
+				shader->disable();
+				query.finish();
+				cpu_time += std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+				while (!query.isReady());
+				gpu_time += query.value * 0.000001;
+			}
+			printf("   %4d characters %s: CPU %7.2f ms  GPU %7.2f ms per frame\n", count, method == CPU ? "CPU" : "GPU", cpu_time / frames, gpu_time / frames);
+		}
+
+	skinning.jobs.clear();
+	for (GFX::Mesh* output : outputs)
+		delete output;
+}
@@ -0,0 +1,81 @@
+#pragma once
+
+#include <vector>
+#include <deque>
+
+#include "../core/math.h"
+#include "../gfx/shader.h"
+
+namespace GFX {
+	class Mesh;
+}
+
+namespace SCN {
+
+	class Node;
+
+	const int SKINNING_MAX_BONES = 128; //must match the size of u_bones in the shader atlas
+
+	//Deforms the meshes imported with bones (glTF skins) using the pose of the nodes of the prefab.
+	//GPU: the bone matrices are uploaded to a UBO and the vertex shader (SKINNING macro) blends them
+	//CPU: all the characters of the frame are skinned in parallel with SSE and streamed to a VBO per node
+	class Skinning {
+	private:
+		Skinning();
+
+	public:
+		static Skinning& instance()
+		{
+			static Skinning INSTANCE;
+			return INSTANCE;
+		}
+
+		enum eMethod {
+			GPU,
+			CPU,
+			COUNT
+		};
+
+		struct sJob {
+			GFX::Mesh* mesh; //bind pose
+			GFX::Mesh* output;
+			const Matrix44* bones;
+		};
+
+		bool is_active;
+		eMethod method;
+
+		GFX::BufferObject bones_ubo;
+		std::deque<std::vector<Matrix44>> frame_bones; //bones of every skinned draw of this frame, deque keeps the pointers valid
+		std::vector<sJob> jobs; //CPU skinning pending for this frame
+		int num_skinned; //stats
+		double skinning_time;
+
+		static void showUI();
+
+		//must be called before parsing the nodes of a frame
+		static void beginFrame();
+
+		//returns the final bone matrices of a skinned node according to the current pose of its joints (valid until next frame)
+		static const std::vector<Matrix44>* computeBones(Node* node);
+
+		//enqueues a node to be skinned in the CPU, returns the mesh that will contain the result
+		static GFX::Mesh* addJob(Node* node, const std::vector<Matrix44>* bones);
+
+		//skins all the enqueued jobs in parallel and uploads the results, must be called from the main thread
+		static void skinJobs();
+
+		//skins a range of vertices of a mesh, thread safe
+		static void skinVertices(const GFX::Mesh* mesh, const Matrix44* bones, Vector3f* out_vertices, Vector3f* out_normals, size_t start, size_t end);
+
+		//the skinned version of a shader from the atlas (name + "_skinned") if there are bones
+		static GFX::Shader* getShader(const char* name, const std::vector<Matrix44>* bones);
+
+		//uploads the bones to the UBO and binds it to the shader
+		static void bind(GFX::Shader* shader, const std::vector<Matrix44>& bones);
+
+		//skins and draws from 100 to 1000 characters with both methods and prints the CPU and GPU time of a frame
+		//needs a GL context and the shader atlas
+		static void benchmark(int frames = 20);
+	};
+}
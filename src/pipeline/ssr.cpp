@@ -24,7 +24,7 @@ void SCN::ScreenSpaceReflections::create_fbo(int width, int height)
 		width,
 		height,
 		1,
-		GL_RGB,
+		GL_RGBA, //a is the confidence of the reflection
 		GL_FLOAT,
 		false);
 }
@@ -82,6 +82,7 @@ void SCN::ScreenSpaceReflections::fill(Scene* scene, const GFX::FBO& prev_gbuffe
 	GFX::Mesh* quad = GFX::Mesh::getQuad();
 
 	glDisable(GL_DEPTH_TEST);
+	glClearColor(0.0f, 0.0f, 0.0f, 0.0f); //no confidence where no ray hits
 	glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
 
 	// Send the inverse of the FBO res, for the UVs
@@ -0,0 +1,240 @@
+#include "tracer.h"
+
+#include "scene.h"
+#include "light.h"
+#include "material.h"
+#include "prefab.h"
+#include "../gfx/mesh.h"
+#include "../core/task.h"
+
+using namespace SCN;
+
+namespace {
+
+	inline Vector3f degamma(const Vector3f& c) {
+		return Vector3f(powf(c.x, 2.2f), powf(c.y, 2.2f), powf(c.z, 2.2f));
+	}
+};
+
+const GFX::TriangleBVH* SceneTracer::getMeshBVH(GFX::Mesh* mesh)
+{
+	return mesh->getCollisionBVH();
+}
+
+void SceneTracer::clear()
+{
+	instances.clear();
+	lights.clear();
+	bvh.clear();
+	min = max = ambient_light = Vector3f();
+}
+
+void SceneTracer::addNode(Node* node, BaseEntity* entity)
+{
+	if (!node->visible)
+		return;
+
+	for (Node* child : node->children)
+		addNode(child, entity);
+
+	//transparent surfaces do not block the light
+	if (!node->mesh || !node->material || node->material->alpha_mode == eAlphaMode::BLEND)
+		return;
+
+	sInstance instance;
+	instance.model = node->getGlobalMatrix();
+	instance.inverse_model = instance.model;
+	if (!instance.inverse_model.inverse())
+		return;
+	instance.bvh = nullptr; //filled later, all the meshes at once
+	instance.material = node->material;
+	instance.entity = entity;
+
+	BoundingBox box = transformBoundingBox(instance.model, node->mesh->box);
+	instance.min = box.center - box.halfsize;
+	instance.max = box.center + box.halfsize;
+	instances.push_back(instance);
+	instance_meshes.push_back(node->mesh);
+}
+
+void SceneTracer::build(Scene* scene, bool baked_lights_only)
+{
+	clear();
+	instance_meshes.clear();
+
+	ambient_light = degamma(scene->ambient_light);
+
+	for (BaseEntity* entity : scene->entities)
+	{
+		if (!entity->visible)
+			continue;
+
+		if (entity->getType() == eEntityType::PREFAB)
+			addNode(&entity->root, entity);
+		else if (entity->getType() == eEntityType::LIGHT)
+		{
+			LightEntity* light_entity = (LightEntity*)entity;
+			if (baked_lights_only && !light_entity->baked)
+				continue;
+			Matrix44 global = light_entity->root.getGlobalMatrix();
+
+			sLight light;
+			light.type = light_entity->light_type;
+			light.position = global.getTranslation();
+			light.direction = normalize(global.frontVector());
+			light.color = degamma(light_entity->color) * light_entity->intensity;
+			light.cos_cone_start = cos(light_entity->cone_info.x * DEG2RAD);
+			light.cos_cone_end = cos(light_entity->cone_info.y * DEG2RAD);
+			light.max_distance = light_entity->max_distance;
+			lights.push_back(light);
+		}
+	}
+
+	//the BVHs of the meshes not traced before are built in parallel
+	TaskManager::background.parallelFor(instances.size(), [&](size_t i) {
+		instances[i].bvh = getMeshBVH(instance_meshes[i]);
+	});
+	instance_meshes.clear();
+
+	std::vector<Vector3f> mins(instances.size());
+	std::vector<Vector3f> maxs(instances.size());
+	min = Vector3f(FLT_MAX);
+	max = Vector3f(-FLT_MAX);
+	for (size_t i = 0; i < instances.size(); ++i)
+	{
+		mins[i] = instances[i].min;
+		maxs[i] = instances[i].max;
+		min.set((std::min)(min.x, mins[i].x), (std::min)(min.y, mins[i].y), (std::min)(min.z, mins[i].z));
+		max.set((std::max)(max.x, maxs[i].x), (std::max)(max.y, maxs[i].y), (std::max)(max.z, maxs[i].z));
+	}
+	if (instances.empty())
+		min = max = Vector3f();
+	bvh.build(mins, maxs, 1);
+}
+
+bool SceneTracer::testRay(const Vector3f& origin, const Vector3f& direction, float max_t, sSceneHit& hit) const
+{
+	Vector3f local_normal;
+	bool found = false;
+	bvh.traverse(origin, direction, max_t, [&](int first, int count, float& t) {
+		for (int i = first; i < first + count; ++i)
+		{
+			const sInstance& instance = instances[bvh.indices[i]];
+			//the direction is not normalized in object space, so t is the same in both spaces
+			GFX::sRayHit mesh_hit;
+			if (!instance.bvh->testRay(instance.inverse_model * origin, instance.inverse_model.rotateVector(direction), t, mesh_hit))
+				continue;
+			t = mesh_hit.t;
+			hit.t = mesh_hit.t;
+			hit.instance = bvh.indices[i];
+			local_normal = mesh_hit.normal;
+			found = true;
+		}
+		return false;
+	});
+
+	if (!found)
+		return false;
+
+	hit.position = origin + direction * hit.t;
+	Matrix44 normal_matrix = instances[hit.instance].inverse_model;
+	normal_matrix.transpose();
+	hit.normal = normalize(normal_matrix.rotateVector(local_normal));
+	if (dot(hit.normal, direction) > 0.0f)
+		hit.normal = hit.normal * -1.0f;
+	return true;
+}
+
+int SceneTracer::testOcclusion(const Vector3f& origin, const Vector3f& direction, float max_t) const
+{
+	int occluder = -1;
+	bvh.traverse(origin, direction, max_t, [&](int first, int count, float& t) {
+		for (int i = first; i < first + count; ++i)
+		{
+			const sInstance& instance = instances[bvh.indices[i]];
+			if (instance.bvh->testOcclusion(instance.inverse_model * origin, instance.inverse_model.rotateVector(direction), t))
+			{
+				occluder = bvh.indices[i];
+				return true;
+			}
+		}
+		return false;
+	});
+	return occluder;
+}
+
+bool SceneTracer::getLightDirection(const sLight& light, const Vector3f& position, Vector3f& L, float& distance) const
+{
+	if (light.type == eLightType::DIRECTIONAL)
+	{
+		L = light.direction;
+		distance = (max - min).length() * 2.0f;
+		return true;
+	}
+	L = light.position - position;
+	distance = L.length();
+	if (distance <= 0.0f)
+		return false;
+	L = L * (1.0f / distance);
+	return true;
+}
+
+float SceneTracer::getBias() const
+{
+	return (std::max)(0.0001f, (max - min).length() * 0.0001f);
+}
+
+void SceneTracer::getSurface(const sSceneHit& hit, Vector3f& albedo, Vector3f& emission) const
+{
+	const Material* material = instances[hit.instance].material;
+	albedo = degamma(Vector3f(material->color.x, material->color.y, material->color.z));
+	emission = material->emissive_factor;
+}
+
+Vector3f SceneTracer::computeDirect(const Vector3f& position, const Vector3f& normal, std::vector<int>* occluders) const
+{
+	//moved a bit out of the surface so the shadow rays do not hit it
+	Vector3f origin = position + normal * getBias();
+
+	Vector3f incoming;
+	for (const sLight& light : lights)
+	{
+		Vector3f L;
+		float distance;
+		if (!getLightDirection(light, position, L, distance))
+			continue;
+		Vector3f intensity = light.color;
+		if (light.type != eLightType::DIRECTIONAL)
+		{
+			intensity = intensity * (1.0f / (distance * distance));
+			if (light.type == eLightType::SPOT)
+			{
+				float numerator = (std::min)(1.0f, (std::max)(0.0f, dot(L, light.direction))) - light.cos_cone_end;
+				if (numerator < 0.0f)
+					continue;
+				intensity = intensity * (numerator / (light.cos_cone_start - light.cos_cone_end));
+			}
+		}
+
+		float NdotL = dot(normal, L);
+		if (NdotL <= 0.0f)
+			continue;
+
+		int occluder = testOcclusion(origin, L, distance);
+		if (occluder != -1)
+		{
+			if (occluders)
+				occluders->push_back(occluder);
+			continue;
+		}
+		incoming += intensity * (NdotL / (float)PI);
+	}
+	return incoming;
+}
+
+Vector3f SceneTracer::shade(const sSceneHit& hit, const Vector3f& indirect, std::vector<int>* occluders) const
+{
+	Vector3f albedo, emission;
+	getSurface(hit, albedo, emission);
+	return emission + albedo * (indirect + computeDirect(hit.position, hit.normal, occluders));
+}
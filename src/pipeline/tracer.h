@@ -0,0 +1,86 @@
+/*  Ray tracing of the scene on the CPU, used to bake the lighting
+	The meshes are traced in object space with their GFX::TriangleBVH (the collision BVH of the mesh, shared with the picking),
+	every node with a mesh is one instance and a BVH over the boxes of the instances finds them.
+	Build it in the main thread, then trace and shade from as many threads as you want (nothing changes while tracing).
+*/
+#pragma once
+
+#include <vector>
+
+#include "../core/math.h"
+#include "../gfx/bvh.h"
+
+namespace SCN {
+
+	class Scene;
+	class Node;
+	class BaseEntity;
+	class Material;
+	class LightEntity;
+
+	struct sSceneHit {
+		float t = FLT_MAX;
+		int instance = -1;
+		Vector3f position;
+		Vector3f normal; //geometric, world space, facing the ray
+	};
+
+	class SceneTracer {
+	public:
+		struct sInstance {
+			Matrix44 model;
+			Matrix44 inverse_model;
+			const GFX::TriangleBVH* bvh;
+			Material* material;
+			BaseEntity* entity; //the one that owns the node
+			Vector3f min, max; //world box
+		};
+
+		struct sLight {
+			int type;
+			Vector3f position;
+			Vector3f direction; //towards the light, like in the shaders
+			Vector3f color; //linear, multiplied by the intensity
+			float cos_cone_start, cos_cone_end;
+			float max_distance;
+		};
+
+		std::vector<sInstance> instances;
+		std::vector<sLight> lights;
+		Vector3f ambient_light; //linear
+		Vector3f min, max; //of the whole scene
+		GFX::BVH bvh; //of the instances
+
+		//the visible prefabs and lights of the scene, the colors are converted to linear (degamma)
+		//baked_lights_only keeps only the lights that are in the lightmaps
+		void build(Scene* scene, bool baked_lights_only = false);
+		void clear();
+
+		bool testRay(const Vector3f& origin, const Vector3f& direction, float max_t, sSceneHit& hit) const;
+		//returns the instance that blocks the ray or -1
+		int testOcclusion(const Vector3f& origin, const Vector3f& direction, float max_t) const;
+
+		//radiance that leaves the hit towards the origin of the ray: emission + albedo * (indirect + direct lights with shadows)
+		//indirect is the irradiance / PI that arrives from everything else: ambient_light, or a previous bake that already contains it
+		//occluders receives the instances of the shadow rays blocked (can be NULL)
+		Vector3f shade(const sSceneHit& hit, const Vector3f& indirect, std::vector<int>* occluders = nullptr) const;
+		//irradiance / PI of the direct lights (with shadows) in a point of a surface, without the ambient
+		Vector3f computeDirect(const Vector3f& position, const Vector3f& normal, std::vector<int>* occluders = nullptr) const;
+		//linear albedo and emission of the material of the hit
+		void getSurface(const sSceneHit& hit, Vector3f& albedo, Vector3f& emission) const;
+		//how far the rays that leave a surface are moved out of it, depends on the size of the scene
+		float getBias() const;
+
+		//direction from position to the light and how far it is, false if it is in the same position
+		bool getLightDirection(const sLight& light, const Vector3f& position, Vector3f& L, float& distance) const;
+
+		//the collision BVH of the mesh, built the first time and kept by the mesh
+		static const GFX::TriangleBVH* getMeshBVH(GFX::Mesh* mesh);
+
+	private:
+		std::vector<GFX::Mesh*> instance_meshes; //only while building
+
+		void addNode(Node* node, BaseEntity* entity);
+	};
+
+};
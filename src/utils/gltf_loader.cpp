@@ -7,11 +7,22 @@
 
 #include "../gfx/mesh.h"
 #include "../gfx/texture.h"
+#include "../gfx/mipmaps.h"
 #include "../pipeline/material.h"
 #include "../pipeline/prefab.h"
 #include "../utils/utils.h"
 
 #include <iostream>
+#include <algorithm>
+#include <functional>
+#include <map>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+	#define GLTF_USE_SSE2
+	#include <emmintrin.h>
+#endif
+
+#define GLTF_UPLOAD_MS 2 //time per frame used to upload the primitives of the prefabs loaded asynchronously
 
 //** PARSING GLTF IS UGLY
 std::string base_folder;
@@ -22,217 +33,164 @@ std::string base_folder;
 	bool load_textures = true; //must textures be loadead?
 #endif
 
-void parseGLTFBufferVector4(std::vector<Vector4f>& container, cgltf_accessor* acc, cgltf_accessor* indices_acc = NULL)
+//unpacks one element of a normalized/integer accessor to floats, SSE version for the common 4 components case (colors, weights)
+static inline void unpackGLTFElement(float* out, const unsigned char* data, int num_components, cgltf_component_type type, bool normalized)
 {
-	int i = 0;
-
-	assert(acc->buffer_view->buffer->data);
-	unsigned char* data = (unsigned char*)(acc->buffer_view->buffer->data) + acc->buffer_view->offset + acc->offset;
-	if (acc->normalized)
-	{
-		//denormalize
-		//assert(!"TO DO");
-	}
-	int num_elements = acc->count;
-	std::vector<Vector4f> unindexed;
-	unindexed.resize(num_elements);
-
-	std::vector<float> values;
-
-	//sometimes colors are in 16u or 8u format, instead of 32f
-	if (acc->component_type != cgltf_component_type_r_32f)
+#ifdef GLTF_USE_SSE2
+	if (num_components == 4 && type != cgltf_component_type_r_32u)
 	{
-		if (acc->type != cgltf_type_vec4)
+		__m128i v;
+		int packed;
+		memcpy(&packed, data, sizeof(int));
+		float scale = 1.0f;
+		bool is_signed = false;
+		switch (type)
 		{
-			//not supported vec3 colors
-			return;
+		case cgltf_component_type_r_8u: //zero extend bytes to 32 bits
+			v = _mm_cvtsi32_si128(packed);
+			v = _mm_unpacklo_epi16(_mm_unpacklo_epi8(v, _mm_setzero_si128()), _mm_setzero_si128());
+			scale = 1.0f / 255.0f;
+			break;
+		case cgltf_component_type_r_8: //place bytes in the top of every lane and shift back keeping the sign
+			v = _mm_cvtsi32_si128(packed);
+			v = _mm_srai_epi32(_mm_unpacklo_epi16(_mm_setzero_si128(), _mm_unpacklo_epi8(_mm_setzero_si128(), v)), 24);
+			scale = 1.0f / 127.0f;
+			is_signed = true;
+			break;
+		case cgltf_component_type_r_16u:
+			v = _mm_unpacklo_epi16(_mm_loadl_epi64((const __m128i*)data), _mm_setzero_si128());
+			scale = 1.0f / 65535.0f;
+			break;
+		case cgltf_component_type_r_16:
+			v = _mm_srai_epi32(_mm_unpacklo_epi16(_mm_setzero_si128(), _mm_loadl_epi64((const __m128i*)data)), 16);
+			scale = 1.0f / 32767.0f;
+			is_signed = true;
+			break;
+		default:
+			v = _mm_setzero_si128();
 		}
-		//num elements per num components as values is vector of floats
-		values.resize(num_elements * 4);
-
-		if (acc->component_type == cgltf_component_type_r_16u)
+		__m128 f = _mm_cvtepi32_ps(v);
+		if (normalized)
 		{
-			int stride = acc->stride;
-			uint8* current = data;
-			for (size_t i = 0; i < num_elements; ++i)
-			{
-				for (size_t j = 0; j < 4; ++j)
-				{
-					values[i*4+j] = *(uint16*)(current+j*2);
-					if (acc->normalized) values[i * 4 + j] /= (float)0xFFFF;
-				}
-				current += stride;
-			}
+			f = _mm_mul_ps(f, _mm_set1_ps(scale));
+			if (is_signed)
+				f = _mm_max_ps(f, _mm_set1_ps(-1.0f));
 		}
-		else if (acc->component_type == cgltf_component_type_r_8u)
-		{
-			int stride = acc->stride;
-			uint8* current = data;
-			for (size_t i = 0; i < num_elements; ++i)
-			{
-				for (size_t j = 0; j < 4; ++j)
-				{
-					values[i * 4 + j] = *(current + j);
-					if (acc->normalized) values[i * 4 + j] /= (float)0xFFFF;
-				}
-				current += stride;
-			}
-		}
-		else
-			return;
-
-		acc->stride = sizeof(Vector4f);
-		data = (unsigned char*)&values[0];
-	}
-
-	//assert(acc->component_type == cgltf_component_type_r_32f && acc->type == cgltf_type_vec4);
-	if (acc->stride == sizeof(Vector4f))
-		memcpy(&unindexed[0], data, num_elements * sizeof(Vector4f));
-	else
-	{
-		//read every element one by one to jump the gap between them
-		for (int i = 0; i < num_elements; ++i)
-		{
-			memcpy(&unindexed[i], data, sizeof(Vector4f));
-			data += acc->stride;
-		}
-	}
-
-	if (!indices_acc)
-	{
-		container = unindexed;
+		_mm_storeu_ps(out, f);
 		return;
 	}
-
-	//deindex
-	container.resize(indices_acc->count);
-
-	unsigned char* indices = (unsigned char*)indices_acc->buffer_view->buffer->data + indices_acc->offset;
-	int stride = indices_acc->stride;
-	for (size_t i = 0; i < indices_acc->count; ++i)
+#endif
+	for (int j = 0; j < num_components; ++j)
 	{
-		size_t index = 0;
-		unsigned char* pos = indices + i * stride;
-		switch (indices_acc->component_type)
+		switch (type)
 		{
-		case cgltf_component_type_r_8u: index = (int)*pos; break;
-		case cgltf_component_type_r_16u: index = (int)*(unsigned short*)pos; break;
-		case cgltf_component_type_r_32u: index = (int)*(unsigned int*)pos; break;
+		case cgltf_component_type_r_8u: out[j] = normalized ? data[j] / 255.0f : data[j]; break;
+		case cgltf_component_type_r_8: out[j] = normalized ? (std::max)(((int8_t*)data)[j] / 127.0f, -1.0f) : ((int8_t*)data)[j]; break;
+		case cgltf_component_type_r_16u: out[j] = normalized ? ((uint16*)data)[j] / 65535.0f : ((uint16*)data)[j]; break;
+		case cgltf_component_type_r_16: out[j] = normalized ? (std::max)(((int16*)data)[j] / 32767.0f, -1.0f) : ((int16*)data)[j]; break;
+		case cgltf_component_type_r_32u: out[j] = (float)((uint32*)data)[j]; break;
+		default: out[j] = 0;
 		}
-		if (index < unindexed.size()) //sometimes indices are out of bounds
-			container[i] = unindexed[index];
-		else
-			std::cout << "index out of bounds:" << index << std::endl;
 	}
 }
 
-void parseGLTFBufferVector3(std::vector<Vector3f>& container, cgltf_accessor* acc, cgltf_accessor* indices_acc = NULL)
+//reads an accessor directly into the final container (with out_components floats per element), in a single pass.
+//Tightly packed float streams are a single memcpy, missing components (vec3 colors) are filled with 1
+bool parseGLTFBuffer(float* out, int out_components, cgltf_accessor* acc)
 {
-	int i = 0;
+	size_t num_elements = acc->count;
+	int num_components = (int)cgltf_num_components(acc->type);
+	int copy_components = (std::min)(num_components, out_components);
 
-	assert(acc->buffer_view->buffer->data);
-	unsigned char* data = (unsigned char*)(acc->buffer_view->buffer->data) + acc->buffer_view->offset + acc->offset;
-	if (acc->normalized)
-	{
-		//denormalize
-		assert(!"TO DO");
-	}
-	int num_elements = acc->count;
-	std::vector<Vector3f> unindexed;
-	unindexed.resize(num_elements);
-	assert(acc->component_type == cgltf_component_type_r_32f && acc->type == cgltf_type_vec3);
-	if (acc->stride == sizeof(Vector3f))
-		memcpy(&unindexed[0], data, num_elements * sizeof(Vector3f));
-	else
-	{
-		for (int i = 0; i < num_elements; ++i)
-		{
-			memcpy(&unindexed[i], data, sizeof(Vector3f));
-			data += acc->stride;
-		}
-	}
+	if (!num_elements)
+		return true;
 
-	if (!indices_acc)
+	//sparse accessors or accessors without data, let cgltf solve them
+	if (acc->is_sparse || !acc->buffer_view || !acc->buffer_view->buffer->data)
 	{
-		container = unindexed;
-		return;
+		std::vector<float> values(num_elements * num_components);
+		if (!cgltf_accessor_unpack_floats(acc, &values[0], values.size()))
+			return false;
+		for (size_t i = 0; i < num_elements; ++i)
+			for (int j = 0; j < out_components; ++j)
+				out[i * out_components + j] = j < num_components ? values[i * num_components + j] : 1.0f;
+		return true;
 	}
 
-	//deindex
-	container.resize(indices_acc->count);
+	unsigned char* data = (unsigned char*)(acc->buffer_view->buffer->data) + acc->buffer_view->offset + acc->offset;
+	size_t stride = acc->stride;
 
-	unsigned char* indices = (unsigned char*)indices_acc->buffer_view->buffer->data + indices_acc->offset;
-	int stride = indices_acc->stride;
-	for (size_t i = 0; i < indices_acc->count; ++i)
+	if (acc->component_type == cgltf_component_type_r_32f)
 	{
-		size_t index = 0;
-		unsigned char* pos = indices + i * stride;
-		switch (indices_acc->component_type)
+		if (num_components == out_components && stride == out_components * sizeof(float))
+			memcpy(out, data, num_elements * stride); //tightly packed
+		else
 		{
-		case cgltf_component_type_r_8u: index = (int)*pos; break;
-		case cgltf_component_type_r_16u: index = (int)*(unsigned short*)pos; break;
-		case cgltf_component_type_r_32u: index = (int)*(unsigned int*)pos; break;
+			//interleaved in the file, read every element one by one to jump the gap between them
+			for (size_t i = 0; i < num_elements; ++i)
+			{
+				memcpy(out + i * out_components, data, copy_components * sizeof(float));
+				data += stride;
+			}
 		}
-		if (index < unindexed.size()) //sometimes indices are out of bounds
-			container[i] = unindexed[index];
-		else
-			std::cout << "index out of bounds:" << index << std::endl;
 	}
-}
-
-void parseGLTFBufferVector2(std::vector<Vector2f>& container, cgltf_accessor* acc, cgltf_accessor* indices_acc = NULL)
-{
-	assert(acc->buffer_view->buffer->data);
-	unsigned char* data = (unsigned char*)(acc->buffer_view->buffer->data) + acc->offset + acc->buffer_view->offset;
-	if (acc->normalized)
-	{
-		//denormalize
-		assert(!"TO DO");
-	}
-	int num_elements = acc->count;
-	std::vector<Vector2f> unindexed;
-	unindexed.resize(num_elements);
-	assert(acc->component_type == cgltf_component_type_r_32f && acc->type == cgltf_type_vec2);
-	if (acc->stride == sizeof(Vector2f))
-		memcpy(&unindexed[0], data, num_elements * sizeof(Vector2f));
 	else
 	{
-		for (int i = 0; i < num_elements; ++i)
+		//quantized or normalized integers (KHR_mesh_quantization, 8/16 bits colors and weights)
+		float element[4];
+		for (size_t i = 0; i < num_elements; ++i)
 		{
-			memcpy(&unindexed[i], data, sizeof(Vector2f));
-			data += acc->stride;
+			if (num_components == out_components)
+				unpackGLTFElement(out + i * out_components, data, num_components, acc->component_type, acc->normalized);
+			else
+			{
+				unpackGLTFElement(element, data, copy_components, acc->component_type, acc->normalized);
+				memcpy(out + i * out_components, element, copy_components * sizeof(float));
+			}
+			data += stride;
 		}
 	}
 
-	if (!indices_acc)
-	{
-		container = unindexed;
-		return;
-	}
+	for (int j = copy_components; j < out_components; ++j)
+		for (size_t i = 0; i < num_elements; ++i)
+			out[i * out_components + j] = 1.0f;
+
+	return true;
+}
+
+void parseGLTFBufferVector4(std::vector<Vector4f>& container, cgltf_accessor* acc)
+{
+	container.resize(acc->count);
+	if (!parseGLTFBuffer(container.size() ? &container[0].x : NULL, 4, acc))
+		container.clear();
+}
 
-	//deindex
-	container.resize(indices_acc->count);
+void parseGLTFBufferVector3(std::vector<Vector3f>& container, cgltf_accessor* acc)
+{
+	container.resize(acc->count);
+	if (!parseGLTFBuffer(container.size() ? &container[0].x : NULL, 3, acc))
+		container.clear();
+}
 
-	assert(indices_acc->sparse.count == 0); //sparse not supported yet
+void parseGLTFBufferVector2(std::vector<Vector2f>& container, cgltf_accessor* acc)
+{
+	container.resize(acc->count);
+	if (!parseGLTFBuffer(container.size() ? &container[0].x : NULL, 2, acc))
+		container.clear();
+}
 
-	unsigned char* indices = (unsigned char*)indices_acc->buffer_view->buffer->data + indices_acc->offset;
-	int stride = indices_acc->stride;
-	for (size_t i = 0; i < indices_acc->count; ++i)
+//bone indices, the vertex shader reads them as unsigned bytes (max 256 bones)
+void parseGLTFBufferJoints(std::vector<Vector4ub>& container, cgltf_accessor* acc)
+{
+	container.resize(acc->count);
+	cgltf_uint joints[4];
+	for (size_t i = 0; i < acc->count; ++i)
 	{
-		unsigned int index = 0;
-		unsigned char* pos = indices + i * stride;
-		switch (indices_acc->component_type)
-		{
-		case cgltf_component_type_r_8u: index = static_cast<unsigned int>(*pos); break;
-		case cgltf_component_type_r_16u: index = static_cast<unsigned int>(*(unsigned short*)pos); break;
-		case cgltf_component_type_r_32u: index = static_cast<unsigned int>(*(unsigned int*)pos); break;
-		}
-		if (index < unindexed.size())  //sometimes indices are out of bounds
-			container[i] = unindexed[index];
-		else
-			std::cout << "index out of bounds:" << index << std::endl;
+		joints[0] = joints[1] = joints[2] = joints[3] = 0;
+		cgltf_accessor_read_uint(acc, i, joints, 4);
+		for (int j = 0; j < 4; ++j)
+			container[i].v[j] = (uint8)std::min<cgltf_uint>(joints[j], 255);
 	}
-
 }
 
 void parseGLTFBufferIndices(std::vector<unsigned int>& container, cgltf_accessor* acc)
@@ -244,6 +202,12 @@ void parseGLTFBufferIndices(std::vector<unsigned int>& container, cgltf_accessor
 
 	unsigned char* indices = (unsigned char*)acc->buffer_view->buffer->data + acc->buffer_view->offset + acc->offset;
 	int stride = acc->stride;
+	if (acc->component_type == cgltf_component_type_r_32u && stride == sizeof(unsigned int))
+	{
+		memcpy(final_indices, indices, acc->count * sizeof(unsigned int));
+		return;
+	}
+
 	for (int i = 0; i < acc->count; ++i)
 	{
 		unsigned int index = 0;
@@ -258,9 +222,95 @@ void parseGLTFBufferIndices(std::vector<unsigned int>& container, cgltf_accessor
 	}
 }
 
-std::vector<GFX::Mesh*> parseGLTFMesh(cgltf_mesh* meshdata, const char* basename)
+//work collected while walking the nodes, the CPU parsing is done in parallel afterwards
+//and only the GL uploads are done in the main thread
+struct sGLTFImportContext {
+	struct sPrimitiveJob {
+		GFX::Mesh* mesh;
+		cgltf_primitive* primitive;
+		std::string name; //empty if the mesh must not be registered
+	};
+	std::vector<sPrimitiveJob> primitives;
+	std::map<cgltf_mesh*, std::vector<GFX::Mesh*>> meshes; //meshes already scheduled from this file
+	std::map<std::string, GFX::Mesh*> meshes_by_name;
+	std::map<cgltf_image*, GFX::Texture*> images; //images shared by several materials are decoded once
+};
+
+//only CPU work, it is safe to call it from any thread
+void parseGLTFPrimitive(GFX::Mesh* mesh, cgltf_primitive* primitive)
 {
-	std::vector<GFX::Mesh*> result;
+	//streams
+	for (size_t j = 0; j < primitive->attributes_count; ++j)
+	{
+		cgltf_attribute* attr = &primitive->attributes[j];
+
+		//std::string attrname = attr->name;
+		if (attr->type == cgltf_attribute_type_position)
+		{
+			parseGLTFBufferVector3(mesh->vertices, attr->data);
+			if (attr->data->has_min && attr->data->has_max)
+			{
+				mesh->aabb_min = attr->data->min;
+				mesh->aabb_max = attr->data->max;
+				mesh->box.center = (mesh->aabb_max + mesh->aabb_min) * 0.5f;
+				mesh->box.halfsize = mesh->aabb_max - mesh->box.center;
+			}
+			else
+				mesh->updateBoundingBox();
+		}
+		else
+		if (attr->type == cgltf_attribute_type_normal)
+			parseGLTFBufferVector3(mesh->normals, attr->data);
+		else
+		if (attr->type == cgltf_attribute_type_texcoord)
+		{
+			if (strcmp(attr->name,"TEXCOORD_1") == 0) //secondary UV set
+				parseGLTFBufferVector2(mesh->m_uvs1, attr->data);
+			else
+				parseGLTFBufferVector2(mesh->uvs, attr->data);
+		}
+		else
+		if (attr->type == cgltf_attribute_type_color)
+		{
+			parseGLTFBufferVector4(mesh->colors, attr->data);
+		}
+		else
+		if (attr->type == cgltf_attribute_type_weights)
+		{
+			if (strcmp(attr->name, "WEIGHTS_0") == 0)
+				parseGLTFBufferVector4(mesh->weights, attr->data);
+		}
+		else
+		if (attr->type == cgltf_attribute_type_joints)
+		{
+			if (strcmp(attr->name, "JOINTS_0") == 0) //only 4 bones per vertex
+				parseGLTFBufferJoints(mesh->bones, attr->data);
+		}
+	}
+
+	if (primitive->indices && primitive->indices->count)
+		parseGLTFBufferIndices(mesh->m_indices, primitive->indices);
+}
+
+//parses all the scheduled primitives using every core, the calling thread also works
+void parseGLTFPrimitives(std::vector<sGLTFImportContext::sPrimitiveJob>& jobs)
+{
+	TaskManager::background.parallelFor(jobs.size(), [&](size_t i) {
+		//named primitives may have been processed already by the cooker
+		if (use_cooked_assets && jobs[i].name.size() && jobs[i].mesh->readBin(getCookedFilename(jobs[i].name, ".mbin").c_str()))
+			return;
+		parseGLTFPrimitive(jobs[i].mesh, jobs[i].primitive);
+	});
+}
+
+//returns one mesh per primitive, new meshes are empty until parseGLTFPrimitives is called
+std::vector<GFX::Mesh*> parseGLTFMesh(cgltf_mesh* meshdata, const char* basename, sGLTFImportContext* context)
+{
+	auto it = context->meshes.find(meshdata);
+	if (it != context->meshes.end())
+		return it->second;
+
+	std::vector<GFX::Mesh*>& result = context->meshes[meshdata];
 
 	//if (meshdata->name)
 	//	stdlog( std::string("\t<- MESH: ") + meshdata->name);
@@ -276,6 +326,8 @@ std::vector<GFX::Mesh*> parseGLTFMesh(cgltf_mesh* meshdata, const char* basename
 		{
 			submesh_name = std::string(basename) + std::string("::") + std::string(meshdata->name) + std::string("::") + std::to_string(i);
 			mesh = GFX::Mesh::Get(submesh_name.c_str(), true);
+			if (!mesh && context->meshes_by_name.count(submesh_name))
+				mesh = context->meshes_by_name[submesh_name];
 			if (mesh)
 			{
 				result.push_back(mesh);
@@ -284,76 +336,30 @@ std::vector<GFX::Mesh*> parseGLTFMesh(cgltf_mesh* meshdata, const char* basename
 		}
 
 		mesh = new GFX::Mesh();
-
-        //streams
-		for (size_t j = 0; j < primitive->attributes_count; ++j)
-		{
-			cgltf_attribute* attr = &primitive->attributes[j];
-
-            //std::string attrname = attr->name;
-			if (attr->type == cgltf_attribute_type_position)
-			{
-				parseGLTFBufferVector3(mesh->vertices, attr->data);
-				if (attr->data->has_min && attr->data->has_max)
-				{
-					mesh->aabb_min = attr->data->min;
-					mesh->aabb_max = attr->data->max;
-					mesh->box.center = (mesh->aabb_max + mesh->aabb_min) * 0.5f;
-					mesh->box.halfsize = mesh->aabb_max - mesh->box.center;
-				}
-				else
-					mesh->updateBoundingBox();
-			}
-			else
-			if (attr->type == cgltf_attribute_type_normal)
-				parseGLTFBufferVector3(mesh->normals, attr->data);
-			else
-			if (attr->type == cgltf_attribute_type_texcoord)
-			{
-				if (strcmp(attr->name,"TEXCOORD_1") == 0) //secondary UV set
-					parseGLTFBufferVector2(mesh->m_uvs1, attr->data);
-				else
-					parseGLTFBufferVector2(mesh->uvs, attr->data);
-			}
-			else
-			if (attr->type == cgltf_attribute_type_color)
-			{
-				parseGLTFBufferVector4(mesh->colors, attr->data);
-			}
-			else
-			if (attr->type == cgltf_attribute_type_weights)
-			{
-				parseGLTFBufferVector4(mesh->weights, attr->data);
-			}
-			else
-			if (attr->type == cgltf_attribute_type_joints)
-			{
-				//parseGLTFBufferVector4(mesh->bones, attr->data);
-			}
-
-			if (primitive->indices && primitive->indices->count)
-				parseGLTFBufferIndices(mesh->m_indices, primitive->indices);
-		}
-		mesh->uploadToVRAM();
+		context->primitives.push_back({ mesh, primitive, submesh_name });
 		if (meshdata->name)
-			mesh->registerMesh(submesh_name);
+			context->meshes_by_name[submesh_name] = mesh;
 		result.push_back(mesh);
 	}
 
 	return result;
 }
 
+#ifndef SKIP_GL //the assets library imports only the geometry
 int GLTF_TEXTURE_LAST_ID = 1;
 
-GFX::Texture* parseGLTFTexture(cgltf_image* image, const char* filename)
+//embedded images are decoded in the background threads, a placeholder is returned meanwhile
+GFX::Texture* parseGLTFImage(cgltf_image* image, const char* filename, const GFX::MipGenerator::sOptions& options)
 {
-	if (!load_textures || !image )
-		return NULL;
-
 	std::string fullpath = filename ? filename : "";
 
 	if (image->uri)
-		return GFX::Texture::GetAsync((std::string(base_folder) + "/" + image->uri).c_str());
+	{
+		fullpath = std::string(base_folder) + "/" + image->uri;
+		if (!GFX::Texture::Find(fullpath.c_str()))
+			GFX::MipGenerator::setOptions(fullpath, options);
+		return GFX::Texture::GetAsync(fullpath.c_str());
+	}
 	else
 	if (filename)
 	{
@@ -371,43 +377,62 @@ GFX::Texture* parseGLTFTexture(cgltf_image* image, const char* filename)
 
 	if (image->buffer_view)
 	{
-		Image img;
-		std::vector<unsigned char> buffer;
-		buffer.resize(image->buffer_view->size);
-		memcpy(&buffer[0], (char*)image->buffer_view->buffer->data + image->buffer_view->offset, image->buffer_view->size);
-
-		if (!strcmp(image->mime_type, "image/png"))
-			img.loadPNG(buffer);
-		else if (!strcmp(image->mime_type, "image/jpeg"))
-			img.loadJPG(buffer);
-		else
+		const char* mime_type = image->mime_type ? image->mime_type : "";
+		if (strcmp(mime_type, "image/png") && strcmp(mime_type, "image/jpeg"))
 		{
-			stdlog(std::string("image format not supported: ") + image->mime_type);
+			stdlog(std::string("image format not supported: ") + mime_type);
 			return NULL;
 		}
-		if (!img.width)
-		{
-			stdlog(std::string("image encoding has error: ") + image->mime_type);
-			return NULL;
-		}
-		GFX::Texture* tex = new GFX::Texture();
-		tex->loadFromImage(&img);
+
+		std::vector<uint8> buffer;
+		buffer.resize(image->buffer_view->size);
+		memcpy(&buffer[0], (char*)image->buffer_view->buffer->data + image->buffer_view->offset, image->buffer_view->size);
+
+		GFX::MipGenerator::setOptions(fullpath, options);
+		GFX::Texture* tex = GFX::Texture::DecodeAsync(fullpath.c_str(), buffer);
 		if (filename)
-		{
-			tex->setName(fullpath.c_str());
 			stdlog(std::string("\t<- TEXTURE: ") + fullpath);
-		}
 		else
-			stdlog(std::string(" TEXTURE: UNNAMED ") + image->mime_type );
+			stdlog(std::string(" TEXTURE: UNNAMED ") + mime_type);
 
 		return tex;
 	}
 	else
-		stdlog(std::string(" No texture data") + image->mime_type);
+		stdlog(std::string(" No texture data") + (image->mime_type ? image->mime_type : ""));
+	return NULL;
+}
+#endif
+
+//how the mips of the texture of a channel are built (color space, normals, alpha test)
+GFX::MipGenerator::sOptions getGLTFTextureOptions(cgltf_material* matdata, SCN::eTextureChannel channel)
+{
+	GFX::MipGenerator::sOptions options;
+	options.filter = GFX::MipGenerator::instance().default_filter;
+	options.normal_map = channel == SCN::eTextureChannel::NORMALMAP;
+	options.srgb = channel == SCN::eTextureChannel::ALBEDO || channel == SCN::eTextureChannel::EMISSIVE;
+	if (channel == SCN::eTextureChannel::ALBEDO && matdata->alpha_mode == cgltf_alpha_mode_mask)
+		options.alpha_cutoff = matdata->alpha_cutoff;
+	return options;
+}
+
+GFX::Texture* parseGLTFTexture(cgltf_image* image, const char* filename, sGLTFImportContext* context, const GFX::MipGenerator::sOptions& options)
+{
+#ifdef SKIP_GL
 	return NULL;
+#else
+	if (!load_textures || !image )
+		return NULL;
+
+	auto it = context->images.find(image);
+	if (it != context->images.end())
+		return it->second;
+	GFX::Texture* texture = parseGLTFImage(image, filename, options);
+	context->images[image] = texture;
+	return texture;
+#endif
 }
 
-SCN::Material* parseGLTFMaterial(cgltf_material* matdata, const char* basename)
+SCN::Material* parseGLTFMaterial(cgltf_material* matdata, const char* basename, sGLTFImportContext* context)
 {
 	SCN::Material* material = NULL;
 	std::string name;
@@ -431,7 +456,7 @@ SCN::Material* parseGLTFMaterial(cgltf_material* matdata, const char* basename)
 	//normalmap
 	if (matdata->normal_texture.texture)
 	{
-		material->textures[SCN::eTextureChannel::NORMALMAP].texture = parseGLTFTexture( matdata->normal_texture.texture->image, matdata->normal_texture.texture->name);
+		material->textures[SCN::eTextureChannel::NORMALMAP].texture = parseGLTFTexture( matdata->normal_texture.texture->image, matdata->normal_texture.texture->name, context, getGLTFTextureOptions(matdata, SCN::eTextureChannel::NORMALMAP));
 		material->textures[SCN::eTextureChannel::NORMALMAP].uv_channel = matdata->normal_texture.texcoord;
 	}
 
@@ -439,7 +464,7 @@ SCN::Material* parseGLTFMaterial(cgltf_material* matdata, const char* basename)
 	material->emissive_factor = matdata->emissive_factor;
 	if (matdata->emissive_texture.texture)
 	{
-		material->textures[SCN::eTextureChannel::EMISSIVE].texture = parseGLTFTexture(matdata->emissive_texture.texture->image, matdata->emissive_texture.texture->name);
+		material->textures[SCN::eTextureChannel::EMISSIVE].texture = parseGLTFTexture(matdata->emissive_texture.texture->image, matdata->emissive_texture.texture->name, context, getGLTFTextureOptions(matdata, SCN::eTextureChannel::EMISSIVE));
 		material->textures[SCN::eTextureChannel::EMISSIVE].uv_channel = matdata->emissive_texture.texcoord;
 	}
 
@@ -448,7 +473,7 @@ SCN::Material* parseGLTFMaterial(cgltf_material* matdata, const char* basename)
 	if (matdata->has_pbr_specular_glossiness)
 	{
 		if (matdata->pbr_specular_glossiness.diffuse_texture.texture)
-			material->textures[SCN::eTextureChannel::ALBEDO].texture = parseGLTFTexture(matdata->pbr_specular_glossiness.diffuse_texture.texture->image, matdata->pbr_specular_glossiness.diffuse_texture.texture->name);
+			material->textures[SCN::eTextureChannel::ALBEDO].texture = parseGLTFTexture(matdata->pbr_specular_glossiness.diffuse_texture.texture->image, matdata->pbr_specular_glossiness.diffuse_texture.texture->name, context, getGLTFTextureOptions(matdata, SCN::eTextureChannel::ALBEDO));
 	}
 	if (matdata->has_pbr_metallic_roughness)
 	{
@@ -460,12 +485,12 @@ SCN::Material* parseGLTFMaterial(cgltf_material* matdata, const char* basename)
 		{
 			if (matdata->pbr_metallic_roughness.base_color_texture.texture)
 			{
-				material->textures[SCN::eTextureChannel::ALBEDO].texture = parseGLTFTexture(matdata->pbr_metallic_roughness.base_color_texture.texture->image, matdata->pbr_metallic_roughness.base_color_texture.texture->name);
+				material->textures[SCN::eTextureChannel::ALBEDO].texture = parseGLTFTexture(matdata->pbr_metallic_roughness.base_color_texture.texture->image, matdata->pbr_metallic_roughness.base_color_texture.texture->name, context, getGLTFTextureOptions(matdata, SCN::eTextureChannel::ALBEDO));
 				material->textures[SCN::eTextureChannel::ALBEDO].uv_channel = matdata->pbr_metallic_roughness.base_color_texture.texcoord;
 			}
 			if (matdata->pbr_metallic_roughness.metallic_roughness_texture.texture)
 			{
-				material->textures[SCN::eTextureChannel::METALLIC_ROUGHNESS].texture = parseGLTFTexture(matdata->pbr_metallic_roughness.metallic_roughness_texture.texture->image, matdata->pbr_metallic_roughness.metallic_roughness_texture.texture->name);
+				material->textures[SCN::eTextureChannel::METALLIC_ROUGHNESS].texture = parseGLTFTexture(matdata->pbr_metallic_roughness.metallic_roughness_texture.texture->image, matdata->pbr_metallic_roughness.metallic_roughness_texture.texture->name, context, getGLTFTextureOptions(matdata, SCN::eTextureChannel::METALLIC_ROUGHNESS));
 				material->textures[SCN::eTextureChannel::METALLIC_ROUGHNESS].uv_channel = matdata->pbr_metallic_roughness.metallic_roughness_texture.texcoord;
 			}
 		}
@@ -473,7 +498,7 @@ SCN::Material* parseGLTFMaterial(cgltf_material* matdata, const char* basename)
 
 	if (matdata->occlusion_texture.texture)
 	{
-		material->textures[SCN::eTextureChannel::OCCLUSION].texture = parseGLTFTexture(matdata->occlusion_texture.texture->image, matdata->occlusion_texture.texture->name);
+		material->textures[SCN::eTextureChannel::OCCLUSION].texture = parseGLTFTexture(matdata->occlusion_texture.texture->image, matdata->occlusion_texture.texture->name, context, getGLTFTextureOptions(matdata, SCN::eTextureChannel::OCCLUSION));
 		material->textures[SCN::eTextureChannel::OCCLUSION].uv_channel = matdata->occlusion_texture.texcoord;
 	}
 
@@ -500,8 +525,38 @@ void parseGLTFTransform(cgltf_node* node, Matrix44 &model)
 	}
 }
 
+//bones of a skinned mesh, the name of every bone is the name of the node that moves it
+void parseGLTFSkin(cgltf_skin* skin, GFX::Mesh* mesh)
+{
+	if (mesh->bones_info.size()) //already has them (shared mesh or loaded from cache)
+		return;
+
+	mesh->bones_info.resize(skin->joints_count);
+	mesh->bind_matrix.setIdentity();
+	for (size_t i = 0; i < skin->joints_count; ++i)
+	{
+		BoneInfo& info = mesh->bones_info[i];
+		cgltf_node* joint = skin->joints[i];
+		if (joint->name)
+		{
+			strncpy(info.name, joint->name, sizeof(info.name) - 1);
+			info.name[sizeof(info.name) - 1] = 0;
+		}
+		else
+			snprintf(info.name, sizeof(info.name), "joint_%d", (int)i);
+
+		//glTF matrices are column major, same memory layout as Matrix44
+		info.bind_pose.setIdentity();
+		if (skin->inverse_bind_matrices)
+			cgltf_accessor_read_float(skin->inverse_bind_matrices, i, info.bind_pose.m, 16);
+	}
+
+	if (skin->joints_count > 256)
+		std::cout << "[WARN] skin with more than 256 bones, not supported" << std::endl;
+}
+
 //GLTF PARSING: you can pass the node or it will create it
-SCN::Node* parseGLTFNode(cgltf_node* node, SCN::Node* scenenode = NULL, const char* basename = NULL)
+SCN::Node* parseGLTFNode(cgltf_node* node, sGLTFImportContext* context, SCN::Node* scenenode = NULL, const char* basename = NULL)
 {
 	if (scenenode == NULL)
 		scenenode = new SCN::Node();
@@ -520,14 +575,16 @@ SCN::Node* parseGLTFNode(cgltf_node* node, SCN::Node* scenenode = NULL, const ch
 		if (node->mesh->primitives_count > 1)
 		{
 			std::vector<GFX::Mesh*> meshes;
-			meshes = parseGLTFMesh(node->mesh, basename);
+			meshes = parseGLTFMesh(node->mesh, basename, context);
 
 			for (size_t i = 0; i < node->mesh->primitives_count; ++i)
 			{
 				SCN::Node* subnode = new SCN::Node();
 				subnode->mesh = meshes[i];
+				if (node->skin)
+					parseGLTFSkin(node->skin, meshes[i]);
 				if (node->mesh->primitives[i].material)
-					subnode->material = parseGLTFMaterial(node->mesh->primitives[i].material, basename );
+					subnode->material = parseGLTFMaterial(node->mesh->primitives[i].material, basename, context);
 				scenenode->addChild(subnode);
 			}
 		}
@@ -539,20 +596,23 @@ SCN::Node* parseGLTFNode(cgltf_node* node, SCN::Node* scenenode = NULL, const ch
 			if (!scenenode->mesh)
 			{
 				std::vector<GFX::Mesh*> meshes;
-				meshes = parseGLTFMesh(node->mesh, basename);
+				meshes = parseGLTFMesh(node->mesh, basename, context);
 				//printf("Parsed GLTF mesh %s (success)\n", node->name);
 				//return nullptr;
 				if(meshes.size())
 					scenenode->mesh = meshes[0];
 			}
 
+			if (node->skin && scenenode->mesh)
+				parseGLTFSkin(node->skin, scenenode->mesh);
+
 			if (node->mesh->primitives->material)
-				scenenode->material = parseGLTFMaterial(node->mesh->primitives->material, basename );
+				scenenode->material = parseGLTFMaterial(node->mesh->primitives->material, basename, context);
 		}
 	}
 
 	for (size_t i = 0; i < node->children_count; ++i)
-		scenenode->addChild(parseGLTFNode(node->children[i],NULL, basename));
+		scenenode->addChild(parseGLTFNode(node->children[i], context, NULL, basename));
 
 	return scenenode;
 }
@@ -585,10 +645,10 @@ cgltf_result internalOpenMemory(const struct cgltf_memory_options* memory_option
 	return cgltf_result_success;
 }
 
-SCN::Prefab* loadGLTF(const char *filename, cgltf_data *data, cgltf_options& options)
+//builds the tree of nodes, materials start decoding their images in the background and primitives are only scheduled
+//must be called from the main thread (it creates textures and registers materials)
+void buildGLTFPrefab(const char* filename, cgltf_data* data, SCN::Prefab* prefab, sGLTFImportContext& context)
 {
-	cgltf_result result;
-
 	if (data->scenes_count > 1)
 		std::cout << "[WARN] more than one scene, skipping the rest" << std::endl;
 
@@ -596,68 +656,75 @@ SCN::Prefab* loadGLTF(const char *filename, cgltf_data *data, cgltf_options& opt
 	cgltf_scene* scene = &data->scenes[0];
 
 	char folder[1024];
-	char basename[1024];
 	strcpy(folder, filename);
 	char* name_start = strrchr(folder, '/');
-	*name_start = '\0';
+	if (name_start)
+		*name_start = '\0';
 	base_folder = folder; //global
-	const char* basename_start = strrchr(filename, '/');
-	strcpy(basename, basename_start+1);
 
+	if (scene->nodes_count > 1)
 	{
-		result = cgltf_load_buffers(&options, data, filename);
-		if (result != cgltf_result_success) {
-			stdlog(std::string("[BIN NOT FOUND]:") + filename);
-			return NULL;
+		for (size_t i = 0; i < scene->nodes_count; ++i)
+		{
+			SCN::Node *node = parseGLTFNode(scene->nodes[i], &context, NULL, filename);
+			prefab->root.addChild(node);
 		}
 	}
-
-	SCN::Prefab* prefab = new SCN::Prefab();
-
+	else
 	{
-		if (scene->nodes_count > 1)
-		{
-			cgltf_node *root = nullptr;
-			float fiTotal = 1.0f / (float) scene->nodes_count;
-			for (size_t i = 0; i < scene->nodes_count; ++i)
-			{
-				float fProgress = ((float) i * fiTotal) * 100.0f;
-				SCN::Node *node = parseGLTFNode(scene->nodes[i], NULL, filename);
-				prefab->root.addChild(node);
-			}
-		}
-		else
-		{
-			parseGLTFNode(scene->nodes[0], &prefab->root, filename);
-		}
+		parseGLTFNode(scene->nodes[0], &context, &prefab->root, filename);
 	}
+}
 
-
-	//fetch first valid node (glTF sometime have lots of nested empty nodes 
-	/*
-	Matrix44 model;
-	if (1)
+//GL calls only from the main thread, returns false if the time budget ends before uploading all the primitives
+bool uploadGLTFPrimitives(sGLTFImportContext& context, size_t& next, long max_ms = -1)
+{
+	long start = getTime();
+	for (; next < context.primitives.size(); ++next)
 	{
-		while (node->children_count == 1 && !node->mesh)
-		{
-			Matrix44 temp;
-			parseGLTFTransform(node, temp);
-			model = temp * model;
-			node = node->children[0];
-		}
+		if (max_ms >= 0 && getTime() - start > max_ms)
+			return false;
+		auto& job = context.primitives[next];
+		if (GFX::Mesh::auto_upload_to_vram)
+			job.mesh->uploadToVRAM();
+		if (job.name.size())
+			job.mesh->registerMesh(job.name);
 	}
-	*/
-	//prefab->root.model = model;
+	return true;
+}
 
+void finishGLTFPrefab(const char* filename, cgltf_data* data, SCN::Prefab* prefab)
+{
 	prefab->updateNodesByName();
 	prefab->updateBounding();
 
 	//frees all data, including bin
 	cgltf_free(data);
 
-    stdlog( std::string(" - Loaded ") + filename );
+	stdlog( std::string(" - Loaded ") + filename );
+}
 
-    return prefab;
+SCN::Prefab* loadGLTF(const char *filename, cgltf_data *data, cgltf_options& options)
+{
+	cgltf_result result = cgltf_load_buffers(&options, data, filename);
+	if (result != cgltf_result_success) {
+		stdlog(std::string("[BIN NOT FOUND]:") + filename);
+		cgltf_free(data);
+		return NULL;
+	}
+
+	SCN::Prefab* prefab = new SCN::Prefab();
+	sGLTFImportContext context;
+	buildGLTFPrefab(filename, data, prefab, context);
+
+	//parse the geometry of all the primitives in parallel
+	parseGLTFPrimitives(context.primitives);
+
+	size_t next = 0;
+	uploadGLTFPrimitives(context, next);
+
+	finishGLTFPrefab(filename, data, prefab);
+	return prefab;
 }
 
 SCN::Prefab* loadGLTF(const std::vector<unsigned char>& dat, const std::string& path)
@@ -677,6 +744,80 @@ SCN::Prefab* loadGLTF(const std::vector<unsigned char>& dat, const std::string&
 	return loadGLTF(path.c_str(), data, options);
 }
 
+//state of a prefab being imported, it travels between the background threads and the main thread
+struct sGLTFAsyncImport {
+	std::string filename;
+	SCN::Prefab* prefab;
+	cgltf_data* data;
+	cgltf_options options;
+	sGLTFImportContext context;
+	size_t next_upload;
+};
+
+void uploadGLTFAsync(sGLTFAsyncImport* import)
+{
+	//a few primitives per frame so the frame rate does not drop
+	if (!uploadGLTFPrimitives(import->context, import->next_upload, GLTF_UPLOAD_MS))
+	{
+		TaskManager::foreground.addTask(new Task(std::bind(uploadGLTFAsync, import)));
+		return;
+	}
+
+	finishGLTFPrefab(import->filename.c_str(), import->data, import->prefab);
+	import->prefab->loading = false;
+	delete import;
+}
+
+void loadGLTFAsync(const char* filename, SCN::Prefab* prefab)
+{
+	std::cout << "loading gltf async " << TermColor::YELLOW << filename << TermColor::DEFAULT << " ..." << std::endl;
+	sGLTFAsyncImport* import = new sGLTFAsyncImport();
+	import->filename = filename;
+	import->prefab = prefab;
+	import->data = NULL;
+	import->next_upload = 0;
+	memset(&import->options, 0, sizeof(cgltf_options));
+	import->options.file.read = internalOpenFile;
+	prefab->loading = true;
+
+	//background: read and parse the files
+	TaskManager::background.addTask(new Task([import]() {
+		const char* filename = import->filename.c_str();
+		if (cgltf_parse_file(&import->options, filename, &import->data) != cgltf_result_success)
+			import->data = NULL;
+		else if (cgltf_load_buffers(&import->options, import->data, filename) != cgltf_result_success)
+		{
+			cgltf_free(import->data);
+			import->data = NULL;
+		}
+
+		//main thread: nodes, materials and textures
+		TaskManager::foreground.addTask(new Task([import]() {
+			if (!import->data)
+			{
+				std::cout << "[ERROR]: Prefab not found: " << import->filename << std::endl;
+				//the entities that asked for it still point to it, so it is not deleted
+				import->prefab->unregisterPrefab();
+				import->prefab->failed = true;
+				import->prefab->loading = false;
+				delete import;
+				return;
+			}
+			buildGLTFPrefab(import->filename.c_str(), import->data, import->prefab, import->context);
+
+			//background: geometry
+			TaskManager::background.addTask(new Task([import]() {
+				parseGLTFPrimitives(import->context.primitives);
+				TaskManager::foreground.addTask(new Task([import]() {
+					//the bounding of the geometry replaces the placeholder while the primitives are uploaded
+					import->prefab->updateBounding();
+					uploadGLTFAsync(import);
+				}));
+			}));
+		}));
+	}));
+}
+
 SCN::Prefab* loadGLTF(const char* filename)
 {
 	std::cout << "loading gltf " << TermColor::YELLOW << filename << TermColor::DEFAULT << " ..." << std::endl;
@@ -697,3 +838,30 @@ SCN::Prefab* loadGLTF(const char* filename)
 	return loadGLTF(filename, data, options);
 }
 
+std::map<std::string, GFX::MipGenerator::sOptions> getGLTFImageOptions(const char* filename)
+{
+	std::map<std::string, GFX::MipGenerator::sOptions> result;
+	cgltf_options options = {};
+	cgltf_data* data = NULL;
+	if (cgltf_parse_file(&options, filename, &data) != cgltf_result_success)
+		return result;
+
+	std::string folder = getFolderName(filename);
+	for (cgltf_size i = 0; i < data->materials_count; ++i)
+	{
+		cgltf_material* matdata = &data->materials[i];
+		std::pair<cgltf_texture*, SCN::eTextureChannel> channels[] = {
+			{ matdata->normal_texture.texture, SCN::eTextureChannel::NORMALMAP },
+			{ matdata->emissive_texture.texture, SCN::eTextureChannel::EMISSIVE },
+			{ matdata->occlusion_texture.texture, SCN::eTextureChannel::OCCLUSION },
+			{ matdata->has_pbr_specular_glossiness ? matdata->pbr_specular_glossiness.diffuse_texture.texture : NULL, SCN::eTextureChannel::ALBEDO },
+			{ matdata->has_pbr_metallic_roughness ? matdata->pbr_metallic_roughness.base_color_texture.texture : NULL, SCN::eTextureChannel::ALBEDO },
+			{ matdata->has_pbr_metallic_roughness ? matdata->pbr_metallic_roughness.metallic_roughness_texture.texture : NULL, SCN::eTextureChannel::METALLIC_ROUGHNESS }
+		};
+		for (auto& channel : channels)
+			if (channel.first && channel.first->image && channel.first->image->uri && !result.count(folder + "/" + channel.first->image->uri))
+				result[folder + "/" + channel.first->image->uri] = getGLTFTextureOptions(matdata, channel.second);
+	}
+	cgltf_free(data);
+	return result;
+}
@@ -1,7 +1,18 @@
 #pragma once
 
+#include <map>
+
 #include "../pipeline/prefab.h"
+#include "../gfx/mipmaps.h"
+
+extern bool load_textures; //the cooker imports only the geometry
 
 SCN::Prefab* loadGLTF(const char* filename);
 //GTR::Prefab* loadGLTF(const char* filename, cgltf_data* data, cgltf_options& options);
 SCN::Prefab* loadGLTF(const std::vector<unsigned char>& data, const std::string& path);
+
+//fills the prefab in the next frames: files and geometry are parsed in the background, nodes and uploads in the main thread
+void loadGLTFAsync(const char* filename, SCN::Prefab* prefab);
+
+//how the materials use every image referenced by the file (path from the folder of the glTF), the cooker needs it before decoding them
+std::map<std::string, GFX::MipGenerator::sOptions> getGLTFImageOptions(const char* filename);
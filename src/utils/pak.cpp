@@ -0,0 +1,488 @@
+#include "pak.h"
+
+#include <cassert>
+#include <cstring>
+#include <iostream>
+#include <algorithm>
+
+#include "utils.h"
+#include "../core/core.h"
+#include "../core/task.h"
+
+#ifdef WIN32
+	#include <windows.h>
+#else
+	#include <sys/mman.h>
+	#include <sys/stat.h>
+	#include <fcntl.h>
+	#include <unistd.h>
+#endif
+
+#define PAK_HASH_BITS 16 //entries of the match finder of the compressor
+#define PAK_MIN_MATCH 4
+#define PAK_MAX_OFFSET 65535
+
+std::vector<Pak*> Pak::s_mounted;
+
+Pak::Pak()
+{
+	data = NULL;
+	data_size = 0;
+	header = NULL;
+	entries = NULL;
+#ifdef WIN32
+	file_handle = NULL;
+	mapping_handle = NULL;
+#endif
+}
+
+Pak::~Pak()
+{
+	close();
+}
+
+bool Pak::open(const char* filename)
+{
+	assert(filename);
+	close();
+
+#ifdef WIN32
+	HANDLE file = CreateFileA(filename, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_FLAG_RANDOM_ACCESS, NULL);
+	if (file == INVALID_HANDLE_VALUE)
+		return false;
+	LARGE_INTEGER size;
+	GetFileSizeEx(file, &size);
+	HANDLE mapping = CreateFileMappingA(file, NULL, PAGE_READONLY, 0, 0, NULL);
+	void* view = mapping ? MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0) : NULL;
+	if (!view)
+	{
+		if (mapping)
+			CloseHandle(mapping);
+		CloseHandle(file);
+		return false;
+	}
+	file_handle = file;
+	mapping_handle = mapping;
+	data_size = (size_t)size.QuadPart;
+#else
+	int fd = ::open(filename, O_RDONLY);
+	if (fd == -1)
+		return false;
+	struct stat stbuffer;
+	if (fstat(fd, &stbuffer) != 0 || stbuffer.st_size == 0)
+	{
+		::close(fd);
+		return false;
+	}
+	void* view = mmap(NULL, stbuffer.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	::close(fd); //the mapping keeps the file alive
+	if (view == MAP_FAILED)
+		return false;
+	data_size = (size_t)stbuffer.st_size;
+#endif
+
+	data = (const unsigned char*)view;
+	header = (const sHeader*)data;
+
+	//validate before trusting any offset
+	if (data_size < sizeof(sHeader) || memcmp(header->magic, "GPAK", 4) != 0 || header->version != PAK_VERSION ||
+		header->toc_offset > data_size || (uint64_t)header->num_entries * sizeof(sEntry) > data_size - header->toc_offset ||
+		header->names_offset > data_size || header->names_size > data_size - header->names_offset)
+	{
+		std::cout << "[ERROR] invalid pak: " << filename << std::endl;
+		close();
+		return false;
+	}
+
+	entries = (const sEntry*)(data + header->toc_offset);
+
+	//validate every entry now so find/getName/read can trust them later
+	const char* names = (const char*)(data + header->names_offset);
+	for (uint32_t i = 0; i < header->num_entries; ++i)
+	{
+		const sEntry& entry = entries[i];
+		bool valid = entry.name_offset < header->names_size &&
+			memchr(names + entry.name_offset, 0, header->names_size - entry.name_offset) != NULL &&
+			entry.offset <= data_size && entry.stored_size <= data_size - entry.offset && //no overflow
+			((entry.flags & COMPRESSED) || entry.stored_size == entry.size);
+		if (!valid)
+		{
+			std::cout << "[ERROR] invalid pak entry " << i << ": " << filename << std::endl;
+			close();
+			return false;
+		}
+	}
+
+	this->filename = filename;
+	return true;
+}
+
+void Pak::close()
+{
+	if (!data)
+		return;
+#ifdef WIN32
+	UnmapViewOfFile(data);
+	CloseHandle(mapping_handle);
+	CloseHandle(file_handle);
+	file_handle = mapping_handle = NULL;
+#else
+	munmap((void*)data, data_size);
+#endif
+	data = NULL;
+	data_size = 0;
+	header = NULL;
+	entries = NULL;
+}
+
+const Pak::sEntry* Pak::find(const std::string& filename)
+{
+	if (!entries)
+		return NULL;
+
+	std::string path = normalizePath(filename);
+	uint64_t hash = hashPath(path);
+
+	//binary search in the TOC, then compare the names in case of collision
+	const sEntry* end = entries + header->num_entries;
+	const sEntry* it = std::lower_bound(entries, end, hash, [](const sEntry& entry, uint64_t hash) { return entry.hash < hash; });
+	for (; it != end && it->hash == hash; ++it)
+		if (path == getName(it))
+			return it;
+	return NULL;
+}
+
+const char* Pak::getName(const sEntry* entry)
+{
+	assert(entry && entry->name_offset < header->names_size);
+	return (const char*)(data + header->names_offset + entry->name_offset);
+}
+
+bool Pak::read(const sEntry* entry, unsigned char* dst)
+{
+	assert(entry && dst);
+	const unsigned char* src = data + entry->offset;
+	if (entry->flags & COMPRESSED)
+		return decompressBlock(src, entry->stored_size, dst, entry->size);
+	memcpy(dst, src, entry->size);
+	return true;
+}
+
+Pak* Pak::mount(const char* filename)
+{
+	Pak* pak = new Pak();
+	if (!pak->open(filename))
+	{
+		delete pak;
+		return NULL;
+	}
+	std::cout << " + Pak mounted: " << TermColor::YELLOW << filename << TermColor::DEFAULT << " Files: " << pak->header->num_entries << std::endl;
+	s_mounted.push_back(pak);
+	return pak;
+}
+
+void Pak::unmountAll()
+{
+	for (Pak* pak : s_mounted)
+		delete pak;
+	s_mounted.clear();
+}
+
+const Pak::sEntry* Pak::findMounted(const std::string& filename, Pak** pak)
+{
+	for (int i = (int)s_mounted.size() - 1; i >= 0; --i)
+	{
+		const sEntry* entry = s_mounted[i]->find(filename);
+		if (!entry)
+			continue;
+		if (pak)
+			*pak = s_mounted[i];
+		return entry;
+	}
+	return NULL;
+}
+
+bool Pak::readMounted(const std::string& filename, std::vector<unsigned char>& buffer)
+{
+	if (s_mounted.empty())
+		return false;
+	Pak* pak = NULL;
+	const sEntry* entry = findMounted(filename, &pak);
+	if (!entry)
+		return false;
+	buffer.resize(entry->size);
+	return !entry->size || pak->read(entry, &buffer[0]);
+}
+
+bool Pak::readMounted(const std::string& filename, std::string& content)
+{
+	if (s_mounted.empty())
+		return false;
+	Pak* pak = NULL;
+	const sEntry* entry = findMounted(filename, &pak);
+	if (!entry)
+		return false;
+	content.resize(entry->size);
+	return !entry->size || pak->read(entry, (unsigned char*)&content[0]);
+}
+
+bool Pak::build(const char* filename, const std::vector<std::string>& files, bool compress, uint32_t alignment)
+{
+	assert(filename && alignment);
+
+	struct sItem {
+		std::string name;
+		std::vector<unsigned char> content;
+		std::vector<unsigned char> compressed;
+		bool valid;
+	};
+
+	//read and compress in parallel
+	std::vector<sItem> items(files.size());
+	TaskManager::background.parallelFor(items.size(), [&](size_t i) {
+		sItem& item = items[i];
+		item.name = normalizePath(files[i]);
+		item.valid = readFileBin(files[i], item.content);
+		if (item.valid && compress && item.content.size())
+			if (!compressBlock(&item.content[0], item.content.size(), item.compressed))
+				item.compressed.clear();
+	});
+
+	FILE* f = fopen(filename, "wb");
+	if (f == NULL)
+	{
+		std::cout << "[ERROR] cannot write pak: " << filename << std::endl;
+		return false;
+	}
+
+	sHeader pak_header;
+	memset(&pak_header, 0, sizeof(pak_header));
+	memcpy(pak_header.magic, "GPAK", 4);
+	pak_header.version = PAK_VERSION;
+	pak_header.alignment = alignment;
+	fwrite(&pak_header, sizeof(pak_header), 1, f);
+
+	static const char padding[256] = { 0 };
+	auto align = [&](uint64_t pos) {
+		uint64_t aligned = (pos + alignment - 1) / alignment * alignment;
+		for (uint64_t remaining = aligned - pos; remaining; )
+		{
+			size_t n = (size_t)std::min<uint64_t>(remaining, sizeof(padding));
+			fwrite(padding, 1, n, f);
+			remaining -= n;
+		}
+		return aligned;
+	};
+
+	//data
+	std::vector<sEntry> toc;
+	std::string names;
+	uint64_t pos = sizeof(pak_header);
+	for (sItem& item : items)
+	{
+		if (!item.valid)
+		{
+			std::cout << "[WARN] file not packed: " << item.name << std::endl;
+			continue;
+		}
+		sEntry entry;
+		memset(&entry, 0, sizeof(entry));
+		pos = align(pos);
+		entry.hash = hashPath(item.name);
+		entry.offset = pos;
+		entry.size = item.content.size();
+		entry.name_offset = (uint32_t)names.size();
+		std::vector<unsigned char>& stored = item.compressed.size() ? item.compressed : item.content;
+		entry.stored_size = stored.size();
+		entry.flags = item.compressed.size() ? COMPRESSED : 0;
+		if (stored.size())
+			fwrite(&stored[0], 1, stored.size(), f);
+		pos += stored.size();
+		names.append(item.name.c_str(), item.name.size() + 1);
+		toc.push_back(entry);
+	}
+
+	//table of contents
+	std::sort(toc.begin(), toc.end(), [](const sEntry& a, const sEntry& b) { return a.hash < b.hash; });
+	pos = align(pos);
+	pak_header.num_entries = (uint32_t)toc.size();
+	pak_header.toc_offset = pos;
+	if (toc.size())
+		fwrite(&toc[0], sizeof(sEntry), toc.size(), f);
+	pos += toc.size() * sizeof(sEntry);
+	pak_header.names_offset = pos;
+	pak_header.names_size = names.size();
+	fwrite(names.c_str(), 1, names.size(), f);
+
+	fseek(f, 0, SEEK_SET);
+	fwrite(&pak_header, sizeof(pak_header), 1, f);
+	fclose(f);
+	return true;
+}
+
+std::string Pak::normalizePath(const std::string& filename)
+{
+	std::string path = cleanPath(filename);
+	if (CORE::base_path.size() && path.find(CORE::base_path) == 0)
+		path = path.substr(CORE::base_path.size() + 1);
+	while (path.find("./") == 0)
+		path = path.substr(2);
+	size_t pos;
+	while ((pos = path.find("/./")) != std::string::npos)
+		path.erase(pos, 2);
+	while ((pos = path.find("//")) != std::string::npos)
+		path.erase(pos, 1);
+	return path;
+}
+
+//FNV-1a
+uint64_t Pak::hashPath(const std::string& path)
+{
+	uint64_t hash = 14695981039346656037ULL;
+	for (unsigned char c : path)
+	{
+		hash ^= c;
+		hash *= 1099511628211ULL;
+	}
+	return hash;
+}
+
+static void writeLZ4Length(std::vector<unsigned char>& dst, size_t length)
+{
+	while (length >= 255)
+	{
+		dst.push_back(255);
+		length -= 255;
+	}
+	dst.push_back((unsigned char)length);
+}
+
+static void writeLZ4Sequence(std::vector<unsigned char>& dst, const unsigned char* literals, size_t num_literals, size_t offset, size_t match_length)
+{
+	size_t match_code = match_length ? match_length - PAK_MIN_MATCH : 0;
+	dst.push_back((unsigned char)((std::min<size_t>(num_literals, 15) << 4) | std::min<size_t>(match_code, 15)));
+	if (num_literals >= 15)
+		writeLZ4Length(dst, num_literals - 15);
+	dst.insert(dst.end(), literals, literals + num_literals);
+	if (!match_length) //last sequence, only literals
+		return;
+	dst.push_back((unsigned char)(offset & 0xFF));
+	dst.push_back((unsigned char)(offset >> 8));
+	if (match_code >= 15)
+		writeLZ4Length(dst, match_code - 15);
+}
+
+//greedy compressor with a hash of the next 4 bytes, compatible with any LZ4 block decoder
+bool Pak::compressBlock(const unsigned char* src, size_t size, std::vector<unsigned char>& dst)
+{
+	dst.clear();
+	if (size < 16)
+		return false;
+	dst.reserve(size);
+
+	std::vector<int64_t> table(1 << PAK_HASH_BITS, -1);
+	const size_t match_start_limit = size - 12; //the format requires the last matches to start before this
+	const size_t match_end_limit = size - 5; //and the last 5 bytes to be literals
+	size_t anchor = 0;
+	size_t i = 0;
+	while (i < match_start_limit)
+	{
+		uint32_t sequence;
+		memcpy(&sequence, src + i, 4);
+		uint32_t hash = (sequence * 2654435761u) >> (32 - PAK_HASH_BITS);
+		int64_t ref = table[hash];
+		table[hash] = (int64_t)i;
+
+		uint32_t ref_sequence = 0;
+		if (ref >= 0)
+			memcpy(&ref_sequence, src + ref, 4);
+		if (ref < 0 || i - (size_t)ref > PAK_MAX_OFFSET || ref_sequence != sequence)
+		{
+			++i;
+			continue;
+		}
+
+		size_t match = (size_t)ref;
+		size_t length = PAK_MIN_MATCH;
+		while (i + length < match_end_limit && src[match + length] == src[i + length])
+			++length;
+		while (i > anchor && match > 0 && src[i - 1] == src[match - 1])
+		{
+			--i;
+			--match;
+			++length;
+		}
+
+		writeLZ4Sequence(dst, src + anchor, i - anchor, i - match, length);
+		i += length;
+		anchor = i;
+
+		if (dst.size() >= size) //not worth it
+			return false;
+	}
+
+	writeLZ4Sequence(dst, src + anchor, size - anchor, 0, 0);
+	return dst.size() < size;
+}
+
+bool Pak::decompressBlock(const unsigned char* src, size_t size, unsigned char* dst, size_t dst_size)
+{
+	size_t ip = 0;
+	size_t op = 0;
+	while (ip < size)
+	{
+		unsigned char token = src[ip++];
+
+		size_t num_literals = token >> 4;
+		if (num_literals == 15)
+		{
+			unsigned char b;
+			do {
+				if (ip >= size)
+					return false;
+				b = src[ip++];
+				num_literals += b;
+			} while (b == 255);
+		}
+		if (ip + num_literals > size || op + num_literals > dst_size)
+			return false;
+		memcpy(dst + op, src + ip, num_literals);
+		ip += num_literals;
+		op += num_literals;
+
+		if (ip >= size) //last sequence has no match
+			break;
+
+		if (ip + 2 > size)
+			return false;
+		size_t offset = src[ip] | (src[ip + 1] << 8);
+		ip += 2;
+		if (offset == 0 || offset > op)
+			return false;
+
+		size_t length = token & 15;
+		if (length == 15)
+		{
+			unsigned char b;
+			do {
+				if (ip >= size)
+					return false;
+				b = src[ip++];
+				length += b;
+			} while (b == 255);
+		}
+		length += PAK_MIN_MATCH;
+		if (op + length > dst_size)
+			return false;
+
+		//matches can overlap with the output
+		const unsigned char* match = dst + op - offset;
+		if (offset >= length)
+			memcpy(dst + op, match, length);
+		else
+			for (size_t j = 0; j < length; ++j)
+				dst[op + j] = match[j];
+		op += length;
+	}
+	return op == dst_size;
+}
@@ -0,0 +1,86 @@
+/*  Pak archives
+	Many files packed in a single one, so loading the assets does not need a fopen/stat/fread per file.
+	The archive is mapped in memory once and the table of contents (sorted by the hash of the path) is used directly from it.
+	Entries can be stored compressed (LZ4 block format) and every entry starts aligned.
+
+	Once mounted, readFile/readFileBin/fileExists look inside the paks before going to the disk,
+	so every loader that uses them (meshes, textures, prefabs, shader atlas) works transparently.
+	Paks are created with the GTR_Cooker (-p option).
+*/
+#pragma once
+
+#include <string>
+#include <vector>
+#include <cstdint>
+
+#define PAK_VERSION 1
+#define PAK_DEFAULT_ALIGNMENT 64 //bytes, enough for cache lines and SIMD loads
+
+class Pak {
+public:
+	enum eFlags {
+		COMPRESSED = 1
+	};
+
+	struct sHeader {
+		char magic[4]; //"GPAK"
+		uint32_t version;
+		uint32_t num_entries;
+		uint32_t alignment;
+		uint64_t toc_offset; //array of sEntry sorted by hash
+		uint64_t names_offset; //null terminated paths
+		uint64_t names_size;
+	};
+
+	struct sEntry {
+		uint64_t hash; //of the normalized path
+		uint64_t offset;
+		uint64_t size; //uncompressed
+		uint64_t stored_size; //in the file
+		uint32_t name_offset;
+		uint32_t flags;
+	};
+
+	//mounted paks, searched in reverse order so the last one overrides the rest
+	static std::vector<Pak*> s_mounted;
+
+	std::string filename;
+
+	Pak();
+	~Pak();
+
+	bool open(const char* filename);
+	void close();
+
+	//returns NULL if the file is not in the pak
+	const sEntry* find(const std::string& filename);
+	const char* getName(const sEntry* entry);
+	bool read(const sEntry* entry, unsigned char* dst); //dst must have entry->size bytes
+
+	//global virtual file layer
+	static Pak* mount(const char* filename);
+	static void unmountAll();
+	static const sEntry* findMounted(const std::string& filename, Pak** pak = NULL);
+	static bool readMounted(const std::string& filename, std::vector<unsigned char>& buffer);
+	static bool readMounted(const std::string& filename, std::string& content);
+
+	//packs the files using every core, the names are stored normalized
+	static bool build(const char* filename, const std::vector<std::string>& files, bool compress = true, uint32_t alignment = PAK_DEFAULT_ALIGNMENT);
+
+	static std::string normalizePath(const std::string& filename);
+	static uint64_t hashPath(const std::string& path);
+
+	//LZ4 block format, compress returns false if the data does not get smaller
+	static bool compressBlock(const unsigned char* src, size_t size, std::vector<unsigned char>& dst);
+	static bool decompressBlock(const unsigned char* src, size_t size, unsigned char* dst, size_t dst_size);
+
+private:
+	const unsigned char* data; //whole file mapped
+	size_t data_size;
+	const sHeader* header;
+	const sEntry* entries;
+#ifdef WIN32
+	void* file_handle;
+	void* mapping_handle;
+#endif
+};
@@ -1,11 +1,14 @@
 #include "utils.h"
 
 #include <cassert>
+#include <cstring>
 #include <iostream>
 #include <algorithm>
+#include <sys/stat.h>
 
 #include "../core/includes.h"
 #include "../core/core.h"
+#include "pak.h"
 
 #ifndef WIN32
 	#include <sys/time.h>
@@ -23,11 +26,49 @@ long getTime()
 	#endif
 }
 
+uint16_t floatToHalf(float value)
+{
+	uint32_t bits;
+	memcpy(&bits, &value, 4);
+	uint32_t sign = (bits >> 16) & 0x8000;
+	int exponent = (int)((bits >> 23) & 0xFF) - 127 + 15;
+	uint32_t mantissa = bits & 0x7FFFFF;
+	if (exponent <= 0)
+		return (uint16_t)sign; //too small, zero
+	if (exponent >= 31)
+		return (uint16_t)(sign | 0x7BFF); //too big (or inf/nan), the biggest half
+	uint32_t half = sign | (exponent << 10) | (mantissa >> 13);
+	if (mantissa & 0x1000) //round
+		half++;
+	return (uint16_t)half;
+}
+
+float halfToFloat(uint16_t value)
+{
+	uint32_t sign = (uint32_t)(value & 0x8000) << 16;
+	uint32_t exponent = (value >> 10) & 0x1F;
+	uint32_t mantissa = value & 0x3FF;
+	uint32_t bits;
+	if (exponent == 0)
+	{
+		float result = mantissa / 16777216.0f; //subnormal, 2^-24
+		return sign ? -result : result;
+	}
+	bits = sign | ((exponent - 15 + 127) << 23) | (mantissa << 13);
+	float result;
+	memcpy(&result, &bits, 4);
+	return result;
+}
+
+#ifdef SKIP_GL
+std::string CORE::base_path; //core.cpp is not part of the assets library
+#else
 //this function is used to access OpenGL Extensions (special features not supported by all cards)
 void* getGLProcAddress(const char* name)
 {
 	return SDL_GL_GetProcAddress(name);
 }
+#endif
 
 std::string getFolderName(std::string path)
 {
@@ -72,10 +113,44 @@ std::string makePathRelative(std::string filename)
 	return relpath;
 }
 
+std::string cooked_folder = "data/cooked";
+bool use_cooked_assets = true;
+
+std::string getCookedFilename(std::string filename, const char* ext)
+{
+	std::string path = cleanPath(filename);
+	if (CORE::base_path.size() && path.find(CORE::base_path) == 0)
+		path = path.substr(CORE::base_path.size() + 1);
+	if (path.find("./") == 0)
+		path = path.substr(2);
+	//names like "scene.gltf::mesh::0" or absolute paths must be valid inside the cooked folder
+	for (size_t i = 0; i < path.size(); ++i)
+	{
+		char c = path[i];
+		if (c == ':' || c == '*' || c == '?' || c == '"' || c == '<' || c == '>' || c == '|')
+			path[i] = '_';
+	}
+	while (path.size() && path[0] == '/')
+		path = path.substr(1);
+	return cooked_folder + "/" + path + ext;
+}
+
+bool fileExists(const std::string& filename)
+{
+	if (Pak::s_mounted.size() && Pak::findMounted(filename))
+		return true;
+	struct stat stbuffer;
+	return stat(filename.c_str(), &stbuffer) == 0;
+}
+
 bool readFile(const std::string& filename, std::string& content)
 {
 	content.clear();
 
+	//packed files have priority
+	if (Pak::readMounted(filename, content))
+		return true;
+
 	long count = 0;
 
 	FILE *fp = fopen(filename.c_str(), "rb");
@@ -102,6 +177,8 @@ bool readFile(const std::string& filename, std::string& content)
 bool readFileBin(const std::string& filename, std::vector<unsigned char>& buffer)
 {
 	buffer.clear();
+	if (Pak::readMounted(filename, buffer))
+		return true;
 	FILE* fp = nullptr;
 	fp = fopen(filename.c_str(), "rb");
 	if (fp == nullptr)
@@ -7,6 +7,7 @@
 #include <string>
 #include <sstream>
 #include <vector>
+#include <cstdint>
 #include "../extra/cJSON.h"
 
 
@@ -15,6 +16,7 @@
 
 //General functions **************
 long getTime(); //there is also CORE::getTime
+bool fileExists(const std::string& filename); //also checks the mounted paks
 bool readFile(const std::string& filename, std::string& content);
 bool readFileBin(const std::string& filename, std::vector<unsigned char>& buffer);
 bool writeFile(const std::string& filename, std::string& content);
@@ -26,6 +28,11 @@ std::string toLowerCase(std::string str);
 std::string cleanPath(std::string);
 std::string makePathRelative(std::string filename);
 
+//assets processed offline by the GTR_Cooker, loaders check the cooked folder before parsing the source file
+extern std::string cooked_folder;
+extern bool use_cooked_assets;
+std::string getCookedFilename(std::string filename, const char* ext = ""); //path of the cooked version of a file
+
 //to work with strings (split, join, etc)
 std::vector<std::string> tokenize(const std::string& source, const char* delimiters, bool process_strings = false);
 std::vector<std::string>& split(const std::string &s, char delim, std::vector<std::string> &elems);
@@ -34,6 +41,10 @@ std::string join(std::vector<std::string>& strings, const char* delim);
 
 void stdlog(std::string str);
 
+//IEEE 754 half floats, for the GL_HALF_FLOAT textures baked on the CPU (too big values become the biggest half)
+uint16_t floatToHalf(float value);
+float halfToFloat(uint16_t value);
+
 //Used in the MESH and ANIM parsers to read and parse binary chunks from pointer address
 char* fetchWord(char* data, char* word);
 char* fetchFloat(char* data, float& f);